@@ -0,0 +1,66 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include "iaea_phsp.h"    // functions operating on PHSP files
+#include "iaea_index.h"   // spatial index and clustered rewrite of PHSP files
+
+using namespace std;
+
+// Rewrites a phase space file with its records sorted by the position of
+// their histories in a plane (iaea_cluster), so that the cuts of that
+// plane read few contiguous ranges of records (see the cutter's --index).
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        cerr << "Usage: " << argv[0] << " <inputFileBase> <outputFileBase> [--plane Z]"
+             << " [--memory MB] [--index]" << endl;
+        return 1;
+    }
+    const char* inFile = argv[1];
+    const char* outFile = argv[2];
+
+    // Plane the particles are projected to, memory used to sort the
+    // records, and whether the index of the output is built too
+    float plane = IAEA_INDEX_PLANE;
+    IAEA_I64 memory = IAEA_CLUSTER_MEMORY;
+    bool buildIndex = false;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--plane") == 0 && i + 1 < argc) {
+            plane = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--memory") == 0 && i + 1 < argc) {
+            memory = (IAEA_I64)atoi(argv[++i]) << 20;
+        } else if (strcmp(argv[i], "--index") == 0) {
+            buildIndex = true;
+        } else {
+            cerr << "Unknown option: " << argv[i] << endl;
+            return 1;
+        }
+    }
+    if (memory <= 0) {
+        cerr << "The memory must be at least 1 MB." << endl;
+        return 1;
+    }
+
+    cout << "Sorting input file (" << inFile << ") by the position at z = " << plane
+         << " into " << outFile << " with " << (memory >> 20) << " MB of memory..." << endl;
+    if (iaea_cluster(inFile, outFile, plane, memory) != OK) {
+        cerr << "Error rewriting " << inFile << "." << endl;
+        return 1;
+    }
+    cout << "Sorted file written to " << outFile << endl;
+
+    if (buildIndex) {
+        iaea_index index;
+        if (iaea_index_build(outFile, IAEA_INDEX_POSITION_BINS, IAEA_INDEX_PROJECTION_BINS,
+                             plane, &index) != OK ||
+            iaea_index_write(&index, outFile) != OK) {
+            cerr << "Error building the index of " << outFile << "." << endl;
+            iaea_index_free(&index);
+            return 1;
+        }
+        cout << "Index written to " << outFile << ".IAEAindex (" << index.n_ranges
+             << " record ranges)" << endl;
+        iaea_index_free(&index);
+    }
+    return 0;
+}
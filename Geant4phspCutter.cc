@@ -1,21 +1,45 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cctype>
 #include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
 #include <sys/stat.h>
 #include "iaea_phsp.h"    // functions operating on PHSP files
 #include "iaea_header.h"  // header handling
 #include "iaea_record.h"  // record (particle) operations
+#include "iaea_filter.h"  // vectorized particle filters
+#include "iaea_index.h"   // spatial index of PHSP files
+#include "iaea_pack.h"    // compressed records
+#include "iaea_quant.h"   // quantized records
+#include "iaea_column.h"  // records stored column by column
 #include "utilities.h"    // helper functions
 
 using namespace std;
 
-// Filter parameters – units: cm
-const float Z_PLANE = 100.0f; // z-axis level, e.g. 1000 mm
-const float X_MIN = -7.0f;
-const float X_MAX = 7.0f;
-const float Y_MIN = -7.0f;
-const float Y_MAX = 7.0f;
+// Default aperture, used for an output whose conditions give no aperture:
+// particles crossing the square [-7,7] x [-7,7] cm at z = 100 cm (or at
+// the plane given)
+const char* DEFAULT_PLANE = "plane 100";
+const char* DEFAULT_APERTURE = "rect -7 7 -7 7";
+
+// Number of particles read and written per call
+const IAEA_I32 BATCH_SIZE = 4096;
+
+// Upper limit of worker threads, each of them opens its own input and
+// output source
+const int MAX_THREADS = 256;
+
+// True if the chain has an aperture condition (rectangle, circle, polygon)
+bool hasAperture(const iaea_filter_chain& chain) {
+    for (int i = 0; i < chain.n_stages; i++)
+        if (chain.stage[i].kind == IAEA_STAGE_RECTANGLE || chain.stage[i].kind == IAEA_STAGE_CIRCLE ||
+            chain.stage[i].kind == IAEA_STAGE_POLYGON)
+            return true;
+    return false;
+}
 
 // Helper function: removes output files if they exist
 void removeOutputFiles(const char* baseName) {
@@ -25,79 +49,651 @@ void removeOutputFiles(const char* baseName) {
     remove(phspFile.c_str());
 }
 
+// One output of the cutter: the particles passing filter are written to
+// the file base. All outputs are filled in the same pass over the input.
+struct Output {
+    string base;
+    iaea_filter_chain filter;
+    // Range of the quantized records of the output (see
+    // iaea_filter_quantization), no condition for records of floats
+    iaea_filter_chain range;
+    IAEA_I32 id;
+};
+
+// Ranges of records read by a worker (see iaea_set_read_ranges), and the
+// histories counted by the records skipped before every range and after
+// the last one (see countSkipped)
+struct RecordRanges {
+    vector<IAEA_I64> first, count;
+    IAEA_I64 records = 0;
+    vector<IAEA_I64> skipped;
+    IAEA_I64 skippedAfter = 0;
+};
+
+// Result of filtering a range of records
+struct FilterResult {
+    IAEA_I64 processed;
+    vector<IAEA_I64> accepted; // per output
+    vector<IAEA_I64> pending;  // per output, histories started after its last particle
+    vector<IAEA_I64> rejected; // per output, accepted but out of its quantization range
+    bool failed;
+};
+
+// Index of the extra long holding the incremental number of histories of
+// source id (type 1, see iaea_set_type_extralong_variable), or -1
+int statLongIndex(IAEA_I32 id) {
+    IAEA_I32 nExtraFloat, nExtraLong, res;
+    IAEA_I32 longTypes[NUM_EXTRA_LONG], floatTypes[NUM_EXTRA_FLOAT];
+    iaea_get_extra_numbers(&id, &nExtraFloat, &nExtraLong);
+    iaea_get_type_extra_variables(&id, &res, longTypes, floatTypes);
+    for (IAEA_I32 j = 0; j < nExtraLong; j++)
+        if (longTypes[j] == 1) return j;
+    return -1;
+}
+
+// Columns of the extra longs (or floats, if floats) of source dest in
+// those of source src: the j-th extra variable of a type in dest is taken
+// from the j-th one of that type in src, -1 if there is none
+vector<int> extraColumns(IAEA_I32 src, IAEA_I32 dest, bool floats) {
+    IAEA_I32 nFloat[2], nLong[2], res;
+    IAEA_I32 longTypes[2][NUM_EXTRA_LONG], floatTypes[2][NUM_EXTRA_FLOAT];
+    IAEA_I32 ids[2] = { src, dest };
+    for (int s = 0; s < 2; s++) {
+        iaea_get_extra_numbers(&ids[s], &nFloat[s], &nLong[s]);
+        iaea_get_type_extra_variables(&ids[s], &res, longTypes[s], floatTypes[s]);
+    }
+    IAEA_I32* types[2] = { floats ? floatTypes[0] : longTypes[0],
+                           floats ? floatTypes[1] : longTypes[1] };
+    IAEA_I32 n[2] = { floats ? nFloat[0] : nLong[0], floats ? nFloat[1] : nLong[1] };
+    vector<int> column(n[1], -1);
+    for (IAEA_I32 j = 0; j < n[1]; j++) {
+        int seen = 0;
+        for (IAEA_I32 i = 0; i < j; i++)
+            if (types[1][i] == types[1][j]) seen++;
+        for (IAEA_I32 i = 0; i < n[0] && column[j] < 0; i++)
+            if (types[0][i] == types[1][j] && seen-- == 0) column[j] = i;
+    }
+    return column;
+}
+
+// Sets the histories counted by the records of begin..end-1 the ranges
+// skip, from the history index of the input (none without one)
+void countSkipped(RecordRanges* ranges, IAEA_I64 begin, IAEA_I64 end,
+                  const iaea_history_index* histories) {
+    ranges->skipped.assign(ranges->first.size(), 0);
+    ranges->skippedAfter = 0;
+    if (histories == NULL) return;
+    IAEA_I64 next = begin;
+    for (size_t r = 0; r < ranges->first.size(); r++) {
+        ranges->skipped[r] = iaea_history_count(histories, next, ranges->first[r] - 1);
+        next = ranges->first[r] + ranges->count[r];
+    }
+    ranges->skippedAfter = iaea_history_count(histories, next, end - 1);
+}
+
+// Reads nRecords particles from src batch by batch (from the ranges, if
+// src reads ranges of records), applies the filter of every output and
+// writes the accepted particles to its source dest[k].
+void filterRecords(IAEA_I32 src, const vector<Output>& outputs, const vector<IAEA_I32>& dest,
+                   IAEA_I64 nRecords, const RecordRanges* ranges, bool verbose,
+                   FilterResult* result) {
+    // Arrays holding one batch of particle record data (structure of arrays).
+    vector<IAEA_I32> n_stat(BATCH_SIZE), partType(BATCH_SIZE);
+    vector<IAEA_Float> E(BATCH_SIZE), wt(BATCH_SIZE);
+    vector<IAEA_Float> x(BATCH_SIZE), y(BATCH_SIZE), z(BATCH_SIZE);
+    vector<IAEA_Float> u(BATCH_SIZE), v(BATCH_SIZE), w(BATCH_SIZE);
+    vector<IAEA_Float> extraFloats(BATCH_SIZE * NUM_EXTRA_FLOAT);
+    vector<IAEA_I32> extraInts(BATCH_SIZE * NUM_EXTRA_LONG);
+    // Accept masks of the batch, one per output, one bit per particle
+    vector<vector<IAEA_U64> > acceptMasks(outputs.size(),
+                                          vector<IAEA_U64>(IAEA_MASK_WORDS(BATCH_SIZE)));
+    vector<IAEA_I32> nAccepted(outputs.size());
+    iaea_particle_block batch = { BATCH_SIZE, &n_stat[0], &partType[0], &E[0], &wt[0],
+                                  &x[0], &y[0], &z[0], &u[0], &v[0], &w[0],
+                                  &extraFloats[0], &extraInts[0] };
+    // Accepted particles of an output when they have to be re-encoded; the
+    // batch itself is kept for the next output.
+    vector<IAEA_I32> a_n_stat(BATCH_SIZE), a_partType(BATCH_SIZE);
+    vector<IAEA_Float> a_E(BATCH_SIZE), a_wt(BATCH_SIZE);
+    vector<IAEA_Float> a_x(BATCH_SIZE), a_y(BATCH_SIZE), a_z(BATCH_SIZE);
+    vector<IAEA_Float> a_u(BATCH_SIZE), a_v(BATCH_SIZE), a_w(BATCH_SIZE);
+    vector<IAEA_Float> a_extraFloats(BATCH_SIZE * NUM_EXTRA_FLOAT);
+    vector<IAEA_I32> a_extraInts(BATCH_SIZE * NUM_EXTRA_LONG);
+    
+    size_t nOutputs = outputs.size();
+    IAEA_I64 count = 0;
+    vector<IAEA_I64> accepted(nOutputs, 0), rejected(nOutputs, 0);
+    bool failed = false;
+    // Copy accepted records without re-encoding them, as long as the
+    // output records are stored the same way as the input ones
+    vector<bool> rawCopy(nOutputs, true);
+    // Histories started since the last particle written to an output. As
+    // EGS does, they are carried over to the next particle written, whose
+    // n_stat (outStat) counts the histories left out before its own.
+    vector<IAEA_I64> pending(nOutputs, 0);
+    vector<IAEA_I32> outStat(BATCH_SIZE);
+    // Histories counted by a particle read, with those of the records
+    // skipped before it if it starts a range
+    vector<IAEA_I64> increment(BATCH_SIZE);
+    size_t nextRange = 0;
+    IAEA_I64 nextRangeAt = 0; // particles read before range nextRange
+    // Extra variables of the outputs, taken from these columns of the
+    // input when the particles are re-encoded
+    vector<int> statLong(nOutputs);
+    vector<vector<int> > longColumn(nOutputs), floatColumn(nOutputs);
+    for (size_t k = 0; k < nOutputs; k++) {
+        statLong[k] = statLongIndex(dest[k]);
+        longColumn[k] = extraColumns(src, dest[k], false);
+        floatColumn[k] = extraColumns(src, dest[k], true);
+    }
+    // An input stored column by column is read only in the variables the
+    // filters test, the others are read for the particles accepted by one
+    // of the outputs (see iaea_set_read_columns)
+    IAEA_I32 filterColumns = 0, res;
+    for (size_t k = 0; k < nOutputs; k++)
+        filterColumns |= iaea_filter_columns(&outputs[k].filter);
+    iaea_set_read_columns(&src, &filterColumns, &res);
+    bool projected = (res == 0);
+    if (verbose && projected)
+        cout << "Reading the input column by column." << endl;
+    vector<IAEA_U64> gatherMask(IAEA_MASK_WORDS(BATCH_SIZE));
+    vector<IAEA_U64> rangeMask(IAEA_MASK_WORDS(BATCH_SIZE));
+    
+    while (count < nRecords && !failed) {
+        IAEA_I32 nWant = BATCH_SIZE;
+        if (nRecords - count < nWant)
+            nWant = (IAEA_I32)(nRecords - count);
+        // The extra numbers are stored nWant to a column
+        batch.n_max = nWant;
+        IAEA_I32 nRead;
+        iaea_get_particles_batch(&src, &nWant, &nRead, &n_stat[0], &partType[0],
+                                 &E[0], &wt[0], &x[0], &y[0], &z[0],
+                                 &u[0], &v[0], &w[0],
+                                 &extraFloats[0], &extraInts[0]);
+        if (nRead < nWant) {
+            cerr << "Error reading particles after record " << count + (nRead > 0 ? nRead : 0)
+                 << ". Aborting filtering." << endl;
+            failed = true;
+            if (nRead <= 0) break;
+        }
+        for (IAEA_I32 i = 0; i < nRead; i++) {
+            increment[i] = (n_stat[i] > 0) ? n_stat[i] : 0;
+            while (ranges != NULL && nextRange < ranges->skipped.size() &&
+                   count + i == nextRangeAt) {
+                increment[i] += ranges->skipped[nextRange];
+                nextRangeAt += ranges->count[nextRange++];
+            }
+        }
+        // Apply the filter of every output to the whole batch.
+        for (size_t k = 0; k < nOutputs; k++)
+            nAccepted[k] = iaea_filter_run(&outputs[k].filter, &batch, nRead,
+                                           &acceptMasks[k][0]);
+        if (projected) {
+            // The variables the filters left out, for the particles accepted
+            for (IAEA_I32 j = 0; j < IAEA_MASK_WORDS(nRead); j++) {
+                gatherMask[j] = 0;
+                for (size_t k = 0; k < nOutputs; k++)
+                    gatherMask[j] |= acceptMasks[k][j];
+            }
+            iaea_gather_particles_batch(&src, &nWant, &nRead, &gatherMask[0], &n_stat[0],
+                                        &partType[0], &E[0], &wt[0], &x[0], &y[0], &z[0],
+                                        &u[0], &v[0], &w[0], &extraFloats[0], &extraInts[0],
+                                        &res);
+            if (res < 0) {
+                cerr << "Error reading particles after record " << count
+                     << ". Aborting filtering." << endl;
+                failed = true;
+                break;
+            }
+        }
+        // Particles accepted out of the quantization range of an output are
+        // left out (its records could not be written), with all the
+        // variables read
+        for (size_t k = 0; k < nOutputs; k++) {
+            if (outputs[k].range.n_stages == 0 || nAccepted[k] == 0) continue;
+            iaea_filter_run(&outputs[k].range, &batch, nRead, &rangeMask[0]);
+            IAEA_I32 nInRange = 0;
+            for (IAEA_I32 j = 0; j < IAEA_MASK_WORDS(nRead); j++) {
+                acceptMasks[k][j] &= rangeMask[j];
+                for (IAEA_U64 bits = acceptMasks[k][j]; bits != 0; bits &= bits - 1)
+                    nInRange++;
+            }
+            rejected[k] += nAccepted[k] - nInRange;
+            nAccepted[k] = nInRange;
+        }
+        for (size_t k = 0; k < nOutputs; k++) {
+            const IAEA_U64* acceptMask = &acceptMasks[k][0];
+            for (IAEA_I32 i = 0; i < nRead; i++) {
+                pending[k] += increment[i];
+                outStat[i] = 0;
+                if ((acceptMask[i >> 6] >> (i & 63)) & 1) {
+                    outStat[i] = (IAEA_I32)pending[k];
+                    pending[k] = 0;
+                }
+            }
+            IAEA_I32 nWritten = 0;
+            if (nAccepted[k] > 0 && rawCopy[k]) {
+                // Same record layout: accepted records are copied as raw bytes
+                // (with the history counts of outStat).
+                iaea_copy_particles_batch(&src, &dest[k], &nRead, &acceptMask[0],
+                                          &outStat[0], &partType[0], &E[0], &wt[0],
+                                          &x[0], &y[0], &z[0], &nWritten);
+                if (nWritten == -2) {
+                    if (verbose)
+                        cout << "Record layouts differ, accepted particles are re-encoded"
+                             << " for " << outputs[k].base << "." << endl;
+                    rawCopy[k] = false;
+                }
+            }
+            if (nAccepted[k] > 0 && !rawCopy[k]) {
+                // Gather the accepted particles and write them to output,
+                // the extra numbers nAccepted to a column.
+                IAEA_I32 n = 0;
+                for (IAEA_I32 i = 0; i < nRead; i++) {
+                    if ((acceptMask[i >> 6] >> (i & 63)) & 1) {
+                        a_n_stat[n] = outStat[i];
+                        for (size_t c = 0; c < longColumn[k].size(); c++)
+                            a_extraInts[c * nAccepted[k] + n] = (longColumn[k][c] < 0) ? 0
+                                : extraInts[longColumn[k][c] * nWant + i];
+                        for (size_t c = 0; c < floatColumn[k].size(); c++)
+                            a_extraFloats[c * nAccepted[k] + n] = (floatColumn[k][c] < 0) ? 0
+                                : extraFloats[floatColumn[k][c] * nWant + i];
+                        if (statLong[k] >= 0)
+                            a_extraInts[statLong[k] * nAccepted[k] + n] = outStat[i];
+                        a_partType[n] = partType[i];
+                        a_E[n] = E[i];
+                        a_wt[n] = wt[i];
+                        a_x[n] = x[i];
+                        a_y[n] = y[i];
+                        a_z[n] = z[i];
+                        a_u[n] = u[i];
+                        a_v[n] = v[i];
+                        a_w[n] = w[i];
+                        n++;
+                    }
+                }
+                iaea_write_particles_batch(&dest[k], &nAccepted[k], &nWritten, &a_n_stat[0],
+                                           &a_partType[0], &a_E[0], &a_wt[0],
+                                           &a_x[0], &a_y[0], &a_z[0], &a_u[0], &a_v[0], &a_w[0],
+                                           &a_extraFloats[0], &a_extraInts[0]);
+            }
+            if (nWritten != nAccepted[k]) {
+                cerr << "Error writing accepted particles to " << outputs[k].base
+                     << ". Aborting filtering." << endl;
+                failed = true;
+                break;
+            }
+            accepted[k] += nAccepted[k];
+        }
+        if (verbose && (count + nRead) / 1000000 != count / 1000000)
+            cout << "Processed " << (count + nRead) / 1000000 * 1000000 << " records." << endl;
+        count += nRead;
+        if (nRead < nWant) break;
+    }
+    
+    if (ranges != NULL)
+        for (size_t k = 0; k < nOutputs; k++)
+            pending[k] += ranges->skippedAfter;
+    
+    result->processed = count;
+    result->accepted = accepted;
+    result->pending = pending;
+    result->rejected = rejected;
+    result->failed = failed;
+}
+
+// Creates the output source base with the header of src. Its records are
+// stored as those of src, with the constant variables and all the extra
+// numbers (LATCH, ILB, ...), so that the accepted records can be copied
+// as raw bytes; if dropExtras is set, only the incremental number of
+// histories is kept of the extra numbers, if src has one. Returns the
+// new source Id, or -1.
+IAEA_I32 createOutput(IAEA_I32 src, const string& base, bool dropExtras) {
+    IAEA_I32 dest, res;
+    IAEA_I32 accessWrite = 2;
+    removeOutputFiles(base.c_str());
+    iaea_new_source(&dest, const_cast<char*>(base.c_str()), &accessWrite, &res,
+                    (int)base.size());
+    if (res < 0)
+        return -1;
+    iaea_copy_header(&src, &dest, &res);
+    if (res < 0) {
+        iaea_destroy_source(&dest, &res);
+        return -1;
+    }
+    if (!dropExtras) {
+        // The header copy leaves the layout of the records out
+        for (IAEA_I32 i = 0; i < 7; i++) {
+            IAEA_Float constant;
+            iaea_get_constant_variable(&src, &i, &constant, &res);
+            if (res == 0) iaea_set_constant_variable(&dest, &i, &constant);
+        }
+        IAEA_I32 nExtraFloat, nExtraLong;
+        IAEA_I32 longTypes[NUM_EXTRA_LONG], floatTypes[NUM_EXTRA_FLOAT];
+        iaea_get_extra_numbers(&src, &nExtraFloat, &nExtraLong);
+        iaea_set_extra_numbers(&dest, &nExtraFloat, &nExtraLong);
+        iaea_get_type_extra_variables(&src, &res, longTypes, floatTypes);
+        for (IAEA_I32 i = 0; i < nExtraLong; i++)
+            iaea_set_type_extralong_variable(&dest, &i, &longTypes[i]);
+        for (IAEA_I32 i = 0; i < nExtraFloat; i++)
+            iaea_set_type_extrafloat_variable(&dest, &i, &floatTypes[i]);
+        return dest;
+    }
+    IAEA_I32 zero = 0, nExtraLong = (statLongIndex(src) >= 0) ? 1 : 0;
+    iaea_set_extra_numbers(&dest, &zero, &nExtraLong);
+    if (nExtraLong > 0) {
+        IAEA_I32 statType = 1;
+        iaea_set_type_extralong_variable(&dest, &zero, &statType);
+    }
+    return dest;
+}
+
+// Appends the particles of the temporary output chunkId to dest, the
+// first one also counting the carried histories (those started after the
+// last particle of the previous chunks). Returns the number of particles
+// appended, or a negative number.
+IAEA_I64 appendChunk(IAEA_I32 dest, IAEA_I32 chunkId, IAEA_I64 carried) {
+    IAEA_I64 nAppended = 0;
+    if (carried == 0) {
+        iaea_append_source(&dest, &chunkId, &nAppended);
+        return nAppended;
+    }
+    vector<IAEA_I32> n_stat(BATCH_SIZE), partType(BATCH_SIZE);
+    vector<IAEA_Float> E(BATCH_SIZE), wt(BATCH_SIZE);
+    vector<IAEA_Float> x(BATCH_SIZE), y(BATCH_SIZE), z(BATCH_SIZE);
+    vector<IAEA_Float> u(BATCH_SIZE), v(BATCH_SIZE), w(BATCH_SIZE);
+    vector<IAEA_Float> extraFloats(BATCH_SIZE * NUM_EXTRA_FLOAT);
+    vector<IAEA_I32> extraInts(BATCH_SIZE * NUM_EXTRA_LONG);
+    vector<IAEA_U64> all(IAEA_MASK_WORDS(BATCH_SIZE), ~(IAEA_U64)0);
+    for (;;) {
+        IAEA_I32 nRead, nWritten;
+        iaea_get_particles_batch(&chunkId, &BATCH_SIZE, &nRead, &n_stat[0], &partType[0],
+                                 &E[0], &wt[0], &x[0], &y[0], &z[0], &u[0], &v[0], &w[0],
+                                 &extraFloats[0], &extraInts[0]);
+        if (nRead <= 0) break;
+        if (nAppended == 0) n_stat[0] += (IAEA_I32)carried;
+        iaea_copy_particles_batch(&chunkId, &dest, &nRead, &all[0], &n_stat[0],
+                                  &partType[0], &E[0], &wt[0], &x[0], &y[0], &z[0],
+                                  &nWritten);
+        if (nWritten != nRead) return -1;
+        nAppended += nRead;
+        if (nRead < BATCH_SIZE) break;
+    }
+    return nAppended;
+}
+
+// Name of the temporary output of chunk iChunk
+string chunkName(const string& base, IAEA_I32 iChunk) {
+    return base + "_chunk" + to_string(iChunk);
+}
+
+// Worker of the parallel mode: opens the input file, filters the nRecords
+// particles of chunk iChunk (starting at record firstRecord, or the given
+// ranges of records) into a temporary file for every output and closes
+// the sources again.
+void filterChunk(const char* inFile, IAEA_I32 src, const vector<Output>* outputs,
+                 bool dropExtras, IAEA_I32 iChunk, IAEA_I64 firstRecord, IAEA_I64 nRecords,
+                 const RecordRanges* ranges, FilterResult* result) {
+    IAEA_I32 chunkSrc, res;
+    IAEA_I32 accessRead = 4;
+    result->processed = 0;
+    result->failed = true;
+    
+    iaea_new_source(&chunkSrc, const_cast<char*>(inFile), &accessRead, &res,
+                    (int)strlen(inFile));
+    if (res >= 0 && ranges != NULL) {
+        IAEA_I64 nRanges = (IAEA_I64)ranges->first.size();
+        if (nRanges > 0)
+            iaea_set_read_ranges(&chunkSrc, &nRanges, &ranges->first[0], &ranges->count[0], &res);
+    } else if (res >= 0 && nRecords > 0)
+        iaea_set_record(&chunkSrc, &firstRecord, &res);
+    if (res < 0) {
+        cerr << "Error opening input chunk " << iChunk << "." << endl;
+        return;
+    }
+    IAEA_I32 readStatistics = 0;
+    iaea_set_read_statistics(&chunkSrc, &readStatistics, &res);
+    vector<IAEA_I32> chunkDest;
+    for (size_t k = 0; k < outputs->size(); k++) {
+        string chunkFile = chunkName((*outputs)[k].base, iChunk);
+        IAEA_I32 dest = createOutput(src, chunkFile, dropExtras);
+        if (dest < 0) {
+            cerr << "Error creating temporary output: " << chunkFile << endl;
+            break;
+        }
+        chunkDest.push_back(dest);
+    }
+    
+    if (chunkDest.size() == outputs->size())
+        filterRecords(chunkSrc, *outputs, chunkDest, nRecords, ranges, false, result);
+    
+    iaea_destroy_source(&chunkSrc, &res);
+    for (size_t k = 0; k < chunkDest.size(); k++)
+        iaea_destroy_source(&chunkDest[k], &res);
+}
+
 int main(int argc, char* argv[]) {
     if (argc < 3) {
-        cerr << "Usage: " << argv[0] << " <inputFileBase> <outputFileBase>" << endl;
+        cerr << "Usage: " << argv[0] << " <inputFileBase> <outputFileBase> [--threads N]"
+             << " [--byte-order little|big] [--compress [RECORDS]] [--columns [RECORDS]]"
+             << " [--quantize [RESOLUTION]] [--index] [--drop-extras]"
+             << " [--config FILE] [--plane Z] [--rect X_MIN X_MAX Y_MIN Y_MAX]"
+             << " [--circle X0 Y0 R] [--polygon X1 Y1 X2 Y2 ...] [--energy E_MIN E_MAX]"
+             << " [--types T1 T2 ...] [--latch [any|all|none] MASK] [--ilb K L_MIN [L_MAX]]"
+             << " [--output outputFileBase [filter options]] ..." << endl
+             << "An output without --rect, --circle or --polygon is cut to the aperture"
+             << " [-7,7] x [-7,7] cm at z = 100 cm (or at the --plane given)." << endl;
         return 1;
     }
     
     // First argument – input file base name (without extension)
     // Second argument – output file base name (without extension)
     const char* inFile = argv[1];
-    const char* outFile = argv[2];
     
-    // Remove any existing output files for a clean start
-    removeOutputFiles(outFile);
+    // Optional number of worker threads, each filtering its own chunk of
+    // the input file
+    IAEA_I32 nThreads = 1;
+    // Byte order of the outputs (1234 little endian, 4321 big endian),
+    // 0 for the byte order of the machine
+    IAEA_I32 byteOrder = 0;
+    // Records per compressed block of the outputs, 0 for raw records
+    IAEA_I32 blockRecords = 0;
+    // Records per block of the outputs stored column by column, 0 for
+    // records stored one after the other
+    IAEA_I32 columnRecords = 0;
+    // Position resolution (cm) of the quantized records of the outputs, 0
+    // for records of floats
+    IAEA_Float resolution = 0.f;
+    // Read only the records the spatial index of the input selects for the
+    // filters (inputFileBase.IAEAindex, see Geant4phspIndex)
+    bool useIndex = false;
+    // Leave the extra numbers of the input (LATCH, ILB, ...) out of the
+    // outputs, except the incremental number of histories
+    bool dropExtras = false;
+    // Outputs, the first one is given by the second argument and every
+    // --output option adds another one. The filter conditions of an output
+    // follow its name, from a configuration file (--config) or given as
+    // options; every other option is a filter statement (see
+    // iaea_filter_parse) made of its name and the arguments that follow
+    vector<Output> outputs;
+    for (int i = 2; i < argc; i++) {
+        if (i == 2 || (strcmp(argv[i], "--output") == 0 && i + 1 < argc)) {
+            outputs.push_back(Output());
+            outputs.back().base = (i == 2) ? argv[i] : argv[++i];
+            iaea_filter_init(&outputs.back().filter);
+            iaea_filter_parse(&outputs.back().filter, DEFAULT_PLANE);
+            iaea_filter_init(&outputs.back().range);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            nThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--byte-order") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "little") == 0) byteOrder = 1234;
+            else if (strcmp(argv[i], "big") == 0) byteOrder = 4321;
+            else {
+                cerr << "Unknown byte order: " << argv[i] << endl;
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            blockRecords = IAEA_PACK_BLOCK_RECORDS;
+            if (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0]))
+                blockRecords = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--columns") == 0) {
+            columnRecords = IAEA_COLUMN_BLOCK_RECORDS;
+            if (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0]))
+                columnRecords = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--quantize") == 0) {
+            resolution = IAEA_QUANT_RESOLUTION;
+            if (i + 1 < argc && (isdigit((unsigned char)argv[i + 1][0]) || argv[i + 1][0] == '.'))
+                resolution = (IAEA_Float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--index") == 0) {
+            useIndex = true;
+        } else if (strcmp(argv[i], "--drop-extras") == 0) {
+            dropExtras = true;
+        } else if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+            if (iaea_filter_read(&outputs.back().filter, argv[++i]) != OK)
+                return 1;
+        } else if (strncmp(argv[i], "--", 2) == 0 && argv[i][2] != '\0') {
+            string statement = argv[i] + 2;
+            while (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0)
+                statement += string(" ") + argv[++i];
+            if (iaea_filter_parse(&outputs.back().filter, statement.c_str()) != OK)
+                return 1;
+        } else {
+            cerr << "Unknown option: " << argv[i] << endl;
+            return 1;
+        }
+    }
+    for (size_t k = 0; k < outputs.size(); k++) {
+        if (!hasAperture(outputs[k].filter))
+            iaea_filter_parse(&outputs[k].filter, DEFAULT_APERTURE);
+        iaea_filter_compile(&outputs[k].filter);
+    }
+    if ((blockRecords > 0) + (columnRecords > 0) + (resolution > 0.f) > 1) {
+        cerr << "Outputs are either compressed, stored column by column or quantized"
+             << " (--compress, --columns and --quantize exclude each other)." << endl;
+        return 1;
+    }
+    if (nThreads < 1) nThreads = 1;
+    if (nThreads > MAX_THREADS) {
+        cerr << "Warning: at most " << MAX_THREADS << " threads supported, using "
+             << MAX_THREADS << "." << endl;
+        nThreads = MAX_THREADS;
+    }
     
-    IAEA_I32 src, dest, res;
+    IAEA_I32 src, res;
     int lenIn = strlen(inFile);
-    int lenOut = strlen(outFile);
     
-    // Open input source in read-only mode (access = 1)
-    IAEA_I32 accessRead = 1;
+    // Open input source in read-only mode, decoding records straight from
+    // the memory mapped phsp file (access = 4)
+    IAEA_I32 accessRead = 4;
     iaea_new_source(&src, const_cast<char*>(inFile), &accessRead, &res, lenIn);
     if (res < 0) {
         cerr << "Error opening input source: " << inFile << endl;
         return 1;
     }
+    // Statistics of the particles read are not needed, only the output
+    // header statistics are
+    IAEA_I32 readStatistics = 0;
+    iaea_set_read_statistics(&src, &readStatistics, &res);
     
-    // Check file size and byte order of input file.
+    // Check file size and byte order of input file. Records in the other
+    // byte order are converted as they are read.
     iaea_check_file_size_byte_order(&src, &res);
     if (res != 0) {
-        // If error code is -3 (size mismatch but byte order ok), we issue a warning and proceed.
-        if (res == -3) {
+        if (res == -4 || res == -5)
+            cout << "Input file is in the other byte order, converting it." << endl;
+        // If error code is -3 or -5 (size mismatch), we issue a warning and proceed.
+        if (res == -3 || res == -5) {
             cerr << "Warning: Input file size does not match header checksum (code " 
                  << res << "). Proceeding anyway." << endl;
-            res = 0;
-        } else {
+        } else if (res != -4) {
             cerr << "Error: input file size or byte order mismatch (code " << res << ")." << endl;
             iaea_destroy_source(&src, &res);
             return 1;
         }
+        res = 0;
     }
     
-    // Open output source in write mode (access = 2)
-    IAEA_I32 accessWrite = 2;
-    iaea_new_source(&dest, const_cast<char*>(outFile), &accessWrite, &res, lenOut);
-    if (res < 0) {
-        cerr << "Error creating output source: " << outFile << endl;
-        iaea_destroy_source(&src, &res);
-        return 1;
+    // Conditions on extra longs (LATCH, ILB) test the columns the input
+    // stores them in
+    {
+        IAEA_I32 nExtraFloat, nExtraLong;
+        IAEA_I32 longTypes[NUM_EXTRA_LONG], floatTypes[NUM_EXTRA_FLOAT];
+        iaea_get_extra_numbers(&src, &nExtraFloat, &nExtraLong);
+        iaea_get_type_extra_variables(&src, &res, longTypes, floatTypes);
+        for (size_t k = 0; k < outputs.size(); k++) {
+            if (iaea_filter_bind(&outputs[k].filter, nExtraLong, longTypes) != OK) {
+                cerr << "Error: the filter of " << outputs[k].base
+                     << " tests extra numbers " << inFile << " does not have." << endl;
+                iaea_destroy_source(&src, &res);
+                return 1;
+            }
+        }
+        res = 0;
     }
     
-    // Copy header from input file to output file
-    iaea_copy_header(&src, &dest, &res);
-    if (res < 0) {
-        cerr << "Error copying header from input source." << endl;
-        iaea_destroy_source(&src, &res);
-        iaea_destroy_source(&dest, &res);
-        return 1;
+    // Open the output sources in write mode with the header and the record
+    // layout of the input, extra numbers included unless --drop-extras is
+    // given (any existing output files are removed for a clean start)
+    vector<IAEA_I32> dest;
+    for (size_t k = 0; k < outputs.size(); k++) {
+        outputs[k].id = createOutput(src, outputs[k].base, dropExtras);
+        if (outputs[k].id >= 0 && byteOrder != 0) {
+            iaea_set_byte_order(&outputs[k].id, &byteOrder, &res);
+            if (res < 0) {
+                iaea_destroy_source(&outputs[k].id, &res);
+                outputs[k].id = -1;
+            }
+        }
+        if (outputs[k].id >= 0 && blockRecords > 0) {
+            iaea_set_compression(&outputs[k].id, &blockRecords, &res);
+            if (res < 0) {
+                iaea_destroy_source(&outputs[k].id, &res);
+                outputs[k].id = -1;
+            }
+        }
+        if (outputs[k].id >= 0 && columnRecords > 0) {
+            iaea_set_columns(&outputs[k].id, &columnRecords, &res);
+            if (res < 0) {
+                iaea_destroy_source(&outputs[k].id, &res);
+                outputs[k].id = -1;
+            }
+        }
+        if (outputs[k].id >= 0 && resolution > 0.f) {
+            IAEA_Float energyMin = IAEA_QUANT_ENERGY_MIN, energyMax = IAEA_QUANT_ENERGY_MAX;
+            iaea_set_quantization(&outputs[k].id, &resolution, &energyMin, &energyMax, &res);
+            // Only the stored x, y and z are quantized
+            int positions = 0;
+            for (IAEA_I32 i = 0; i < 3; i++) {
+                IAEA_Float constant;
+                IAEA_I32 constantRes;
+                iaea_get_constant_variable(&outputs[k].id, &i, &constant, &constantRes);
+                if (constantRes != 0) positions |= 1 << i;
+            }
+            if (res < 0 || iaea_filter_quantization(&outputs[k].range, resolution, energyMin,
+                                                    energyMax, positions) != OK) {
+                iaea_destroy_source(&outputs[k].id, &res);
+                outputs[k].id = -1;
+            } else
+                iaea_filter_compile(&outputs[k].range);
+        }
+        if (outputs[k].id < 0) {
+            cerr << "Error creating output source: " << outputs[k].base << endl;
+            for (size_t j = 0; j < k; j++)
+                iaea_destroy_source(&outputs[j].id, &res);
+            iaea_destroy_source(&src, &res);
+            return 1;
+        }
+        dest.push_back(outputs[k].id);
     }
     
-    // Modify output header: disable extra data storage
-    int zero = 0;
-    iaea_set_extra_numbers(&dest, &zero, &zero);
-    
-    // Reset statistics – we will count only accepted records
-    IAEA_I64 acceptedHistories = 0;
-    IAEA_I64 acceptedParticles = 0;
-    
-    // Variables to hold particle record data.
-    IAEA_I32 n_stat, partType;
-    IAEA_Float E, wt, x, y, z, u, v, w;
-    // In this example we ignore extra floats/longs.
-    float dummyExtraFloats[NUM_EXTRA_FLOAT];
-    IAEA_I32 dummyExtraInts[NUM_EXTRA_LONG];
+    // A particle is written to an output if it passes all the conditions
+    // of its filter.
+    for (size_t k = 0; k < outputs.size(); k++) {
+        cout << "Filter of " << outputs[k].base << ":" << endl;
+        iaea_filter_print(&outputs[k].filter, stdout);
+    }
+    cout << "Filter kernel: " << iaea_simd_isa_name() << endl;
     
     // Get expected number of records from header.
     IAEA_I64 expected;
@@ -107,82 +703,228 @@ int main(int argc, char* argv[]) {
     IAEA_I64 expectedRecords = (expected > 0) ? expected - 1 : expected;
     cout << "Expected records (from header): " << expectedRecords << endl;
     
+    // Candidate records selected by the spatial index: the records of the
+    // cells some of whose particles could pass one of the filters. The
+    // other records are never read.
+    bool indexed = false;
+    RecordRanges candidates;
+    if (useIndex) {
+        iaea_index index;
+        if (iaea_index_read(&index, inFile) != OK) {
+            cerr << "Warning: no valid index of " << inFile
+                 << ", reading the whole file." << endl;
+        } else {
+            vector<iaea_filter_chain> chains;
+            for (size_t k = 0; k < outputs.size(); k++)
+                chains.push_back(outputs[k].filter);
+            IAEA_I64 *first, *count, nRanges;
+            candidates.records = iaea_index_select(&index, &chains[0], (int)chains.size(),
+                                                   expectedRecords, &first, &count, &nRanges);
+            iaea_index_free(&index);
+            if (candidates.records >= 0) {
+                candidates.first.assign(first, first + nRanges);
+                candidates.count.assign(count, count + nRanges);
+                free(first);
+                free(count);
+                indexed = true;
+                cout << "Candidate records (from index): " << candidates.records << " in "
+                     << nRanges << " ranges" << endl;
+            }
+        }
+    }
+    
+    // History index of the input (inputFileBase.IAEAhistory, see
+    // Geant4phspIndex), to split it at history boundaries and to count the
+    // histories of the records the spatial index skips
+    iaea_history_index histories;
+    bool historyIndexed = (iaea_history_read(&histories, inFile) == OK);
+    if (indexed && !historyIndexed)
+        cerr << "Warning: no valid history index of " << inFile << ", the histories of the"
+             << " records skipped are not counted in the n_stat of the outputs." << endl;
+    
     cout << "Processing input file (" << inFile << ")..." << endl;
     
-    // Loop: read records and apply filter
+    // Statistics – we count only accepted records
     IAEA_I64 count = 0;
-    int errorCount = 0;
-    const int ERROR_THRESHOLD = 10;
-    
-    for (IAEA_I64 i = 0; i < expectedRecords; i++) {
-        iaea_get_particle(&src, &n_stat, &partType, &E, &wt,
-                          &x, &y, &z, &u, &v, &w,
-                          dummyExtraFloats, dummyExtraInts);
-        if (n_stat == -1) {
-            errorCount++;
-            cerr << "Error reading particle at record " << i 
-                 << " (error count: " << errorCount << ")" << endl;
-            if (errorCount > ERROR_THRESHOLD) {
-                cerr << "Too many errors. Aborting filtering." << endl;
-                break;
+    vector<IAEA_I64> acceptedParticles(outputs.size(), 0);
+    vector<IAEA_I64> rejectedParticles(outputs.size(), 0);
+    bool failed = false;
+    
+    if (nThreads == 1) {
+        FilterResult result;
+        IAEA_I64 nRecords = expectedRecords;
+        if (indexed) {
+            IAEA_I64 nRanges = (IAEA_I64)candidates.first.size();
+            if (nRanges > 0)
+                iaea_set_read_ranges(&src, &nRanges, &candidates.first[0],
+                                     &candidates.count[0], &res);
+            nRecords = candidates.records;
+        }
+        if (indexed) countSkipped(&candidates, 1, expectedRecords + 1,
+                                  historyIndexed ? &histories : NULL);
+        filterRecords(src, outputs, dest, nRecords, indexed ? &candidates : NULL, true,
+                      &result);
+        count = result.processed;
+        acceptedParticles = result.accepted;
+        rejectedParticles = result.rejected;
+        failed = result.failed;
+    } else {
+        // Parallel mode: the input is split into nThreads chunks of whole
+        // histories. Every worker reads its chunk through its own source and
+        // writes the accepted particles to its own temporary outputs; the
+        // temporary outputs are appended to the output files in chunk order
+        // afterwards, so the result is the same as in serial mode.
+        // Every worker opens and closes its own sources.
+        cout << "Using " << nThreads << " threads." << endl;
+        vector<FilterResult> results(nThreads);
+        
+        // Chunk j starts with the first history starting at or after record
+        // 1 + expectedRecords*j/nThreads, or with the spatial index after
+        // candidates.records*j/nThreads candidate records, so that every
+        // chunk reads about as many records. The starts of the histories are
+        // looked up in the history index of the input if there is a valid
+        // one, else the records after the split points are read.
+        cout << "Chunks split at the starts of histories"
+             << (historyIndexed ? " (from the history index)" : "") << endl;
+        vector<IAEA_I64> chunkStart(nThreads + 1);
+        chunkStart[0] = 1;
+        chunkStart[nThreads] = expectedRecords + 1;
+        size_t range = 0;
+        IAEA_I64 before = 0; // candidate records of the ranges before range
+        for (IAEA_I32 j = 1; j < nThreads; j++) {
+            IAEA_I64 split = 1 + expectedRecords * j / nThreads;
+            if (indexed) {
+                IAEA_I64 rank = candidates.records * j / nThreads;
+                while (range < candidates.first.size() &&
+                       before + candidates.count[range] <= rank)
+                    before += candidates.count[range++];
+                split = (range < candidates.first.size())
+                        ? candidates.first[range] + (rank - before) : expectedRecords + 1;
             }
-            continue;
+            IAEA_I64 start = iaea_history_start(historyIndexed ? &histories : NULL, src, split);
+            if (start < 0) start = split;
+            chunkStart[j] = min(max(start, chunkStart[j - 1]), expectedRecords + 1);
+        }
+        
+        // With the spatial index, the candidate ranges are split at the
+        // chunk starts
+        vector<RecordRanges> chunkRanges(indexed ? nThreads : 0);
+        IAEA_I32 chunk = 0;
+        for (size_t r = 0; r < candidates.first.size(); r++) {
+            IAEA_I64 first = candidates.first[r], left = candidates.count[r];
+            while (left > 0) {
+                while (first >= chunkStart[chunk + 1]) chunk++;
+                IAEA_I64 n = min(left, chunkStart[chunk + 1] - first);
+                chunkRanges[chunk].first.push_back(first);
+                chunkRanges[chunk].count.push_back(n);
+                chunkRanges[chunk].records += n;
+                first += n;
+                left -= n;
+            }
+        }
+        for (size_t j = 0; j < chunkRanges.size(); j++)
+            countSkipped(&chunkRanges[j], chunkStart[j], chunkStart[j + 1],
+                         historyIndexed ? &histories : NULL);
+        
+        vector<thread> workers;
+        for (IAEA_I32 j = 0; j < nThreads; j++) {
+            IAEA_I64 nRecords = indexed ? chunkRanges[j].records
+                                        : chunkStart[j + 1] - chunkStart[j];
+            workers.push_back(thread(filterChunk, inFile, src, &outputs, dropExtras, j + 1,
+                                     chunkStart[j], nRecords,
+                                     indexed ? &chunkRanges[j] : NULL,
+                                     &results[j]));
         }
-        // Filter condition:
-        // If the particle is moving in the positive z direction and,
-        // at z = Z_PLANE, its (x,y) falls within [X_MIN, X_MAX] x [Y_MIN, Y_MAX],
-        // then accept (write) the particle.
-        if (w > 0) {
-            float newX = x;
-            float newY = y;
-            if (z < Z_PLANE) {
-                float t = (Z_PLANE - z) / w;
-                newX = x + u * t;
-                newY = y + v * t;
+        for (IAEA_I32 j = 0; j < nThreads; j++)
+            workers[j].join();
+        
+        // Append the temporary outputs in order. The histories started after
+        // the last particle a chunk wrote to an output are carried over to
+        // the first particle of the next chunks, as in serial mode.
+        vector<IAEA_I64> carried(outputs.size(), 0);
+        for (IAEA_I32 j = 0; j < nThreads; j++) {
+            if (!failed) {
+                count += results[j].processed;
+                failed = results[j].failed;
             }
-            if (newX >= X_MIN && newX <= X_MAX && newY >= Y_MIN && newY <= Y_MAX) {
-                // Write accepted particle to output.
-                iaea_write_particle(&dest, &n_stat, &partType, &E, &wt,
-                                    &x, &y, &z, &u, &v, &w,
-                                    dummyExtraFloats, dummyExtraInts);
-                acceptedHistories++;
-                acceptedParticles++;
+            for (size_t k = 0; k < outputs.size(); k++) {
+                string chunkFile = chunkName(outputs[k].base, j + 1);
+                if (!failed) {
+                    IAEA_I32 chunkId;
+                    IAEA_I64 nAppended;
+                    acceptedParticles[k] += results[j].accepted[k];
+                    rejectedParticles[k] += results[j].rejected[k];
+                    iaea_new_source(&chunkId, const_cast<char*>(chunkFile.c_str()),
+                                    &accessRead, &res, (int)chunkFile.size());
+                    if (res < 0) {
+                        cerr << "Error opening temporary output: " << chunkFile << endl;
+                        failed = true;
+                    } else {
+                        nAppended = appendChunk(outputs[k].id, chunkId, carried[k]);
+                        if (results[j].accepted[k] > 0) carried[k] = 0;
+                        carried[k] += results[j].pending[k];
+                        if (nAppended != results[j].accepted[k]) {
+                            cerr << "Error appending temporary output: " << chunkFile << endl;
+                            failed = true;
+                        }
+                        iaea_destroy_source(&chunkId, &res);
+                    }
+                }
+                removeOutputFiles(chunkFile.c_str());
             }
         }
-        count++;
-        if (count % 1000000 == 0)
-            cout << "Processed " << count << " records." << endl;
     }
+    if (failed)
+        cerr << "Filtering was aborted, the output files are incomplete." << endl;
     
     cout << "Total records processed: " << count << endl;
-    cout << "Accepted records (filtered): " << acceptedParticles << endl;
     
-    // Update output header statistics based on accepted records.
-    iaea_set_total_original_particles(&dest, &acceptedHistories);
-    iaea_update_header(&dest, &res);
-    if (res < 0)
-        cerr << "Error updating output header (code " << res << ")." << endl;
-    else
-        cout << "Output header updated successfully." << endl;
-    
-    // Report output PHSP file size.
-    string outPhspPath = string(outFile) + ".IAEAphsp";
-    struct stat fileStatus;
-    FILE* fp = fopen(outPhspPath.c_str(), "rb");
-    if (fp) {
-        if (fstat(fileno(fp), &fileStatus) == 0) {
-            IAEA_I64 fileSize = fileStatus.st_size;
-            cout << "Output PHSP file size: " << fileSize << " bytes." << endl;
-        }
-        fclose(fp);
-    } else {
-        cerr << "Cannot open output PHSP file for size check: " << outPhspPath << endl;
+    for (size_t k = 0; k < outputs.size(); k++) {
+        cout << "Accepted records (filtered) in " << outputs[k].base << ": "
+             << acceptedParticles[k] << endl;
+        if (outputs[k].range.n_stages > 0) {
+            if (rejectedParticles[k] > 0)
+                cerr << "Warning: " << rejectedParticles[k] << " accepted records out of the"
+                     << " quantization range left out of " << outputs[k].base << "." << endl;
+            iaea_set_quantization_rejected(&outputs[k].id, &rejectedParticles[k], &res);
+        }
+        
+        // Update output header statistics based on accepted records. The
+        // particles are those of all the histories of the input, whether
+        // they were left out or not, so the number of original histories
+        // is that of the input.
+        IAEA_I64 origHistories;
+        iaea_get_total_original_particles(&src, &origHistories);
+        iaea_set_total_original_particles(&outputs[k].id, &origHistories);
+        iaea_update_header(&outputs[k].id, &res);
+        if (res < 0)
+            cerr << "Error updating output header (code " << res << ")." << endl;
+        else
+            cout << "Output header updated successfully." << endl;
+        
+        // Report output PHSP file size.
+        string outPhspPath = outputs[k].base + ".IAEAphsp";
+        struct stat fileStatus;
+        FILE* fp = fopen(outPhspPath.c_str(), "rb");
+        if (fp) {
+            if (fstat(fileno(fp), &fileStatus) == 0) {
+                IAEA_I64 fileSize = fileStatus.st_size;
+                cout << "Output PHSP file size: " << fileSize << " bytes." << endl;
+            }
+            fclose(fp);
+        } else {
+            cerr << "Cannot open output PHSP file for size check: " << outPhspPath << endl;
+        }
     }
     
     // Clean up: close input and output sources.
+    iaea_history_free(&histories);
     iaea_destroy_source(&src, &res);
-    iaea_destroy_source(&dest, &res);
+    for (size_t k = 0; k < outputs.size(); k++)
+        iaea_destroy_source(&outputs[k].id, &res);
     
+    if (failed)
+        return 1;
     cout << "Filtering complete." << endl;
     return 0;
 }
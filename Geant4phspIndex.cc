@@ -0,0 +1,102 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include "iaea_phsp.h"    // functions operating on PHSP files
+#include "iaea_index.h"   // spatial index of PHSP files
+
+using namespace std;
+
+// Builds the spatial index of a phase space file and stores it next to
+// it (inputFileBase.IAEAindex), to be used by the cutter with --index.
+// With --histories the history index (inputFileBase.IAEAhistory) is
+// built as well, by which the cutter divides the file among its threads.
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        cerr << "Usage: " << argv[0] << " <inputFileBase> [--position-bins N]"
+             << " [--projection-bins N] [--plane Z] [--histories]" << endl;
+        return 1;
+    }
+    const char* inFile = argv[1];
+
+    // Cells: positionBins x positionBins bins of (x,y) times
+    // projectionBins x projectionBins bins of (x,y) projected to the
+    // plane z = plane, best set to the plane of the apertures cut most
+    int positionBins = IAEA_INDEX_POSITION_BINS;
+    int projectionBins = IAEA_INDEX_PROJECTION_BINS;
+    float plane = IAEA_INDEX_PLANE;
+    bool buildHistories = false;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--position-bins") == 0 && i + 1 < argc) {
+            positionBins = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--projection-bins") == 0 && i + 1 < argc) {
+            projectionBins = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--plane") == 0 && i + 1 < argc) {
+            plane = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--histories") == 0) {
+            buildHistories = true;
+        } else {
+            cerr << "Unknown option: " << argv[i] << endl;
+            return 1;
+        }
+    }
+    if (positionBins < 1 || positionBins > 64 || projectionBins < 1 || projectionBins > 64) {
+        cerr << "The position and projection bins must be in 1..64." << endl;
+        return 1;
+    }
+
+    cout << "Indexing input file (" << inFile << ") with " << positionBins << " x "
+         << positionBins << " position bins and " << projectionBins << " x "
+         << projectionBins << " bins at z = " << plane << "..." << endl;
+    iaea_index index;
+    if (iaea_index_build(inFile, positionBins, projectionBins, plane, &index) != OK) {
+        cerr << "Error building the index of " << inFile << "." << endl;
+        return 1;
+    }
+
+    if (index.nxy != positionBins || index.nproj != projectionBins) {
+        cout << "Too few particles for the bins, indexed with " << index.nxy << " x "
+             << index.nxy << " position bins and " << index.nproj << " x " << index.nproj
+             << " projected bins." << endl;
+    }
+    IAEA_I64 allCells = (IAEA_I64)index.nxy * index.nxy *
+                        ((IAEA_I64)index.nproj * index.nproj + 1);
+    cout << "Records indexed: " << index.n_records << endl;
+    cout << "Cells holding particles: " << index.n_cells << " of " << allCells << endl;
+    cout << "Record ranges: " << index.n_ranges << endl;
+
+    // Records a cut reads for one cell, on average: where the file mixes
+    // the cells, the ranges of every cell spread over much of it
+    double spanned = 0;
+    for (IAEA_I64 r = 0; r < index.n_ranges; r++) spanned += (double)index.count[r];
+    double cellShare = index.n_cells > 0 && index.n_records > 0 ?
+                       100. * spanned / index.n_cells / index.n_records : 0.;
+    if (cellShare > 10.) {
+        cout << "WARNING: the ranges of a cell span " << (int)cellShare << " % of the records"
+             << " on average, the file is not sorted by position and a cut with --index"
+             << " saves little. Sort it with Geant4phspCluster (--plane " << plane
+             << ") and index the sorted file." << endl;
+    }
+
+    int result = iaea_index_write(&index, inFile);
+    iaea_index_free(&index);
+    if (result != OK) {
+        cerr << "Error writing the index of " << inFile << "." << endl;
+        return 1;
+    }
+    cout << "Index written to " << inFile << ".IAEAindex" << endl;
+
+    if (buildHistories) {
+        iaea_history_index histories;
+        if (iaea_history_build(inFile, &histories) != OK ||
+            iaea_history_write(&histories, inFile) != OK) {
+            cerr << "Error building the history index of " << inFile << "." << endl;
+            iaea_history_free(&histories);
+            return 1;
+        }
+        cout << "Histories indexed: " << histories.n_histories << endl;
+        cout << "History index written to " << inFile << ".IAEAhistory" << endl;
+        iaea_history_free(&histories);
+    }
+    return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef IAEA_COLUMN
+#define IAEA_COLUMN
+
+#include "iaea_record.h"
+#include "iaea_pack.h"
+
+/* *********************************************************************** */
+// Records stored column by column, used by the phase space files of
+// FILE_TYPE 4 (see iaea_set_columns). The records are kept in blocks as
+// in the files of compressed records (block headers, block table and
+// trailer of iaea_pack.h, the trailer starting with "IAEACOLS" and
+// IAEA_COLUMN_VERSION), but the data of a block are its columns, as they
+// are, one after the other: the type bytes, then for every 4-byte word of
+// the records (energy, stored x, y, z, u, v and weight, extra floats,
+// extra longs) its n values in the byte order of the header. Every column
+// starts at a multiple of IAEA_COLUMN_ALIGN bytes in the file, so a reader
+// can load the columns it needs only (see iaea_set_read_columns) and read
+// the values of the other ones for the particles it keeps.
+
+#ifndef IAEA_COLUMN_BLOCK_RECORDS
+  #define IAEA_COLUMN_BLOCK_RECORDS 65536 // default records per block
+#endif
+
+#define IAEA_COLUMN_VERSION 1
+
+#define IAEA_COLUMN_ALIGN 64 // alignment of the blocks and columns in the file
+
+#ifndef IAEA_COLUMN_GAP
+  #define IAEA_COLUMN_GAP 4096 // values of a column closer than this are read at once
+#endif
+
+/* *********************************************************************** */
+// functions
+
+/**************************************************************************
+* Size of the data of a block of n records of reclength bytes (without
+* the block header).
+**************************************************************************/
+IAEA_I64 iaea_column_size(int n, int reclength);
+
+/**************************************************************************
+* Offset in the data of a block of n records of column (0 for the type
+* bytes, j > 0 for the j-th word of the records) and the size of its
+* values (1 or 4).
+**************************************************************************/
+IAEA_I64 iaea_column_offset(int n, int reclength, int column);
+int iaea_column_width(int column);
+
+/**************************************************************************
+* Split n records of reclength bytes into the columns of a block, data
+* has room for iaea_column_size(n, reclength) bytes.
+**************************************************************************/
+void iaea_column_records(const unsigned char *records, int n, int reclength,
+                         unsigned char *data);
+
+/**************************************************************************
+* Copy the n values of column at values into the records (the other bytes
+* of the records are left as they are).
+**************************************************************************/
+void iaea_column_scatter(const unsigned char *values, int n, int reclength, int column,
+                         unsigned char *records);
+
+#endif
@@ -46,6 +46,17 @@ typedef long long IAEA_I64;
 #endif
 #endif
 
+// Unsigned 64 bit word, used for bit masks
+#if (defined WIN32) || (defined WIN64)
+typedef unsigned __int64 IAEA_U64;
+#else
+#if defined NO_LONG_LONG || defined LONG_IS_64
+typedef unsigned long IAEA_U64;
+#else
+typedef unsigned long long IAEA_U64;
+#endif
+#endif
+
 #ifdef __cplusplus
 #define IAEA_EXTERN_C extern "C"
 #else
@@ -0,0 +1,175 @@
+#ifndef IAEA_FILTER
+#define IAEA_FILTER
+
+#include "iaea_record.h"
+#include "iaea_simd.h"
+
+/* *********************************************************************** */
+// Vectorized particle filters operating on a block of decoded particles
+// (see iaea_get_particles_batch). The result of a filter is an accept mask
+// (see IAEA_MASK_WORDS in iaea_simd.h); the kernels are dispatched to the
+// instruction set of iaea_simd_isa.
+
+/* *********************************************************************** */
+// structures
+
+// Particles moving forward (w > 0) are projected to the plane z = z_plane
+// (if not already beyond it) and accepted if the projected (x,y) lies in
+// [x_min,x_max] x [y_min,y_max].
+struct iaea_plane_cut
+{
+  float z_plane;
+  float x_min, x_max;
+  float y_min, y_max;
+};
+
+// Conditions a filter chain is made of. The numbers order them by cost,
+// the cheapest conditions are evaluated first.
+#define IAEA_STAGE_TYPE      0 // particle type in a set of types
+#define IAEA_STAGE_BITS      1 // bits of an extra long (EGS LATCH)
+#define IAEA_STAGE_LABEL     2 // extra long in [l_min,l_max] (PENELOPE ILB)
+#define IAEA_STAGE_ENERGY    3 // kinetic energy in [e_min,e_max]
+#define IAEA_STAGE_RECTANGLE 4 // rectangular aperture (iaea_plane_cut)
+#define IAEA_STAGE_CIRCLE    5 // circular aperture
+#define IAEA_STAGE_POLYGON   6 // polygonal aperture (even-odd rule)
+#define IAEA_STAGE_RANGE     7 // in the range of a quantization (iaea_quant.h)
+
+#define IAEA_MAX_STAGES   16 // maximum number of conditions in a chain
+#define IAEA_MAX_VERTICES 32 // maximum number of polygon vertices
+
+struct iaea_filter_stage;
+
+// Kernel of a condition: returns the accept bits of the particles
+// first..first+n-1 of a block (n <= 64), bit k for particle first+k
+typedef IAEA_U64 (*iaea_stage_kernel)(const iaea_filter_stage *stage,
+                                      const iaea_particle_block *block,
+                                      int first, int n);
+
+// One condition of a filter chain. Apertures take the particles moving
+// forward (w > 0) and project them to the plane z = plane.z_plane as
+// iaea_plane_cut does, the aperture is then tested in that plane.
+// Conditions on an extra long name it by its type (see
+// iaea_set_type_extralong_variable); the column of the block holding it
+// is set by iaea_filter_bind. A bits condition accepts a particle if
+// ((value & bit_mask) == bit_value) == bit_match.
+struct iaea_filter_stage
+{
+  int kind;                 // IAEA_STAGE_*
+  iaea_plane_cut plane;     // z_plane of all apertures, limits of a rectangle
+  float x0, y0, radius;     // circle
+  float e_min, e_max;       // energy window
+  unsigned int types;       // bit (type - 1) set for every accepted type
+  int long_type;            // type of the extra long tested
+  int column;               // its column in the block, -1 if there is none
+  unsigned int bit_mask, bit_value;
+  int bit_match;
+  IAEA_I32 l_min, l_max;    // label range
+  int n_vertices;           // polygon
+  float vx[IAEA_MAX_VERTICES], vy[IAEA_MAX_VERTICES];
+  float resolution;         // quantization range, with e_min and the
+  double log_step;          // stored x, y and z (bits 0, 1 and 2 of
+  int positions;            // positions)
+  iaea_stage_kernel kernel; // set by iaea_filter_compile
+};
+
+// A particle is accepted if it passes all the conditions of the chain
+struct iaea_filter_chain
+{
+  float z_plane;            // plane of the apertures added next
+  int n_stages;
+  iaea_filter_stage stage[IAEA_MAX_STAGES];
+};
+
+/* *********************************************************************** */
+// functions
+
+/**************************************************************************
+* Apply the Z-plane projection cut to n particles and store the result in
+* mask. Returns the number of accepted particles.
+**************************************************************************/
+int iaea_filter_plane(const iaea_plane_cut *cut, int n,
+                      const IAEA_Float *x, const IAEA_Float *y, const IAEA_Float *z,
+                      const IAEA_Float *u, const IAEA_Float *v, const IAEA_Float *w,
+                      IAEA_U64 *mask);
+
+/**************************************************************************
+* Empty filter chain (accepts every particle), apertures are at z = 0
+* until a plane statement is parsed.
+**************************************************************************/
+void iaea_filter_init(iaea_filter_chain *chain);
+
+/**************************************************************************
+* Add a condition to a filter chain from a statement (numbers can be
+* separated by spaces or commas, lengths in cm and energies in MeV):
+*   plane Z                      plane of the apertures that follow
+*   rect X_MIN X_MAX Y_MIN Y_MAX rectangular aperture
+*   circle X0 Y0 R               circular aperture
+*   polygon X1 Y1 X2 Y2 ...      polygonal aperture, at least 3 vertices
+*   energy E_MIN E_MAX           kinetic energy window
+*   types T1 T2 ...              particle types, by number (1-5) or name
+*                                (photon, electron, positron, neutron, proton)
+*   latch [any|all|none] MASK    EGS LATCH with any (default), all or none
+*                                of the bits of MASK set (decimal or 0x hex)
+*   ilb K L_MIN [L_MAX]          PENELOPE label ILB(K), K = 1..5, equal to
+*                                L_MIN or in [L_MIN,L_MAX]
+* Empty statements and statements starting with # are ignored.
+* Returns OK, or FAIL with a message on stderr.
+**************************************************************************/
+int iaea_filter_parse(iaea_filter_chain *chain, const char *statement);
+
+/**************************************************************************
+* Add a condition that accepts the particles in the range of a quantization
+* of the given resolution and energy range (see iaea_set_quantization and
+* iaea_quant_position_range), positions being the stored x, y and z (bits
+* 0, 1 and 2 set), so that the particles a quantized source can not write
+* are left out. Returns OK, or FAIL with a message on stderr.
+**************************************************************************/
+int iaea_filter_quantization(iaea_filter_chain *chain, float resolution,
+                             float energy_min, float energy_max, int positions);
+
+/**************************************************************************
+* Add the conditions of a filter configuration file, one statement per
+* line. Returns OK, or FAIL with a message on stderr.
+**************************************************************************/
+int iaea_filter_read(iaea_filter_chain *chain, const char *file_name);
+
+/**************************************************************************
+* Bind the conditions on extra longs of a chain to the extra longs of the
+* particles it is run on: the k-th extra long (k = 0..n_extralong-1) is of
+* type extralong_type[k] and is held in column k of the block (as
+* iaea_get_type_extra_variables and iaea_get_particles_batch return
+* them). Returns OK, or FAIL with a message on stderr if a condition
+* names an extra long that is not there. A condition that was not bound
+* accepts no particle.
+**************************************************************************/
+int iaea_filter_bind(iaea_filter_chain *chain, int n_extralong, const IAEA_I32 *extralong_type);
+
+/**************************************************************************
+* Prepare a chain for iaea_filter_run: the conditions are ordered by cost
+* and bound to the kernels of the instruction set in use. Must be called
+* after the last condition was added.
+**************************************************************************/
+void iaea_filter_compile(iaea_filter_chain *chain);
+
+/**************************************************************************
+* Apply a compiled filter chain to n particles of a block (type, E,
+* x, y, z, u, v, w and the extra longs bound are used) and store the result in mask. Returns the
+* number of accepted particles. The conditions are evaluated 64 particles
+* at a time, a group is dropped as soon as none of its particles is left.
+**************************************************************************/
+int iaea_filter_run(const iaea_filter_chain *chain, const iaea_particle_block *block,
+                    int n, IAEA_U64 *mask);
+
+/**************************************************************************
+* Variables a bound filter chain tests (a sum of IAEA_COLUMN_* of
+* iaea_record.h), the only ones to read from a file of columns to run it
+* (see iaea_set_read_columns).
+**************************************************************************/
+int iaea_filter_columns(const iaea_filter_chain *chain);
+
+/**************************************************************************
+* Print the conditions of a filter chain, one per line.
+**************************************************************************/
+void iaea_filter_print(const iaea_filter_chain *chain, FILE *out);
+
+#endif
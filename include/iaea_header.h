@@ -3,6 +3,7 @@
 
 /* *********************************************************************** */
 #include "iaea_record.h"
+#include "iaea_simd.h"
 
 // defines
 #define SEGMENT_BEG_TOKEN '$'
@@ -25,6 +26,13 @@
 //  7: ILB1 (PENELOPE) 
 //  more to be defined
 
+// Position of a $KEYWORD: line in the indexed header text
+struct iaea_header_block
+{
+  const char *name; // keyword (in header_text)
+  int line;         // number of the keyword line
+};
+
 #define MAX_NUMB_EXTRAFLOAT_TYPES 3 /* maximum number of extra float allowed */
  //  0: User defined generic type
  //  1: XLAST (x coord. of the last interaction)  
@@ -39,7 +47,8 @@ struct iaea_header_type
   // ******************************************************************************
   // 1. PHSP format
   
-  int file_type;            // 0 = phsp file ;  1 = phsp generator 
+  int file_type;            // 0 = phsp file ;  1 = phsp generator ;  2 = phsp file of compressed records 
+                            // 3 = phsp file of quantized records ;  4 = phsp file of columns
   int byte_order;           // as defined by get_byte_order routine
   int record_contents[9];   // record_contents[i] = 1 or 0 (variable or constant)
                             // correspond to the following logical variables :
@@ -67,10 +76,20 @@ struct iaea_header_type
   //                  record_contents[8]*4 +                  (iextralong)
   IAEA_I64 checksum;
 
+  // Quantized records (file_type = 3, see iaea_quant.h)
+  float quant_resolution;   // position resolution (cm)
+  float quant_energy_min;   // energy range (MeV)
+  float quant_energy_max;
+  double quant_error[3];    // largest position (cm), relative energy and
+                            // direction (degrees) errors of the records
+  IAEA_I64 quant_rejected;  // particles left out as out of range
+
   // ******************************************************************************
   // 2. Mandatory description of the phsp
   
-  char coordinate_system_description[MAX_STR_LEN*MAX_NUMB_LINES+1];
+  // The descriptive blocks (text) below are allocated with the exact size
+  // when they are set (see set_text), a block that is not present is NULL
+  char *coordinate_system_description;
 
   // Counters for phsp file
   IAEA_I64 orig_histories;  
@@ -78,49 +97,49 @@ struct iaea_header_type
   IAEA_I64 particle_number[MAX_NUM_PARTICLES];
 
   // Event generator input file
-  char input_file_for_event_generator[MAX_STR_LEN*MAX_NUMB_LINES+1];
+  char *input_file_for_event_generator;
   
   // ******************************************************************************
   // 3. Mandatory additional information
   
   unsigned int iaea_index; // Agency ID
-  char title[MAX_STR_LEN*MAX_NUMB_LINES+1];
+  char *title;
   
-  char machine_type[MAX_STR_LEN*MAX_NUMB_LINES+1];
+  char *machine_type;
   
-  char MC_code_and_version[MAX_STR_LEN*MAX_NUMB_LINES+1];
+  char *MC_code_and_version;
   
   float global_photon_energy_cutoff;
   
   float global_particle_energy_cutoff;
   
-  char transport_parameters[MAX_STR_LEN*MAX_NUMB_LINES+1];
+  char *transport_parameters;
 
   // ******************************************************************************
   // 4. Optional description
   
-  char beam_name[MAX_STR_LEN*MAX_NUMB_LINES+1];
+  char *beam_name;
   
-  char field_size[MAX_STR_LEN*MAX_NUMB_LINES+1];
+  char *field_size;
   
-  char nominal_SSD[MAX_STR_LEN*MAX_NUMB_LINES+1];
+  char *nominal_SSD;
   
-  char variance_reduction_techniques[MAX_STR_LEN*MAX_NUMB_LINES+1];
+  char *variance_reduction_techniques;
   
-  char initial_source_description[MAX_STR_LEN*MAX_NUMB_LINES+1];
+  char *initial_source_description;
 
   // Documentation sub-section
-  char MC_input_filename[MAX_STR_LEN*MAX_NUMB_LINES+1];
+  char *MC_input_filename;
   
   // Assumed to be the preferred citation
-  char published_reference[MAX_STR_LEN*MAX_NUMB_LINES+1]; 
-  char authors[MAX_STR_LEN*MAX_NUMB_LINES+1];
+  char *published_reference; 
+  char *authors;
   
-  char institution[MAX_STR_LEN*MAX_NUMB_LINES+1];
+  char *institution;
   
-  char link_validation[MAX_STR_LEN*MAX_NUMB_LINES+1];
+  char *link_validation;
 
-  char additional_notes[MAX_STR_LEN*MAX_NUMB_LINES+1];
+  char *additional_notes;
 
   // ******************************************************************************
   // 5. Optional statistical information
@@ -136,6 +155,18 @@ struct iaea_header_type
 
   IAEA_I64 read_indep_histories;  
 
+  int skip_read_counters;  // counters are not updated for particles read
+                           // (see iaea_set_read_statistics)
+
+  // Header file contents while it is parsed by read_header: the lines
+  // (comments removed) and an index of the blocks sorted by keyword
+  char *header_text;
+  int *line_offset;
+  int n_lines;
+  int next_line;
+  iaea_header_block *blocks;
+  int n_blocks;
+
 // CLASS FUNCTIONS
 
 public:
@@ -146,15 +177,26 @@ public:
       int get_record_contents(iaea_record_type *p_iaea_record);
       void initialize_counters();
       void update_counters(iaea_record_type *p_iaea_record);
+      void update_counters(const iaea_particle_block *block, int first, int n);
+      void update_counters(const iaea_particle_block *block, const IAEA_U64 *mask, int n);
+      int  same_record_layout(iaea_header_type *other);
+      int  set_text(char **text, const char *value);
+      void release();
 
 private:
+      int parse_header();
+      int index_header();
+      void free_index();
+      int get_line(char *line);
       int read_block(char *lineread, const char *blockname);
+      int read_text(char **text, const char *blockname);
       int get_block(char *lineread);
       int get_blockname(char *line, const char *blockname);
       int write_blockname(const char *blockname);
 
       int check_byte_order();
       void print_statistics();
+      void add_statistics(const iaea_block_stats *stats);
 };
 
 #endif
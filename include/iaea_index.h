@@ -0,0 +1,229 @@
+#ifndef IAEA_INDEX
+#define IAEA_INDEX
+
+#include "iaea_record.h"
+#include "iaea_filter.h"
+
+/* *********************************************************************** */
+// Spatial index of a phase space file, kept in a sidecar file next to it
+// (base.IAEAindex). The records are divided into coarse cells by their
+// position (x,y) and by the position their particle is projected to in a
+// reference plane z = z_ref (as the apertures of a filter chain project
+// them); particles not moving forward have cells of their own. For every
+// cell the index holds the ranges of records the particles of the cell
+// are stored in and bounds of their variables, for the cells holding
+// particles only (the index grows with the data, not with the number of
+// bins). A filter chain then
+// selects the cells some of whose particles could pass it, and only the
+// records of their ranges need to be read (see iaea_set_read_ranges).
+//
+// A range may also hold records of other cells: records of a cell less
+// than IAEA_INDEX_GAP records apart are stored as one range, the filter
+// drops the others as it does when the whole file is read. The fewer
+// cells a stretch of the file mixes (e.g. the records were written in
+// the order of their position), the more records a cut skips.
+//
+// The index is kept within 1/IAEA_INDEX_FRACTION of the size of the file:
+// with too few particles per cell the bins are halved, and where the file
+// mixes the cells the ranges of a cell nearest each other are merged
+// further (a cut then reads more of the file, which is best sorted first,
+// see iaea_cluster).
+
+#ifndef IAEA_INDEX_POSITION_BINS
+  #define IAEA_INDEX_POSITION_BINS 16 // bins of x and of y
+#endif
+
+#ifndef IAEA_INDEX_PROJECTION_BINS
+  #define IAEA_INDEX_PROJECTION_BINS 16 // bins of x and of y projected to the reference plane
+#endif
+
+#ifndef IAEA_INDEX_PLANE
+  #define IAEA_INDEX_PLANE 100.f // reference plane (cm)
+#endif
+
+#ifndef IAEA_INDEX_GAP
+  #define IAEA_INDEX_GAP 256 // records between two ranges of a cell merged into one
+#endif
+
+#ifndef IAEA_INDEX_FRACTION
+  #define IAEA_INDEX_FRACTION 16 // largest index, as a fraction of the file (1/16)
+#endif
+
+#define IAEA_INDEX_VERSION 2
+
+#define IAEA_HISTORY_VERSION 2
+
+#ifndef IAEA_CLUSTER_MEMORY
+  #define IAEA_CLUSTER_MEMORY ((IAEA_I64)256 << 20) // Bytes of particles sorted in memory
+#endif
+
+#ifndef IAEA_CLUSTER_FAN_IN
+  #define IAEA_CLUSTER_FAN_IN 64 // sorted runs merged at once
+#endif
+
+/* *********************************************************************** */
+// structures
+
+// Particles of a cell. The bounds of the particles moving forward (w > 0)
+// are those the apertures are tested with; tx = u/w and ty = v/w are the
+// slopes of their projection to a plane.
+struct iaea_index_cell
+{
+  IAEA_I64 id;             // (x bin*nxy + y bin)*(nproj*nproj + 1) + projected
+                           // x bin*nproj + projected y bin, or + nproj*nproj
+                           // for the particles not moving forward
+  IAEA_I64 first_range;    // first range of the cell in the index arrays
+  IAEA_I64 n_ranges;
+  IAEA_I64 n_records;      // particles in the cell
+  IAEA_I64 n_forward;      // of which moving forward
+  unsigned int types;      // bit (type - 1) set for every type in the cell
+  float e_min, e_max;      // kinetic energy
+  float x_min, x_max;      // forward particles
+  float y_min, y_max;
+  float z_min, z_max;
+  double tx_min, tx_max;
+  double ty_min, ty_max;
+};
+
+struct iaea_index
+{
+  IAEA_I64 n_records;      // records indexed
+  IAEA_I64 file_size;      // size and modification time of the phsp file,
+  IAEA_I64 file_time;      // the index is out of date when they change
+  int nxy, nproj;          // position and projected position bins
+  float z_ref;             // reference plane
+  float x_min, x_max;      // range of both kinds of bins
+  float y_min, y_max;
+  IAEA_I64 n_cells;        // cells holding particles, of nxy*nxy*(nproj*nproj + 1)
+  iaea_index_cell *cell;   // in the order of their id
+  IAEA_I64 n_ranges;       // ranges of all cells, cell by cell
+  IAEA_I64 *first;         // first record of a range (counted from 1)
+  IAEA_I64 *count;         // records in the range
+};
+
+// History index of a phase space file, kept in the sidecar file
+// base.IAEAhistory: the record every history starts with, i.e. the
+// records with n_stat > 0 (and the first record of the file), and their
+// n_stat summed up. A file can then be divided at history boundaries, the
+// k-th history be found and the histories of a range of records be
+// counted without reading the file.
+struct iaea_history_index
+{
+  IAEA_I64 n_records;      // records indexed
+  IAEA_I64 file_size;      // size and modification time of the phsp file
+  IAEA_I64 file_time;
+  IAEA_I64 n_histories;
+  IAEA_I64 *first;         // first record of every history (counted from 1)
+  IAEA_I64 *counted;       // n_stat of the records before every history, summed
+};
+
+/* *********************************************************************** */
+// functions
+
+/**************************************************************************
+* Build the index of the phase space file base (without extension) with
+* nxy x nxy position bins and nproj x nproj bins of the position projected
+* to the plane z = z_ref, both spanning the positions of its particles
+* (projected positions outside are put into the outer bins). The file is
+* read twice, and again with half the bins of one kind as long as the
+* cells would take more than half the size allowed for the index (see
+* IAEA_INDEX_FRACTION); index->nxy and index->nproj are the bins used.
+* Returns OK, or FAIL with a message on stderr.
+**************************************************************************/
+int iaea_index_build(const char *base, int nxy, int nproj, float z_ref,
+                     iaea_index *index);
+
+/**************************************************************************
+* Write the index to base.IAEAindex, or read it from there. Reading fails
+* if the file is not an index written on a machine of the same kind, or
+* if the phase space file base.IAEAphsp was changed since the index was
+* built. Return OK, or FAIL (with a message on stderr unless the index
+* file does not exist).
+**************************************************************************/
+int iaea_index_write(const iaea_index *index, const char *base);
+
+int iaea_index_read(iaea_index *index, const char *base);
+
+/**************************************************************************
+* Select the ranges of records holding the particles that could pass at
+* least one of n_chains compiled filter chains: the cells are tested with
+* the bounds of their particles, the ranges of the cells selected are
+* merged and clipped to the records 1..last_record. The ranges are
+* returned in *first and *count (allocated with malloc, NULL if there is
+* none) and their number in *n_ranges. Returns the number of records in
+* the ranges, or -1 with a message on stderr.
+**************************************************************************/
+IAEA_I64 iaea_index_select(const iaea_index *index, const iaea_filter_chain *chains,
+                           int n_chains, IAEA_I64 last_record,
+                           IAEA_I64 **first, IAEA_I64 **count, IAEA_I64 *n_ranges);
+
+/**************************************************************************
+* Release the arrays of an index.
+**************************************************************************/
+void iaea_index_free(iaea_index *index);
+
+/**************************************************************************
+* Build the history index of the phase space file base (without
+* extension), reading the file once. Returns OK, or FAIL with a message
+* on stderr.
+**************************************************************************/
+int iaea_history_build(const char *base, iaea_history_index *index);
+
+/**************************************************************************
+* Write the history index to base.IAEAhistory, or read it from there, as
+* iaea_index_write and iaea_index_read do.
+**************************************************************************/
+int iaea_history_write(const iaea_history_index *index, const char *base);
+
+int iaea_history_read(iaea_history_index *index, const char *base);
+
+/**************************************************************************
+* Record the k-th history (counted from 1) starts with. For k equal to
+* n_histories + 1 it is n_records + 1, the end of the last history.
+* Returns -1 if k is out of range.
+**************************************************************************/
+IAEA_I64 iaea_history_record(const iaea_history_index *index, IAEA_I64 k);
+
+/**************************************************************************
+* Histories the records first..last (counted from 1) count: the sum of
+* their n_stat, which for incremental history numbers (EGS) includes the
+* histories that left no particle in the file.
+**************************************************************************/
+IAEA_I64 iaea_history_count(const iaea_history_index *index, IAEA_I64 first, IAEA_I64 last);
+
+/**************************************************************************
+* First record at or after record (counted from 1) that starts a history,
+* or the record after the last one if there is none. It is looked up in
+* index unless index is NULL; then the records of the source id are read
+* from record on until one starting a history is found (the read position
+* of the source is changed). Used to divide a file into chunks of whole
+* histories. Returns -1 if the records cannot be read.
+**************************************************************************/
+IAEA_I64 iaea_history_start(const iaea_history_index *index, IAEA_I32 id, IAEA_I64 record);
+
+/**************************************************************************
+* Release the arrays of a history index.
+**************************************************************************/
+void iaea_history_free(iaea_history_index *index);
+
+/**************************************************************************
+* Rewrite the phase space file in as out with its records ordered by the
+* Morton code (Z-order curve) of the position their particle is projected
+* to in the plane z = z_plane, so that the records of a rectangle of that
+* plane are stored in few ranges of records (see iaea_index_build).
+* Histories are kept together: all the records of a history are ordered by
+* the position of its first particle and stay in their order, histories
+* of equal position keep the order of in. Particles not moving forward
+* are put after all the others. The records are copied unchanged (in the
+* byte order of the machine), the header of out is that of in.
+*
+* The file is sorted externally: runs of histories filling about memory
+* bytes are sorted in memory and written to temporary files out_runK,
+* which are then merged, IAEA_CLUSTER_FAN_IN at a time. A history of more
+* records than a run holds gets a longer run (and more memory), so that
+* histories are never split. Returns OK, or FAIL with a message on
+* stderr.
+**************************************************************************/
+int iaea_cluster(const char *in, const char *out, float z_plane, IAEA_I64 memory);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef IAEA_PACK
+#define IAEA_PACK
+
+#include "iaea_record.h"
+
+/* *********************************************************************** */
+// Lossless compression of blocks of raw records, used by the phase space
+// files of FILE_TYPE 2 (see iaea_set_compression). The records of a block
+// are split into columns (the type byte and every 4-byte word), a word
+// column is predicted from the previous record (XOR or integer delta,
+// whichever leaves less information) and split into its 4 byte planes,
+// and every plane is stored as it is, as a single repeated byte or with a
+// canonical Huffman code of its own. A block is decoded without anything
+// but its own bytes, so blocks can be decoded in any order and in
+// parallel.
+//
+// The .IAEAphsp file of FILE_TYPE 2 holds the compressed blocks one after
+// the other, each one starting with the number of its records and the
+// size of its data (4-byte integers), followed by the table of the file
+// offsets of the blocks (8-byte integers) and a trailer of
+// IAEA_PACK_TRAILER bytes: the magic "IAEAPACK", the format version and
+// the records per block (4-byte integers), the number of records and the
+// number of blocks (8-byte integers). All the integers are little endian;
+// the records themselves are compressed in the byte order of the header.
+// Every block but the last one holds the same number of records.
+
+#ifndef IAEA_PACK_BLOCK_RECORDS
+  #define IAEA_PACK_BLOCK_RECORDS 16384 // default records per block
+#endif
+
+#define IAEA_PACK_MAX_BLOCK_RECORDS (1 << 20)
+
+#define IAEA_PACK_VERSION 1
+
+#define IAEA_PACK_BLOCK_HEADER 8 // records and data size of a block
+#define IAEA_PACK_TRAILER     32 // magic, version, records per block, records, blocks
+
+/* *********************************************************************** */
+// functions
+
+/**************************************************************************
+* Upper limit of the size of the data of a block of n records of
+* reclength bytes (without the block header).
+**************************************************************************/
+IAEA_I64 iaea_pack_bound(int n, int reclength);
+
+/**************************************************************************
+* Compress n raw records of reclength bytes (a type byte followed by
+* 4-byte words) into out, which has room for iaea_pack_bound(n, reclength)
+* bytes. Returns the size of the data.
+**************************************************************************/
+IAEA_I64 iaea_pack_records(const unsigned char *records, int n, int reclength,
+                           unsigned char *out);
+
+/**************************************************************************
+* Decompress the size bytes of data of a block of n records of reclength
+* bytes into records. Returns OK, or FAIL if the data are not a valid
+* block of that many records.
+**************************************************************************/
+int iaea_unpack_records(const unsigned char *data, IAEA_I64 size, int n, int reclength,
+                        unsigned char *records);
+
+// Little endian integers of the block headers, block tables and trailers
+void iaea_pack_put32(unsigned char *p, IAEA_I64 value);
+void iaea_pack_put64(unsigned char *p, IAEA_I64 value);
+IAEA_I64 iaea_pack_get32(const unsigned char *p);
+IAEA_I64 iaea_pack_get64(const unsigned char *p);
+
+#endif
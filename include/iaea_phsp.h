@@ -67,9 +67,16 @@
 * knows what went wrong). This function *must* be called before using
 * any of the following functions for a given source id.
 *
-* access = 1 => opening read-only file
-* access = 2 => opening file for writing
-* access = 3 => opening file for appending/updating
+* access = 1 => opening read-only file, the file is read ahead by a
+*               reader thread (see iaea_set_read_ahead)
+* access = 2 => opening file for writing, the particles are written by a
+*               writer thread (see iaea_set_write_behind)
+* access = 3 => opening file for appending/updating (written as access = 2)
+* access = 4 => opening read-only file, records are decoded directly
+*               from the memory mapped phsp file (falls back to access = 1
+*               where memory mapping is not available and for files of
+*               compressed records or columns, see iaea_set_compression
+*               and iaea_set_columns)
 *
 ***********************************************************************/
 IAEA_EXTERN_C IAEA_EXPORT 
@@ -290,6 +297,191 @@ IAEA_EXTERN_C IAEA_EXPORT
 void iaea_set_total_original_particles(const IAEA_I32 *id, 
                                        IAEA_I64 *number_of_original_particles);
 
+/*****************************************************************************
+* Switch the counters of the particles read from the Source with Id id
+* on (read_statistics = 1, the default) or off (read_statistics = 0).
+*
+* The counters give the statistics printed for a source and the number
+* of independent histories read so far (iaea_get_used_original_particles).
+* When they are not needed, switching them off saves the work done for
+* every particle read. Particles written are always counted, the header
+* of the output is made from them.
+*
+* Set result to negative if such source does not exist.
+******************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_read_statistics(const IAEA_I32 *id, const IAEA_I32 *read_statistics,
+                              IAEA_I32 *result);
+
+/*****************************************************************************
+* Read the phsp file of the Source with Id id ahead of the particles
+* returned, through n_buffers buffers of buffer_size bytes each.
+*
+* A reader thread fills the buffers while the particles of the previous
+* one are decoded, so iaea_get_particle and iaea_get_particles_batch do
+* not wait for the disk. Sources opened with access = 1 are read ahead by
+* default (IAEA_READ_AHEAD_BUFFERS buffers of IAEA_READ_AHEAD_SIZE bytes),
+* buffer_size = 0 switches to plain stdio reading. n_buffers is between
+* 2 and IAEA_READ_AHEAD_MAX_BUFFERS.
+*
+* Set result to negative if such source does not exist (-1), is not read
+* through stdio (-2, e.g. memory mapped or opened for writing) or the
+* read-ahead can not be set up (-3, also while columns are left out, see
+* iaea_set_read_columns).
+******************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_read_ahead(const IAEA_I32 *id, const IAEA_I64 *buffer_size,
+                         const IAEA_I32 *n_buffers, IAEA_I32 *result);
+
+/*****************************************************************************
+* Write the particles of the Source with Id id through n_buffers buffers
+* of buffer_size bytes each.
+*
+* The records are encoded into a buffer and a writer thread writes the
+* filled buffers with single large writes while the next one is filled,
+* so encoding and writing overlap. Sources opened with access = 2 or 3 are
+* written behind by default (IAEA_WRITE_BEHIND_BUFFERS buffers of
+* IAEA_WRITE_BEHIND_SIZE bytes), buffer_size = 0 switches to plain stdio
+* writing. n_buffers is between 2 and IAEA_WRITE_BEHIND_MAX_BUFFERS.
+* A failed write is reported by a later write, by iaea_update_header or
+* when the source is destroyed; iaea_update_header writes all particles
+* before the header.
+*
+* Set result to negative if such source does not exist (-1), is not open
+* for writing (-2) or the particles written so far could not be written
+* (-3).
+******************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_write_behind(const IAEA_I32 *id, const IAEA_I64 *buffer_size,
+                           const IAEA_I32 *n_buffers, IAEA_I32 *result);
+
+/*****************************************************************************
+* Write the particles of the Source with Id id in the byte order byte_order
+* (1234 little endian, 4321 big endian, as the BYTE_ORDER of the header).
+*
+* Sources opened with access = 2 are written in the byte order of the
+* machine unless another one is set here, before the first particle is
+* written; the records are converted as they are written. Files in the
+* other byte order are converted in the same way as they are read
+* (access = 1, 4) or appended to (access = 3).
+*
+* Set result to negative if such source does not exist (-1), is not open
+* for writing (-2), byte_order is not 1234 or 4321 (-3) or the source
+* already holds particles (-4).
+******************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_byte_order(const IAEA_I32 *id, const IAEA_I32 *byte_order,
+                         IAEA_I32 *result);
+
+/*****************************************************************************
+* Write the particles of the Source with Id id in compressed blocks of
+* block_records records each (FILE_TYPE 2 in the header), or as raw
+* records if block_records = 0. IAEA_PACK_BLOCK_RECORDS (iaea_pack.h) is a
+* good size: every block is compressed on its own, by the writer thread
+* if there is one, with a lossless codec of the library (no compression
+* library is needed).
+*
+* Sources opened with access = 2 are written raw unless compression is set
+* here, before the first particle is written. Files of compressed records
+* are read (access = 1, 4) and appended to (access = 3) like any other;
+* iaea_get_particle and the batched routines return the same particles,
+* and iaea_set_record, iaea_set_parallel and iaea_set_read_ranges only
+* decode the blocks holding the records asked for. The CHECKSUM of the
+* header is then the size of the compressed file.
+*
+* Set result to negative if such source does not exist (-1), is not open
+* for writing (-2), block_records is out of range (-3), the source
+* already holds particles (-4) or its records are quantized (-5).
+******************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_compression(const IAEA_I32 *id, const IAEA_I32 *block_records,
+                          IAEA_I32 *result);
+
+/*****************************************************************************
+* Write the particles of the Source with Id id quantized (FILE_TYPE 3 in
+* the header, see iaea_quant.h): x, y and z to multiples of
+* position_resolution (cm), the energy to one of 65535 values spaced
+* logarithmically from energy_min to energy_max (MeV) and the direction to
+* 16 bits, so a record of x, y, z, u, v and weight takes 15 bytes instead
+* of 29. position_resolution = 0 writes records of floats again. With the
+* defaults of iaea_quant.h (0.01 cm, 1 eV to 10 GeV) positions are kept
+* within 0.005 cm up to 327 cm, energies within 0.02 % and directions
+* within 0.65 degrees.
+*
+* The particles must store u, v and w. A particle with a value out of
+* range is not written (iaea_write_particle fails), such particles are to
+* be left out beforehand (see iaea_filter_quantization) and can be counted
+* in the header (see iaea_set_quantization_rejected). The largest errors of
+* the particles written are kept in the header (QUANTIZATION_ERRORS). Files
+* of quantized records are read (access = 1, 4) and appended to
+* (access = 3) like any other, the particles read being the quantized
+* ones. Quantized records are little endian whatever the byte order of the
+* header, and are never compressed (iaea_set_compression) nor stored in
+* columns (iaea_set_columns).
+*
+* Set result to negative if such source does not exist (-1), is not open
+* for writing (-2), the resolution or the energy range is out of range
+* (-3), the source already holds particles (-4) or its particles can not
+* be quantized (-5).
+******************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_quantization(const IAEA_I32 *id, const IAEA_Float *position_resolution,
+                           const IAEA_Float *energy_min, const IAEA_Float *energy_max,
+                           IAEA_I32 *result);
+
+/*****************************************************************************
+* Set the number of particles left out of the Source with Id id as out of
+* the range of its quantization (QUANTIZATION_REJECTED in the header, see
+* iaea_set_quantization), to be written with the header.
+*
+* Set result to negative if such source does not exist (-1) or its
+* records are not quantized (-2).
+******************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_quantization_rejected(const IAEA_I32 *id, const IAEA_I64 *n_rejected,
+                                    IAEA_I32 *result);
+
+/*****************************************************************************
+* Write the particles of the Source with Id id column by column (FILE_TYPE
+* 4 in the header, see iaea_column.h), in blocks of block_records records,
+* or as raw records if block_records = 0. IAEA_COLUMN_BLOCK_RECORDS is a
+* good size. A block holds the particle types, then every variable stored
+* (energy, x, y, z, u, v, weight, extra floats and longs) for all its
+* particles, each of them aligned to IAEA_COLUMN_ALIGN bytes in the file.
+*
+* Files of columns are read (access = 1, 4) and appended to (access = 3)
+* like any other, and as files of compressed records (see
+* iaea_set_compression) only the blocks holding the records asked for are
+* read. A reader that needs some of the variables only to select
+* particles reads only those (see iaea_set_read_columns). The CHECKSUM of
+* the header is the size of the file. The records are not compressed
+* (iaea_set_compression replaces the columns) nor quantized.
+*
+* Set result to negative if such source does not exist (-1), is not open
+* for writing (-2), block_records is out of range (-3), the source
+* already holds particles (-4) or its records are quantized (-5).
+******************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_columns(const IAEA_I32 *id, const IAEA_I32 *block_records,
+                      IAEA_I32 *result);
+
+/*****************************************************************************
+* Read only the variables of columns (a sum of IAEA_COLUMN_* of
+* iaea_record.h, IAEA_COLUMN_ALL for all of them) of the particles of the
+* Source with Id id, a file of columns (see iaea_set_columns), from the
+* next particle read on. The other variables of the particles read are 0
+* until they are read with iaea_gather_particles_batch for the particles
+* kept. The energy and the incremental number of histories are always
+* read, w needs the particle type, u and v. While variables are left out,
+* the file is not read ahead and the counters of the particles read are
+* not updated.
+*
+* Set result to negative if such source does not exist (-1) or is not a
+* file of columns open for reading (-2).
+******************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_read_columns(const IAEA_I32 *id, const IAEA_I32 *columns, IAEA_I32 *result);
+
 /**************************************************************************
 * Partitioning for parallel runs 
 *
@@ -301,6 +493,9 @@ void iaea_set_total_original_particles(const IAEA_I32 *id,
 * The extra parameter i_parallel is needed
 * for the cases where the source is an event generator and should
 * be used to adjust the random number sequence.
+* The portions hold equal numbers of records, so a history may be split
+* between two of them; iaea_history_start (iaea_index.h) finds the
+* history boundaries to divide a file at.
 * The variable is_ok should be set to 0 if everything went smoothly,
 * or to some error code if it didnt.
 **************************************************************************/
@@ -321,12 +516,36 @@ IAEA_EXTERN_C IAEA_EXPORT
 void iaea_set_record(const IAEA_I32 *id, const IAEA_I64 *record_num,
                            IAEA_I32 *result);
 
+/**************************************************************************
+* Read only ranges of records of the Source with Id id
+*
+* From now on the particles are read from the n_ranges ranges of records
+* first[k] .. first[k]+count[k]-1 (records counted from 1, as by
+* iaea_set_record), in this order, as if they were the whole file; the
+* end of the file is reached after the last range. The ranges must be
+* sorted and must not overlap. Only the pages of the file holding records
+* of the ranges are read, e.g. the candidates of a cut selected with a
+* spatial index (see iaea_index.h). n_ranges = 0 goes back to reading the
+* whole file from the current position; iaea_set_record and
+* iaea_set_parallel do the same.
+*
+* Set result to negative if such source does not exist (-1), is not open
+* for reading (-2), the ranges are not valid (-3) or could not be stored
+* (-4).
+**************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_read_ranges(const IAEA_I32 *id, const IAEA_I64 *n_ranges,
+                          const IAEA_I64 *first, const IAEA_I64 *count,
+                          IAEA_I32 *result);
+
 /**************************************************************************
 * check that the file size equals the value of checksum in the header
 *
 * id is the phase space file identifier.  If the size of the phase space
 * file is not equal to checksum, then result returns -1, otherwise result
 * is set to 0.
+* A byte order mismatch is reported as -4 (-5 together with a size
+* mismatch); the records of such files are converted as they are read.
 **************************************************************************/
 IAEA_EXTERN_C IAEA_EXPORT
 void iaea_check_file_size_byte_order(const IAEA_I32 *id, IAEA_I32 *result);
@@ -380,6 +599,165 @@ const IAEA_Float *w,  /* direction in cartesian coordinates*/
 const IAEA_Float *extra_floats,
 const IAEA_I32 *extra_ints);
 
+/**************************************************************************
+* Get a block of particles
+*
+* Return up to n_max next particles from source with Id id in caller
+* provided arrays (structure of arrays), n_read is set to the number of
+* particles returned. The meaning of n_stat and the other variables is
+* the same as in iaea_get_particle. Extra floats and integers are stored
+* column by column: extra_floats(i,k) = extra_floats[(k-1)*n_max + i-1]
+* is the k-th extra float of the i-th particle (Fortran order).
+* n_read < n_max means the end of the phase space file was reached.
+* Set n_read to -1, if a source with Id id does not exist. Set n_read
+* to -2, if called at the end of file (the file is then rewound).
+**************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_get_particles_batch(const IAEA_I32 *id, const IAEA_I32 *n_max,
+IAEA_I32 *n_read,
+IAEA_I32 *n_stat,
+IAEA_I32 *type, /* particle types */
+IAEA_Float *E,  /* kinetic energies in MeV */
+IAEA_Float *wt, /* statistical weights */
+IAEA_Float *x,
+IAEA_Float *y,
+IAEA_Float *z,  /* positions in cartesian coordinates*/
+IAEA_Float *u,
+IAEA_Float *v,
+IAEA_Float *w,  /* directions in cartesian coordinates*/
+IAEA_Float *extra_floats,
+IAEA_I32 *extra_ints);
+
+/**************************************************************************
+* Write a block of particles
+*
+* Write n particles given as structure of arrays to the source with Id
+* id. The meaning of the variables is the same as in iaea_write_particle,
+* extra floats and integers are stored column by column with leading
+* dimension n (see iaea_get_particles_batch).
+* n_written is set to the number of particles written, or to -1 if
+* ERROR (source with Id id does not exist or writing failed).
+**************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_write_particles_batch(const IAEA_I32 *id, const IAEA_I32 *n,
+IAEA_I32 *n_written,
+const IAEA_I32 *n_stat,
+const IAEA_I32 *type, /* particle types */
+const IAEA_Float *E,  /* kinetic energies in MeV */
+const IAEA_Float *wt, /* statistical weights */
+const IAEA_Float *x,
+const IAEA_Float *y,
+const IAEA_Float *z,  /* positions in cartesian coordinates*/
+const IAEA_Float *u,
+const IAEA_Float *v,
+const IAEA_Float *w,  /* directions in cartesian coordinates*/
+const IAEA_Float *extra_floats,
+const IAEA_I32 *extra_ints);
+
+/**************************************************************************
+* Copy particles without decoding them
+*
+* Copy the raw records of the particles selected by mask from the last
+* block read with iaea_get_particles_batch from source with Id source_ID
+* to the source with Id destiny_ID. n is the number of particles of that
+* block, bit (i-1)%64 of mask((i-1)/64+1) selects the i-th particle.
+* The records of both sources have to be stored in the same way. n_stat,
+* type, E, wt, x, y and z are the values of the block as returned by
+* iaea_get_particles_batch, used to update the counters of destiny_ID.
+* The history marks of the records copied (sign of the energy and the
+* incremental number of histories, if stored) are set from n_stat, which
+* may thus differ from the values read, e.g. to carry the histories of
+* particles left out over to the next particle written.
+* n_written is set to the number of particles copied, or to
+*    -1 if ERROR (source does not exist or writing failed)
+*    -2 if records of both sources are stored differently
+*    -3 if no block of n particles was read before
+**************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_copy_particles_batch(const IAEA_I32 *source_ID,
+const IAEA_I32 *destiny_ID, const IAEA_I32 *n, const IAEA_U64 *mask,
+const IAEA_I32 *n_stat,
+const IAEA_I32 *type, /* particle types */
+const IAEA_Float *E,  /* kinetic energies in MeV */
+const IAEA_Float *wt, /* statistical weights */
+const IAEA_Float *x,
+const IAEA_Float *y,
+const IAEA_Float *z,  /* positions in cartesian coordinates*/
+IAEA_I32 *n_written);
+
+/**************************************************************************
+* Read the variables left out (see iaea_set_read_columns) of the particles
+* selected by mask of the last block read with iaea_get_particles_batch
+* from source with Id id. n is the number of particles of that block, bit
+* (i-1)%64 of mask((i-1)/64+1) selects the i-th particle. The particles
+* selected are decoded again into the arrays of the block (n_max and the
+* arrays as given to iaea_get_particles_batch), the others are left as
+* they are, and their records are complete for iaea_copy_particles_batch.
+* Only the values of the particles selected are read from the file, a
+* run of them at a time. Nothing is read if no variable is left out.
+* Set result to negative if such source does not exist (-1), if no block
+* of n particles was read before (-2) or the file can not be read (-3).
+**************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_gather_particles_batch(const IAEA_I32 *id, const IAEA_I32 *n_max,
+const IAEA_I32 *n, const IAEA_U64 *mask,
+IAEA_I32 *n_stat,
+IAEA_I32 *type, /* particle types */
+IAEA_Float *E,  /* kinetic energies in MeV */
+IAEA_Float *wt, /* statistical weights */
+IAEA_Float *x,
+IAEA_Float *y,
+IAEA_Float *z,  /* positions in cartesian coordinates*/
+IAEA_Float *u,
+IAEA_Float *v,
+IAEA_Float *w,  /* directions in cartesian coordinates*/
+IAEA_Float *extra_floats,
+IAEA_I32 *extra_ints,
+IAEA_I32 *result);
+
+/**************************************************************************
+* Copy particles without decoding them, in a given order
+*
+* Same as iaea_copy_particles_batch, but the particles order(1), ...,
+* order(n) of the last block read from source with Id source_ID are
+* copied, in this order (order(k) = i selects the i-th particle of the
+* block). A particle can be selected once. Used to reorder the records
+* of a file, e.g. to sort them (see iaea_cluster in iaea_index.h).
+* n_written is set to the number of particles copied, or to
+*    -1 if ERROR (source does not exist or writing failed)
+*    -2 if records of both sources are stored differently
+*    -3 if no block holding the particles selected was read before
+*    -4 if a particle is selected twice
+**************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_copy_particles_ordered(const IAEA_I32 *source_ID,
+const IAEA_I32 *destiny_ID, const IAEA_I32 *n, const IAEA_I32 *order,
+const IAEA_I32 *n_stat,
+const IAEA_I32 *type, /* particle types */
+const IAEA_Float *E,  /* kinetic energies in MeV */
+const IAEA_Float *wt, /* statistical weights */
+const IAEA_Float *x,
+const IAEA_Float *y,
+const IAEA_Float *z,  /* positions in cartesian coordinates*/
+IAEA_I32 *n_written);
+
+/**************************************************************************
+* Append a source
+*
+* Append all particles of the source with Id source_ID (open for reading)
+* to the source with Id destiny_ID. The records are copied without
+* decoding them and the counters of destiny_ID are updated, so the result
+* is the same as writing the particles to destiny_ID one by one. Used to
+* merge phase space files written in parallel into one file.
+* The records of both sources have to be stored in the same way.
+* result is set to the number of particles appended, or to
+*    -1 if ERROR (source does not exist, reading or writing failed)
+*    -2 if records of both sources are stored differently
+**************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_append_source(const IAEA_I32 *destiny_ID, const IAEA_I32 *source_ID,
+                        IAEA_I64 *result);
+
 /***************************************************************************
 * Destroy a source 
 *
@@ -407,6 +785,10 @@ void iaea_copy_header(const IAEA_I32 *source_ID, const IAEA_I32 *destiny_ID,
 
 /***************************************************************************
 * Update header of the source_id 
+*
+* The particles not written yet are written first.
+* result is set to negative if phsp source does not exist (-1) or the
+* particles could not be written (-2).
 ****************************************************************************/
 IAEA_EXTERN_C IAEA_EXPORT 
 void iaea_update_header(const IAEA_I32 *source_ID, IAEA_I32 *result);
@@ -0,0 +1,109 @@
+#ifndef IAEA_QUANT
+#define IAEA_QUANT
+
+#include "iaea_record.h"
+
+/* *********************************************************************** */
+// Lossy storage of the records of the phase space files of FILE_TYPE 3
+// (see iaea_set_quantization). A stored record holds
+//   1 byte   the particle type, bit 7 set for the first particle of a history
+//   2 bytes  the energy: 0 for E = 0, codes 1 to 65535 spaced
+//            logarithmically from the minimum to the maximum energy
+//   2 bytes  every stored x, y and z, a signed multiple of the position
+//            resolution
+//   2 bytes  the direction, a point of the octahedron |u|+|v|+|w| = 1
+//            unfolded onto a square of 256 x 256 cells (replaces u, v and
+//            the sign of w kept in the particle type)
+//   4 bytes  the weight if it is stored and every extra float and long,
+//            as they are
+// All the numbers are little endian, whatever the byte order of the
+// header. Records are quantized as they are written and expanded back to
+// the usual records of floats as they are read, so the rest of the library
+// never sees a quantized record. The largest errors of the records written,
+// measured on the values as they are read back, are kept in the header
+// (QUANTIZATION_ERRORS) rounded upward, so no record exceeds them.
+
+#ifndef IAEA_QUANT_RESOLUTION
+  #define IAEA_QUANT_RESOLUTION 0.01f // default position resolution (cm)
+#endif
+
+#ifndef IAEA_QUANT_ENERGY_MIN
+  #define IAEA_QUANT_ENERGY_MIN 1.e-6f // default lowest energy (MeV)
+#endif
+
+#ifndef IAEA_QUANT_ENERGY_MAX
+  #define IAEA_QUANT_ENERGY_MAX 1.e4f  // default highest energy (MeV)
+#endif
+
+#define IAEA_QUANT_CODES    65536 // codes of the energy and of the direction
+#define IAEA_QUANT_POSITION 32767 // largest position code (in resolutions)
+
+/* *********************************************************************** */
+// structures
+
+struct iaea_quantization
+{
+  float resolution;  // position resolution (cm)
+  float energy_min;  // energies of the codes 1 and 65535 (MeV)
+  float energy_max;
+  double log_step;   // logarithm of the ratio of two consecutive energies
+  float *energy;     // energy of every code
+
+  // Largest errors of the records quantized: position (cm), relative
+  // energy and angle of the direction (degrees)
+  double error[3];
+};
+
+/* *********************************************************************** */
+// functions
+
+/**************************************************************************
+* Quantization of the given resolution and energy range, NULL if the
+* arguments are out of range or memory is lacking. The errors start at 0.
+**************************************************************************/
+iaea_quantization *iaea_quant_new(float resolution, float energy_min, float energy_max);
+
+void iaea_quant_free(iaea_quantization *q);
+
+/**************************************************************************
+* OK if the records of p can be quantized (u, v and w are stored), FAIL
+* otherwise.
+**************************************************************************/
+int iaea_quant_layout(const iaea_record_type *p);
+
+/**************************************************************************
+* Range of a quantization of the given resolution and energy range (see
+* iaea_quant_new): OK if iaea_quantize_records can code a stored position
+* x (cm), an energy (MeV, its absolute value is taken) or a direction
+* (u, v, w), FAIL otherwise. log_step is iaea_quant_log_step(energy_min,
+* energy_max). Used to leave the particles out of range out before they
+* are written (see iaea_filter_quantization).
+**************************************************************************/
+double iaea_quant_log_step(float energy_min, float energy_max);
+int iaea_quant_position_range(float resolution, float x);
+int iaea_quant_energy_range(float energy_min, double log_step, float energy);
+int iaea_quant_direction_range(double u, double v, double w);
+
+/**************************************************************************
+* Size of a quantized record of the layout of p.
+**************************************************************************/
+int iaea_quant_length(const iaea_record_type *p);
+
+/**************************************************************************
+* Quantize in place the n records (in the byte order of the machine) of
+* the layout of p at records, the quantized records following each other
+* from records on. The errors of q are updated. Returns FAIL if a value
+* is outside the range of q (see iaea_quant_position_range), the records
+* are left undefined then.
+**************************************************************************/
+int iaea_quantize_records(iaea_quantization *q, const iaea_record_type *p,
+                          unsigned char *records, int n);
+
+/**************************************************************************
+* Expand n quantized records of the layout of p into records of floats
+* (in the byte order of the machine). stored may be records itself.
+**************************************************************************/
+void iaea_expand_records(const iaea_quantization *q, const iaea_record_type *p,
+                         const unsigned char *stored, unsigned char *records, int n);
+
+#endif
@@ -24,7 +24,39 @@
                             // 3 positrons
                             // 4 neutrons
                             // 5 protons
-#define MAX_NUM_SOURCES 30
+#ifndef MAX_NUM_SOURCES
+  #define MAX_NUM_SOURCES 65536 // Upper limit of source Ids, the slots are
+                                // allocated when needed (see iaea_new_source)
+#endif
+
+#ifndef IAEA_MAP_WINDOW
+  #define IAEA_MAP_WINDOW ((IAEA_I64)sizeof(void *) << 28) // Bytes mapped at once
+                                                          // (1 GB on 32 bit, 2 GB on 64 bit)
+#endif
+
+#ifndef IAEA_MAP_READAHEAD
+  #define IAEA_MAP_READAHEAD ((IAEA_I64)64 << 20) // Bytes announced ahead of the reader
+#endif
+
+#ifndef IAEA_READ_AHEAD_SIZE
+  #define IAEA_READ_AHEAD_SIZE ((IAEA_I64)8 << 20) // Bytes per read-ahead buffer
+#endif
+
+#ifndef IAEA_READ_AHEAD_BUFFERS
+  #define IAEA_READ_AHEAD_BUFFERS 2 // Read-ahead buffers (one decoded, the others in flight)
+#endif
+
+#define IAEA_READ_AHEAD_MAX_BUFFERS 8
+
+#ifndef IAEA_WRITE_BEHIND_SIZE
+  #define IAEA_WRITE_BEHIND_SIZE ((IAEA_I64)8 << 20) // Bytes per write-behind buffer
+#endif
+
+#ifndef IAEA_WRITE_BEHIND_BUFFERS
+  #define IAEA_WRITE_BEHIND_BUFFERS 2 // Write-behind buffers (one filled, the others written)
+#endif
+
+#define IAEA_WRITE_BEHIND_MAX_BUFFERS 8
 
 #define OK     0
 #define FAIL  -1
@@ -32,6 +64,50 @@
 /* *********************************************************************** */
 // structures
 
+// Structure-of-arrays view of a block of particles used by the batched
+// read/write routines. Extra floats and longs are stored column by column,
+// extra_floats[k*n_max + i] is the k-th extra float of the i-th particle.
+struct iaea_particle_block
+{
+  IAEA_I32 n_max;      // leading dimension of the extra arrays
+  IAEA_I32 *n_stat;
+  IAEA_I32 *type;
+  IAEA_Float *E;
+  IAEA_Float *wt;
+  IAEA_Float *x, *y, *z;
+  IAEA_Float *u, *v, *w;
+  IAEA_Float *extra_floats;
+  IAEA_I32 *extra_ints;
+};
+
+// Variables of the records, loaded column by column from the files of
+// FILE_TYPE 4 (see iaea_set_read_columns and iaea_column.h)
+#define IAEA_COLUMN_TYPE       0x1
+#define IAEA_COLUMN_E          0x2
+#define IAEA_COLUMN_X          0x4
+#define IAEA_COLUMN_Y          0x8
+#define IAEA_COLUMN_Z          0x10
+#define IAEA_COLUMN_U          0x20
+#define IAEA_COLUMN_V          0x40
+#define IAEA_COLUMN_W          0x80  // sign of w, with the type, u and v
+#define IAEA_COLUMN_WEIGHT     0x100
+#define IAEA_COLUMN_EXTRA_FLOAT(k) (0x200 << (k))   // k-th extra float
+#define IAEA_COLUMN_EXTRA_LONG(k)  (0x80000 << (k)) // k-th extra long
+#define IAEA_COLUMN_ALL        0x1fffffff
+
+struct iaea_record_type;
+struct iaea_read_ahead;   // read-ahead buffers and reader thread (iaea_record.cpp)
+struct iaea_write_behind; // write-behind buffers and writer thread (iaea_record.cpp)
+struct iaea_packed;       // block table and buffers of compressed records or columns (iaea_record.cpp)
+struct iaea_quantization; // parameters and errors of quantized records (iaea_quant.h)
+
+// Decoder/encoder of a block of records of one layout (see select_codecs)
+typedef void (*iaea_decode_fn)(const iaea_record_type *p, const unsigned char *records,
+                               int n, const iaea_particle_block *block, int first,
+                               int stat_long);
+typedef void (*iaea_encode_fn)(const iaea_record_type *p, const iaea_particle_block *block,
+                               int n, unsigned char *records);
+
 struct iaea_record_type
 {
   FILE *p_file;   // phase space file pointer   
@@ -57,10 +133,121 @@ struct iaea_record_type
   float extrafloat[NUM_EXTRA_FLOAT];  // (default: no extra float stored)
   IAEA_I32 extralong[NUM_EXTRA_LONG];      // (default: one extra long stored)
 
+  // Memory mapped reading (access = 4)
+  int use_map;           // 1 if records are decoded from the mapped file
+  unsigned char *p_map;  // currently mapped window of the phsp file
+  IAEA_I64 map_offset;   // file offset of the first mapped byte
+  IAEA_I64 map_length;   // number of mapped bytes
+  IAEA_I64 map_position; // file offset of the next record to be read
+  IAEA_I64 map_advised;  // end of the region already announced with MADV_WILLNEED
+  IAEA_I64 file_size;
+
+  // Read-ahead reading (access = 1)
+  int use_ahead;            // 1 if records are read through the read-ahead buffers
+  iaea_read_ahead *p_ahead; // NULL if the file is not read ahead
+
+  // Write-behind writing (access = 2, 3)
+  int use_behind;              // 1 if records are written through the write-behind buffers
+  iaea_write_behind *p_behind; // NULL if the file is not written behind
+
+  // Records stored in compressed blocks (FILE_TYPE 2, see iaea_pack.h) or
+  // in blocks of columns (FILE_TYPE 4, see iaea_column.h)
+  int use_packed;          // 1 if the records are stored in blocks
+  iaea_packed *p_packed;   // NULL if the records are stored raw
+
+  // Records stored quantized (FILE_TYPE 3, see iaea_quant.h), expanded to
+  // records of floats as they are read and quantized as they are written
+  iaea_quantization *p_quant; // NULL if the records are stored as floats
+
+  // Records stored in the other byte order than the machine's are
+  // converted as they are read and written (see iaea_swap_records)
+  int swap_bytes;        // 1 if the records are stored in the other byte order
+
+  // Ranges of records read (see iaea_set_read_ranges), NULL if the whole
+  // file is read. Read through stdio, the records of a range are read
+  // into range_buffer.
+  IAEA_I64 *range_first;  // first record of a range (counted from 1)
+  IAEA_I64 *range_count;  // records in the range
+  IAEA_I64 n_ranges;
+  IAEA_I64 next_range;    // range started next
+  IAEA_I64 range_left;    // records left in the current range
+  IAEA_I64 range_advised; // next range to be announced to the kernel (mapped file)
+  unsigned char *range_buffer;
+  IAEA_I64 range_capacity;
+
+  // Buffer holding a block of raw records for the batched routines
+  unsigned char *raw_buffer;
+  IAEA_I64 raw_capacity;
+
+  // Codecs of the batched routines, chosen for the layout of the records
+  // (NULL for layouts decoded and encoded record by record)
+  int codec_layout;      // layout the codecs were chosen for, 0 if none yet
+  iaea_decode_fn decode;
+  iaea_encode_fn encode;
+
+  // Raw records of the last block returned by read_records
+  const unsigned char *block_records;
+  int block_count;
+
+  // Record of the file (counted from 0) of every record of that block,
+  // kept while columns are left out of the reads (see set_columns)
+  IAEA_I64 *block_index;
+  IAEA_I64 index_capacity;
+
 public:
       short read_particle();
       short write_particle();
       short initialize();
+      short map_file();
+      short unmap_file();
+      short set_read_ahead(IAEA_I64 size, int n_buffers);
+      short set_write_behind(IAEA_I64 size, int n_buffers);
+      short set_ranges(const IAEA_I64 *first, const IAEA_I64 *count, IAEA_I64 n);
+      short set_packed(int block, int columnar = 0);
+      short open_packed(int append, int columnar = 0);
+      short set_columns(int variables);
+      int   projected();
+      short gather_records(const IAEA_U64 *mask, int n);
+      IAEA_I64 packed_size();
+      short set_quantization(float resolution, float energy_min, float energy_max);
+      short flush_records();
+      void  release();
+      short seek_position(IAEA_I64 offset);
+      void  rewind_file();
+      int   end_of_file();
+      int   record_size();
+      int   stored_size();
+
+      const unsigned char *next_records(int n, int *n_got);
+      const unsigned char *read_records(int n, int *n_got);
+      unsigned char *buffer_records(int n);
+      unsigned char *output_records(int n);
+      short commit_records(int n);
+      void  unpack_particles(const unsigned char *records, int n,
+                             const iaea_particle_block *block, int first,
+                             int stat_long = -1);
+      void  pack_particles(const iaea_particle_block *block, int n,
+                           unsigned char *records);
+      int   pack_particle(unsigned char *record);
+      void  mark_history(unsigned char *record, IAEA_I32 n_stat, int stat_long = -1);
+
+private:
+      const unsigned char *map_records(int reclength, int n, int *n_got);
+      const unsigned char *ahead_records(int reclength, int n, int *n_got);
+      IAEA_I64 ahead_wait(int reclength);
+      short start_reader(int reclength);
+      void  stop_reader();
+      short start_writer();
+      short stop_writer();
+      short start_range();
+      const unsigned char *range_records(int reclength, int n, int *n_got);
+      void  advise_ranges(int reclength);
+      short set_position(IAEA_I64 offset);
+      IAEA_I64 get_position();
+      size_t read_raw(unsigned char *records, int reclength, size_t n);
+      short unpack_particle(const unsigned char *record);
+      void  select_codecs();
+      short index_records(int first, int n);
 };
 
 #endif
@@ -0,0 +1,105 @@
+#ifndef IAEA_SIMD
+#define IAEA_SIMD
+
+#include "iaea_record.h"
+
+/* *********************************************************************** */
+// Vectorized kernels of the record layer (statistics of a block of
+// particles, reconstruction of w, transposition and byte order conversion
+// of raw records) and the instruction set they and the filters of
+// iaea_filter.h are dispatched to. The result of a filter, and the
+// particles a block statistics takes, are given by a mask: bit (i & 63)
+// of mask[i >> 6] is set for the i-th particle. A mask for n particles
+// needs IAEA_MASK_WORDS(n) words.
+
+#define IAEA_MASK_WORDS(n) (((n) + 63) >> 6)
+
+// Instruction sets the kernels are dispatched to
+#define IAEA_ISA_SCALAR 0
+#define IAEA_ISA_SSE2   1
+#define IAEA_ISA_AVX2   2
+#define IAEA_ISA_AVX512 3
+
+// The SIMD versions of the kernels are built with GCC compatible compilers
+// for x86, with function level target attributes
+#if !defined(DOUBLE) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IAEA_SIMD_X86
+#endif
+
+/* *********************************************************************** */
+// structures
+
+// Statistics of a block of particles as kept by the header counters.
+// Minima start at +infinity and maxima at -infinity; the per type values
+// are indexed by particle type - 1.
+struct iaea_block_stats
+{
+  IAEA_I64 n_particles;
+  IAEA_I64 n_histories;       // sum of the positive n_stat
+  float min_x, max_x;
+  float min_y, max_y;
+  float min_z, max_z;
+  IAEA_I64 count[MAX_NUM_PARTICLES];
+  double sum_weight[MAX_NUM_PARTICLES];
+  double sum_energy[MAX_NUM_PARTICLES]; // sum of weight*|E|
+  float min_weight[MAX_NUM_PARTICLES], max_weight[MAX_NUM_PARTICLES];
+  float min_energy[MAX_NUM_PARTICLES], max_energy[MAX_NUM_PARTICLES]; // of |E|
+};
+
+/* *********************************************************************** */
+// functions
+
+/**************************************************************************
+* Compute the statistics of n particles. If mask is not NULL only the
+* particles selected by it are taken. A NULL x, y or z column is skipped
+* (the variable is constant), a NULL wt column means every particle has
+* the weight wt_const. Minima and maxima are the same as when the
+* particles are counted one by one, the sums are accumulated in a
+* different order.
+**************************************************************************/
+void iaea_block_statistics(int n, const IAEA_U64 *mask,
+                           const IAEA_I32 *n_stat, const IAEA_I32 *type,
+                           const IAEA_Float *E, const IAEA_Float *wt, float wt_const,
+                           const IAEA_Float *x, const IAEA_Float *y, const IAEA_Float *z,
+                           iaea_block_stats *stats);
+
+/**************************************************************************
+* Reconstruct the direction cosine w of n decoded particles from u and v.
+* On input w holds the sign of w (+1 or -1, from the particle type byte),
+* on output w = sign*sqrt(1 - u*u - v*v). Where u*u + v*v > 1, u and v
+* are renormalized instead and w is 0. The result is the same as when
+* the records are decoded one by one.
+**************************************************************************/
+void iaea_direction_w(int n, IAEA_Float *u, IAEA_Float *v, IAEA_Float *w);
+
+/**************************************************************************
+* Transpose n raw records of reclength bytes, a type byte followed by
+* n_words 4-byte words, into columns of 4-byte values: word j of the i-th
+* record is stored in column[j][i] (NULL columns are skipped). Word 0 is
+* the energy, stored as |E|. type[i] is the particle type (absolute value
+* of the type byte), sign[i] the sign of w coded in it (+1 or -1) and
+* new_history[i] is 1 if the energy is negative, 0 otherwise (new_history
+* may be NULL). With AVX2 and AVX-512 the records are read with gathers.
+**************************************************************************/
+void iaea_transpose_records(const unsigned char *records, int n, int reclength,
+                            int n_words, void *const *column, IAEA_I32 *type,
+                            IAEA_Float *sign, IAEA_I32 *new_history);
+
+/**************************************************************************
+* Reverse the byte order of the 4-byte words of n raw records of reclength
+* bytes (a type byte followed by 4-byte words) and store them in out,
+* which can be records itself. Converts records between little and big
+* endian.
+**************************************************************************/
+void iaea_swap_records(const unsigned char *records, unsigned char *out, int n, int reclength);
+
+/**************************************************************************
+* Instruction set used by the kernels of the library (one of IAEA_ISA_*).
+* Selected at the first call from the capabilities of the CPU, the
+* environment variable IAEA_SIMD (scalar, sse2, avx2, avx512) caps it.
+**************************************************************************/
+int iaea_simd_isa();
+
+const char *iaea_simd_isa_name();
+
+#endif
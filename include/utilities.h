@@ -128,4 +128,5 @@ int readBinaryDataFromFile(FILE *iStream, int nItemsToRead, float *inputArray, i
 // RCN added
 int fget_c_string(char *string, int Max_Str_Len, FILE *fspec);
 int get_string(FILE *fspec, char *string);
+int sget_c_string(char *string, int Max_Str_Len, const char *buffer, long size, long *position);
 #endif
@@ -0,0 +1,65 @@
+/*
+ * Blocks of records stored column by column (see iaea_column.h).
+ *
+ * The data of a block start with IAEA_COLUMN_ALIGN - IAEA_PACK_BLOCK_HEADER
+ * zero bytes, so that its first column starts at a multiple of
+ * IAEA_COLUMN_ALIGN in the file (the blocks themselves start at one), and
+ * every column is padded with zero bytes to a multiple of
+ * IAEA_COLUMN_ALIGN.
+ */
+#include <cstring>
+
+#include "iaea_column.h"
+
+static inline IAEA_I64 column_padded(IAEA_I64 size)
+{
+  return (size + IAEA_COLUMN_ALIGN - 1)/IAEA_COLUMN_ALIGN*IAEA_COLUMN_ALIGN;
+}
+
+int iaea_column_width(int column)
+{
+  return (column == 0) ? 1 : 4;
+}
+
+IAEA_I64 iaea_column_offset(int n, int reclength, int column)
+{
+  (void)reclength;
+  IAEA_I64 offset = IAEA_COLUMN_ALIGN - IAEA_PACK_BLOCK_HEADER;
+  if(column > 0) offset += column_padded(n) + (column - 1)*column_padded(4*(IAEA_I64)n);
+  return (offset);
+}
+
+IAEA_I64 iaea_column_size(int n, int reclength)
+{
+  return iaea_column_offset(n, reclength, 1 + (reclength - 1)/4);
+}
+
+void iaea_column_records(const unsigned char *records, int n, int reclength,
+                         unsigned char *data)
+{
+  int n_columns = 1 + (reclength - 1)/4;
+  memset(data, 0, (size_t)iaea_column_size(n, reclength));
+
+  unsigned char *p = data + iaea_column_offset(n, reclength, 0);
+  for(int i=0;i<n;i++) p[i] = records[(IAEA_I64)i*reclength];
+
+  for(int j=1;j<n_columns;j++)
+  {
+     const unsigned char *field = records + 1 + 4*(j - 1);
+     p = data + iaea_column_offset(n, reclength, j);
+     for(int i=0;i<n;i++) memcpy(p + 4*(IAEA_I64)i, field + (IAEA_I64)i*reclength, 4);
+  }
+}
+
+void iaea_column_scatter(const unsigned char *values, int n, int reclength, int column,
+                         unsigned char *records)
+{
+  if(column == 0)
+  {
+     for(int i=0;i<n;i++) records[(IAEA_I64)i*reclength] = values[i];
+     return;
+  }
+
+  unsigned char *field = records + 1 + 4*(column - 1);
+  for(int i=0;i<n;i++) memcpy(field + (IAEA_I64)i*reclength, values + 4*(IAEA_I64)i, 4);
+}
@@ -0,0 +1,864 @@
+/*
+ * Vectorized particle filters for the phase space cutter (the Z-plane cut
+ * and the filter chains configured at run time).
+ *
+ * Every kernel works on a block of decoded particles (structure of arrays,
+ * see iaea_get_particles_batch) and sets one bit per accepted particle.
+ * The SIMD versions are compiled with function level target attributes,
+ * so the file builds without special compiler flags; the best version for
+ * the running CPU is picked at the first call. The SIMD kernels do the
+ * same single precision operations in the same order as the scalar one
+ * and therefore accept exactly the same particles.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cmath>
+
+#include "iaea_filter.h"
+#include "iaea_quant.h"
+
+#ifdef IAEA_SIMD_X86
+#include <immintrin.h>
+#endif
+
+// x + u*t must stay a separate multiply and add (no fused multiply-add),
+// otherwise projected positions on the cut boundary could differ from
+// the scalar result
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize ("fp-contract=off")
+#endif
+
+/* *********************************************************************** */
+// Z-plane projection cut
+
+static int plane_scalar(const iaea_plane_cut *cut, int first, int n,
+                        const IAEA_Float *x, const IAEA_Float *y, const IAEA_Float *z,
+                        const IAEA_Float *u, const IAEA_Float *v, const IAEA_Float *w,
+                        IAEA_U64 *mask)
+{
+  int n_accepted = 0;
+  for(int i=first;i<n;i++)
+  {
+      if( !(w[i] > 0) ) continue;
+      float newX = x[i];
+      float newY = y[i];
+      if(z[i] < cut->z_plane)
+      {
+          float t = (cut->z_plane - z[i]) / w[i];
+          newX = x[i] + u[i] * t;
+          newY = y[i] + v[i] * t;
+      }
+      if(newX >= cut->x_min && newX <= cut->x_max &&
+         newY >= cut->y_min && newY <= cut->y_max)
+      {
+          mask[i >> 6] |= (IAEA_U64)1 << (i & 63);
+          n_accepted++;
+      }
+  }
+  return n_accepted;
+}
+
+#ifdef IAEA_SIMD_X86
+
+__attribute__((target("sse2")))
+static int plane_sse2(const iaea_plane_cut *cut, int n,
+                      const IAEA_Float *x, const IAEA_Float *y, const IAEA_Float *z,
+                      const IAEA_Float *u, const IAEA_Float *v, const IAEA_Float *w,
+                      IAEA_U64 *mask)
+{
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 zp   = _mm_set1_ps(cut->z_plane);
+  const __m128 xmin = _mm_set1_ps(cut->x_min);
+  const __m128 xmax = _mm_set1_ps(cut->x_max);
+  const __m128 ymin = _mm_set1_ps(cut->y_min);
+  const __m128 ymax = _mm_set1_ps(cut->y_max);
+
+  int n_accepted = 0;
+  int i = 0;
+  for(;i+4<=n;i+=4)
+  {
+      __m128 X = _mm_loadu_ps(x + i), Y = _mm_loadu_ps(y + i), Z = _mm_loadu_ps(z + i);
+      __m128 U = _mm_loadu_ps(u + i), V = _mm_loadu_ps(v + i), W = _mm_loadu_ps(w + i);
+
+      __m128 t = _mm_div_ps(_mm_sub_ps(zp, Z), W);
+      __m128 before = _mm_cmplt_ps(Z, zp);
+      __m128 newX = _mm_add_ps(X, _mm_mul_ps(U, t));
+      __m128 newY = _mm_add_ps(Y, _mm_mul_ps(V, t));
+      newX = _mm_or_ps(_mm_and_ps(before, newX), _mm_andnot_ps(before, X));
+      newY = _mm_or_ps(_mm_and_ps(before, newY), _mm_andnot_ps(before, Y));
+
+      __m128 ok = _mm_cmpgt_ps(W, zero);
+      ok = _mm_and_ps(ok, _mm_cmpge_ps(newX, xmin));
+      ok = _mm_and_ps(ok, _mm_cmple_ps(newX, xmax));
+      ok = _mm_and_ps(ok, _mm_cmpge_ps(newY, ymin));
+      ok = _mm_and_ps(ok, _mm_cmple_ps(newY, ymax));
+
+      unsigned int bits = (unsigned int)_mm_movemask_ps(ok);
+      mask[i >> 6] |= (IAEA_U64)bits << (i & 63);
+      n_accepted += __builtin_popcount(bits);
+  }
+  return n_accepted + plane_scalar(cut, i, n, x, y, z, u, v, w, mask);
+}
+
+__attribute__((target("avx2")))
+static int plane_avx2(const iaea_plane_cut *cut, int n,
+                      const IAEA_Float *x, const IAEA_Float *y, const IAEA_Float *z,
+                      const IAEA_Float *u, const IAEA_Float *v, const IAEA_Float *w,
+                      IAEA_U64 *mask)
+{
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 zp   = _mm256_set1_ps(cut->z_plane);
+  const __m256 xmin = _mm256_set1_ps(cut->x_min);
+  const __m256 xmax = _mm256_set1_ps(cut->x_max);
+  const __m256 ymin = _mm256_set1_ps(cut->y_min);
+  const __m256 ymax = _mm256_set1_ps(cut->y_max);
+
+  int n_accepted = 0;
+  int i = 0;
+  for(;i+8<=n;i+=8)
+  {
+      __m256 X = _mm256_loadu_ps(x + i), Y = _mm256_loadu_ps(y + i), Z = _mm256_loadu_ps(z + i);
+      __m256 U = _mm256_loadu_ps(u + i), V = _mm256_loadu_ps(v + i), W = _mm256_loadu_ps(w + i);
+
+      __m256 t = _mm256_div_ps(_mm256_sub_ps(zp, Z), W);
+      __m256 before = _mm256_cmp_ps(Z, zp, _CMP_LT_OQ);
+      __m256 newX = _mm256_blendv_ps(X, _mm256_add_ps(X, _mm256_mul_ps(U, t)), before);
+      __m256 newY = _mm256_blendv_ps(Y, _mm256_add_ps(Y, _mm256_mul_ps(V, t)), before);
+
+      __m256 ok = _mm256_cmp_ps(W, zero, _CMP_GT_OQ);
+      ok = _mm256_and_ps(ok, _mm256_cmp_ps(newX, xmin, _CMP_GE_OQ));
+      ok = _mm256_and_ps(ok, _mm256_cmp_ps(newX, xmax, _CMP_LE_OQ));
+      ok = _mm256_and_ps(ok, _mm256_cmp_ps(newY, ymin, _CMP_GE_OQ));
+      ok = _mm256_and_ps(ok, _mm256_cmp_ps(newY, ymax, _CMP_LE_OQ));
+
+      unsigned int bits = (unsigned int)_mm256_movemask_ps(ok);
+      mask[i >> 6] |= (IAEA_U64)bits << (i & 63);
+      n_accepted += __builtin_popcount(bits);
+  }
+  return n_accepted + plane_scalar(cut, i, n, x, y, z, u, v, w, mask);
+}
+
+__attribute__((target("avx512f")))
+static int plane_avx512(const iaea_plane_cut *cut, int n,
+                        const IAEA_Float *x, const IAEA_Float *y, const IAEA_Float *z,
+                        const IAEA_Float *u, const IAEA_Float *v, const IAEA_Float *w,
+                        IAEA_U64 *mask)
+{
+  const __m512 zero = _mm512_setzero_ps();
+  const __m512 zp   = _mm512_set1_ps(cut->z_plane);
+  const __m512 xmin = _mm512_set1_ps(cut->x_min);
+  const __m512 xmax = _mm512_set1_ps(cut->x_max);
+  const __m512 ymin = _mm512_set1_ps(cut->y_min);
+  const __m512 ymax = _mm512_set1_ps(cut->y_max);
+
+  int n_accepted = 0;
+  for(int i=0;i<n;i+=16)
+  {
+      // The last (partial) vector is loaded with a lane mask
+      __mmask16 lanes = (n - i >= 16) ? (__mmask16)0xFFFF
+                                      : (__mmask16)((1u << (n - i)) - 1);
+      __m512 X = _mm512_maskz_loadu_ps(lanes, x + i);
+      __m512 Y = _mm512_maskz_loadu_ps(lanes, y + i);
+      __m512 Z = _mm512_maskz_loadu_ps(lanes, z + i);
+      __m512 U = _mm512_maskz_loadu_ps(lanes, u + i);
+      __m512 V = _mm512_maskz_loadu_ps(lanes, v + i);
+      __m512 W = _mm512_maskz_loadu_ps(lanes, w + i);
+
+      __mmask16 ok = _mm512_mask_cmp_ps_mask(lanes, W, zero, _CMP_GT_OQ);
+      __m512 t = _mm512_div_ps(_mm512_sub_ps(zp, Z), W);
+      __mmask16 before = _mm512_cmp_ps_mask(Z, zp, _CMP_LT_OQ);
+      __m512 newX = _mm512_mask_blend_ps(before, X, _mm512_add_ps(X, _mm512_mul_ps(U, t)));
+      __m512 newY = _mm512_mask_blend_ps(before, Y, _mm512_add_ps(Y, _mm512_mul_ps(V, t)));
+
+      ok = _mm512_mask_cmp_ps_mask(ok, newX, xmin, _CMP_GE_OQ);
+      ok = _mm512_mask_cmp_ps_mask(ok, newX, xmax, _CMP_LE_OQ);
+      ok = _mm512_mask_cmp_ps_mask(ok, newY, ymin, _CMP_GE_OQ);
+      ok = _mm512_mask_cmp_ps_mask(ok, newY, ymax, _CMP_LE_OQ);
+
+      unsigned int bits = (unsigned int)ok;
+      mask[i >> 6] |= (IAEA_U64)bits << (i & 63);
+      n_accepted += __builtin_popcount(bits);
+  }
+  return n_accepted;
+}
+
+#endif // IAEA_SIMD_X86
+
+int iaea_filter_plane(const iaea_plane_cut *cut, int n,
+                      const IAEA_Float *x, const IAEA_Float *y, const IAEA_Float *z,
+                      const IAEA_Float *u, const IAEA_Float *v, const IAEA_Float *w,
+                      IAEA_U64 *mask)
+{
+  if(n <= 0) return 0;
+  memset(mask, 0, IAEA_MASK_WORDS(n)*sizeof(IAEA_U64));
+
+  switch(iaea_simd_isa())
+  {
+#ifdef IAEA_SIMD_X86
+  case IAEA_ISA_AVX512: return plane_avx512(cut, n, x, y, z, u, v, w, mask);
+  case IAEA_ISA_AVX2:   return plane_avx2(cut, n, x, y, z, u, v, w, mask);
+  case IAEA_ISA_SSE2:   return plane_sse2(cut, n, x, y, z, u, v, w, mask);
+#endif
+  default:              return plane_scalar(cut, 0, n, x, y, z, u, v, w, mask);
+  }
+}
+
+/* *********************************************************************** */
+// Filter chains
+//
+// Every condition has a kernel that tests up to 64 particles and returns
+// their accept bits. The rectangle reuses the plane cut kernels; the other
+// conditions have a scalar and an AVX2 version (also used on AVX-512
+// machines), doing the same single precision operations in the same order.
+
+static IAEA_U64 type_scalar(const iaea_filter_stage *s, const iaea_particle_block *p,
+                            int first, int n)
+{
+  IAEA_U64 bits = 0;
+  for(int i=0;i<n;i++)
+  {
+      unsigned int t = (unsigned int)(p->type[first + i] - 1);
+      if( t < 32 && ((s->types >> t) & 1) ) bits |= (IAEA_U64)1 << i;
+  }
+  return bits;
+}
+
+static IAEA_U64 energy_scalar(const iaea_filter_stage *s, const iaea_particle_block *p,
+                              int first, int n)
+{
+  IAEA_U64 bits = 0;
+  for(int i=0;i<n;i++)
+  {
+      float E = p->E[first + i];
+      if( E >= s->e_min && E <= s->e_max ) bits |= (IAEA_U64)1 << i;
+  }
+  return bits;
+}
+
+static IAEA_U64 bits_scalar(const iaea_filter_stage *s, const iaea_particle_block *p,
+                            int first, int n)
+{
+  if(s->column < 0) return 0;
+  const IAEA_I32 *value = p->extra_ints + (IAEA_I64)s->column*p->n_max + first;
+  IAEA_U64 bits = 0;
+  for(int i=0;i<n;i++)
+  {
+      bool match = (((unsigned int)value[i] & s->bit_mask) == s->bit_value);
+      if( match == (s->bit_match != 0) ) bits |= (IAEA_U64)1 << i;
+  }
+  return bits;
+}
+
+static IAEA_U64 label_scalar(const iaea_filter_stage *s, const iaea_particle_block *p,
+                             int first, int n)
+{
+  if(s->column < 0) return 0;
+  const IAEA_I32 *value = p->extra_ints + (IAEA_I64)s->column*p->n_max + first;
+  IAEA_U64 bits = 0;
+  for(int i=0;i<n;i++)
+      if( value[i] >= s->l_min && value[i] <= s->l_max ) bits |= (IAEA_U64)1 << i;
+  return bits;
+}
+
+static IAEA_U64 range_scalar(const iaea_filter_stage *s, const iaea_particle_block *p,
+                             int first, int n)
+{
+  const IAEA_Float *position[3] = {p->x, p->y, p->z};
+  IAEA_U64 bits = 0;
+  for(int i=0;i<n;i++)
+  {
+      int k = first + i;
+      bool in = ( p->type[k] >= -127 && p->type[k] <= 127 &&
+                  iaea_quant_energy_range(s->e_min, s->log_step, p->E[k]) == OK &&
+                  iaea_quant_direction_range(p->u[k], p->v[k], p->w[k]) == OK );
+      for(int j=0;j<3 && in;j++)
+         if((s->positions >> j) & 1)
+            in = (iaea_quant_position_range(s->resolution, position[j][k]) == OK);
+      if(in) bits |= (IAEA_U64)1 << i;
+  }
+  return bits;
+}
+
+// Position of a forward moving particle in the plane z = z_plane, as
+// computed by plane_scalar
+static inline bool project_scalar(float z_plane, const iaea_particle_block *p, int i,
+                                  float *px, float *py)
+{
+  if( !(p->w[i] > 0) ) return false;
+  float x = p->x[i], y = p->y[i], z = p->z[i];
+  *px = x;
+  *py = y;
+  if(z < z_plane)
+  {
+      float t = (z_plane - z) / (float)p->w[i];
+      *px = x + (float)p->u[i] * t;
+      *py = y + (float)p->v[i] * t;
+  }
+  return true;
+}
+
+static IAEA_U64 circle_scalar(const iaea_filter_stage *s, const iaea_particle_block *p,
+                              int first, int n)
+{
+  const float r2 = s->radius * s->radius;
+  IAEA_U64 bits = 0;
+  for(int i=0;i<n;i++)
+  {
+      float px, py;
+      if( !project_scalar(s->plane.z_plane, p, first + i, &px, &py) ) continue;
+      float dx = px - s->x0, dy = py - s->y0;
+      if( dx*dx + dy*dy <= r2 ) bits |= (IAEA_U64)1 << i;
+  }
+  return bits;
+}
+
+static IAEA_U64 polygon_scalar(const iaea_filter_stage *s, const iaea_particle_block *p,
+                               int first, int n)
+{
+  IAEA_U64 bits = 0;
+  for(int i=0;i<n;i++)
+  {
+      float px, py;
+      if( !project_scalar(s->plane.z_plane, p, first + i, &px, &py) ) continue;
+      bool inside = false;
+      for(int k=0, j=s->n_vertices-1; k<s->n_vertices; j=k++)
+      {
+          if( ((s->vy[k] > py) != (s->vy[j] > py)) &&
+              px < (s->vx[j] - s->vx[k]) * (py - s->vy[k]) / (s->vy[j] - s->vy[k]) + s->vx[k] )
+              inside = !inside;
+      }
+      if(inside) bits |= (IAEA_U64)1 << i;
+  }
+  return bits;
+}
+
+static IAEA_U64 rect_scalar(const iaea_filter_stage *s, const iaea_particle_block *p,
+                            int first, int n)
+{
+  IAEA_U64 bits = 0;
+  plane_scalar(&s->plane, 0, n, p->x + first, p->y + first, p->z + first,
+               p->u + first, p->v + first, p->w + first, &bits);
+  return bits;
+}
+
+#ifdef IAEA_SIMD_X86
+
+static IAEA_U64 rect_sse2(const iaea_filter_stage *s, const iaea_particle_block *p,
+                          int first, int n)
+{
+  IAEA_U64 bits = 0;
+  plane_sse2(&s->plane, n, p->x + first, p->y + first, p->z + first,
+             p->u + first, p->v + first, p->w + first, &bits);
+  return bits;
+}
+
+static IAEA_U64 rect_avx2(const iaea_filter_stage *s, const iaea_particle_block *p,
+                          int first, int n)
+{
+  IAEA_U64 bits = 0;
+  plane_avx2(&s->plane, n, p->x + first, p->y + first, p->z + first,
+             p->u + first, p->v + first, p->w + first, &bits);
+  return bits;
+}
+
+static IAEA_U64 rect_avx512(const iaea_filter_stage *s, const iaea_particle_block *p,
+                            int first, int n)
+{
+  IAEA_U64 bits = 0;
+  plane_avx512(&s->plane, n, p->x + first, p->y + first, p->z + first,
+               p->u + first, p->v + first, p->w + first, &bits);
+  return bits;
+}
+
+// The scalar kernels finish the particles left after the last full vector
+// of 8; they take the bits of the particles first..first+n-1 and are
+// called with first = first + i, so their bits are shifted by i.
+
+__attribute__((target("avx2")))
+static IAEA_U64 type_avx2(const iaea_filter_stage *s, const iaea_particle_block *p,
+                          int first, int n)
+{
+  const __m256i types = _mm256_set1_epi32((int)s->types);
+  const __m256i one = _mm256_set1_epi32(1);
+  IAEA_U64 bits = 0;
+  int i = 0;
+  for(;i+8<=n;i+=8)
+  {
+      // shifts by 32 or more (also type 0 and negative types) give 0
+      __m256i t = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(p->type + first + i)), one);
+      __m256i ok = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_srlv_epi32(types, t), one), one);
+      bits |= (IAEA_U64)(unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(ok)) << i;
+  }
+  if(i < n) bits |= type_scalar(s, p, first + i, n - i) << i;
+  return bits;
+}
+
+__attribute__((target("avx2")))
+static IAEA_U64 energy_avx2(const iaea_filter_stage *s, const iaea_particle_block *p,
+                            int first, int n)
+{
+  const __m256 e_min = _mm256_set1_ps(s->e_min);
+  const __m256 e_max = _mm256_set1_ps(s->e_max);
+  IAEA_U64 bits = 0;
+  int i = 0;
+  for(;i+8<=n;i+=8)
+  {
+      __m256 E = _mm256_loadu_ps(p->E + first + i);
+      __m256 ok = _mm256_and_ps(_mm256_cmp_ps(E, e_min, _CMP_GE_OQ),
+                                _mm256_cmp_ps(E, e_max, _CMP_LE_OQ));
+      bits |= (IAEA_U64)(unsigned int)_mm256_movemask_ps(ok) << i;
+  }
+  if(i < n) bits |= energy_scalar(s, p, first + i, n - i) << i;
+  return bits;
+}
+
+// Projection of 8 particles starting at particle i, see project_scalar.
+// Returns the lanes of the particles moving forward.
+__attribute__((target("avx2")))
+static inline __m256 project_avx2(float z_plane, const iaea_particle_block *p, int i,
+                                  __m256 *px, __m256 *py)
+{
+  const __m256 zp = _mm256_set1_ps(z_plane);
+  __m256 X = _mm256_loadu_ps(p->x + i), Y = _mm256_loadu_ps(p->y + i), Z = _mm256_loadu_ps(p->z + i);
+  __m256 U = _mm256_loadu_ps(p->u + i), V = _mm256_loadu_ps(p->v + i), W = _mm256_loadu_ps(p->w + i);
+
+  __m256 t = _mm256_div_ps(_mm256_sub_ps(zp, Z), W);
+  __m256 before = _mm256_cmp_ps(Z, zp, _CMP_LT_OQ);
+  *px = _mm256_blendv_ps(X, _mm256_add_ps(X, _mm256_mul_ps(U, t)), before);
+  *py = _mm256_blendv_ps(Y, _mm256_add_ps(Y, _mm256_mul_ps(V, t)), before);
+  return _mm256_cmp_ps(W, _mm256_setzero_ps(), _CMP_GT_OQ);
+}
+
+__attribute__((target("avx2")))
+static IAEA_U64 circle_avx2(const iaea_filter_stage *s, const iaea_particle_block *p,
+                            int first, int n)
+{
+  const __m256 x0 = _mm256_set1_ps(s->x0);
+  const __m256 y0 = _mm256_set1_ps(s->y0);
+  const __m256 r2 = _mm256_set1_ps(s->radius * s->radius);
+  IAEA_U64 bits = 0;
+  int i = 0;
+  for(;i+8<=n;i+=8)
+  {
+      __m256 px, py;
+      __m256 ok = project_avx2(s->plane.z_plane, p, first + i, &px, &py);
+      __m256 dx = _mm256_sub_ps(px, x0), dy = _mm256_sub_ps(py, y0);
+      __m256 d2 = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+      ok = _mm256_and_ps(ok, _mm256_cmp_ps(d2, r2, _CMP_LE_OQ));
+      bits |= (IAEA_U64)(unsigned int)_mm256_movemask_ps(ok) << i;
+  }
+  if(i < n) bits |= circle_scalar(s, p, first + i, n - i) << i;
+  return bits;
+}
+
+__attribute__((target("avx2")))
+static IAEA_U64 polygon_avx2(const iaea_filter_stage *s, const iaea_particle_block *p,
+                             int first, int n)
+{
+  IAEA_U64 bits = 0;
+  int i = 0;
+  for(;i+8<=n;i+=8)
+  {
+      __m256 px, py;
+      __m256 ok = project_avx2(s->plane.z_plane, p, first + i, &px, &py);
+      __m256 inside = _mm256_setzero_ps();
+      for(int k=0, j=s->n_vertices-1; k<s->n_vertices; j=k++)
+      {
+          __m256 xk = _mm256_set1_ps(s->vx[k]), yk = _mm256_set1_ps(s->vy[k]);
+          __m256 xj = _mm256_set1_ps(s->vx[j]), yj = _mm256_set1_ps(s->vy[j]);
+          // edges not crossing the line y = py may divide by zero, they
+          // are masked out by the first condition
+          __m256 crosses = _mm256_xor_ps(_mm256_cmp_ps(yk, py, _CMP_GT_OQ),
+                                         _mm256_cmp_ps(yj, py, _CMP_GT_OQ));
+          __m256 x = _mm256_add_ps(_mm256_div_ps(_mm256_mul_ps(_mm256_sub_ps(xj, xk),
+                                                               _mm256_sub_ps(py, yk)),
+                                                 _mm256_sub_ps(yj, yk)), xk);
+          crosses = _mm256_and_ps(crosses, _mm256_cmp_ps(px, x, _CMP_LT_OQ));
+          inside = _mm256_xor_ps(inside, crosses);
+      }
+      ok = _mm256_and_ps(ok, inside);
+      bits |= (IAEA_U64)(unsigned int)_mm256_movemask_ps(ok) << i;
+  }
+  if(i < n) bits |= polygon_scalar(s, p, first + i, n - i) << i;
+  return bits;
+}
+
+#endif // IAEA_SIMD_X86
+
+static iaea_stage_kernel stage_kernel(int kind, int isa)
+{
+#ifdef IAEA_SIMD_X86
+  if(isa >= IAEA_ISA_AVX2)
+  {
+     switch(kind)
+     {
+     case IAEA_STAGE_TYPE:      return type_avx2;
+     case IAEA_STAGE_ENERGY:    return energy_avx2;
+     case IAEA_STAGE_RECTANGLE: return (isa == IAEA_ISA_AVX512) ? rect_avx512 : rect_avx2;
+     case IAEA_STAGE_CIRCLE:    return circle_avx2;
+     case IAEA_STAGE_POLYGON:   return polygon_avx2;
+     }
+  }
+  if(isa == IAEA_ISA_SSE2 && kind == IAEA_STAGE_RECTANGLE) return rect_sse2;
+#else
+  (void)isa;
+#endif
+  switch(kind)
+  {
+  case IAEA_STAGE_TYPE:      return type_scalar;
+  case IAEA_STAGE_BITS:      return bits_scalar;
+  case IAEA_STAGE_LABEL:     return label_scalar;
+  case IAEA_STAGE_ENERGY:    return energy_scalar;
+  case IAEA_STAGE_RECTANGLE: return rect_scalar;
+  case IAEA_STAGE_CIRCLE:    return circle_scalar;
+  case IAEA_STAGE_RANGE:     return range_scalar;
+  default:                   return polygon_scalar;
+  }
+}
+
+void iaea_filter_init(iaea_filter_chain *chain)
+{
+  chain->z_plane = 0.f;
+  chain->n_stages = 0;
+}
+
+static const char *type_names[] = { "photon", "electron", "positron", "neutron", "proton" };
+
+// Reads the numbers of a statement into value, returns how many were read
+// or -1 if something else than a number was found
+static int parse_numbers(const char *text, float *value, int max_values)
+{
+  int n = 0;
+  for(;;)
+  {
+      while(isspace((unsigned char)*text) || *text == ',') text++;
+      if(*text == '\0' || *text == '#') return n;
+      char *end;
+      double number = strtod(text, &end);
+      if(end == text || n == max_values) return -1;
+      value[n++] = (float)number;
+      text = end;
+  }
+}
+
+// Same for integers (decimal, or hexadecimal with 0x)
+static int parse_integers(const char *text, long long *value, int max_values)
+{
+  int n = 0;
+  for(;;)
+  {
+      while(isspace((unsigned char)*text) || *text == ',') text++;
+      if(*text == '\0' || *text == '#') return n;
+      char *end;
+      long long number = strtoll(text, &end, 0);
+      if(end == text || n == max_values) return -1;
+      value[n++] = number;
+      text = end;
+  }
+}
+
+int iaea_filter_parse(iaea_filter_chain *chain, const char *statement)
+{
+  while(isspace((unsigned char)*statement)) statement++;
+  if(*statement == '\0' || *statement == '#') return OK;
+
+  char keyword[16];
+  int len = 0;
+  while(isalpha((unsigned char)statement[len]) && len < 15)
+  {
+      keyword[len] = (char)tolower((unsigned char)statement[len]);
+      len++;
+  }
+  keyword[len] = '\0';
+  const char *args = statement + len;
+
+  if(chain->n_stages == IAEA_MAX_STAGES && strcmp(keyword, "plane") != 0)
+  {
+      fprintf(stderr, "\n ERROR: More than %d filter conditions\n", IAEA_MAX_STAGES);
+      return FAIL;
+  }
+  iaea_filter_stage *s = &chain->stage[chain->n_stages];
+  memset(s, 0, sizeof(*s));
+  s->plane.z_plane = chain->z_plane;
+
+  float value[2*IAEA_MAX_VERTICES];
+  int n = parse_numbers(args, value, 2*IAEA_MAX_VERTICES);
+
+  if(strcmp(keyword, "plane") == 0 && n == 1)
+  {
+      chain->z_plane = value[0];
+      return OK;
+  }
+  else if((strcmp(keyword, "rect") == 0 || strcmp(keyword, "rectangle") == 0) && n == 4)
+  {
+      s->kind = IAEA_STAGE_RECTANGLE;
+      s->plane.x_min = value[0]; s->plane.x_max = value[1];
+      s->plane.y_min = value[2]; s->plane.y_max = value[3];
+  }
+  else if(strcmp(keyword, "circle") == 0 && n == 3 && value[2] >= 0)
+  {
+      s->kind = IAEA_STAGE_CIRCLE;
+      s->x0 = value[0]; s->y0 = value[1]; s->radius = value[2];
+  }
+  else if(strcmp(keyword, "polygon") == 0 && n >= 6 && n % 2 == 0)
+  {
+      s->kind = IAEA_STAGE_POLYGON;
+      s->n_vertices = n / 2;
+      for(int k=0;k<s->n_vertices;k++) { s->vx[k] = value[2*k]; s->vy[k] = value[2*k+1]; }
+  }
+  else if(strcmp(keyword, "energy") == 0 && n == 2)
+  {
+      s->kind = IAEA_STAGE_ENERGY;
+      s->e_min = value[0]; s->e_max = value[1];
+  }
+  else if(strcmp(keyword, "latch") == 0)
+  {
+      // Optional mode word before the mask
+      const char *text = args;
+      while(isspace((unsigned char)*text)) text++;
+      int mode = 0; // any
+      if(strncmp(text, "any", 3) == 0)       { text += 3; }
+      else if(strncmp(text, "all", 3) == 0)  { text += 3; mode = 1; }
+      else if(strncmp(text, "none", 4) == 0) { text += 4; mode = 2; }
+      long long mask;
+      n = parse_integers(text, &mask, 1);
+      if(n == 1 && mask > 0 && mask <= 0xFFFFFFFFLL)
+      {
+         s->kind = IAEA_STAGE_BITS;
+         s->long_type = 2;
+         s->column = -1;
+         s->bit_mask = (unsigned int)mask;
+         s->bit_value = (mode == 1) ? s->bit_mask : 0;
+         s->bit_match = (mode != 0);
+      }
+      else n = -1;
+  }
+  else if(strcmp(keyword, "ilb") == 0)
+  {
+      long long label[3];
+      n = parse_integers(args, label, 3);
+      if((n == 2 || n == 3) && label[0] >= 1 && label[0] <= 5)
+      {
+         s->kind = IAEA_STAGE_LABEL;
+         s->long_type = 8 - (int)label[0]; // ILB1 is of type 7, ILB5 of type 3
+         s->column = -1;
+         s->l_min = (IAEA_I32)label[1];
+         s->l_max = (IAEA_I32)label[n - 1];
+         if(s->l_min > s->l_max) n = -1;
+      }
+      else n = -1;
+  }
+  else if(strcmp(keyword, "types") == 0 || strcmp(keyword, "type") == 0)
+  {
+      s->kind = IAEA_STAGE_TYPE;
+      const char *text = args;
+      for(;;)
+      {
+          while(isspace((unsigned char)*text) || *text == ',') text++;
+          if(*text == '\0' || *text == '#') break;
+          int word = 0;
+          while(text[word] != '\0' && text[word] != ',' && !isspace((unsigned char)text[word]))
+              word++;
+          // number, or singular or plural name
+          char name[16];
+          int n_name = 0;
+          for(;n_name<word && n_name<15;n_name++)
+             name[n_name] = (char)tolower((unsigned char)text[n_name]);
+          if(n_name > 1 && name[n_name-1] == 's') n_name--;
+          name[n_name] = '\0';
+          int type = 0;
+          for(int k=0;k<MAX_NUM_PARTICLES;k++)
+             if(word < 16 && strcmp(name, type_names[k]) == 0) type = k + 1;
+          if(word == 1 && text[0] >= '1' && text[0] <= '0' + MAX_NUM_PARTICLES)
+             type = text[0] - '0';
+          if(type == 0)
+          {
+             fprintf(stderr, "\n ERROR: Unknown particle type in filter statement: %s\n", statement);
+             return FAIL;
+          }
+          s->types |= 1u << (type - 1);
+          text += word;
+      }
+      if(s->types == 0) n = -1;
+      else n = 0;
+  }
+  else n = -1;
+
+  if(n < 0)
+  {
+      fprintf(stderr, "\n ERROR: Wrong filter statement: %s\n", statement);
+      return FAIL;
+  }
+  chain->n_stages++;
+  return OK;
+}
+
+int iaea_filter_quantization(iaea_filter_chain *chain, float resolution,
+                             float energy_min, float energy_max, int positions)
+{
+  if(chain->n_stages == IAEA_MAX_STAGES)
+  {
+      fprintf(stderr, "\n ERROR: More than %d filter conditions\n", IAEA_MAX_STAGES);
+      return FAIL;
+  }
+  if(!(resolution > 0.f) || !(energy_min > 0.f) || !(energy_max > energy_min))
+  {
+      fprintf(stderr, "\n ERROR: Wrong quantization range for the filter\n");
+      return FAIL;
+  }
+  iaea_filter_stage *s = &chain->stage[chain->n_stages++];
+  memset(s, 0, sizeof(*s));
+  s->kind = IAEA_STAGE_RANGE;
+  s->resolution = resolution;
+  s->e_min = energy_min;
+  s->e_max = energy_max;
+  s->log_step = iaea_quant_log_step(energy_min, energy_max);
+  s->positions = positions;
+  return OK;
+}
+
+int iaea_filter_read(iaea_filter_chain *chain, const char *file_name)
+{
+  FILE *fp = fopen(file_name, "r");
+  if(fp == NULL)
+  {
+      fprintf(stderr, "\n ERROR: Opening filter configuration %s\n", file_name);
+      return FAIL;
+  }
+  char line[MAX_STR_LEN];
+  int result = OK;
+  while(result == OK && fgets(line, MAX_STR_LEN, fp) != NULL)
+  {
+      line[strcspn(line, "\r\n")] = '\0';
+      result = iaea_filter_parse(chain, line);
+  }
+  fclose(fp);
+  return result;
+}
+
+int iaea_filter_bind(iaea_filter_chain *chain, int n_extralong, const IAEA_I32 *extralong_type)
+{
+  int result = OK;
+  for(int i=0;i<chain->n_stages;i++)
+  {
+      iaea_filter_stage *s = &chain->stage[i];
+      if(s->kind != IAEA_STAGE_BITS && s->kind != IAEA_STAGE_LABEL) continue;
+      s->column = -1;
+      for(int k=0;k<n_extralong && s->column < 0;k++)
+         if(extralong_type[k] == s->long_type) s->column = k;
+      if(s->column < 0)
+      {
+         fprintf(stderr, "\n ERROR: The particles have no extra long of type %d to filter on\n",
+                 s->long_type);
+         result = FAIL;
+      }
+  }
+  return result;
+}
+
+void iaea_filter_compile(iaea_filter_chain *chain)
+{
+  // Cheapest conditions first (stable, so equal kinds keep their order)
+  for(int i=1;i<chain->n_stages;i++)
+  {
+      iaea_filter_stage s = chain->stage[i];
+      int j = i;
+      for(;j>0 && chain->stage[j-1].kind > s.kind;j--) chain->stage[j] = chain->stage[j-1];
+      chain->stage[j] = s;
+  }
+  int isa = iaea_simd_isa();
+  for(int i=0;i<chain->n_stages;i++)
+      chain->stage[i].kernel = stage_kernel(chain->stage[i].kind, isa);
+}
+
+int iaea_filter_run(const iaea_filter_chain *chain, const iaea_particle_block *block,
+                    int n, IAEA_U64 *mask)
+{
+  int n_accepted = 0;
+  for(int first=0;first<n;first+=64)
+  {
+      int count = (n - first < 64) ? n - first : 64;
+      IAEA_U64 bits = (count == 64) ? ~(IAEA_U64)0 : ((IAEA_U64)1 << count) - 1;
+      for(int i=0;i<chain->n_stages && bits != 0;i++)
+          bits &= chain->stage[i].kernel(&chain->stage[i], block, first, count);
+      mask[first >> 6] = bits;
+      for(;bits != 0;bits &= bits - 1) n_accepted++;
+  }
+  return n_accepted;
+}
+
+int iaea_filter_columns(const iaea_filter_chain *chain)
+{
+  int columns = 0;
+  for(int i=0;i<chain->n_stages;i++)
+  {
+      const iaea_filter_stage *s = &chain->stage[i];
+      switch(s->kind)
+      {
+         case IAEA_STAGE_TYPE:   columns |= IAEA_COLUMN_TYPE; break;
+         case IAEA_STAGE_ENERGY: columns |= IAEA_COLUMN_E; break;
+         case IAEA_STAGE_BITS:
+         case IAEA_STAGE_LABEL:
+            if(s->column >= 0) columns |= IAEA_COLUMN_EXTRA_LONG(s->column);
+            break;
+         case IAEA_STAGE_RANGE:
+            columns |= IAEA_COLUMN_TYPE | IAEA_COLUMN_E | IAEA_COLUMN_X | IAEA_COLUMN_Y |
+                       IAEA_COLUMN_Z | IAEA_COLUMN_U | IAEA_COLUMN_V | IAEA_COLUMN_W;
+            break;
+         default: // apertures, the particles projected to their plane
+            columns |= IAEA_COLUMN_X | IAEA_COLUMN_Y | IAEA_COLUMN_Z |
+                       IAEA_COLUMN_U | IAEA_COLUMN_V | IAEA_COLUMN_W;
+      }
+  }
+  return columns;
+}
+
+void iaea_filter_print(const iaea_filter_chain *chain, FILE *out)
+{
+  if(chain->n_stages == 0) fprintf(out, "  all particles\n");
+  for(int i=0;i<chain->n_stages;i++)
+  {
+      const iaea_filter_stage *s = &chain->stage[i];
+      switch(s->kind)
+      {
+      case IAEA_STAGE_TYPE:
+          fprintf(out, "  types:");
+          for(int k=0;k<MAX_NUM_PARTICLES;k++)
+             if((s->types >> k) & 1) fprintf(out, " %s", type_names[k]);
+          fprintf(out, "\n");
+          break;
+      case IAEA_STAGE_BITS:
+          fprintf(out, "  latch with %s of the bits 0x%x set\n",
+                  !s->bit_match ? "any" : (s->bit_value != 0 ? "all" : "none"), s->bit_mask);
+          break;
+      case IAEA_STAGE_LABEL:
+          if(s->l_min == s->l_max)
+             fprintf(out, "  ILB%d = %d\n", 8 - s->long_type, (int)s->l_min);
+          else
+             fprintf(out, "  ILB%d in [%d, %d]\n", 8 - s->long_type, (int)s->l_min, (int)s->l_max);
+          break;
+      case IAEA_STAGE_ENERGY:
+          fprintf(out, "  energy in [%g, %g] MeV\n", s->e_min, s->e_max);
+          break;
+      case IAEA_STAGE_RECTANGLE:
+          fprintf(out, "  z = %g cm: x in [%g, %g], y in [%g, %g] cm\n", s->plane.z_plane,
+                  s->plane.x_min, s->plane.x_max, s->plane.y_min, s->plane.y_max);
+          break;
+      case IAEA_STAGE_CIRCLE:
+          fprintf(out, "  z = %g cm: circle at (%g, %g), radius %g cm\n", s->plane.z_plane,
+                  s->x0, s->y0, s->radius);
+          break;
+      case IAEA_STAGE_POLYGON:
+          fprintf(out, "  z = %g cm: polygon", s->plane.z_plane);
+          for(int k=0;k<s->n_vertices;k++) fprintf(out, " (%g, %g)", s->vx[k], s->vy[k]);
+          fprintf(out, "\n");
+          break;
+      case IAEA_STAGE_RANGE:
+          fprintf(out, "  in the quantization range: %g cm, %g to %g MeV\n",
+                  s->resolution, s->e_min, s->e_max);
+          break;
+      }
+  }
+}
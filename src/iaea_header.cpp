@@ -62,8 +62,26 @@ using namespace std;
 
 #include "utilities.h"
 #include "iaea_header.h"
+#include "iaea_quant.h"
 
+// The header file is read once and split into lines (comments removed as
+// done by get_string), the blocks are then looked up in a sorted index
+// instead of scanning the file again for every keyword.
 int iaea_header_type::read_header ()
+{
+    if(fheader==NULL)
+    {
+      printf("\n ERROR: Unable to open header file \n");
+        return(FAIL);
+    }
+
+    if( index_header() != OK ) return(FAIL);
+    int result = parse_header();
+    free_index();
+    return(result);
+}
+
+int iaea_header_type::parse_header ()
 {
     char line[MAX_STR_LEN];
 
@@ -122,21 +140,21 @@ int iaea_header_type::read_header ()
 
     for (i=0;i<9;i++)
     {
-      if( get_string(fheader,line) == FAIL ) return FAIL;
+      if( get_line(line) == FAIL ) return FAIL;
       if( *line == SEGMENT_BEG_TOKEN ) break;
       record_contents[i] = atoi(line);
     };
 
     for(i=0;i<record_contents[7];i++)
     {
-      if( get_string(fheader,line) == FAIL ) return FAIL;
+      if( get_line(line) == FAIL ) return FAIL;
       if( *line == SEGMENT_BEG_TOKEN ) break;
       extrafloat_contents[i] = atoi(line);
     }
 
     for(i=0;i<record_contents[8];i++)
     {
-      if( get_string(fheader,line) == FAIL ) return FAIL;
+      if( get_line(line) == FAIL ) return FAIL;
       if( *line == SEGMENT_BEG_TOKEN ) break;
       extralong_contents[i] = atoi(line);
     }
@@ -152,15 +170,54 @@ int iaea_header_type::read_header ()
     {
         record_constant[i] = 32000.f;
         if(record_contents[i] > 0) continue;
-        if( get_string(fheader,line) == FAIL ) return FAIL;
+        if( get_line(line) == FAIL ) return FAIL;
         if( *line == SEGMENT_BEG_TOKEN ) break;
         record_constant[i] = (float)atof(line);
     };
 
+    /*********************************************/
+    if(file_type == 3) // quantized records
+    {
+      if( get_blockname(line,"QUANTIZATION") == FAIL)
+      {
+         printf("\nMandatory keyword QUANTIZATION is not defined in input\n");
+           return FAIL;
+      }
+
+      float fbuff[3];
+      for (i=0;i<3;i++)
+      {
+          if( get_line(line) == FAIL || *line == SEGMENT_BEG_TOKEN )
+          {
+             printf("\nWRONG DEFINED HEADER BLOCK QUANTIZATION\n");
+             return FAIL;
+          }
+          fbuff[i] = (float)atof(line);
+      }
+      quant_resolution = fbuff[0];
+      quant_energy_min = fbuff[1];
+      quant_energy_max = fbuff[2];
+
+      for (i=0;i<3;i++) quant_error[i] = 0.;
+      if( get_blockname(line,"QUANTIZATION_ERRORS") == OK)
+      {
+        for (i=0;i<3;i++)
+        {
+            if( get_line(line) == FAIL ) return FAIL;
+            if( *line == SEGMENT_BEG_TOKEN ) break;
+            quant_error[i] = atof(line);
+        }
+      }
+
+      quant_rejected = 0;
+      if( read_block(line,"QUANTIZATION_REJECTED") == OK)
+        quant_rejected = (IAEA_I64)atof(line);
+    }
+
 // ******************************************************************************
 // 2. Mandatory description of the phsp
 
-      if ( read_block(coordinate_system_description,"COORDINATE_SYSTEM_DESCRIPTION") == FAIL)
+      if ( read_text(&coordinate_system_description,"COORDINATE_SYSTEM_DESCRIPTION") == FAIL)
       {
             printf("\nMandatory keyword COORDINATE_SYSTEM_DESCRIPTION is not defined in input\n");
             return FAIL;
@@ -176,7 +233,7 @@ int iaea_header_type::read_header ()
       }
   }
 
-  if(file_type == 0) // for phsp files
+  if(file_type != 1) // for phsp files (raw, compressed or quantized records, columns)
   {
       /*********************************************/
       if ( read_block(line,"ORIG_HISTORIES") == FAIL )
@@ -223,21 +280,21 @@ int iaea_header_type::read_header ()
       else iaea_index = atoi(line);
 
       /*********************************************/
-      if ( read_block(title,"TITLE") == FAIL )
+      if ( read_text(&title,"TITLE") == FAIL )
       {
             printf("\nMandatory keyword TITLE is not defined in input\n");
             return FAIL;
       }
 
       /*********************************************/
-      if ( read_block(machine_type,"MACHINE_TYPE") == FAIL)
+      if ( read_text(&machine_type,"MACHINE_TYPE") == FAIL)
       {
             printf("\nMandatory keyword MACHINE_TYPE is not defined in input\n");
             return FAIL;
       }
 
       /*********************************************/
-      if ( read_block(MC_code_and_version,"MONTE_CARLO_CODE_VERSION") == FAIL )
+      if ( read_text(&MC_code_and_version,"MONTE_CARLO_CODE_VERSION") == FAIL )
       {
             printf("\nMandatory keyword MONTE_CARLO_CODE_VERSION is not defined in input\n");
             return FAIL;
@@ -260,7 +317,7 @@ int iaea_header_type::read_header ()
       else global_particle_energy_cutoff = (float)atof(line);
 
       /*********************************************/
-      if ( read_block(transport_parameters,"TRANSPORT_PARAMETERS") == FAIL )
+      if ( read_text(&transport_parameters,"TRANSPORT_PARAMETERS") == FAIL )
       {
             printf("\nMandatory keyword TRANSPORT_PARAMETERS is not defined in input\n");
             return FAIL;
@@ -269,29 +326,29 @@ int iaea_header_type::read_header ()
 // ******************************************************************************
 // 4. Optional description
 
-      if ( read_block(beam_name,"BEAM_NAME") == FAIL )
+      if ( read_text(&beam_name,"BEAM_NAME") == FAIL )
             printf("ERROR reading BEAM_NAME\n");
-      if ( read_block(field_size,"FIELD_SIZE") == FAIL )
+      if ( read_text(&field_size,"FIELD_SIZE") == FAIL )
             printf("ERROR reading FIELD_SIZE\n");
-      if ( read_block(nominal_SSD,"NOMINAL_SSD") == FAIL )
+      if ( read_text(&nominal_SSD,"NOMINAL_SSD") == FAIL )
             printf("ERROR reading NOMINAL_SSD\n");
-      if ( read_block(variance_reduction_techniques,
+      if ( read_text(&variance_reduction_techniques,
                         "VARIANCE_REDUCTION_TECHNIQUES") == FAIL )
             printf("VARIANCE_REDUCTION_TECHNIQUES\n");
-      if ( read_block(initial_source_description,"INITIAL_SOURCE_DESCRIPTION") == FAIL )
+      if ( read_text(&initial_source_description,"INITIAL_SOURCE_DESCRIPTION") == FAIL )
             printf("INITIAL_SOURCE_DESCRIPTION:\n");
 
       // Documentation sub-section
       /*********************************************/
-      if ( read_block(MC_input_filename,"MC_INPUT_FILENAME") == FAIL )
+      if ( read_text(&MC_input_filename,"MC_INPUT_FILENAME") == FAIL )
             printf("MC_INPUT_FILENAME\n");
-      if ( read_block(published_reference,"PUBLISHED_REFERENCE") == FAIL )
+      if ( read_text(&published_reference,"PUBLISHED_REFERENCE") == FAIL )
             printf("PUBLISHED_REFERENCE\n");
-      if ( read_block(authors,"AUTHORS") == FAIL ) printf("AUTHORS\n");
-      if ( read_block(institution,"INSTITUTION") == FAIL ) printf("INSTITUTION\n");
-      if ( read_block(link_validation,"LINK_VALIDATION") == FAIL )
+      if ( read_text(&authors,"AUTHORS") == FAIL ) printf("AUTHORS\n");
+      if ( read_text(&institution,"INSTITUTION") == FAIL ) printf("INSTITUTION\n");
+      if ( read_text(&link_validation,"LINK_VALIDATION") == FAIL )
             printf("LINK_VALIDATION\n");
-      if ( read_block(additional_notes,"ADDITIONAL_NOTES") == FAIL )
+      if ( read_text(&additional_notes,"ADDITIONAL_NOTES") == FAIL )
             printf("ADDITIONAL_NOTES\n");
 
 // ******************************************************************************
@@ -301,7 +358,7 @@ int iaea_header_type::read_header ()
     {
         for(i=0;i<MAX_NUM_PARTICLES;i++)
         {
-              if( get_string(fheader,line) == FAIL ) return FAIL;
+              if( get_line(line) == FAIL ) return FAIL;
               if( *line == SEGMENT_BEG_TOKEN ) break;
 
               if(particle_number[i] == 0) continue;
@@ -333,7 +390,7 @@ int iaea_header_type::read_header ()
         {
             if(record_contents[i] == 1)
             {
-                  if( get_string(fheader,line) == FAIL ) return FAIL;
+                  if( get_line(line) == FAIL ) return FAIL;
                   if( *line == SEGMENT_BEG_TOKEN ) break;
 
                 // -------------------------------------------------------
@@ -363,33 +420,136 @@ int iaea_header_type::write_blockname(const char *blockname)
   (fprintf(fheader,"%c%s%c\n",SEGMENT_BEG_TOKEN,blockname,SEGMENT_END_TOKEN));
 }
 
-int iaea_header_type::get_blockname(char *line, const char *blockname)
+// Error bound rounded upward to the 6 digits it is written with, so that
+// the bound read back is never below the largest error
+static double upper_bound(double error)
 {
-  char *begptr, *endptr;
+  char text[32];
+  double bound = error;
+  for(;;)
+  {
+    snprintf(text, sizeof(text), "%.6g", bound);
+    if(atof(text) >= error) return (atof(text));
+    bound = atof(text) + pow(10., floor(log10(error)) - 5.);
+  }
+}
 
-  // printf("                       Reading block: %s ...\n",blockname);
+static const char *text_of(const char *text)
+{
+  return (text != NULL) ? text : "";
+}
 
-  if(fheader==NULL)
+static int compare_blocks(const void *a, const void *b)
+{
+  const iaea_header_block *block_a = (const iaea_header_block *) a;
+  const iaea_header_block *block_b = (const iaea_header_block *) b;
+  int cmp = strcmp(block_a->name, block_b->name);
+  if(cmp != 0) return(cmp);
+  return(block_a->line - block_b->line);
+}
+
+int iaea_header_type::index_header()
+{
+  free_index();
+
+  // Reading the whole header file at once
+  long size = -1;
+  if( fseek(fheader, 0, SEEK_END) == 0 ) size = ftell(fheader);
+  rewind(fheader);
+  if(size < 0)
   {
-    printf("\n ERROR: Opening header file to Get Block \n"); return(FAIL);
+    printf("\n ERROR: Getting the size of the header file \n"); return(FAIL);
+  }
+
+  char *buffer = (char *) malloc(size + 1);
+  // Lines and keywords are never longer than the file itself
+  header_text = (char *) malloc(2*(size + 1) + MAX_STR_LEN);
+  line_offset = (int *) malloc((size + 1)*sizeof(int));
+  blocks = (iaea_header_block *) malloc((size + 1)*sizeof(iaea_header_block));
+  if(buffer == NULL || header_text == NULL || line_offset == NULL || blocks == NULL)
+  {
+    printf("\n ERROR: Allocating memory to read the header \n");
+    free(buffer); free_index(); return(FAIL);
   }
-  rewind(fheader) ;
+  if( (long)fread(buffer, 1, size, fheader) != size )
+  {
+    printf("\n ERROR: Reading header file \n");
+    free(buffer); free_index(); return(FAIL);
+  }
+  rewind(fheader);
 
-  while( get_string(fheader,line) == OK )
+  // Splitting it into lines and indexing the $KEYWORD: lines
+  char line[MAX_STR_LEN];
+  long position = 0;
+  int length = 0;
+  while( sget_c_string(line, MAX_STR_LEN, buffer, size, &position) == OK )
   {
+    line_offset[n_lines] = length;
+    strcpy(header_text + length, line);
+    length += strlen(line) + 1;
+
     if( *line == SEGMENT_BEG_TOKEN )
+    {
+      char *endptr = strchr(line + 1, SEGMENT_END_TOKEN);
+      if( endptr != NULL )
       {
-         begptr = line + 1 ;
-             // printf("                       Read line %s ...\n",line);
-         endptr = strchr(begptr,SEGMENT_END_TOKEN) ;
-         if( endptr != NULL ) {
-           *endptr = '\0' ;
-               // printf("                       Comparing %s ...\n",begptr);
-           if( strcmp(begptr,blockname) == 0 ) return(OK) ;
-         }
+        *endptr = '\0';
+        blocks[n_blocks].name = header_text + length;
+        blocks[n_blocks].line = n_lines;
+        strcpy(header_text + length, line + 1);
+        length += strlen(line + 1) + 1;
+        n_blocks++;
       }
-  };
-  return(FAIL) ;
+    }
+    n_lines++;
+  }
+  free(buffer);
+
+  qsort(blocks, n_blocks, sizeof(iaea_header_block), compare_blocks);
+  next_line = n_lines;
+  return(OK);
+}
+
+void iaea_header_type::free_index()
+{
+  free(header_text);
+  free(line_offset);
+  free(blocks);
+  header_text = NULL;
+  line_offset = NULL;
+  blocks = NULL;
+  n_lines = n_blocks = next_line = 0;
+}
+
+int iaea_header_type::get_line(char *line)
+{
+  if(next_line >= n_lines) return(FAIL);
+  strcpy(line, header_text + line_offset[next_line++]);
+  return(OK);
+}
+
+int iaea_header_type::get_blockname(char *line, const char *blockname)
+{
+  // printf("                       Reading block: %s ...\n",blockname);
+
+  if(header_text == NULL)
+  {
+    printf("\n ERROR: Opening header file to Get Block \n"); return(FAIL);
+  }
+
+  // First block with that keyword (lowest line number)
+  int low = 0, high = n_blocks;
+  while(low < high)
+  {
+    int mid = (low + high)/2;
+    if( strcmp(blocks[mid].name, blockname) < 0 ) low = mid + 1;
+    else high = mid;
+  }
+  if( low == n_blocks || strcmp(blocks[low].name, blockname) != 0 ) return(FAIL);
+
+  next_line = blocks[low].line + 1;
+  strcpy(line, header_text + line_offset[blocks[low].line]);
+  return(OK);
 }
 
 int iaea_header_type::get_block(char *lineread)
@@ -399,7 +559,7 @@ int iaea_header_type::get_block(char *lineread)
       char line[MAX_STR_LEN];
 
       strcpy (lineread,""); // Deleting lineread contents
-      while( get_string(fheader,line) == OK )
+      while( get_line(line) == OK )
     {
         if( *line == SEGMENT_BEG_TOKEN ) break;
         strcat(lineread+count*MAX_NUMB_LINES,line); count++;
@@ -416,6 +576,43 @@ int iaea_header_type::read_block(char *lineread,const char *blockname)
       return OK;
 }
 
+// Reads a descriptive block into a size-exact string
+int iaea_header_type::read_text(char **text,const char *blockname)
+{
+    char *lineread = (char *) calloc(MAX_STR_LEN*MAX_NUMB_LINES+1, sizeof(char));
+    if(lineread == NULL) return FAIL;
+    int result = read_block(lineread,blockname);
+    if(result == OK) result = set_text(text,lineread);
+    free(lineread);
+    return result;
+}
+
+// Replaces a descriptive block, empty text is stored as NULL
+int iaea_header_type::set_text(char **text,const char *value)
+{
+    free(*text);
+    *text = NULL;
+    if(value == NULL || *value == '\0') return OK;
+
+    size_t len = strlen(value) + 1;
+    *text = (char *) malloc(len);
+    if(*text == NULL) return FAIL;
+    memcpy(*text,value,len);
+    return OK;
+}
+
+void iaea_header_type::release()
+{
+    char **text[] = { &coordinate_system_description, &input_file_for_event_generator,
+                      &title, &machine_type, &MC_code_and_version, &transport_parameters,
+                      &beam_name, &field_size, &nominal_SSD,
+                      &variance_reduction_techniques, &initial_source_description,
+                      &MC_input_filename, &published_reference, &authors,
+                      &institution, &link_validation, &additional_notes };
+    for(unsigned int i=0;i<sizeof(text)/sizeof(text[0]);i++) set_text(text[i],NULL);
+    free_index();
+}
+
 int iaea_header_type::set_record_contents(iaea_record_type *p_iaea_record)
 {
    int i;
@@ -496,6 +693,19 @@ int iaea_header_type::get_record_contents(iaea_record_type *p_iaea_record)
    p_iaea_record->iextralong = 0;
    if(record_contents[8] > 0) p_iaea_record->iextralong = record_contents[8];
 
+   // Quantized records of a file are expanded as they are read (see iaea_quant.h)
+   if(file_type == 3 && p_iaea_record->p_quant == NULL)
+   {
+      if( iaea_quant_layout(p_iaea_record) != OK ||
+          p_iaea_record->set_quantization(quant_resolution, quant_energy_min,
+                                          quant_energy_max) != OK )
+      {
+         printf("\nWRONG DEFINED HEADER BLOCK QUANTIZATION\n");
+         return FAIL;
+      }
+      for(i=0;i<3;i++) p_iaea_record->p_quant->error[i] = quant_error[i];
+   }
+
    record_length = 5; // To consider for particle type (1 bytes) and energy (4 bytes)
    for(i=0;i<8;i++) record_length += record_contents[i]*sizeof(float);
    record_length -= 4; // 4 bytes substracted as w is not stored, just his sign
@@ -563,6 +773,95 @@ void iaea_header_type::update_counters(iaea_record_type *p_iaea_record)
 
 }
 
+// Same as above for the particles first..first+n-1 of a block. The block
+// is reduced at once (see iaea_block_statistics) and the result is merged
+// into the counters.
+void iaea_header_type::update_counters(const iaea_particle_block *block,
+                                       int first, int n)
+{
+  iaea_block_stats stats;
+  iaea_block_statistics(n, NULL, block->n_stat + first, block->type + first,
+      block->E + first, record_contents[6] ? block->wt + first : NULL, record_constant[6],
+      record_contents[0] ? block->x + first : NULL,
+      record_contents[1] ? block->y + first : NULL,
+      record_contents[2] ? block->z + first : NULL, &stats);
+  add_statistics(&stats);
+}
+
+// Same as above for the particles of a block selected by mask
+// (bit k & 63 of mask[k >> 6] set for the k-th particle)
+void iaea_header_type::update_counters(const iaea_particle_block *block,
+                                       const IAEA_U64 *mask, int n)
+{
+  iaea_block_stats stats;
+  iaea_block_statistics(n, mask, block->n_stat, block->type,
+      block->E, record_contents[6] ? block->wt : NULL, record_constant[6],
+      record_contents[0] ? block->x : NULL,
+      record_contents[1] ? block->y : NULL,
+      record_contents[2] ? block->z : NULL, &stats);
+  add_statistics(&stats);
+}
+
+// Merges the statistics of a block into the counters. Variables that are
+// not stored take the constant value of the header.
+void iaea_header_type::add_statistics(const iaea_block_stats *stats)
+{
+  if(stats->n_particles == 0) return;
+
+  float min_x = record_contents[0] ? stats->min_x : record_constant[0];
+  float max_x = record_contents[0] ? stats->max_x : record_constant[0];
+  float min_y = record_contents[1] ? stats->min_y : record_constant[1];
+  float max_y = record_contents[1] ? stats->max_y : record_constant[1];
+  float min_z = record_contents[2] ? stats->min_z : record_constant[2];
+  float max_z = record_contents[2] ? stats->max_z : record_constant[2];
+
+  if (max_x > maximumX )  maximumX = max_x;
+  if (min_x < minimumX )  minimumX = min_x;
+
+  if (max_y > maximumY )  maximumY = max_y;
+  if (min_y < minimumY )  minimumY = min_y;
+
+  if (max_z > maximumZ )  maximumZ = max_z;
+  if (min_z < minimumZ )  minimumZ = min_z;
+
+  nParticles += stats->n_particles;
+  read_indep_histories += stats->n_histories;
+
+  for(int i=0;i<MAX_NUM_PARTICLES;i++)
+  {
+      if(stats->count[i] == 0) continue;
+      particle_number[i] += stats->count[i];
+      sumParticleWeight[i] += stats->sum_weight[i];
+      averageKineticEnergy[i] += stats->sum_energy[i];
+      if (stats->max_weight[i] > maximumWeight[i] ) maximumWeight[i] = stats->max_weight[i];
+      if (stats->min_weight[i] < minimumWeight[i] ) minimumWeight[i] = stats->min_weight[i];
+
+      if (stats->max_energy[i] > maximumKineticEnergy[i] )
+         maximumKineticEnergy[i] = stats->max_energy[i];
+      if (stats->min_energy[i] < minimumKineticEnergy[i] )
+         minimumKineticEnergy[i] = stats->min_energy[i];
+  }
+}
+
+// Returns OK if records of both phsp files are stored in the same way
+// (same variables, constants and extra numbers), so that raw records
+// can be copied from one file to the other
+int iaea_header_type::same_record_layout(iaea_header_type *other)
+{
+  int i;
+  if(record_length != other->record_length) return (FAIL);
+  for(i=0;i<9;i++)
+     if(record_contents[i] != other->record_contents[i]) return (FAIL);
+  for(i=0;i<7;i++)
+     if(record_contents[i] == 0 && record_constant[i] != other->record_constant[i])
+        return (FAIL);
+  for(i=0;i<record_contents[7];i++)
+     if(extrafloat_contents[i] != other->extrafloat_contents[i]) return (FAIL);
+  for(i=0;i<record_contents[8];i++)
+     if(extralong_contents[i] != other->extralong_contents[i]) return (FAIL);
+  return (OK);
+}
+
 void iaea_header_type::print_statistics()
 {
    printf("\n *************************************** \n");
@@ -713,11 +1012,13 @@ int iaea_header_type::write_header()
 
   fprintf(fheader,"%i   // Test header\n\n",iaea_index);
 
-  write_blockname("TITLE");fprintf(fheader,"%s \n\n",title);
+  write_blockname("TITLE");fprintf(fheader,"%s \n\n",text_of(title));
 
-  write_blockname("FILE_TYPE");fprintf(fheader,"0\n\n"); // phasespace is assumed
+  write_blockname("FILE_TYPE");fprintf(fheader,"%i\n\n",file_type); // phasespace is assumed
 
-  checksum = (IAEA_I64)record_length * nParticles;
+  // The size of a file of compressed or quantized records or of columns is
+  // set by the source (see iaea_destroy_source)
+  if(file_type < 2) checksum = (IAEA_I64)record_length * nParticles;
 
   write_blockname("CHECKSUM");fprintf(fheader,"%llu \n\n",checksum);
 
@@ -808,9 +1109,30 @@ int iaea_header_type::write_header()
 
   write_blockname("RECORD_LENGTH");fprintf(fheader,"%i\n\n",record_length);
 
-  int byte_order = check_byte_order();
+  // Byte order the records are written in (see iaea_set_byte_order)
+  if(byte_order != LITTLE_ENDIAN && byte_order != BIG_ENDIAN) byte_order = check_byte_order();
   write_blockname("BYTE_ORDER");fprintf(fheader,"%i\n\n",byte_order);
 
+  if(file_type == 3)
+  {
+    write_blockname("QUANTIZATION");
+    fprintf(fheader,"   %g     // Position resolution (cm)\n",quant_resolution);
+    fprintf(fheader,"   %g     // Minimum energy (MeV)\n",quant_energy_min);
+    fprintf(fheader,"   %g     // Maximum energy (MeV)\n\n",quant_energy_max);
+
+    write_blockname("QUANTIZATION_ERRORS");
+    fprintf(fheader,"   %.6g     // Largest position error (cm)\n",upper_bound(quant_error[0]));
+    fprintf(fheader,"   %.6g     // Largest relative energy error\n",upper_bound(quant_error[1]));
+    fprintf(fheader,"   %.6g     // Largest direction error (degrees)\n\n",
+            upper_bound(quant_error[2]));
+
+    if(quant_rejected > 0)
+    {
+      write_blockname("QUANTIZATION_REJECTED");
+      fprintf(fheader,"%llu     // Particles left out as out of range\n\n",quant_rejected);
+    }
+  }
+
   write_blockname("ORIG_HISTORIES");
   if( orig_histories == 0) printf(
 
@@ -928,7 +1250,7 @@ int iaea_header_type::print_header ()
     if(checksum == 0) printf("\n NEW PHASE SPACE FILE WILL BE CREATED\n");
 
     printf("\n\nIAEA_INDEX: %i\n",iaea_index);
-    printf("TITLE: %s \n",title);
+    printf("TITLE: %s \n",text_of(title));
 
   // ******************************************************************************
   // 1. PHSP format
@@ -936,6 +1258,9 @@ int iaea_header_type::print_header ()
       /*********************************************/
     if(file_type == 0) printf("FILE TYPE: PHASESPACE \n");
     if(file_type == 1) printf("FILE TYPE: GENERATOR \n");
+    if(file_type == 2) printf("FILE TYPE: PHASESPACE (COMPRESSED RECORDS) \n");
+    if(file_type == 3) printf("FILE TYPE: PHASESPACE (QUANTIZED RECORDS) \n");
+    if(file_type == 4) printf("FILE TYPE: PHASESPACE (COLUMNS) \n");
 
     if(checksum>0) printf("CHECKSUM: %llu\n",checksum);
 
@@ -943,6 +1268,16 @@ int iaea_header_type::print_header ()
 
       if(byte_order > 0) printf("BYTE ORDER: %i\n",byte_order);
 
+    if(file_type == 3)
+    {
+      printf("QUANTIZATION: %g cm, %g to %g MeV\n",
+             quant_resolution, quant_energy_min, quant_energy_max);
+      printf("QUANTIZATION ERRORS: %g cm, %g (energy), %g degrees\n",
+             quant_error[0], quant_error[1], quant_error[2]);
+      if(quant_rejected > 0)
+        printf("QUANTIZATION REJECTED: %llu particles\n",quant_rejected);
+    }
+
     int i;
     printf("\nRECORD_CONTENTS:\n");
     for (i=0;i<7;i++)
@@ -1000,14 +1335,15 @@ int iaea_header_type::print_header ()
 // ******************************************************************************
 // 2. Mandatory description of the phsp
 
-      if( strncmp(coordinate_system_description,"                ",15) > 0 )
+      if( strncmp(text_of(coordinate_system_description),"                ",15) > 0 )
           printf("\nCOORDINATE_SYSTEM_DESCRIPTION: \n%s\n",
             coordinate_system_description);
 
       if(file_type == 1)
       {
             // For event generators
-          printf("INPUT FILE for event generator: %s \n",input_file_for_event_generator);
+          printf("INPUT FILE for event generator: %s \n",
+                 text_of(input_file_for_event_generator));
             return OK;
       }
       printf("\n");
@@ -1025,47 +1361,47 @@ int iaea_header_type::print_header ()
 // ******************************************************************************
 // 3. Mandatory additional information
       /*********************************************/
-      if( strncmp(machine_type,"                ",15) > 0 )
+      if( strncmp(text_of(machine_type),"                ",15) > 0 )
         printf("MACHINE_TYPE: %s\n",machine_type);
 
-      if( strncmp(MC_code_and_version,"                ",15) > 0 )
+      if( strncmp(text_of(MC_code_and_version),"                ",15) > 0 )
         printf("MONTE_CARLO_CODE_VERSION: %s \n",MC_code_and_version);
 
       printf("GLOBAL_PHOTON_ENERGY_CUTOFF: %8.5f \n",global_photon_energy_cutoff);
       printf("GLOBAL_PARTICLE_ENERGY_CUTOFF: %8.5f \n",global_particle_energy_cutoff);
       printf("\n");
 
-      if( strncmp(transport_parameters,"                ",15) > 0 )
+      if( strncmp(text_of(transport_parameters),"                ",15) > 0 )
         printf("\nTRANSPORT_PARAMETERS:\n%s\n",transport_parameters);
 
 // ******************************************************************************
 // 4. Optional description
-      if( strncmp(beam_name,"                ",15) > 0 )
+      if( strncmp(text_of(beam_name),"                ",15) > 0 )
         printf("BEAM_NAME: %s\n",beam_name);
-      if( strncmp(field_size,"                ",15) > 0 )
+      if( strncmp(text_of(field_size),"                ",15) > 0 )
         printf("FIELD_SIZE: %s\n",field_size);
-      if( strncmp(nominal_SSD,"                ",15) > 0 )
+      if( strncmp(text_of(nominal_SSD),"                ",15) > 0 )
         printf("NOMINAL_SSD: %s\n",nominal_SSD);
-      if( strncmp(variance_reduction_techniques,"                ",15) > 0 )
+      if( strncmp(text_of(variance_reduction_techniques),"                ",15) > 0 )
         printf("VARIANCE_REDUCTION_TECHNIQUES:\n%s\n",
         variance_reduction_techniques);
-      if( strncmp(initial_source_description,"                ",15) > 0 )
+      if( strncmp(text_of(initial_source_description),"                ",15) > 0 )
         printf("INITIAL_SOURCE_DESCRIPTION: \n%s\n",
         initial_source_description);
 
       // Documentation sub-section
       /*********************************************/
-      if( strncmp(MC_input_filename,"                ",15) > 0 )
+      if( strncmp(text_of(MC_input_filename),"                ",15) > 0 )
         printf("MC_INPUT_FILENAME: %s\n",MC_input_filename);
-      if( strncmp(published_reference,"                ",15) > 0 )
+      if( strncmp(text_of(published_reference),"                ",15) > 0 )
         printf("PUBLISHED_REFERENCE: \n%s\n",published_reference);
-      if( strncmp(authors,"                ",15) > 0 )
+      if( strncmp(text_of(authors),"                ",15) > 0 )
         printf("AUTHORS: \n%s\n",authors);
-      if( strncmp(institution,"                ",15) > 0 )
+      if( strncmp(text_of(institution),"                ",15) > 0 )
         printf("INSTITUTION: \n%s\n",institution);
-      if( strncmp(link_validation,"                ",15) > 0 )
+      if( strncmp(text_of(link_validation),"                ",15) > 0 )
         printf("LINK_VALIDATION: \n%s\n",link_validation);
-      if( strncmp(additional_notes,"                ",15) > 0 )
+      if( strncmp(text_of(additional_notes),"                ",15) > 0 )
         printf("ADDITIONAL_NOTES: \n%s\n",additional_notes);
 
 // ******************************************************************************
@@ -0,0 +1,1203 @@
+/*
+ * Spatial index of a phase space file (see iaea_index.h): building it from
+ * the records of the file, storing it in the sidecar file base.IAEAindex
+ * and selecting the ranges of records a filter chain has to read; the
+ * index of the records the histories of a file start with; and the
+ * rewrite of a file with its records sorted by position, which makes the
+ * ranges of a cut contiguous.
+ *
+ * A cell is only left out of a selection when none of its particles can
+ * pass the chain. The bounds of the positions of its particles projected
+ * to the plane of an aperture are widened by more than the rounding of
+ * the single precision projection of the filter kernels, so a cut reading
+ * the selected ranges accepts exactly the particles a cut of the whole
+ * file does.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <queue>
+#include <functional>
+#include <sys/stat.h>
+
+#include "iaea_index.h"
+#include "iaea_phsp.h"
+
+static const char index_magic[8] = { 'I', 'A', 'E', 'A', 'I', 'N', 'D', 'X' };
+static const char history_magic[8] = { 'I', 'A', 'E', 'A', 'H', 'I', 'S', 'T' };
+
+// Particles read per call while the index is built
+static const IAEA_I32 index_batch = 4096;
+
+// Relative widening of the projected bounds, far above the rounding of
+// the single precision projection
+static const double index_margin = 1e-5;
+
+/* *********************************************************************** */
+// Building
+
+// Size and modification time of the phsp file of base
+static int phsp_file_status(const char *base, IAEA_I64 *size, IAEA_I64 *time)
+{
+  std::string name = std::string(base) + ".IAEAphsp";
+  struct stat status;
+  if(stat(name.c_str(), &status) != 0) return (FAIL);
+  *size = (IAEA_I64)status.st_size;
+  *time = (IAEA_I64)status.st_mtime;
+  return (OK);
+}
+
+// Bin of v in n bins of [lo, lo + n/scale], values outside (and NaN) are
+// put into the first or the last bin
+static inline int index_bin(float v, float lo, float scale, int n)
+{
+  float t = (v - lo)*scale;
+  if( !(t >= 0) ) return 0;
+  if( t >= (float)n ) return n - 1;
+  return (int)t;
+}
+
+// Decoded particles of one batch of up to n_max particles
+struct index_batch_arrays
+{
+  std::vector<IAEA_I32> n_stat, type;
+  std::vector<IAEA_Float> E, wt, x, y, z, u, v, w;
+  std::vector<IAEA_Float> extra_floats;
+  std::vector<IAEA_I32> extra_ints;
+
+  index_batch_arrays(IAEA_I32 n_max = index_batch) : n_stat(n_max), type(n_max), E(n_max),
+     wt(n_max), x(n_max), y(n_max), z(n_max), u(n_max), v(n_max), w(n_max),
+     extra_floats((size_t)n_max*NUM_EXTRA_FLOAT), extra_ints((size_t)n_max*NUM_EXTRA_LONG) {}
+
+  IAEA_I32 read(IAEA_I32 id, IAEA_I32 n_max)
+  {
+     IAEA_I32 n_read;
+     iaea_get_particles_batch(&id, &n_max, &n_read, &n_stat[0], &type[0], &E[0], &wt[0],
+                              &x[0], &y[0], &z[0], &u[0], &v[0], &w[0],
+                              &extra_floats[0], &extra_ints[0]);
+     return n_read;
+  }
+};
+
+// Reads the n_records records of source id from the start, a batch at a
+// time. Returns the number of records read.
+template <class F>
+static IAEA_I64 index_pass(IAEA_I32 id, IAEA_I64 n_records, index_batch_arrays *b, F process)
+{
+  IAEA_I32 result;
+  IAEA_I64 one = 1;
+  iaea_set_record(&id, &one, &result);
+  if(result != 0) return 0;
+
+  IAEA_I64 count = 0;
+  while(count < n_records)
+  {
+     IAEA_I32 n_want = index_batch;
+     if(n_records - count < n_want) n_want = (IAEA_I32)(n_records - count);
+     IAEA_I32 n_read = b->read(id, n_want);
+     if(n_read <= 0) break;
+     process(count, n_read);
+     count += n_read;
+     if(n_read < n_want) break;
+  }
+  return count;
+}
+
+// Merges the ranges (first, count pairs) of a cell at most gap records
+// apart
+static void merge_ranges(std::vector<IAEA_I64> *ranges, IAEA_I64 gap)
+{
+  std::vector<IAEA_I64> &r = *ranges;
+  size_t n = 0;
+  for(size_t j=0;j<r.size();j+=2)
+  {
+     if(n > 0 && r[j] - r[n-2] - r[n-1] <= gap) r[n-1] = r[j] + r[j+1] - r[n-2];
+     else
+     {
+        r[n] = r[j];
+        r[n+1] = r[j+1];
+        n += 2;
+     }
+  }
+  r.resize(n);
+}
+
+int iaea_index_build(const char *base, int nxy, int nproj, float z_ref,
+                     iaea_index *index)
+{
+  memset(index, 0, sizeof(iaea_index));
+  if(nxy < 1 || nproj < 1)
+  {
+     fprintf(stderr, "\n ERROR: iaea_index_build: Invalid number of bins\n");
+     return (FAIL);
+  }
+  if(phsp_file_status(base, &index->file_size, &index->file_time) != OK)
+  {
+     fprintf(stderr, "\n ERROR: iaea_index_build: Cannot access %s.IAEAphsp\n", base);
+     return (FAIL);
+  }
+
+  IAEA_I32 id, result;
+  IAEA_I32 access = 4;
+  std::vector<char> name(base, base + strlen(base) + 1);
+  iaea_new_source(&id, &name[0], &access, &result, (int)strlen(base));
+  if(result < 0)
+  {
+     fprintf(stderr, "\n ERROR: iaea_index_build: Cannot open %s\n", base);
+     return (FAIL);
+  }
+  IAEA_I32 no_statistics = 0;
+  iaea_set_read_statistics(&id, &no_statistics, &result);
+  IAEA_I32 any_type = -1;
+  IAEA_I64 n_records;
+  iaea_get_max_particles(&id, &any_type, &n_records);
+
+  index_batch_arrays b;
+
+  // Pass 1: range of the positions
+  float x_min = HUGE_VALF, x_max = -HUGE_VALF;
+  float y_min = HUGE_VALF, y_max = -HUGE_VALF;
+  n_records = index_pass(id, n_records, &b, [&](IAEA_I64, IAEA_I32 n)
+  {
+     for(int i=0;i<n;i++)
+     {
+        float x = (float)b.x[i], y = (float)b.y[i];
+        if(x < x_min) x_min = x;
+        if(x > x_max) x_max = x;
+        if(y < y_min) y_min = y;
+        if(y > y_max) y_max = y;
+     }
+  });
+  if( !(x_min <= x_max) ) { x_min = 0; x_max = 1; }
+  if( !(y_min <= y_max) ) { y_min = 0; y_max = 1; }
+  if(x_max == x_min) x_max = x_min + 1;
+  if(y_max == y_min) y_max = y_min + 1;
+
+  index->n_records = n_records;
+  index->z_ref = z_ref;
+  index->x_min = x_min; index->x_max = x_max;
+  index->y_min = y_min; index->y_max = y_max;
+
+  // The index is kept within 1/IAEA_INDEX_FRACTION of the size of the
+  // file, half of it for the cells
+  IAEA_I64 max_size = index->file_size/IAEA_INDEX_FRACTION;
+  IAEA_I64 n_all_cells;
+  std::vector<iaea_index_cell> cell;
+  std::vector< std::vector<IAEA_I64> > ranges;
+  for(;;)
+  {
+     IAEA_I64 n_proj_cells = (IAEA_I64)nproj*nproj + 1;
+     n_all_cells = (IAEA_I64)nxy*nxy*n_proj_cells;
+     cell.assign((size_t)n_all_cells, iaea_index_cell());
+     for(IAEA_I64 c=0;c<n_all_cells;c++)
+     {
+        iaea_index_cell *p = &cell[c];
+        memset(p, 0, sizeof(*p));
+        p->id = c;
+        p->e_min = p->x_min = p->y_min = p->z_min = HUGE_VALF;
+        p->e_max = p->x_max = p->y_max = p->z_max = -HUGE_VALF;
+        p->tx_min = p->ty_min = HUGE_VAL;
+        p->tx_max = p->ty_max = -HUGE_VAL;
+     }
+
+     // Pass 2: cells of the particles and their ranges. The range of a
+     // cell still growing is [open_first, open_end).
+     ranges.assign((size_t)n_all_cells, std::vector<IAEA_I64>());
+     std::vector<IAEA_I64> open_first((size_t)n_all_cells, 0);
+     std::vector<IAEA_I64> open_end((size_t)n_all_cells, 0);
+     float x_scale = (float)nxy/(x_max - x_min), y_scale = (float)nxy/(y_max - y_min);
+     float px_scale = (float)nproj/(x_max - x_min), py_scale = (float)nproj/(y_max - y_min);
+
+     IAEA_I64 n_read = index_pass(id, n_records, &b, [&](IAEA_I64 count, IAEA_I32 n)
+     {
+        for(int i=0;i<n;i++)
+        {
+           float x = (float)b.x[i], y = (float)b.y[i];
+           float u = (float)b.u[i], v = (float)b.v[i], w = (float)b.w[i];
+           float z = (float)b.z[i];
+
+           // Projected position as in project_scalar (iaea_filter.cpp), the
+           // last projection cell takes the particles not moving forward
+           IAEA_I64 c = n_proj_cells - 1;
+           if(w > 0)
+           {
+              float px = x, py = y;
+              if(z < z_ref)
+              {
+                 float t = (z_ref - z) / w;
+                 px = x + u * t;
+                 py = y + v * t;
+              }
+              c = (IAEA_I64)index_bin(px, x_min, px_scale, nproj)*nproj +
+                  index_bin(py, y_min, py_scale, nproj);
+           }
+           c += ((IAEA_I64)index_bin(x, x_min, x_scale, nxy)*nxy +
+                 index_bin(y, y_min, y_scale, nxy))*n_proj_cells;
+           iaea_index_cell *p = &cell[c];
+
+           p->n_records++;
+           unsigned int t = (unsigned int)(b.type[i] - 1);
+           if(t < 32) p->types |= 1u << t;
+           float E = (float)b.E[i];
+           if(E < p->e_min) p->e_min = E;
+           if(E > p->e_max) p->e_max = E;
+           if(w > 0)
+           {
+              if(z != z) z = HUGE_VALF; // not projected, see project_scalar
+              double tx = (double)u/w, ty = (double)v/w;
+              p->n_forward++;
+              if(x < p->x_min) p->x_min = x;
+              if(x > p->x_max) p->x_max = x;
+              if(y < p->y_min) p->y_min = y;
+              if(y > p->y_max) p->y_max = y;
+              if(z < p->z_min) p->z_min = z;
+              if(z > p->z_max) p->z_max = z;
+              if(tx < p->tx_min) p->tx_min = tx;
+              if(tx > p->tx_max) p->tx_max = tx;
+              if(ty < p->ty_min) p->ty_min = ty;
+              if(ty > p->ty_max) p->ty_max = ty;
+           }
+
+           IAEA_I64 record = count + i + 1;
+           if(open_end[c] > 0 && record - open_end[c] < IAEA_INDEX_GAP)
+           {
+              open_end[c] = record + 1;
+              continue;
+           }
+           if(open_end[c] > 0)
+           {
+              ranges[c].push_back(open_first[c]);
+              ranges[c].push_back(open_end[c] - open_first[c]);
+           }
+           open_first[c] = record;
+           open_end[c] = record + 1;
+        }
+     });
+     if(n_read != n_records)
+     {
+        fprintf(stderr, "\n ERROR: iaea_index_build: Failed to read %s\n", base);
+        iaea_destroy_source(&id, &result);
+        iaea_index_free(index);
+        return (FAIL);
+     }
+
+     index->n_cells = 0;
+     for(IAEA_I64 c=0;c<n_all_cells;c++)
+     {
+        if(open_end[c] > 0)
+        {
+           ranges[c].push_back(open_first[c]);
+           ranges[c].push_back(open_end[c] - open_first[c]);
+        }
+        if(cell[c].n_records > 0) index->n_cells++;
+     }
+
+     // Too many cells holding particles for the size of the file (few
+     // particles per cell): read again with half the bins, of the
+     // positions first (a file sorted by iaea_cluster keeps the particles
+     // of a projected bin together, not those of a position bin)
+     if(index->n_cells*(IAEA_I64)sizeof(iaea_index_cell) <= max_size/2 ||
+        (nxy == 1 && nproj == 1))
+        break;
+     if(nxy >= nproj) nxy = (nxy + 1)/2;
+     else nproj = (nproj + 1)/2;
+  }
+  iaea_destroy_source(&id, &result);
+  index->nxy = nxy;
+  index->nproj = nproj;
+
+  // The ranges fill the rest of the size, at least one per cell: where the
+  // file mixes the cells, the ranges of the cells nearest each other are
+  // merged, the gaps up to the one keeping that many ranges read as well
+  IAEA_I64 n_ranges = 0;
+  for(IAEA_I64 c=0;c<n_all_cells;c++) n_ranges += (IAEA_I64)ranges[c].size()/2;
+  IAEA_I64 max_ranges = (max_size - index->n_cells*(IAEA_I64)sizeof(iaea_index_cell))/
+                        (IAEA_I64)(2*sizeof(IAEA_I64));
+  if(max_ranges < index->n_cells) max_ranges = index->n_cells;
+  if(n_ranges > max_ranges)
+  {
+     std::vector<IAEA_I64> gaps;
+     gaps.reserve((size_t)(n_ranges - index->n_cells));
+     for(IAEA_I64 c=0;c<n_all_cells;c++)
+        for(size_t j=2;j<ranges[c].size();j+=2)
+           gaps.push_back(ranges[c][j] - ranges[c][j-2] - ranges[c][j-1]);
+     size_t n_merged = (size_t)(n_ranges - max_ranges);
+     std::nth_element(gaps.begin(), gaps.begin() + (n_merged - 1), gaps.end());
+     IAEA_I64 gap = gaps[n_merged - 1];
+
+     n_ranges = 0;
+     for(IAEA_I64 c=0;c<n_all_cells;c++)
+     {
+        merge_ranges(&ranges[c], gap);
+        n_ranges += (IAEA_I64)ranges[c].size()/2;
+     }
+  }
+  index->n_ranges = n_ranges;
+
+  // Only the cells holding particles are kept
+  index->cell = (iaea_index_cell *) malloc((size_t)(index->n_cells + 1)*sizeof(iaea_index_cell));
+  index->first = (IAEA_I64 *) malloc((size_t)(index->n_ranges + 1)*2*sizeof(IAEA_I64));
+  if(index->cell == NULL || index->first == NULL)
+  {
+     fprintf(stderr, "\n ERROR: iaea_index_build: Failed to allocate the index\n");
+     iaea_index_free(index);
+     return (FAIL);
+  }
+  index->count = index->first + index->n_ranges + 1;
+
+  IAEA_I64 k = 0, n_cells = 0;
+  for(IAEA_I64 c=0;c<n_all_cells;c++)
+  {
+     if(cell[c].n_records == 0) continue;
+     iaea_index_cell *p = &index->cell[n_cells++];
+     *p = cell[c];
+     p->first_range = k;
+     p->n_ranges = (IAEA_I64)ranges[c].size()/2;
+     for(size_t j=0;j<ranges[c].size();j+=2,k++)
+     {
+        index->first[k] = ranges[c][j];
+        index->count[k] = ranges[c][j+1];
+     }
+  }
+  return (OK);
+}
+
+/* *********************************************************************** */
+// Sidecar file
+//
+// The magic, the version, a byte order mark and the size of a cell are
+// followed by the index in the memory layout of the machine that built it;
+// it is not meant to be moved between machines of different kinds.
+
+int iaea_index_write(const iaea_index *index, const char *base)
+{
+  std::string name = std::string(base) + ".IAEAindex";
+  FILE *fp = fopen(name.c_str(), "wb");
+  if(fp == NULL)
+  {
+     fprintf(stderr, "\n ERROR: iaea_index_write: Cannot create %s\n", name.c_str());
+     return (FAIL);
+  }
+  IAEA_I32 version = IAEA_INDEX_VERSION;
+  IAEA_I32 mark = 1234;
+  IAEA_I32 cell_size = (IAEA_I32)sizeof(iaea_index_cell);
+  int nxy = index->nxy, nproj = index->nproj;
+  bool ok =
+     fwrite(index_magic, sizeof(index_magic), 1, fp) == 1 &&
+     fwrite(&version, sizeof(version), 1, fp) == 1 &&
+     fwrite(&mark, sizeof(mark), 1, fp) == 1 &&
+     fwrite(&cell_size, sizeof(cell_size), 1, fp) == 1 &&
+     fwrite(&index->n_records, sizeof(IAEA_I64), 1, fp) == 1 &&
+     fwrite(&index->file_size, sizeof(IAEA_I64), 1, fp) == 1 &&
+     fwrite(&index->file_time, sizeof(IAEA_I64), 1, fp) == 1 &&
+     fwrite(&nxy, sizeof(int), 1, fp) == 1 &&
+     fwrite(&nproj, sizeof(int), 1, fp) == 1 &&
+     fwrite(&index->z_ref, sizeof(float), 1, fp) == 1 &&
+     fwrite(&index->x_min, sizeof(float), 1, fp) == 1 &&
+     fwrite(&index->x_max, sizeof(float), 1, fp) == 1 &&
+     fwrite(&index->y_min, sizeof(float), 1, fp) == 1 &&
+     fwrite(&index->y_max, sizeof(float), 1, fp) == 1 &&
+     fwrite(&index->n_cells, sizeof(IAEA_I64), 1, fp) == 1 &&
+     fwrite(&index->n_ranges, sizeof(IAEA_I64), 1, fp) == 1 &&
+     fwrite(index->cell, sizeof(iaea_index_cell), (size_t)index->n_cells, fp) ==
+        (size_t)index->n_cells &&
+     fwrite(index->first, sizeof(IAEA_I64), (size_t)index->n_ranges, fp) ==
+        (size_t)index->n_ranges &&
+     fwrite(index->count, sizeof(IAEA_I64), (size_t)index->n_ranges, fp) ==
+        (size_t)index->n_ranges;
+  if(fclose(fp) != 0) ok = false;
+  if(!ok)
+  {
+     fprintf(stderr, "\n ERROR: iaea_index_write: Failed to write %s\n", name.c_str());
+     remove(name.c_str());
+     return (FAIL);
+  }
+  return (OK);
+}
+
+int iaea_index_read(iaea_index *index, const char *base)
+{
+  memset(index, 0, sizeof(iaea_index));
+  std::string name = std::string(base) + ".IAEAindex";
+  FILE *fp = fopen(name.c_str(), "rb");
+  if(fp == NULL) return (FAIL);
+
+  char magic[sizeof(index_magic)];
+  IAEA_I32 version = 0, mark = 0, cell_size = 0;
+  int nxy = 0, nproj = 0;
+  bool ok =
+     fread(magic, sizeof(magic), 1, fp) == 1 &&
+     memcmp(magic, index_magic, sizeof(magic)) == 0 &&
+     fread(&version, sizeof(version), 1, fp) == 1 && version == IAEA_INDEX_VERSION &&
+     fread(&mark, sizeof(mark), 1, fp) == 1 && mark == 1234 &&
+     fread(&cell_size, sizeof(cell_size), 1, fp) == 1 &&
+     cell_size == (IAEA_I32)sizeof(iaea_index_cell) &&
+     fread(&index->n_records, sizeof(IAEA_I64), 1, fp) == 1 &&
+     fread(&index->file_size, sizeof(IAEA_I64), 1, fp) == 1 &&
+     fread(&index->file_time, sizeof(IAEA_I64), 1, fp) == 1 &&
+     fread(&nxy, sizeof(int), 1, fp) == 1 &&
+     fread(&nproj, sizeof(int), 1, fp) == 1 &&
+     fread(&index->z_ref, sizeof(float), 1, fp) == 1 &&
+     fread(&index->x_min, sizeof(float), 1, fp) == 1 &&
+     fread(&index->x_max, sizeof(float), 1, fp) == 1 &&
+     fread(&index->y_min, sizeof(float), 1, fp) == 1 &&
+     fread(&index->y_max, sizeof(float), 1, fp) == 1 &&
+     fread(&index->n_cells, sizeof(IAEA_I64), 1, fp) == 1 &&
+     fread(&index->n_ranges, sizeof(IAEA_I64), 1, fp) == 1 &&
+     nxy > 0 && nproj > 0 && index->n_cells >= 0 &&
+     index->n_cells <= (IAEA_I64)nxy*nxy*((IAEA_I64)nproj*nproj + 1) &&
+     index->n_ranges >= 0;
+  if(ok)
+  {
+     index->nxy = nxy;
+     index->nproj = nproj;
+     index->cell = (iaea_index_cell *) malloc((size_t)(index->n_cells + 1)*sizeof(iaea_index_cell));
+     index->first = (IAEA_I64 *) malloc((size_t)(index->n_ranges + 1)*2*sizeof(IAEA_I64));
+     ok = index->cell != NULL && index->first != NULL;
+  }
+  if(ok)
+  {
+     index->count = index->first + index->n_ranges + 1;
+     ok = fread(index->cell, sizeof(iaea_index_cell), (size_t)index->n_cells, fp) ==
+             (size_t)index->n_cells &&
+          fread(index->first, sizeof(IAEA_I64), (size_t)index->n_ranges, fp) ==
+             (size_t)index->n_ranges &&
+          fread(index->count, sizeof(IAEA_I64), (size_t)index->n_ranges, fp) ==
+             (size_t)index->n_ranges;
+  }
+  fclose(fp);
+  if(!ok)
+  {
+     fprintf(stderr, "\n ERROR: iaea_index_read: %s is not a valid index\n", name.c_str());
+     iaea_index_free(index);
+     return (FAIL);
+  }
+
+  IAEA_I64 size, time;
+  if(phsp_file_status(base, &size, &time) != OK ||
+     size != index->file_size || time != index->file_time)
+  {
+     fprintf(stderr, "\n ERROR: iaea_index_read: %s is out of date\n", name.c_str());
+     iaea_index_free(index);
+     return (FAIL);
+  }
+  return (OK);
+}
+
+/* *********************************************************************** */
+// Selection
+
+// Bounds of lo..hi + t*d for t in [t_lo, t_hi] and d in [d_lo, d_hi],
+// widened by the margin. Unbounded if a product is not a number.
+static void projected_bounds(double lo, double hi, double t_lo, double t_hi,
+                             double d_lo, double d_hi, double *p_lo, double *p_hi)
+{
+  double a = t_lo*d_lo, b = t_lo*d_hi, c = t_hi*d_lo, d = t_hi*d_hi;
+  if(std::isnan(a) || std::isnan(b) || std::isnan(c) || std::isnan(d))
+  {
+     *p_lo = -HUGE_VAL;
+     *p_hi = HUGE_VAL;
+     return;
+  }
+  double s_lo = min(min(a, b), min(c, d));
+  double s_hi = max(max(a, b), max(c, d));
+  double margin = index_margin*(fabs(lo) + fabs(hi) + fabs(s_lo) + fabs(s_hi)) + index_margin;
+  *p_lo = lo + s_lo - margin;
+  *p_hi = hi + s_hi + margin;
+}
+
+// Whether some particle of a cell could pass the aperture of a stage
+static bool cell_in_aperture(const iaea_index_cell *c, const iaea_filter_stage *s)
+{
+  if(c->n_forward == 0) return false;
+
+  // Projected positions, see project_scalar in iaea_filter.cpp: particles
+  // beyond the plane keep their position
+  double zp = s->plane.z_plane;
+  double d_lo = max(zp - c->z_max, 0.0), d_hi = max(zp - c->z_min, 0.0);
+  double px_lo, px_hi, py_lo, py_hi;
+  projected_bounds(c->x_min, c->x_max, c->tx_min, c->tx_max, d_lo, d_hi, &px_lo, &px_hi);
+  projected_bounds(c->y_min, c->y_max, c->ty_min, c->ty_max, d_lo, d_hi, &py_lo, &py_hi);
+
+  // Bounding box of the aperture
+  double ax_lo, ax_hi, ay_lo, ay_hi;
+  if(s->kind == IAEA_STAGE_RECTANGLE)
+  {
+     ax_lo = s->plane.x_min; ax_hi = s->plane.x_max;
+     ay_lo = s->plane.y_min; ay_hi = s->plane.y_max;
+  }
+  else if(s->kind == IAEA_STAGE_CIRCLE)
+  {
+     double m = index_margin*(fabs(s->x0) + fabs(s->y0) + s->radius);
+     ax_lo = s->x0 - s->radius - m; ax_hi = s->x0 + s->radius + m;
+     ay_lo = s->y0 - s->radius - m; ay_hi = s->y0 + s->radius + m;
+  }
+  else
+  {
+     ax_lo = ay_lo = HUGE_VAL;
+     ax_hi = ay_hi = -HUGE_VAL;
+     for(int k=0;k<s->n_vertices;k++)
+     {
+        ax_lo = min(ax_lo, (double)s->vx[k]); ax_hi = max(ax_hi, (double)s->vx[k]);
+        ay_lo = min(ay_lo, (double)s->vy[k]); ay_hi = max(ay_hi, (double)s->vy[k]);
+     }
+     double m = index_margin*(fabs(ax_lo) + fabs(ax_hi) + fabs(ay_lo) + fabs(ay_hi));
+     ax_lo -= m; ax_hi += m;
+     ay_lo -= m; ay_hi += m;
+  }
+  return !(px_hi < ax_lo || px_lo > ax_hi || py_hi < ay_lo || py_lo > ay_hi);
+}
+
+// Whether some particle of a cell could pass all the conditions of a chain
+static bool cell_in_chain(const iaea_index_cell *c, const iaea_filter_chain *chain)
+{
+  if(c->n_records == 0) return false;
+  for(int k=0;k<chain->n_stages;k++)
+  {
+     const iaea_filter_stage *s = &chain->stage[k];
+     switch(s->kind)
+     {
+     case IAEA_STAGE_TYPE:
+        if( (c->types & s->types) == 0 ) return false;
+        break;
+     case IAEA_STAGE_ENERGY:
+        if( !(c->e_max >= s->e_min && c->e_min <= s->e_max) ) return false;
+        break;
+     case IAEA_STAGE_BITS:
+     case IAEA_STAGE_LABEL:
+        break; // extra longs are not indexed
+     case IAEA_STAGE_RANGE:
+        break; // tested on the particles read
+     default:
+        if( !cell_in_aperture(c, s) ) return false;
+     }
+  }
+  return true;
+}
+
+IAEA_I64 iaea_index_select(const iaea_index *index, const iaea_filter_chain *chains,
+                           int n_chains, IAEA_I64 last_record,
+                           IAEA_I64 **first, IAEA_I64 **count, IAEA_I64 *n_ranges)
+{
+  *first = *count = NULL;
+  *n_ranges = 0;
+
+  // Ranges of the cells selected, as [first, end)
+  std::vector< std::pair<IAEA_I64, IAEA_I64> > selected;
+  for(IAEA_I64 c=0;c<index->n_cells;c++)
+  {
+     const iaea_index_cell *p = &index->cell[c];
+     bool in = false;
+     for(int k=0;k<n_chains && !in;k++) in = cell_in_chain(p, &chains[k]);
+     if(!in) continue;
+     for(IAEA_I64 r=p->first_range;r<p->first_range+p->n_ranges;r++)
+     {
+        if(index->first[r] > last_record) break;
+        selected.push_back(std::make_pair(index->first[r], index->first[r] + index->count[r]));
+     }
+  }
+  if(selected.empty()) return 0;
+  std::sort(selected.begin(), selected.end());
+
+  // Overlapping and adjacent ranges are merged
+  std::vector< std::pair<IAEA_I64, IAEA_I64> > merged;
+  for(size_t k=0;k<selected.size();k++)
+  {
+     if(!merged.empty() && selected[k].first <= merged.back().second)
+        merged.back().second = max(merged.back().second, selected[k].second);
+     else merged.push_back(selected[k]);
+  }
+
+  IAEA_I64 n = (IAEA_I64)merged.size();
+  *first = (IAEA_I64 *) malloc((size_t)n*sizeof(IAEA_I64));
+  *count = (IAEA_I64 *) malloc((size_t)n*sizeof(IAEA_I64));
+  if(*first == NULL || *count == NULL)
+  {
+     fprintf(stderr, "\n ERROR: iaea_index_select: Failed to allocate the ranges\n");
+     free(*first);
+     free(*count);
+     *first = *count = NULL;
+     return -1;
+  }
+  IAEA_I64 n_records = 0;
+  for(IAEA_I64 k=0;k<n;k++)
+  {
+     IAEA_I64 end = min(merged[k].second, last_record + 1);
+     (*first)[k] = merged[k].first;
+     (*count)[k] = end - merged[k].first;
+     n_records += (*count)[k];
+  }
+  *n_ranges = n;
+  return n_records;
+}
+
+void iaea_index_free(iaea_index *index)
+{
+  free(index->cell);
+  free(index->first);
+  index->cell = NULL;
+  index->first = index->count = NULL;
+  index->n_cells = index->n_ranges = 0;
+}
+
+/* *********************************************************************** */
+// History index
+
+int iaea_history_build(const char *base, iaea_history_index *index)
+{
+  memset(index, 0, sizeof(iaea_history_index));
+  if(phsp_file_status(base, &index->file_size, &index->file_time) != OK)
+  {
+     fprintf(stderr, "\n ERROR: iaea_history_build: Cannot access %s.IAEAphsp\n", base);
+     return (FAIL);
+  }
+
+  IAEA_I32 id, result;
+  IAEA_I32 access = 4;
+  std::vector<char> name(base, base + strlen(base) + 1);
+  iaea_new_source(&id, &name[0], &access, &result, (int)strlen(base));
+  if(result < 0)
+  {
+     fprintf(stderr, "\n ERROR: iaea_history_build: Cannot open %s\n", base);
+     return (FAIL);
+  }
+  IAEA_I32 no_statistics = 0;
+  iaea_set_read_statistics(&id, &no_statistics, &result);
+  IAEA_I32 any_type = -1;
+  IAEA_I64 n_records;
+  iaea_get_max_particles(&id, &any_type, &n_records);
+
+  index_batch_arrays b;
+  std::vector<IAEA_I64> first, counted;
+  IAEA_I64 sum = 0;
+  index->n_records = index_pass(id, n_records, &b, [&](IAEA_I64 count, IAEA_I32 n)
+  {
+     for(int i=0;i<n;i++)
+        if(b.n_stat[i] > 0 || count + i == 0)
+        {
+           first.push_back(count + i + 1);
+           counted.push_back(sum);
+           if(b.n_stat[i] > 0) sum += b.n_stat[i];
+        }
+  });
+  iaea_destroy_source(&id, &result);
+  counted.push_back(sum);
+
+  index->n_histories = (IAEA_I64)first.size();
+  index->first = (IAEA_I64 *) malloc((size_t)(index->n_histories + 1)*2*sizeof(IAEA_I64));
+  if(index->first == NULL)
+  {
+     fprintf(stderr, "\n ERROR: iaea_history_build: Failed to allocate the index\n");
+     return (FAIL);
+  }
+  index->counted = index->first + index->n_histories + 1;
+  if(index->n_histories > 0)
+     memcpy(index->first, &first[0], (size_t)index->n_histories*sizeof(IAEA_I64));
+  memcpy(index->counted, &counted[0], (size_t)(index->n_histories + 1)*sizeof(IAEA_I64));
+  return (OK);
+}
+
+int iaea_history_write(const iaea_history_index *index, const char *base)
+{
+  std::string name = std::string(base) + ".IAEAhistory";
+  FILE *fp = fopen(name.c_str(), "wb");
+  if(fp == NULL)
+  {
+     fprintf(stderr, "\n ERROR: iaea_history_write: Cannot create %s\n", name.c_str());
+     return (FAIL);
+  }
+  IAEA_I32 version = IAEA_HISTORY_VERSION;
+  IAEA_I32 mark = 1234;
+  bool ok =
+     fwrite(history_magic, sizeof(history_magic), 1, fp) == 1 &&
+     fwrite(&version, sizeof(version), 1, fp) == 1 &&
+     fwrite(&mark, sizeof(mark), 1, fp) == 1 &&
+     fwrite(&index->n_records, sizeof(IAEA_I64), 1, fp) == 1 &&
+     fwrite(&index->file_size, sizeof(IAEA_I64), 1, fp) == 1 &&
+     fwrite(&index->file_time, sizeof(IAEA_I64), 1, fp) == 1 &&
+     fwrite(&index->n_histories, sizeof(IAEA_I64), 1, fp) == 1 &&
+     fwrite(index->first, sizeof(IAEA_I64), (size_t)index->n_histories, fp) ==
+        (size_t)index->n_histories &&
+     fwrite(index->counted, sizeof(IAEA_I64), (size_t)index->n_histories + 1, fp) ==
+        (size_t)index->n_histories + 1;
+  if(fclose(fp) != 0) ok = false;
+  if(!ok)
+  {
+     fprintf(stderr, "\n ERROR: iaea_history_write: Failed to write %s\n", name.c_str());
+     remove(name.c_str());
+     return (FAIL);
+  }
+  return (OK);
+}
+
+int iaea_history_read(iaea_history_index *index, const char *base)
+{
+  memset(index, 0, sizeof(iaea_history_index));
+  std::string name = std::string(base) + ".IAEAhistory";
+  FILE *fp = fopen(name.c_str(), "rb");
+  if(fp == NULL) return (FAIL);
+
+  char magic[sizeof(history_magic)];
+  IAEA_I32 version = 0, mark = 0;
+  bool ok =
+     fread(magic, sizeof(magic), 1, fp) == 1 &&
+     memcmp(magic, history_magic, sizeof(magic)) == 0 &&
+     fread(&version, sizeof(version), 1, fp) == 1 && version == IAEA_HISTORY_VERSION &&
+     fread(&mark, sizeof(mark), 1, fp) == 1 && mark == 1234 &&
+     fread(&index->n_records, sizeof(IAEA_I64), 1, fp) == 1 &&
+     fread(&index->file_size, sizeof(IAEA_I64), 1, fp) == 1 &&
+     fread(&index->file_time, sizeof(IAEA_I64), 1, fp) == 1 &&
+     fread(&index->n_histories, sizeof(IAEA_I64), 1, fp) == 1 &&
+     index->n_histories >= 0 && index->n_histories <= index->n_records;
+  if(ok)
+  {
+     index->first = (IAEA_I64 *) malloc((size_t)(index->n_histories + 1)*2*sizeof(IAEA_I64));
+     ok = index->first != NULL;
+  }
+  if(ok)
+  {
+     index->counted = index->first + index->n_histories + 1;
+     ok = fread(index->first, sizeof(IAEA_I64), (size_t)index->n_histories, fp) ==
+             (size_t)index->n_histories &&
+          fread(index->counted, sizeof(IAEA_I64), (size_t)index->n_histories + 1, fp) ==
+             (size_t)index->n_histories + 1;
+  }
+  fclose(fp);
+  if(!ok)
+  {
+     fprintf(stderr, "\n ERROR: iaea_history_read: %s is not a valid history index\n",
+             name.c_str());
+     iaea_history_free(index);
+     return (FAIL);
+  }
+
+  IAEA_I64 size, time;
+  if(phsp_file_status(base, &size, &time) != OK ||
+     size != index->file_size || time != index->file_time)
+  {
+     fprintf(stderr, "\n ERROR: iaea_history_read: %s is out of date\n", name.c_str());
+     iaea_history_free(index);
+     return (FAIL);
+  }
+  return (OK);
+}
+
+IAEA_I64 iaea_history_record(const iaea_history_index *index, IAEA_I64 k)
+{
+  if(k < 1 || k > index->n_histories + 1) return -1;
+  if(k == index->n_histories + 1) return index->n_records + 1;
+  return index->first[k - 1];
+}
+
+IAEA_I64 iaea_history_count(const iaea_history_index *index, IAEA_I64 first, IAEA_I64 last)
+{
+  if(last < first) return 0;
+  const IAEA_I64 *begin = index->first, *end = begin + index->n_histories;
+  IAEA_I64 k_first = std::lower_bound(begin, end, first) - begin;
+  IAEA_I64 k_last = std::upper_bound(begin, end, last) - begin;
+  return index->counted[k_last] - index->counted[k_first];
+}
+
+IAEA_I64 iaea_history_start(const iaea_history_index *index, IAEA_I32 id, IAEA_I64 record)
+{
+  if(record <= 1) return 1;
+  if(index != NULL)
+  {
+     const IAEA_I64 *begin = index->first, *end = begin + index->n_histories;
+     const IAEA_I64 *p = std::lower_bound(begin, end, record);
+     return (p == end) ? index->n_records + 1 : *p;
+  }
+
+  IAEA_I32 result;
+  iaea_set_record(&id, &record, &result);
+  if(result != 0) return -1;
+  index_batch_arrays b;
+  for(;;)
+  {
+     IAEA_I32 n = b.read(id, index_batch);
+     if(n <= 0) return record;
+     for(int i=0;i<n;i++)
+        if(b.n_stat[i] > 0) return record + i;
+     record += n;
+  }
+}
+
+void iaea_history_free(iaea_history_index *index)
+{
+  free(index->first);
+  index->first = index->counted = NULL;
+  index->n_histories = 0;
+}
+
+/* *********************************************************************** */
+// Clustered rewrite
+//
+// The sort key of a history is the Morton code of the projected position
+// of its first particle. Both coordinates are mapped to unsigned integers
+// of the same order (top 31 bits of the float, sign flipped), so no pass
+// over the file is needed to find their range; their bits are interleaved
+// and bit 63 is set for particles not moving forward.
+
+// Spreads the 31 lowest bits of v to the even bits
+static inline IAEA_U64 spread_bits(IAEA_U64 v)
+{
+  v &= 0x7fffffff;
+  v = (v | (v << 16)) & 0x0000ffff0000ffffULL;
+  v = (v | (v << 8))  & 0x00ff00ff00ff00ffULL;
+  v = (v | (v << 4))  & 0x0f0f0f0f0f0f0f0fULL;
+  v = (v | (v << 2))  & 0x3333333333333333ULL;
+  v = (v | (v << 1))  & 0x5555555555555555ULL;
+  return v;
+}
+
+// Top 31 bits of an unsigned integer ordered as the float f
+static inline IAEA_U64 ordered_bits(float f)
+{
+  unsigned int b;
+  memcpy(&b, &f, sizeof(b));
+  b = (b & 0x80000000u) ? ~b : (b | 0x80000000u);
+  return b >> 1;
+}
+
+static IAEA_U64 cluster_key(float x, float y, float z, float u, float v, float w,
+                            float z_plane)
+{
+  IAEA_U64 backward = 0;
+  if(w > 0)
+  {
+     if(z < z_plane)
+     {
+        float t = (z_plane - z) / w;
+        x = x + u * t;
+        y = y + v * t;
+     }
+  }
+  else backward = (IAEA_U64)1 << 63;
+  return backward | (spread_bits(ordered_bits(x)) << 1) | spread_bits(ordered_bits(y));
+}
+
+// Keys of the n particles of a batch: the key of the history they belong
+// to. *key is the key of the history continued from the previous batch,
+// *started is 0 before the first particle.
+static void history_keys(const index_batch_arrays *b, int n, float z_plane,
+                         IAEA_U64 *key, int *started, IAEA_U64 *keys)
+{
+  for(int i=0;i<n;i++)
+  {
+     if(b->n_stat[i] > 0 || !*started)
+     {
+        *key = cluster_key((float)b->x[i], (float)b->y[i], (float)b->z[i],
+                           (float)b->u[i], (float)b->v[i], (float)b->w[i], z_plane);
+        *started = 1;
+     }
+     keys[i] = *key;
+  }
+}
+
+static IAEA_I32 open_phsp(const std::string &base, IAEA_I32 access)
+{
+  IAEA_I32 id, result;
+  std::vector<char> name(base.begin(), base.end());
+  name.push_back('\0');
+  iaea_new_source(&id, &name[0], &access, &result, (int)base.size());
+  if(result < 0) return -1;
+  if(access == 1 || access == 4)
+  {
+     IAEA_I32 no_statistics = 0;
+     iaea_set_read_statistics(&id, &no_statistics, &result);
+  }
+  return id;
+}
+
+// New phsp file base with the header of source id, its records stored in
+// the same way
+static IAEA_I32 create_phsp(const std::string &base, IAEA_I32 id)
+{
+  IAEA_I32 dest = open_phsp(base, 2);
+  if(dest < 0) return -1;
+  IAEA_I32 result, n_extra_float, n_extra_long;
+  iaea_copy_header(&id, &dest, &result);
+  if(result < 0)
+  {
+     iaea_destroy_source(&dest, &result);
+     return -1;
+  }
+  // The header copy leaves the layout of the records out
+  for(IAEA_I32 i=0;i<7;i++)
+  {
+     IAEA_Float constant;
+     iaea_get_constant_variable(&id, &i, &constant, &result);
+     if(result == 0) iaea_set_constant_variable(&dest, &i, &constant);
+  }
+  iaea_get_extra_numbers(&id, &n_extra_float, &n_extra_long);
+  iaea_set_extra_numbers(&dest, &n_extra_float, &n_extra_long);
+  IAEA_I32 extralong_types[NUM_EXTRA_LONG], extrafloat_types[NUM_EXTRA_FLOAT];
+  iaea_get_type_extra_variables(&id, &result, extralong_types, extrafloat_types);
+  for(IAEA_I32 i=0;i<n_extra_long;i++)
+     iaea_set_type_extralong_variable(&dest, &i, &extralong_types[i]);
+  for(IAEA_I32 i=0;i<n_extra_float;i++)
+     iaea_set_type_extrafloat_variable(&dest, &i, &extrafloat_types[i]);
+  return dest;
+}
+
+static int close_phsp(IAEA_I32 id, bool update)
+{
+  IAEA_I32 result = 0;
+  if(update) iaea_update_header(&id, &result);
+  IAEA_I32 closed;
+  iaea_destroy_source(&id, &closed);
+  return (result < 0 || closed < 0) ? FAIL : OK;
+}
+
+static void remove_phsp(const std::string &base)
+{
+  remove((base + ".IAEAheader").c_str());
+  remove((base + ".IAEAphsp").c_str());
+}
+
+// Reader of a sorted run during the merge
+struct cluster_run
+{
+  IAEA_I32 id;
+  index_batch_arrays b;
+  std::vector<IAEA_U64> keys;
+  int n, i;                 // particles of the batch, next one
+  IAEA_U64 key;             // key of the current history
+  int started;
+
+  cluster_run(IAEA_I32 n_max) : id(-1), b(n_max), keys(n_max), n(0), i(0), key(0), started(0) {}
+
+  void load(IAEA_I32 n_max, float z_plane)
+  {
+     n = b.read(id, n_max);
+     if(n < 0) n = 0;
+     i = 0;
+     history_keys(&b, n, z_plane, &key, &started, &keys[0]);
+  }
+};
+
+// Merges the sorted runs into dest. Of equal keys, the particles of the
+// earlier run come first, so the merge is stable.
+static int merge_runs(const std::vector<std::string> &runs, IAEA_I32 dest, float z_plane,
+                      IAEA_I32 n_max)
+{
+  std::vector<cluster_run *> reader;
+  std::vector<IAEA_I32> identity(n_max);
+  for(IAEA_I32 i=0;i<n_max;i++) identity[i] = i + 1;
+
+  typedef std::pair<IAEA_U64, int> head;
+  std::priority_queue< head, std::vector<head>, std::greater<head> > heads;
+  int result = OK;
+  for(size_t j=0;j<runs.size() && result == OK;j++)
+  {
+     cluster_run *r = new cluster_run(n_max);
+     reader.push_back(r);
+     r->id = open_phsp(runs[j], 4);
+     if(r->id < 0)
+     {
+        fprintf(stderr, "\n ERROR: iaea_cluster: Cannot open %s\n", runs[j].c_str());
+        result = FAIL;
+        break;
+     }
+     r->load(n_max, z_plane);
+     if(r->n > 0) heads.push(head(r->keys[0], (int)j));
+  }
+
+  while(result == OK && !heads.empty())
+  {
+     head h = heads.top();
+     heads.pop();
+     cluster_run *r = reader[h.second];
+
+     // The particles of this run up to the head of the next run
+     int first = r->i;
+     if(heads.empty()) r->i = r->n;
+     else
+     {
+        head next = heads.top();
+        while(r->i < r->n && head(r->keys[r->i], h.second) < next) r->i++;
+     }
+     IAEA_I32 n = r->i - first, n_written;
+     iaea_copy_particles_ordered(&r->id, &dest, &n, &identity[first], &r->b.n_stat[0],
+                                 &r->b.type[0], &r->b.E[0], &r->b.wt[0],
+                                 &r->b.x[0], &r->b.y[0], &r->b.z[0], &n_written);
+     if(n_written != n)
+     {
+        fprintf(stderr, "\n ERROR: iaea_cluster: Failed to write the merged particles\n");
+        result = FAIL;
+        break;
+     }
+
+     if(r->i == r->n) r->load(n_max, z_plane);
+     if(r->i < r->n) heads.push(head(r->keys[r->i], h.second));
+  }
+
+  for(size_t j=0;j<reader.size();j++)
+  {
+     if(reader[j]->id >= 0) close_phsp(reader[j]->id, false);
+     delete reader[j];
+  }
+  return result;
+}
+
+int iaea_cluster(const char *in, const char *out, float z_plane, IAEA_I64 memory)
+{
+  IAEA_I64 file_size, file_time;
+  if(phsp_file_status(in, &file_size, &file_time) != OK)
+  {
+     fprintf(stderr, "\n ERROR: iaea_cluster: Cannot access %s.IAEAphsp\n", in);
+     return (FAIL);
+  }
+  IAEA_I32 src = open_phsp(in, 4);
+  if(src < 0)
+  {
+     fprintf(stderr, "\n ERROR: iaea_cluster: Cannot open %s\n", in);
+     return (FAIL);
+  }
+  IAEA_I32 any_type = -1, result;
+  IAEA_I64 n_records, orig_histories;
+  iaea_get_max_particles(&src, &any_type, &n_records);
+  iaea_get_total_original_particles(&src, &orig_histories);
+
+  // Particles of a run: the decoded particles, their record (if it is
+  // assembled in memory), key and place in the sorted order
+  IAEA_I64 record_length = (n_records > 0) ? file_size/n_records : 0;
+  IAEA_I64 particle_size = record_length + 8*sizeof(IAEA_Float) + 2*sizeof(IAEA_I32) +
+     NUM_EXTRA_FLOAT*sizeof(IAEA_Float) + NUM_EXTRA_LONG*sizeof(IAEA_I32) +
+     2*sizeof(IAEA_U64) + sizeof(IAEA_I32);
+  IAEA_I64 run_size = memory/particle_size;
+  if(run_size < 1024) run_size = 1024;
+  if(run_size > ((IAEA_I64)1 << 28)) run_size = (IAEA_I64)1 << 28;
+  if(run_size > n_records && n_records > 0) run_size = n_records;
+
+  // Pass 1: sorted runs of whole histories
+  std::vector<std::string> runs;
+  int status = OK;
+  {
+     index_batch_arrays b((IAEA_I32)run_size);
+     std::vector<IAEA_U64> keys((size_t)run_size);
+     std::vector< std::pair<IAEA_U64, IAEA_I32> > sorted((size_t)run_size);
+     std::vector<IAEA_I32> order((size_t)run_size);
+
+     IAEA_I64 next = 1, capacity = run_size; // records a run can hold
+     while(next <= n_records && status == OK)
+     {
+        iaea_set_record(&src, &next, &result);
+        IAEA_I32 n_want = (IAEA_I32)((n_records - next + 1 < capacity) ? n_records - next + 1
+                                                                       : capacity);
+        IAEA_I32 n = (result == 0) ? b.read(src, n_want) : -1;
+        if(n < n_want)
+        {
+           fprintf(stderr, "\n ERROR: iaea_cluster: Failed to read %s\n", in);
+           status = FAIL;
+           break;
+        }
+        // The run ends before the last history started in it, unless the
+        // file ends with it. A history that does not end in the run is read
+        // again in a longer one, so that it is not split.
+        if(next + n - 1 < n_records)
+        {
+           IAEA_I32 h = n - 1;
+           while(h > 0 && b.n_stat[h] <= 0) h--;
+           if(h == 0)
+           {
+              if(capacity >= ((IAEA_I64)1 << 30))
+              {
+                 fprintf(stderr, "\n ERROR: iaea_cluster: History of more than %lld records"
+                                 " at record %lld\n", (long long)capacity, (long long)next);
+                 status = FAIL;
+                 break;
+              }
+              capacity *= 2;
+              b = index_batch_arrays((IAEA_I32)capacity);
+              keys.resize((size_t)capacity);
+              sorted.resize((size_t)capacity);
+              order.resize((size_t)capacity);
+              continue;
+           }
+           n = h;
+        }
+
+        IAEA_U64 key = 0;
+        int started = 0;
+        history_keys(&b, n, z_plane, &key, &started, &keys[0]);
+        for(IAEA_I32 i=0;i<n;i++) sorted[i] = std::make_pair(keys[i], i);
+        std::sort(sorted.begin(), sorted.begin() + n);
+        for(IAEA_I32 i=0;i<n;i++) order[i] = sorted[i].second + 1;
+
+        std::string name = std::string(out) + "_run" + std::to_string(runs.size() + 1);
+        IAEA_I32 run = create_phsp(name, src);
+        IAEA_I32 n_written = -1;
+        if(run >= 0)
+        {
+           runs.push_back(name);
+           iaea_copy_particles_ordered(&src, &run, &n, &order[0], &b.n_stat[0], &b.type[0],
+                                       &b.E[0], &b.wt[0], &b.x[0], &b.y[0], &b.z[0],
+                                       &n_written);
+           if(close_phsp(run, true) != OK) n_written = -1;
+        }
+        if(n_written != n)
+        {
+           fprintf(stderr, "\n ERROR: iaea_cluster: Failed to write %s\n", name.c_str());
+           status = FAIL;
+        }
+        next += n;
+     }
+  }
+
+  // Pass 2: merge, IAEA_CLUSTER_FAN_IN runs at a time. Consecutive runs
+  // are merged, which keeps the merge stable.
+  IAEA_I32 n_max = (IAEA_I32)(run_size/IAEA_CLUSTER_FAN_IN);
+  if(n_max < 256) n_max = 256;
+  if(n_max > index_batch) n_max = index_batch;
+  int level = 0;
+  while(status == OK && runs.size() > IAEA_CLUSTER_FAN_IN)
+  {
+     level++;
+     std::vector<std::string> merged;
+     for(size_t j=0;j<runs.size() && status == OK;j+=IAEA_CLUSTER_FAN_IN)
+     {
+        std::vector<std::string> group(runs.begin() + j,
+           runs.begin() + min(j + IAEA_CLUSTER_FAN_IN, runs.size()));
+        std::string name = std::string(out) + "_run" + std::to_string(level) + "_" +
+                           std::to_string(merged.size() + 1);
+        IAEA_I32 dest = create_phsp(name, src);
+        if(dest < 0)
+        {
+           fprintf(stderr, "\n ERROR: iaea_cluster: Cannot create %s\n", name.c_str());
+           status = FAIL;
+           break;
+        }
+        merged.push_back(name);
+        status = merge_runs(group, dest, z_plane, n_max);
+        if(close_phsp(dest, true) != OK) status = FAIL;
+        for(size_t k=0;k<group.size();k++) remove_phsp(group[k]);
+     }
+     if(status != OK)
+        for(size_t k=0;k<runs.size();k++) remove_phsp(runs[k]);
+     runs = merged;
+  }
+
+  if(status == OK)
+  {
+     IAEA_I32 dest = create_phsp(out, src);
+     if(dest < 0)
+     {
+        fprintf(stderr, "\n ERROR: iaea_cluster: Cannot create %s\n", out);
+        status = FAIL;
+     }
+     else
+     {
+        status = merge_runs(runs, dest, z_plane, n_max);
+        iaea_set_total_original_particles(&dest, &orig_histories);
+        if(close_phsp(dest, true) != OK) status = FAIL;
+     }
+  }
+  for(size_t k=0;k<runs.size();k++) remove_phsp(runs[k]);
+  close_phsp(src, false);
+  return status;
+}
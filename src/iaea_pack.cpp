@@ -0,0 +1,423 @@
+/*
+ * Lossless compression of blocks of raw records (see iaea_pack.h).
+ *
+ * The data of a block are its byte planes one after the other: the plane
+ * of the type bytes, then for every 4-byte word of the records the
+ * predictor of its column (one byte) and the planes of bytes 0 to 3 of
+ * the predicted words. A word is read as a little endian integer, so its
+ * byte planes follow the bytes as they are stored, whatever the byte
+ * order of the file. A plane starts with its method:
+ *   0  the n bytes as they are
+ *   1  a single byte repeated n times
+ *   2  the code length of every byte value (256 4-bit lengths, 0 for the
+ *      values not in the plane), the size of the code in bytes (4 bytes,
+ *      little endian) and the code, a canonical Huffman code of at most
+ *      pack_max_length bits per byte written from the most significant
+ *      bit on
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <queue>
+#include <functional>
+
+#include "iaea_pack.h"
+
+// Methods of a byte plane
+#define PLANE_RAW      0
+#define PLANE_CONSTANT 1
+#define PLANE_HUFFMAN  2
+
+// Predictors of a word column
+#define PREDICT_NONE  0
+#define PREDICT_XOR   1 // XOR with the word of the previous record
+#define PREDICT_DELTA 2 // difference to the word of the previous record
+
+// Longest Huffman code, the codes are decoded with a table of
+// 2^pack_max_length entries
+static const int pack_max_length = 12;
+
+// Size of the code lengths of a Huffman coded plane
+static const int pack_length_bytes = 128;
+
+/* *********************************************************************** */
+// Little endian integers
+
+void iaea_pack_put32(unsigned char *p, IAEA_I64 value)
+{
+  for(int k=0;k<4;k++) p[k] = (unsigned char)(value >> (8*k));
+}
+
+void iaea_pack_put64(unsigned char *p, IAEA_I64 value)
+{
+  for(int k=0;k<8;k++) p[k] = (unsigned char)((unsigned long long)value >> (8*k));
+}
+
+IAEA_I64 iaea_pack_get32(const unsigned char *p)
+{
+  IAEA_I64 value = 0;
+  for(int k=0;k<4;k++) value |= (IAEA_I64)p[k] << (8*k);
+  return value;
+}
+
+IAEA_I64 iaea_pack_get64(const unsigned char *p)
+{
+  unsigned long long value = 0;
+  for(int k=0;k<8;k++) value |= (unsigned long long)p[k] << (8*k);
+  return (IAEA_I64)value;
+}
+
+static inline unsigned int load_word(const unsigned char *p)
+{
+  return (unsigned int)p[0] | ((unsigned int)p[1] << 8) |
+         ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static inline void store_word(unsigned char *p, unsigned int w)
+{
+  p[0] = (unsigned char)w;
+  p[1] = (unsigned char)(w >> 8);
+  p[2] = (unsigned char)(w >> 16);
+  p[3] = (unsigned char)(w >> 24);
+}
+
+/* *********************************************************************** */
+// Huffman codes
+
+// Code lengths of the byte values of count (0 for values that do not
+// occur), at most pack_max_length bits. If the optimal code is longer
+// the counts are halved until it is not.
+static void code_lengths(const IAEA_I64 *count, int *length)
+{
+  IAEA_I64 weight[256];
+  for(int s=0;s<256;s++) weight[s] = count[s];
+
+  for(;;)
+  {
+     // Nodes 0..255 are the byte values, the others are merged pairs
+     int parent[511];
+     typedef std::pair<IAEA_I64, int> node;
+     std::priority_queue<node, std::vector<node>, std::greater<node> > heap;
+     for(int s=0;s<256;s++)
+        if(weight[s] > 0) heap.push(node(weight[s], s));
+     int next = 256;
+     while(heap.size() > 1)
+     {
+        node a = heap.top(); heap.pop();
+        node b = heap.top(); heap.pop();
+        parent[a.second] = parent[b.second] = next;
+        heap.push(node(a.first + b.first, next++));
+     }
+     int root = next - 1;
+
+     int longest = 0;
+     for(int s=0;s<256;s++)
+     {
+        length[s] = 0;
+        if(weight[s] == 0) continue;
+        int depth = 0;
+        for(int k=s;k!=root;k=parent[k]) depth++;
+        length[s] = (depth > 0) ? depth : 1;
+        if(length[s] > longest) longest = length[s];
+     }
+     if(longest <= pack_max_length) return;
+
+     for(int s=0;s<256;s++)
+        if(weight[s] > 0) weight[s] = (weight[s] >> 1) | 1;
+  }
+}
+
+// Canonical codes of the lengths: shorter codes first, equal lengths in
+// the order of the byte values
+static void canonical_codes(const int *length, unsigned int *code)
+{
+  int n_length[pack_max_length + 1] = { 0 };
+  for(int s=0;s<256;s++) n_length[length[s]]++;
+  n_length[0] = 0;
+
+  unsigned int next[pack_max_length + 1];
+  unsigned int c = 0;
+  for(int l=1;l<=pack_max_length;l++)
+  {
+     c = (c + n_length[l-1]) << 1;
+     next[l] = c;
+  }
+  for(int s=0;s<256;s++)
+     if(length[s] > 0) code[s] = next[length[s]]++;
+}
+
+/* *********************************************************************** */
+// Byte planes
+
+// Bits the plane takes with the code of its byte frequencies (order-0
+// entropy), used to choose the predictor of a column
+static double plane_entropy(const IAEA_I64 *count, int n)
+{
+  double bits = 0;
+  for(int s=0;s<256;s++)
+     if(count[s] > 0) bits += (double)count[s]*log2((double)n/(double)count[s]);
+  return bits;
+}
+
+// Stores the n bytes of plane at out, returns the bytes written (at most
+// n + 1)
+static IAEA_I64 put_plane(const unsigned char *plane, int n, unsigned char *out)
+{
+  IAEA_I64 count[256] = { 0 };
+  for(int i=0;i<n;i++) count[plane[i]]++;
+
+  int n_values = 0;
+  for(int s=0;s<256;s++) if(count[s] > 0) n_values++;
+  if(n_values == 1)
+  {
+     out[0] = PLANE_CONSTANT;
+     out[1] = plane[0];
+     return 2;
+  }
+
+  int length[256];
+  IAEA_I64 bits = 0;
+  if(n_values > 1)
+  {
+     code_lengths(count, length);
+     for(int s=0;s<256;s++) bits += count[s]*length[s];
+  }
+  IAEA_I64 code_size = (bits + 7)/8;
+  if(n_values <= 1 || 1 + pack_length_bytes + 4 + code_size >= 1 + (IAEA_I64)n)
+  {
+     out[0] = PLANE_RAW;
+     memcpy(out + 1, plane, (size_t)n);
+     return 1 + (IAEA_I64)n;
+  }
+
+  unsigned int code[256];
+  canonical_codes(length, code);
+
+  unsigned char *p = out;
+  *p++ = PLANE_HUFFMAN;
+  for(int s=0;s<256;s+=2) *p++ = (unsigned char)(length[s] | (length[s+1] << 4));
+  iaea_pack_put32(p, code_size);
+  p += 4;
+
+  unsigned long long acc = 0;
+  int n_bits = 0;
+  for(int i=0;i<n;i++)
+  {
+     int s = plane[i];
+     acc = (acc << length[s]) | code[s];
+     n_bits += length[s];
+     while(n_bits >= 8)
+     {
+        n_bits -= 8;
+        *p++ = (unsigned char)(acc >> n_bits);
+     }
+  }
+  if(n_bits > 0) *p++ = (unsigned char)(acc << (8 - n_bits));
+
+  return (IAEA_I64)(p - out);
+}
+
+// Reads a plane of n bytes from the size bytes at data into plane and
+// returns the bytes used, or -1 if the data are not valid
+static IAEA_I64 get_plane(const unsigned char *data, IAEA_I64 size, int n,
+                          unsigned char *plane)
+{
+  if(size < 1) return -1;
+  switch(data[0])
+  {
+  case PLANE_RAW:
+     if(size < 1 + (IAEA_I64)n) return -1;
+     memcpy(plane, data + 1, (size_t)n);
+     return 1 + (IAEA_I64)n;
+
+  case PLANE_CONSTANT:
+     if(size < 2) return -1;
+     memset(plane, data[1], (size_t)n);
+     return 2;
+
+  case PLANE_HUFFMAN:
+     break;
+
+  default:
+     return -1;
+  }
+
+  if(size < 1 + pack_length_bytes + 4) return -1;
+  int length[256];
+  for(int s=0;s<256;s+=2)
+  {
+     length[s]   = data[1 + s/2] & 0x0F;
+     length[s+1] = data[1 + s/2] >> 4;
+  }
+  IAEA_I64 code_size = iaea_pack_get32(data + 1 + pack_length_bytes);
+  const unsigned char *code = data + 1 + pack_length_bytes + 4;
+  if(code_size > size - (1 + pack_length_bytes + 4)) return -1;
+
+  // Decoding table: entry k is the byte value and length of the code the
+  // pack_max_length bits k start with (length 0 if none does)
+  unsigned short table[1 << pack_max_length];
+  memset(table, 0, sizeof(table));
+  unsigned int codes[256];
+  IAEA_I64 kraft = 0;
+  for(int s=0;s<256;s++)
+  {
+     if(length[s] > pack_max_length) return -1;
+     if(length[s] > 0) kraft += (IAEA_I64)1 << (pack_max_length - length[s]);
+  }
+  if(kraft == 0 || kraft > ((IAEA_I64)1 << pack_max_length)) return -1;
+  canonical_codes(length, codes);
+  for(int s=0;s<256;s++)
+  {
+     if(length[s] == 0) continue;
+     int shift = pack_max_length - length[s];
+     for(unsigned int k=codes[s]<<shift;k<((codes[s]+1)<<shift);k++)
+        table[k] = (unsigned short)(s | (length[s] << 8));
+  }
+
+  unsigned long long buffer = 0; // next bits, from the most significant one on
+  int n_bits = 0;
+  IAEA_I64 position = 0, used = 0;
+  for(int i=0;i<n;i++)
+  {
+     while(n_bits <= 56)
+     {
+        unsigned long long byte = (position < code_size) ? code[position] : 0;
+        buffer |= byte << (56 - n_bits);
+        position++;
+        n_bits += 8;
+     }
+     unsigned int entry = table[buffer >> (64 - pack_max_length)];
+     int l = entry >> 8;
+     if(l == 0) return -1;
+     plane[i] = (unsigned char)entry;
+     buffer <<= l;
+     n_bits -= l;
+     used += l;
+  }
+  if(used > code_size*8) return -1;
+
+  return 1 + pack_length_bytes + 4 + code_size;
+}
+
+/* *********************************************************************** */
+// Blocks
+
+static inline unsigned int predict(unsigned int w, unsigned int previous, int predictor)
+{
+  if(predictor == PREDICT_XOR) return w ^ previous;
+  if(predictor == PREDICT_DELTA) return w - previous;
+  return w;
+}
+
+static inline unsigned int unpredict(unsigned int r, unsigned int previous, int predictor)
+{
+  if(predictor == PREDICT_XOR) return r ^ previous;
+  if(predictor == PREDICT_DELTA) return r + previous;
+  return r;
+}
+
+IAEA_I64 iaea_pack_bound(int n, int reclength)
+{
+  IAEA_I64 n_words = (reclength - 1)/4;
+  return (1 + 4*n_words)*(1 + (IAEA_I64)n) + n_words;
+}
+
+IAEA_I64 iaea_pack_records(const unsigned char *records, int n, int reclength,
+                           unsigned char *out)
+{
+  int n_words = (reclength - 1)/4;
+  std::vector<unsigned char> plane(n > 0 ? n : 1);
+  std::vector<unsigned int> word(n > 0 ? n : 1), residual(n > 0 ? n : 1);
+  unsigned char *p = out;
+
+  for(int i=0;i<n;i++) plane[i] = records[(IAEA_I64)i*reclength];
+  p += put_plane(&plane[0], n, p);
+
+  for(int j=0;j<n_words;j++)
+  {
+     const unsigned char *column = records + 1 + 4*j;
+     for(int i=0;i<n;i++) word[i] = load_word(column + (IAEA_I64)i*reclength);
+
+     // Predictor leaving the fewest bits in the byte planes
+     int best = PREDICT_NONE;
+     double best_bits = 0;
+     for(int predictor=PREDICT_NONE;predictor<=PREDICT_DELTA;predictor++)
+     {
+        IAEA_I64 count[4][256];
+        memset(count, 0, sizeof(count));
+        unsigned int previous = 0;
+        for(int i=0;i<n;i++)
+        {
+           unsigned int r = predict(word[i], previous, predictor);
+           previous = word[i];
+           count[0][r & 0xFF]++;
+           count[1][(r >> 8) & 0xFF]++;
+           count[2][(r >> 16) & 0xFF]++;
+           count[3][r >> 24]++;
+        }
+        double bits = 0;
+        for(int b=0;b<4;b++) bits += plane_entropy(count[b], n);
+        if(predictor == PREDICT_NONE || bits < best_bits)
+        {
+           best = predictor;
+           best_bits = bits;
+        }
+     }
+
+     unsigned int previous = 0;
+     for(int i=0;i<n;i++)
+     {
+        residual[i] = predict(word[i], previous, best);
+        previous = word[i];
+     }
+     *p++ = (unsigned char)best;
+     for(int b=0;b<4;b++)
+     {
+        for(int i=0;i<n;i++) plane[i] = (unsigned char)(residual[i] >> (8*b));
+        p += put_plane(&plane[0], n, p);
+     }
+  }
+  return (IAEA_I64)(p - out);
+}
+
+int iaea_unpack_records(const unsigned char *data, IAEA_I64 size, int n, int reclength,
+                        unsigned char *records)
+{
+  int n_words = (reclength - 1)/4;
+  if(n < 0 || reclength < 1 || (reclength - 1) % 4 != 0) return (FAIL);
+  std::vector<unsigned char> plane(n > 0 ? n : 1);
+  std::vector<unsigned int> residual(n > 0 ? n : 1);
+  IAEA_I64 used;
+
+  if( (used = get_plane(data, size, n, &plane[0])) < 0 ) return (FAIL);
+  data += used;
+  size -= used;
+  for(int i=0;i<n;i++) records[(IAEA_I64)i*reclength] = plane[i];
+
+  for(int j=0;j<n_words;j++)
+  {
+     if(size < 1 || data[0] > PREDICT_DELTA) return (FAIL);
+     int predictor = data[0];
+     data++;
+     size--;
+     for(int i=0;i<n;i++) residual[i] = 0;
+     for(int b=0;b<4;b++)
+     {
+        if( (used = get_plane(data, size, n, &plane[0])) < 0 ) return (FAIL);
+        data += used;
+        size -= used;
+        for(int i=0;i<n;i++) residual[i] |= (unsigned int)plane[i] << (8*b);
+     }
+
+     unsigned char *column = records + 1 + 4*j;
+     unsigned int previous = 0;
+     for(int i=0;i<n;i++)
+     {
+        previous = unpredict(residual[i], previous, predictor);
+        store_word(column + (IAEA_I64)i*reclength, previous);
+     }
+  }
+  return (size == 0) ? OK : FAIL;
+}
@@ -53,6 +53,9 @@
 #include <cstring>
 #include <cmath>
 #include <cctype>
+#include <new>
+#include <atomic>
+#include <mutex>
 
 #include<sys/types.h>
 #include<sys/stat.h>
@@ -65,16 +68,110 @@ using namespace std;
 #include "iaea_record.h"
 #include "iaea_header.h"
 #include "iaea_phsp.h"
+#include "iaea_pack.h"
+#include "iaea_quant.h"
+#include "iaea_column.h"
 
 #define false 0
 #define true  1
 
+// Number of particles moved at once by iaea_append_source
+#define APPEND_BLOCK_SIZE  4096
+#define APPEND_MASK_WORDS  ((APPEND_BLOCK_SIZE + 63) >> 6)
+
 // These variables are defined globally. They contain pointers
 // to header and record structures defined by calling iaea_new_source()
 // routine to maintain a list of already initialized IAEA sources.
+//
+// The slots are kept in chunks of SOURCE_CHUNK entries. A chunk is
+// allocated when its first Id is handed out and is never moved or freed,
+// so the state of a source can be reached without locking while other
+// threads open and close sources. A slot is taken and given back with
+// atomic operations, only adding a chunk takes a lock.
 
-static iaea_header_type *p_iaea_header[MAX_NUM_SOURCES];
-static iaea_record_type *p_iaea_record[MAX_NUM_SOURCES];
+#define SOURCE_CHUNK  64
+#define SOURCE_CHUNKS ((MAX_NUM_SOURCES + SOURCE_CHUNK - 1) / SOURCE_CHUNK)
+
+struct iaea_source_slot
+{
+  iaea_header_type *header;
+  iaea_record_type *record;
+  std::atomic<int> used;
+};
+
+static std::atomic<iaea_source_slot *> __iaea_source_chunk[SOURCE_CHUNKS];
+static std::atomic<int> __iaea_n_source(0); // Ids handed out so far
+static std::mutex __iaea_source_lock;       // serializes adding chunks
+
+// Slot of a source Id, NULL if the Id was never handed out
+static iaea_source_slot *source_slot(int id)
+{
+  if(id < 0 || id >= MAX_NUM_SOURCES) return NULL;
+  iaea_source_slot *chunk =
+     __iaea_source_chunk[id / SOURCE_CHUNK].load(std::memory_order_acquire);
+  return (chunk != NULL) ? &chunk[id % SOURCE_CHUNK] : NULL;
+}
+
+// Slot of a new source Id, the chunk is allocated if needed
+static iaea_source_slot *new_source_slot(int id)
+{
+  iaea_source_slot *slot = source_slot(id);
+  if(slot != NULL) return slot;
+
+  std::lock_guard<std::mutex> lock(__iaea_source_lock);
+  std::atomic<iaea_source_slot *> &chunk = __iaea_source_chunk[id / SOURCE_CHUNK];
+  if(chunk.load(std::memory_order_relaxed) == NULL)
+  {
+     iaea_source_slot *slots = new (std::nothrow) iaea_source_slot[SOURCE_CHUNK]();
+     if(slots == NULL) return NULL;
+     chunk.store(slots, std::memory_order_release);
+  }
+  return source_slot(id);
+}
+
+// Marks a slot as used, fails if another thread was faster
+static bool claim_source_slot(iaea_source_slot *slot)
+{
+  int free_slot = false;
+  return slot->used.compare_exchange_strong(free_slot, true);
+}
+
+// p_iaea_header[id] and p_iaea_record[id] give the pointers stored in the
+// slot of a source. For an Id that was never handed out they are NULL.
+template <class T, T *iaea_source_slot::*member>
+struct iaea_source_table
+{
+  T *&operator[](int id)
+  {
+     static thread_local T *none;
+     iaea_source_slot *slot = source_slot(id);
+     if(slot == NULL) { none = NULL; return none; }
+     return slot->*member;
+  }
+};
+
+static iaea_source_table<iaea_header_type, &iaea_source_slot::header> p_iaea_header;
+static iaea_source_table<iaea_record_type, &iaea_source_slot::record> p_iaea_record;
+
+// CHECKSUM and QUANTIZATION_ERRORS of the header of a source of quantized
+// records: the size of its records and their largest errors
+static void stored_quantization(int id)
+{
+  iaea_quantization *q = p_iaea_record[id]->p_quant;
+  if(q == NULL) return;
+
+  p_iaea_header[id]->checksum =
+        (IAEA_I64)p_iaea_record[id]->stored_size()*p_iaea_header[id]->nParticles;
+  for(int i=0;i<3;i++) p_iaea_header[id]->quant_error[i] = q->error[i];
+}
+
+// 1 if records of byte order byte_order (BYTE_ORDER of a header) have to
+// be converted to be used on this machine
+static int foreign_byte_order(int byte_order)
+{
+  return ((byte_order == LITTLE_ENDIAN || byte_order == BIG_ENDIAN) &&
+          byte_order != check_byte_order());
+}
 
 /************************************************************************
 * Initialization
@@ -92,15 +189,19 @@ static iaea_record_type *p_iaea_record[MAX_NUM_SOURCES];
 * knows what went wrong). This function *must* be called before using
 * any of the following functions for a given source id.
 *
-* access = 1 => opening read-only file
-* access = 2 => opening file for writing
-* access = 3 => opening file for appending/updating
+* access = 1 => opening read-only file, the file is read ahead by a
+*               reader thread (see iaea_set_read_ahead)
+* access = 2 => opening file for writing, the particles are written by a
+*               writer thread (see iaea_set_write_behind)
+* access = 3 => opening file for appending/updating (written as access = 2)
+* access = 4 => opening read-only file, records are decoded directly
+*               from the memory mapped phsp file (falls back to access = 1
+*               where memory mapping is not available and for files of
+*               compressed records or columns, see iaea_set_compression
+*               and iaea_set_columns)
 *
 ***********************************************************************/
 
-static int __iaea_source_used[MAX_NUM_SOURCES];
-static int __iaea_n_source = 0;
-
 IAEA_EXTERN_C IAEA_EXPORT
 void iaea_new_source(IAEA_I32 *source_ID, char *header_file,
                      const IAEA_I32 *access, IAEA_I32 *result,
@@ -112,7 +213,7 @@ printf(" access = %i\n", *access);
    if( !header_file ) {
        *result = 105; *source_ID = -1; return;
    } // null header file name
-   if(*access != 1 && *access != 2 && *access != 3) {
+   if(*access < 1 || *access > 4) {
        *result = -99 ; *source_ID = -1; return;
    } // Wrong access requested
 
@@ -123,24 +224,30 @@ printf(" access = %i\n", *access);
        *result = -101 ; *source_ID = -1; return;
    } // String length < 1
 
-   if( !__iaea_n_source ) { // called for the first time
-       for(int j=0; j<MAX_NUM_SOURCES; j++) __iaea_source_used[j] = false;
-   }
    int sid=-1;
    // do we have a spare spot in the arrays ?
    // (e.g. because a source was destroyed)
-   for(int j=0; j<__iaea_n_source; j++) {
-       if( !__iaea_source_used[j] ) { sid = j; break; }
+   int n_source = __iaea_n_source.load();
+   if( n_source > MAX_NUM_SOURCES ) n_source = MAX_NUM_SOURCES;
+   for(int j=0; j<n_source; j++) {
+       iaea_source_slot *slot = source_slot(j);
+       if( slot != NULL && !slot->used && claim_source_slot(slot) ) { sid = j; break; }
    }
-   if( sid < 0 ) {
-       // so, we don't => increase source count and check if
+   while( sid < 0 ) {
+       // so, we don't => take a new Id and check if
        // space left in arrays.
-       if( ++__iaea_n_source >= MAX_NUM_SOURCES ) {
+       int j = __iaea_n_source++;
+       if( j >= MAX_NUM_SOURCES ) {
            *result = -98; *source_ID = -1; return;
        }
-       sid = __iaea_n_source-1; *source_ID = sid;
+       iaea_source_slot *slot = new_source_slot(j);
+       if( slot == NULL ) {
+           *result = -98; *source_ID = -1; return;
+       }
+       // the slot may have been reused by another thread meanwhile
+       if( claim_source_slot(slot) ) sid = j;
    }
-   __iaea_source_used[sid] = true;
+   *source_ID = sid;
 
    //int ilen = strlen(header_file);
    // the above requires a null-terminated string, which may not be
@@ -155,7 +262,7 @@ printf(" access = %i\n", *access);
    // Creating IAEA phsp header and allocating memory for it
    p_iaea_header[*source_ID] = (iaea_header_type *) calloc(1, sizeof(iaea_header_type));
    // Opening header file
-   if(*access == 1) p_iaea_header[*source_ID]->fheader =
+   if(*access == 1 || *access == 4) p_iaea_header[*source_ID]->fheader =
          open_file(header_file,".IAEAheader","rb");
    if(*access == 2) p_iaea_header[*source_ID]->fheader =
          open_file(header_file,".IAEAheader","wb");
@@ -173,7 +280,8 @@ printf(" access = %i\n", *access);
    {
          case 2: // writing a new phsp
 
-             strcpy(p_iaea_header[*source_ID]->title,"PHASESPACE in IAEA format");
+             p_iaea_header[*source_ID]->set_text(&p_iaea_header[*source_ID]->title,
+                                                 "PHASESPACE in IAEA format");
              // Default IAEA index
              *result = p_iaea_header[*source_ID]->iaea_index = 1000;
 
@@ -189,6 +297,11 @@ printf(" access = %i\n", *access);
              if( p_iaea_header[*source_ID]->set_record_contents(p_iaea_record[*source_ID])
                  == FAIL ) { *result = -95; return;}
 
+             // Written in the byte order of the machine (see iaea_set_byte_order)
+             p_iaea_header[*source_ID]->byte_order = check_byte_order();
+
+             p_iaea_record[*source_ID]->set_write_behind(IAEA_WRITE_BEHIND_SIZE,
+                                                         IAEA_WRITE_BEHIND_BUFFERS);
              return;
 
          case 3 : // appending to the existing phsp
@@ -214,11 +327,25 @@ printf(" access = %i\n", *access);
              if( p_iaea_header[*source_ID]->get_record_contents(p_iaea_record[*source_ID])
                  == FAIL) { *result = -91; return;}
 
+             // New records are written in the byte order of the file
+             p_iaea_record[*source_ID]->swap_bytes =
+                 foreign_byte_order(p_iaea_header[*source_ID]->byte_order);
+
+             // Compressed records and columns are added to the last block
+             if((p_iaea_header[*source_ID]->file_type == 2 ||
+                 p_iaea_header[*source_ID]->file_type == 4) &&
+                p_iaea_record[*source_ID]->open_packed(1,
+                    p_iaea_header[*source_ID]->file_type == 4) != OK) { *result = -94; return;}
+
+             p_iaea_record[*source_ID]->set_write_behind(IAEA_WRITE_BEHIND_SIZE,
+                                                         IAEA_WRITE_BEHIND_BUFFERS);
+
              *result = p_iaea_header[*source_ID]->iaea_index; // returning IAEA index
 
              break;
 
          case 1 : // reading existing phsp
+         case 4 : // reading existing phsp through a memory map
 
              if( p_iaea_header[*source_ID]->read_header() != OK) { *result = -93; return;}
 
@@ -235,6 +362,26 @@ printf(" access = %i\n", *access);
              if( p_iaea_header[*source_ID]->get_record_contents(p_iaea_record[*source_ID])
                  == FAIL) { *result = -91; return;}
 
+             // Records in the other byte order are converted as they are read
+             p_iaea_record[*source_ID]->swap_bytes =
+                 foreign_byte_order(p_iaea_header[*source_ID]->byte_order);
+
+             // Compressed records and columns are decoded block by block,
+             // they are read ahead instead of mapped
+             if((p_iaea_header[*source_ID]->file_type == 2 ||
+                 p_iaea_header[*source_ID]->file_type == 4) &&
+                p_iaea_record[*source_ID]->open_packed(0,
+                    p_iaea_header[*source_ID]->file_type == 4) != OK) { *result = -94; return;}
+
+             if(*access == 4 && !p_iaea_record[*source_ID]->use_packed &&
+                p_iaea_record[*source_ID]->map_file() != OK)
+                 printf("\n WARNING: phsp file can not be mapped, reading through stdio\n");
+
+             // Reading through stdio, the file is read ahead of the decoding
+             if(!p_iaea_record[*source_ID]->use_map)
+                 p_iaea_record[*source_ID]->set_read_ahead(IAEA_READ_AHEAD_SIZE,
+                                                           IAEA_READ_AHEAD_BUFFERS);
+
              *result = p_iaea_header[*source_ID]->iaea_index; // returning IAEA index
 
              break;
@@ -925,6 +1072,501 @@ void IAEA_SET_TOTAL_ORIGINAL_PARTICLES__(const IAEA_I32 *id,
                                                 IAEA_I64 *number_of_original_particles)
 { iaea_set_total_original_particles(id, number_of_original_particles); }
 
+/*****************************************************************************
+* Switch the counters of the particles read from the Source with Id id
+* on (read_statistics = 1, the default) or off (read_statistics = 0).
+*
+* The counters give the statistics printed for a source and the number
+* of independent histories read so far (iaea_get_used_original_particles).
+* When they are not needed, switching them off saves the work done for
+* every particle read. Particles written are always counted, the header
+* of the output is made from them.
+*
+* Set result to negative if such source does not exist.
+******************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_read_statistics(const IAEA_I32 *id, const IAEA_I32 *read_statistics,
+                              IAEA_I32 *result)
+{
+      // No header found
+      if(p_iaea_header[*id]->fheader == NULL) {*result = -1; return;}
+
+      p_iaea_header[*id]->skip_read_counters = (*read_statistics == 0);
+      *result = 0;
+      return;
+}
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_read_statistics_(const IAEA_I32 *id, const IAEA_I32 *read_statistics,
+                               IAEA_I32 *result)
+{ iaea_set_read_statistics(id, read_statistics, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_read_statistics__(const IAEA_I32 *id, const IAEA_I32 *read_statistics,
+                                IAEA_I32 *result)
+{ iaea_set_read_statistics(id, read_statistics, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_READ_STATISTICS(const IAEA_I32 *id, const IAEA_I32 *read_statistics,
+                              IAEA_I32 *result)
+{ iaea_set_read_statistics(id, read_statistics, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_READ_STATISTICS_(const IAEA_I32 *id, const IAEA_I32 *read_statistics,
+                               IAEA_I32 *result)
+{ iaea_set_read_statistics(id, read_statistics, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_READ_STATISTICS__(const IAEA_I32 *id, const IAEA_I32 *read_statistics,
+                                IAEA_I32 *result)
+{ iaea_set_read_statistics(id, read_statistics, result); }
+
+/*****************************************************************************
+* Read the phsp file of the Source with Id id ahead of the particles
+* returned, through n_buffers buffers of buffer_size bytes each.
+*
+* A reader thread fills the buffers while the particles of the previous
+* one are decoded, so iaea_get_particle and iaea_get_particles_batch do
+* not wait for the disk. Sources opened with access = 1 are read ahead by
+* default (IAEA_READ_AHEAD_BUFFERS buffers of IAEA_READ_AHEAD_SIZE bytes),
+* buffer_size = 0 switches to plain stdio reading. n_buffers is between
+* 2 and IAEA_READ_AHEAD_MAX_BUFFERS.
+*
+* Set result to negative if such source does not exist (-1), is not read
+* through stdio (-2, e.g. memory mapped or opened for writing) or the
+* read-ahead can not be set up (-3, also while columns are left out, see
+* iaea_set_read_columns).
+******************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_read_ahead(const IAEA_I32 *id, const IAEA_I64 *buffer_size,
+                         const IAEA_I32 *n_buffers, IAEA_I32 *result)
+{
+      // No header found
+      if(p_iaea_header[*id]->fheader == NULL) {*result = -1; return;}
+
+      iaea_record_type *p = p_iaea_record[*id];
+      if(p->p_ahead == NULL || p->use_map) {*result = -2; return;}
+
+      if(p->set_read_ahead(*buffer_size, *n_buffers) != OK) {*result = -3; return;}
+      *result = 0;
+      return;
+}
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_read_ahead_(const IAEA_I32 *id, const IAEA_I64 *buffer_size,
+                          const IAEA_I32 *n_buffers, IAEA_I32 *result)
+{ iaea_set_read_ahead(id, buffer_size, n_buffers, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_read_ahead__(const IAEA_I32 *id, const IAEA_I64 *buffer_size,
+                           const IAEA_I32 *n_buffers, IAEA_I32 *result)
+{ iaea_set_read_ahead(id, buffer_size, n_buffers, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_READ_AHEAD(const IAEA_I32 *id, const IAEA_I64 *buffer_size,
+                         const IAEA_I32 *n_buffers, IAEA_I32 *result)
+{ iaea_set_read_ahead(id, buffer_size, n_buffers, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_READ_AHEAD_(const IAEA_I32 *id, const IAEA_I64 *buffer_size,
+                          const IAEA_I32 *n_buffers, IAEA_I32 *result)
+{ iaea_set_read_ahead(id, buffer_size, n_buffers, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_READ_AHEAD__(const IAEA_I32 *id, const IAEA_I64 *buffer_size,
+                           const IAEA_I32 *n_buffers, IAEA_I32 *result)
+{ iaea_set_read_ahead(id, buffer_size, n_buffers, result); }
+
+/*****************************************************************************
+* Write the particles of the Source with Id id through n_buffers buffers
+* of buffer_size bytes each.
+*
+* The records are encoded into a buffer and a writer thread writes the
+* filled buffers with single large writes while the next one is filled,
+* so encoding and writing overlap. Sources opened with access = 2 or 3 are
+* written behind by default (IAEA_WRITE_BEHIND_BUFFERS buffers of
+* IAEA_WRITE_BEHIND_SIZE bytes), buffer_size = 0 switches to plain stdio
+* writing. n_buffers is between 2 and IAEA_WRITE_BEHIND_MAX_BUFFERS.
+* A failed write is reported by a later write, by iaea_update_header or
+* when the source is destroyed; iaea_update_header writes all particles
+* before the header.
+*
+* Set result to negative if such source does not exist (-1), is not open
+* for writing (-2) or the particles written so far could not be written
+* (-3).
+******************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_write_behind(const IAEA_I32 *id, const IAEA_I64 *buffer_size,
+                           const IAEA_I32 *n_buffers, IAEA_I32 *result)
+{
+      // No header found
+      if(p_iaea_header[*id]->fheader == NULL) {*result = -1; return;}
+
+      iaea_record_type *p = p_iaea_record[*id];
+      if(p->p_behind == NULL) {*result = -2; return;}
+
+      if(p->set_write_behind(*buffer_size, *n_buffers) != OK) {*result = -3; return;}
+      *result = 0;
+      return;
+}
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_write_behind_(const IAEA_I32 *id, const IAEA_I64 *buffer_size,
+                            const IAEA_I32 *n_buffers, IAEA_I32 *result)
+{ iaea_set_write_behind(id, buffer_size, n_buffers, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_write_behind__(const IAEA_I32 *id, const IAEA_I64 *buffer_size,
+                             const IAEA_I32 *n_buffers, IAEA_I32 *result)
+{ iaea_set_write_behind(id, buffer_size, n_buffers, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_WRITE_BEHIND(const IAEA_I32 *id, const IAEA_I64 *buffer_size,
+                           const IAEA_I32 *n_buffers, IAEA_I32 *result)
+{ iaea_set_write_behind(id, buffer_size, n_buffers, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_WRITE_BEHIND_(const IAEA_I32 *id, const IAEA_I64 *buffer_size,
+                            const IAEA_I32 *n_buffers, IAEA_I32 *result)
+{ iaea_set_write_behind(id, buffer_size, n_buffers, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_WRITE_BEHIND__(const IAEA_I32 *id, const IAEA_I64 *buffer_size,
+                             const IAEA_I32 *n_buffers, IAEA_I32 *result)
+{ iaea_set_write_behind(id, buffer_size, n_buffers, result); }
+
+/*****************************************************************************
+* Write the particles of the Source with Id id in the byte order byte_order
+* (1234 little endian, 4321 big endian, as the BYTE_ORDER of the header).
+*
+* Sources opened with access = 2 are written in the byte order of the
+* machine unless another one is set here, before the first particle is
+* written; the records are converted as they are written. Files in the
+* other byte order are converted in the same way as they are read
+* (access = 1, 4) or appended to (access = 3).
+*
+* Set result to negative if such source does not exist (-1), is not open
+* for writing (-2), byte_order is not 1234 or 4321 (-3) or the source
+* already holds particles (-4).
+******************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_byte_order(const IAEA_I32 *id, const IAEA_I32 *byte_order,
+                         IAEA_I32 *result)
+{
+      // No header found
+      if(p_iaea_header[*id]->fheader == NULL) {*result = -1; return;}
+
+      iaea_record_type *p = p_iaea_record[*id];
+      if(p->p_behind == NULL) {*result = -2; return;}
+      if(*byte_order != LITTLE_ENDIAN && *byte_order != BIG_ENDIAN) {*result = -3; return;}
+      if(p_iaea_header[*id]->nParticles > 0) {*result = -4; return;}
+
+      p_iaea_header[*id]->byte_order = *byte_order;
+      p->swap_bytes = (*byte_order != check_byte_order());
+      *result = 0;
+      return;
+}
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_byte_order_(const IAEA_I32 *id, const IAEA_I32 *byte_order,
+                          IAEA_I32 *result)
+{ iaea_set_byte_order(id, byte_order, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_byte_order__(const IAEA_I32 *id, const IAEA_I32 *byte_order,
+                           IAEA_I32 *result)
+{ iaea_set_byte_order(id, byte_order, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_BYTE_ORDER(const IAEA_I32 *id, const IAEA_I32 *byte_order,
+                         IAEA_I32 *result)
+{ iaea_set_byte_order(id, byte_order, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_BYTE_ORDER_(const IAEA_I32 *id, const IAEA_I32 *byte_order,
+                          IAEA_I32 *result)
+{ iaea_set_byte_order(id, byte_order, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_BYTE_ORDER__(const IAEA_I32 *id, const IAEA_I32 *byte_order,
+                           IAEA_I32 *result)
+{ iaea_set_byte_order(id, byte_order, result); }
+
+/*****************************************************************************
+* Write the particles of the Source with Id id in compressed blocks of
+* block_records records each (FILE_TYPE 2 in the header), or as raw
+* records if block_records = 0. IAEA_PACK_BLOCK_RECORDS (iaea_pack.h) is a
+* good size: every block is compressed on its own, by the writer thread
+* if there is one, with a lossless codec of the library (no compression
+* library is needed).
+*
+* Sources opened with access = 2 are written raw unless compression is set
+* here, before the first particle is written. Files of compressed records
+* are read (access = 1, 4) and appended to (access = 3) like any other;
+* iaea_get_particle and the batched routines return the same particles,
+* and iaea_set_record, iaea_set_parallel and iaea_set_read_ranges only
+* decode the blocks holding the records asked for. The CHECKSUM of the
+* header is then the size of the compressed file.
+*
+* Set result to negative if such source does not exist (-1), is not open
+* for writing (-2), block_records is out of range (-3), the source
+* already holds particles (-4) or its records are quantized (-5).
+******************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_compression(const IAEA_I32 *id, const IAEA_I32 *block_records,
+                          IAEA_I32 *result)
+{
+      // No header found
+      if(p_iaea_header[*id]->fheader == NULL) {*result = -1; return;}
+
+      iaea_record_type *p = p_iaea_record[*id];
+      if(p->p_behind == NULL) {*result = -2; return;}
+      if(*block_records < 0 || *block_records > IAEA_PACK_MAX_BLOCK_RECORDS)
+         {*result = -3; return;}
+      if(p_iaea_header[*id]->nParticles > 0) {*result = -4; return;}
+      if(*block_records > 0 && p->p_quant != NULL) {*result = -5; return;}
+
+      // Replaces the columns of iaea_set_columns
+      if(p->set_packed(*block_records) != OK) {*result = -2; return;}
+      p_iaea_header[*id]->file_type = (*block_records > 0) ? 2 : 0;
+      *result = 0;
+      return;
+}
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_compression_(const IAEA_I32 *id, const IAEA_I32 *block_records,
+                           IAEA_I32 *result)
+{ iaea_set_compression(id, block_records, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_compression__(const IAEA_I32 *id, const IAEA_I32 *block_records,
+                            IAEA_I32 *result)
+{ iaea_set_compression(id, block_records, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_COMPRESSION(const IAEA_I32 *id, const IAEA_I32 *block_records,
+                          IAEA_I32 *result)
+{ iaea_set_compression(id, block_records, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_COMPRESSION_(const IAEA_I32 *id, const IAEA_I32 *block_records,
+                           IAEA_I32 *result)
+{ iaea_set_compression(id, block_records, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_COMPRESSION__(const IAEA_I32 *id, const IAEA_I32 *block_records,
+                            IAEA_I32 *result)
+{ iaea_set_compression(id, block_records, result); }
+
+/*****************************************************************************
+* Write the particles of the Source with Id id quantized (FILE_TYPE 3 in
+* the header, see iaea_quant.h): x, y and z to multiples of
+* position_resolution (cm), the energy to one of 65535 values spaced
+* logarithmically from energy_min to energy_max (MeV) and the direction to
+* 16 bits, so a record of x, y, z, u, v and weight takes 15 bytes instead
+* of 29. position_resolution = 0 writes records of floats again. With the
+* defaults of iaea_quant.h (0.01 cm, 1 eV to 10 GeV) positions are kept
+* within 0.005 cm up to 327 cm, energies within 0.02 % and directions
+* within 0.65 degrees.
+*
+* The particles must store u, v and w. A particle with a value out of
+* range is not written (iaea_write_particle fails), such particles are to
+* be left out beforehand (see iaea_filter_quantization) and can be counted
+* in the header (see iaea_set_quantization_rejected). The largest errors of
+* the particles written are kept in the header (QUANTIZATION_ERRORS). Files
+* of quantized records are read (access = 1, 4) and appended to
+* (access = 3) like any other, the particles read being the quantized
+* ones. Quantized records are little endian whatever the byte order of the
+* header, and are never compressed (iaea_set_compression) nor stored in
+* columns (iaea_set_columns).
+*
+* Set result to negative if such source does not exist (-1), is not open
+* for writing (-2), the resolution or the energy range is out of range
+* (-3), the source already holds particles (-4) or its particles can not
+* be quantized (-5).
+******************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_quantization(const IAEA_I32 *id, const IAEA_Float *position_resolution,
+                           const IAEA_Float *energy_min, const IAEA_Float *energy_max,
+                           IAEA_I32 *result)
+{
+      // No header found
+      if(p_iaea_header[*id]->fheader == NULL) {*result = -1; return;}
+
+      iaea_record_type *p = p_iaea_record[*id];
+      iaea_header_type *h = p_iaea_header[*id];
+      if(p->p_behind == NULL) {*result = -2; return;}
+      if(*position_resolution < 0.f) {*result = -3; return;}
+      if(h->nParticles > 0) {*result = -4; return;}
+      if(*position_resolution > 0.f && (p->use_packed || iaea_quant_layout(p) != OK))
+         {*result = -5; return;}
+
+      if(p->set_quantization(*position_resolution, *energy_min, *energy_max) != OK)
+         {*result = -3; return;}
+      if(p->p_quant != NULL)
+      {
+         h->file_type = 3;
+         h->quant_resolution = *position_resolution;
+         h->quant_energy_min = *energy_min;
+         h->quant_energy_max = *energy_max;
+         for(int i=0;i<3;i++) h->quant_error[i] = 0.;
+         h->quant_rejected = 0;
+      }
+      else if(h->file_type == 3) h->file_type = 0;
+      *result = 0;
+      return;
+}
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_quantization_(const IAEA_I32 *id, const IAEA_Float *position_resolution,
+                            const IAEA_Float *energy_min, const IAEA_Float *energy_max,
+                            IAEA_I32 *result)
+{ iaea_set_quantization(id, position_resolution, energy_min, energy_max, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_quantization__(const IAEA_I32 *id, const IAEA_Float *position_resolution,
+                             const IAEA_Float *energy_min, const IAEA_Float *energy_max,
+                             IAEA_I32 *result)
+{ iaea_set_quantization(id, position_resolution, energy_min, energy_max, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_QUANTIZATION(const IAEA_I32 *id, const IAEA_Float *position_resolution,
+                           const IAEA_Float *energy_min, const IAEA_Float *energy_max,
+                           IAEA_I32 *result)
+{ iaea_set_quantization(id, position_resolution, energy_min, energy_max, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_QUANTIZATION_(const IAEA_I32 *id, const IAEA_Float *position_resolution,
+                            const IAEA_Float *energy_min, const IAEA_Float *energy_max,
+                            IAEA_I32 *result)
+{ iaea_set_quantization(id, position_resolution, energy_min, energy_max, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_QUANTIZATION__(const IAEA_I32 *id, const IAEA_Float *position_resolution,
+                             const IAEA_Float *energy_min, const IAEA_Float *energy_max,
+                             IAEA_I32 *result)
+{ iaea_set_quantization(id, position_resolution, energy_min, energy_max, result); }
+
+/*****************************************************************************
+* Set the number of particles left out of the Source with Id id as out of
+* the range of its quantization (QUANTIZATION_REJECTED in the header, see
+* iaea_set_quantization), to be written with the header.
+*
+* Set result to negative if such source does not exist (-1) or its
+* records are not quantized (-2).
+******************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_quantization_rejected(const IAEA_I32 *id, const IAEA_I64 *n_rejected,
+                                    IAEA_I32 *result)
+{
+      // No header found
+      if(p_iaea_header[*id]->fheader == NULL) {*result = -1; return;}
+      if(p_iaea_header[*id]->file_type != 3) {*result = -2; return;}
+
+      p_iaea_header[*id]->quant_rejected = *n_rejected;
+      *result = 0;
+      return;
+}
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_quantization_rejected_(const IAEA_I32 *id, const IAEA_I64 *n_rejected,
+                                     IAEA_I32 *result)
+{ iaea_set_quantization_rejected(id, n_rejected, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_quantization_rejected__(const IAEA_I32 *id, const IAEA_I64 *n_rejected,
+                                      IAEA_I32 *result)
+{ iaea_set_quantization_rejected(id, n_rejected, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_QUANTIZATION_REJECTED(const IAEA_I32 *id, const IAEA_I64 *n_rejected,
+                                    IAEA_I32 *result)
+{ iaea_set_quantization_rejected(id, n_rejected, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_QUANTIZATION_REJECTED_(const IAEA_I32 *id, const IAEA_I64 *n_rejected,
+                                     IAEA_I32 *result)
+{ iaea_set_quantization_rejected(id, n_rejected, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_QUANTIZATION_REJECTED__(const IAEA_I32 *id, const IAEA_I64 *n_rejected,
+                                      IAEA_I32 *result)
+{ iaea_set_quantization_rejected(id, n_rejected, result); }
+
+/*****************************************************************************
+* Write the particles of the Source with Id id column by column (FILE_TYPE
+* 4 in the header, see iaea_column.h), in blocks of block_records records,
+* or as raw records if block_records = 0. IAEA_COLUMN_BLOCK_RECORDS is a
+* good size. A block holds the particle types, then every variable stored
+* (energy, x, y, z, u, v, weight, extra floats and longs) for all its
+* particles, each of them aligned to IAEA_COLUMN_ALIGN bytes in the file.
+*
+* Files of columns are read (access = 1, 4) and appended to (access = 3)
+* like any other, and as files of compressed records (see
+* iaea_set_compression) only the blocks holding the records asked for are
+* read. A reader that needs some of the variables only to select
+* particles reads only those (see iaea_set_read_columns). The CHECKSUM of
+* the header is the size of the file. The records are not compressed
+* (iaea_set_compression replaces the columns) nor quantized.
+*
+* Set result to negative if such source does not exist (-1), is not open
+* for writing (-2), block_records is out of range (-3), the source
+* already holds particles (-4) or its records are quantized (-5).
+******************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_columns(const IAEA_I32 *id, const IAEA_I32 *block_records,
+                      IAEA_I32 *result)
+{
+      // No header found
+      if(p_iaea_header[*id]->fheader == NULL) {*result = -1; return;}
+
+      iaea_record_type *p = p_iaea_record[*id];
+      if(p->p_behind == NULL) {*result = -2; return;}
+      if(*block_records < 0 || *block_records > IAEA_PACK_MAX_BLOCK_RECORDS)
+         {*result = -3; return;}
+      if(p_iaea_header[*id]->nParticles > 0) {*result = -4; return;}
+      if(*block_records > 0 && p->p_quant != NULL) {*result = -5; return;}
+
+      if(p->set_packed(*block_records, 1) != OK) {*result = -2; return;}
+      p_iaea_header[*id]->file_type = (*block_records > 0) ? 4 : 0;
+      *result = 0;
+      return;
+}
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_columns_(const IAEA_I32 *id, const IAEA_I32 *block_records,
+                       IAEA_I32 *result)
+{ iaea_set_columns(id, block_records, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_columns__(const IAEA_I32 *id, const IAEA_I32 *block_records,
+                        IAEA_I32 *result)
+{ iaea_set_columns(id, block_records, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_COLUMNS(const IAEA_I32 *id, const IAEA_I32 *block_records,
+                      IAEA_I32 *result)
+{ iaea_set_columns(id, block_records, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_COLUMNS_(const IAEA_I32 *id, const IAEA_I32 *block_records,
+                       IAEA_I32 *result)
+{ iaea_set_columns(id, block_records, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_COLUMNS__(const IAEA_I32 *id, const IAEA_I32 *block_records,
+                        IAEA_I32 *result)
+{ iaea_set_columns(id, block_records, result); }
+
+/*****************************************************************************
+* Read only the variables of columns (a sum of IAEA_COLUMN_* of
+* iaea_record.h, IAEA_COLUMN_ALL for all of them) of the particles of the
+* Source with Id id, a file of columns (see iaea_set_columns), from the
+* next particle read on. The other variables of the particles read are 0
+* until they are read with iaea_gather_particles_batch for the particles
+* kept. The energy and the incremental number of histories are always
+* read, w needs the particle type, u and v. While variables are left out,
+* the file is not read ahead and the counters of the particles read are
+* not updated.
+*
+* Set result to negative if such source does not exist (-1) or is not a
+* file of columns open for reading (-2).
+******************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_read_columns(const IAEA_I32 *id, const IAEA_I32 *columns, IAEA_I32 *result)
+{
+      // No header found
+      if(p_iaea_header[*id]->fheader == NULL) {*result = -1; return;}
+
+      iaea_record_type *p = p_iaea_record[*id];
+      if(p->p_behind != NULL || p_iaea_header[*id]->file_type != 4) {*result = -2; return;}
+
+      // Incremental number of histories (Type 1 of the extralong stored variable)
+      int variables = *columns;
+      for(int j=0;j<p->iextralong;j++)
+          if(p_iaea_header[*id]->extralong_contents[j] == 1)
+              variables |= IAEA_COLUMN_EXTRA_LONG(j);
+
+      if(p->set_columns(variables) != OK) {*result = -2; return;}
+      *result = 0;
+      return;
+}
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_read_columns_(const IAEA_I32 *id, const IAEA_I32 *columns, IAEA_I32 *result)
+{ iaea_set_read_columns(id, columns, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_read_columns__(const IAEA_I32 *id, const IAEA_I32 *columns, IAEA_I32 *result)
+{ iaea_set_read_columns(id, columns, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_READ_COLUMNS(const IAEA_I32 *id, const IAEA_I32 *columns, IAEA_I32 *result)
+{ iaea_set_read_columns(id, columns, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_READ_COLUMNS_(const IAEA_I32 *id, const IAEA_I32 *columns, IAEA_I32 *result)
+{ iaea_set_read_columns(id, columns, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_READ_COLUMNS__(const IAEA_I32 *id, const IAEA_I32 *columns, IAEA_I32 *result)
+{ iaea_set_read_columns(id, columns, result); }
+
 /**************************************************************************
 * Partitioning for parallel runs
 *
@@ -936,6 +1578,9 @@ void IAEA_SET_TOTAL_ORIGINAL_PARTICLES__(const IAEA_I32 *id,
 * The extra parameter i_parallel is needed
 * for the cases where the source is an event generator and should
 * be used to adjust the random number sequence.
+* The portions hold equal numbers of records, so a history may be split
+* between two of them; iaea_history_start (iaea_index.h) finds the
+* history boundaries to divide a file at.
 * The variable result should be set to 0 if everything went smoothly,
 * or to some error code if it didnt.
 **************************************************************************/
@@ -956,7 +1601,8 @@ void iaea_set_parallel(const IAEA_I32 *id, const IAEA_I32 *i_parallel,
    }
 
    IAEA_I64 nrecords =  p_iaea_header[*id]->nParticles;
-   IAEA_I32 record_length =  p_iaea_header[*id]->record_length;
+   // Size of the records in the file (smaller than RECORD_LENGTH if quantized)
+   IAEA_I32 record_length =  p_iaea_record[*id]->stored_size();
    // IAEA_I32 number_record_per_chunk = (IAEA_I32)nrecords/(*n_chunk); // changed, May 2011
    IAEA_I64 number_record_per_chunk = nrecords/(*n_chunk);
 
@@ -971,10 +1617,9 @@ void iaea_set_parallel(const IAEA_I32 *id, const IAEA_I32 *i_parallel,
    offset   Number of bytes from origin
    origin   Initial position
    */
-   if( fseek(p_iaea_record[*id]->p_file, offset ,SEEK_SET) == 0)
+   p_iaea_record[*id]->set_ranges(NULL, NULL, 0);
+   if( p_iaea_record[*id]->seek_position(offset) == OK)
    {
-         // IAEA_I32 pos = ftell(p_iaea_record[*id]->p_file);  // changed, May 2011
-	     IAEA_I64 pos = (IAEA_I64)ftell(p_iaea_record[*id]->p_file);
          *result = 0;
          return;
    }
@@ -1028,6 +1673,8 @@ void IAEA_SET_PARALLEL__(const IAEA_I32 *id,
 * Returns -1 if the header does not exist; -2 if the function fseek fails
 * for some reason; -3 if there is a file size mismatch; -4 if there is a
 * byte order mismatch; -5 if there is a mismatch in both
+* The records of a file in the other byte order are converted as they
+* are read, a byte order mismatch does not prevent reading it.
 **************************************************************************/
 IAEA_EXTERN_C IAEA_EXPORT
 void iaea_check_file_size_byte_order(const IAEA_I32 *id,
@@ -1035,6 +1682,9 @@ void iaea_check_file_size_byte_order(const IAEA_I32 *id,
 {
    if(p_iaea_header[*id]->fheader == NULL) {*result = -1; return;}
 
+   // Particles not written yet count as well
+   if(p_iaea_record[*id]->p_behind != NULL) p_iaea_record[*id]->flush_records();
+
    int machine_byte_order = check_byte_order();
 
    #if (defined WIN32) || (defined WIN64)
@@ -1113,7 +1763,8 @@ void iaea_set_record(const IAEA_I32 *id, const IAEA_I64 *record_num,
    if(*record_num <= 0) {*result = -2; return;}
    if(*record_num > p_iaea_header[*id]->nParticles+1) {*result = -3; return;}
 
-   IAEA_I32 record_length =  p_iaea_header[*id]->record_length;
+   // Size of the records in the file (smaller than RECORD_LENGTH if quantized)
+   IAEA_I32 record_length =  p_iaea_record[*id]->stored_size();
 
    IAEA_I64 offset = (*record_num-1) * record_length;
    /*
@@ -1125,9 +1776,9 @@ void iaea_set_record(const IAEA_I32 *id, const IAEA_I64 *record_num,
    origin   Initial position
    */
 
-   if( fseek(p_iaea_record[*id]->p_file, offset ,SEEK_SET) == 0)
+   p_iaea_record[*id]->set_ranges(NULL, NULL, 0);
+   if( p_iaea_record[*id]->seek_position(offset) == OK)
    {
-         IAEA_I32 pos = ftell(p_iaea_record[*id]->p_file);
          *result = 0;
          return;
    }
@@ -1161,6 +1812,73 @@ void IAEA_SET_RECORD__(const IAEA_I32 *id,
                                             IAEA_I32 *is_ok)
 { iaea_set_record(id, record_num, is_ok); }
 
+/**************************************************************************
+* Read only ranges of records of the Source with Id id
+*
+* From now on the particles are read from the n_ranges ranges of records
+* first[k] .. first[k]+count[k]-1 (records counted from 1, as by
+* iaea_set_record), in this order, as if they were the whole file; the
+* end of the file is reached after the last range. The ranges must be
+* sorted and must not overlap. Only the pages of the file holding records
+* of the ranges are read, e.g. the candidates of a cut selected with a
+* spatial index (see iaea_index.h). n_ranges = 0 goes back to reading the
+* whole file from the current position; iaea_set_record and
+* iaea_set_parallel do the same.
+*
+* Set result to negative if such source does not exist (-1), is not open
+* for reading (-2), the ranges are not valid (-3) or could not be stored
+* (-4).
+**************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_read_ranges(const IAEA_I32 *id, const IAEA_I64 *n_ranges,
+                          const IAEA_I64 *first, const IAEA_I64 *count,
+                          IAEA_I32 *result)
+{
+   if(p_iaea_header[*id]->fheader == NULL) {*result = -1; return;}
+   if(p_iaea_record[*id]->p_behind != NULL) {*result = -2; return;}
+
+   IAEA_I64 n = *n_ranges;
+   IAEA_I64 end = 1;
+   for(IAEA_I64 k=0;k<n;k++)
+   {
+      if(first[k] < end || count[k] <= 0 ||
+         first[k] + count[k] - 1 > p_iaea_header[*id]->nParticles)
+      {
+         *result = -3;
+         return;
+      }
+      end = first[k] + count[k];
+   }
+
+   if(p_iaea_record[*id]->set_ranges(first, count, n) != OK) {*result = -4; return;}
+   *result = 0;
+}
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_read_ranges_(const IAEA_I32 *id, const IAEA_I64 *n_ranges,
+                          const IAEA_I64 *first, const IAEA_I64 *count,
+                          IAEA_I32 *result)
+{ iaea_set_read_ranges(id, n_ranges, first, count, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_set_read_ranges__(const IAEA_I32 *id, const IAEA_I64 *n_ranges,
+                          const IAEA_I64 *first, const IAEA_I64 *count,
+                          IAEA_I32 *result)
+{ iaea_set_read_ranges(id, n_ranges, first, count, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_READ_RANGES(const IAEA_I32 *id, const IAEA_I64 *n_ranges,
+                          const IAEA_I64 *first, const IAEA_I64 *count,
+                          IAEA_I32 *result)
+{ iaea_set_read_ranges(id, n_ranges, first, count, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_READ_RANGES_(const IAEA_I32 *id, const IAEA_I64 *n_ranges,
+                          const IAEA_I64 *first, const IAEA_I64 *count,
+                          IAEA_I32 *result)
+{ iaea_set_read_ranges(id, n_ranges, first, count, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_SET_READ_RANGES__(const IAEA_I32 *id, const IAEA_I64 *n_ranges,
+                          const IAEA_I64 *first, const IAEA_I64 *count,
+                          IAEA_I32 *result)
+{ iaea_set_read_ranges(id, n_ranges, first, count, result); }
+
 /**************************************************************************
 * Get a particle
 *
@@ -1189,9 +1907,9 @@ IAEA_Float *w,  /* direction in cartesian coordinates*/
 IAEA_Float *extra_floats,
 IAEA_I32 *extra_ints)
 {
-      if(feof(p_iaea_record[*id]->p_file)) {
+      if(p_iaea_record[*id]->end_of_file()) {
          *n_stat = -2;
-         rewind (p_iaea_record[*id]->p_file);
+         p_iaea_record[*id]->rewind_file();
          return;
       }
 
@@ -1253,7 +1971,8 @@ IAEA_I32 *extra_ints)
         Total number of each particle type
         Number of statistically independent histories
       */
-      p_iaea_header[*id]->update_counters(p_iaea_record[*id]);
+      if(!p_iaea_header[*id]->skip_read_counters && !p_iaea_record[*id]->projected())
+          p_iaea_header[*id]->update_counters(p_iaea_record[*id]);
 
       return;
 }
@@ -1466,6 +2185,669 @@ const IAEA_I32 *extra_ints)
 { iaea_write_particle(id, n_stat, type,
                                 E, wt, x, y, z, u, v, w, extra_floats, extra_ints); }
 
+/**************************************************************************
+* Get a block of particles
+*
+* Return up to n_max next particles from source with Id id in caller
+* provided arrays (structure of arrays), n_read is set to the number of
+* particles returned. The meaning of n_stat and the other variables is
+* the same as in iaea_get_particle. Extra floats and integers are stored
+* column by column: extra_floats(i,k) = extra_floats[(k-1)*n_max + i-1]
+* is the k-th extra float of the i-th particle (Fortran order).
+* n_read < n_max means the end of the phase space file was reached.
+* Set n_read to -1, if a source with Id id does not exist. Set n_read
+* to -2, if called at the end of file (the file is then rewound).
+**************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_get_particles_batch(const IAEA_I32 *id, const IAEA_I32 *n_max,
+IAEA_I32 *n_read,
+IAEA_I32 *n_stat,
+IAEA_I32 *type, /* particle types */
+IAEA_Float *E,  /* kinetic energies in MeV */
+IAEA_Float *wt, /* statistical weights */
+IAEA_Float *x,
+IAEA_Float *y,
+IAEA_Float *z,  /* positions in cartesian coordinates*/
+IAEA_Float *u,
+IAEA_Float *v,
+IAEA_Float *w,  /* directions in cartesian coordinates*/
+IAEA_Float *extra_floats,
+IAEA_I32 *extra_ints)
+{
+      // No header found
+      if(p_iaea_header[*id]->fheader == NULL) {*n_read = -1; return;}
+
+      iaea_record_type *p = p_iaea_record[*id];
+      iaea_particle_block block = { *n_max, n_stat, type, E, wt, x, y, z,
+                                    u, v, w, extra_floats, extra_ints };
+
+      // Looking for incremental number of histories
+      // (Type 1 of the extralong stored variable)
+      int stat_long = -1;
+      for(int j=0;j<p->iextralong ;j++)
+          if(p_iaea_header[*id]->extralong_contents[j] == 1) stat_long = j;
+
+      // Decoding the block of records as it comes from the file
+      int n = 0;
+      const unsigned char *records = p->read_records(*n_max, &n);
+      if(records != NULL) p->unpack_particles(records, n, &block, 0, stat_long);
+
+      if(n == 0 && p->end_of_file()) {
+         *n_read = -2;
+         p->rewind_file();
+         return;
+      }
+
+      // Updating counters once for the whole block (see iaea_get_particle),
+      // not when columns are left out of the particles read
+      if(!p_iaea_header[*id]->skip_read_counters && !p->projected())
+          p_iaea_header[*id]->update_counters(&block, 0, n);
+
+      *n_read = n;
+      return;
+}
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_get_particles_batch_(const IAEA_I32 *id, const IAEA_I32 *n_max,
+IAEA_I32 *n_read, IAEA_I32 *n_stat, IAEA_I32 *type, IAEA_Float *E,
+IAEA_Float *wt, IAEA_Float *x, IAEA_Float *y, IAEA_Float *z,
+IAEA_Float *u, IAEA_Float *v, IAEA_Float *w,
+IAEA_Float *extra_floats, IAEA_I32 *extra_ints)
+{ iaea_get_particles_batch(id, n_max, n_read, n_stat, type,
+                           E, wt, x, y, z, u, v, w, extra_floats, extra_ints); }
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_get_particles_batch__(const IAEA_I32 *id, const IAEA_I32 *n_max,
+IAEA_I32 *n_read, IAEA_I32 *n_stat, IAEA_I32 *type, IAEA_Float *E,
+IAEA_Float *wt, IAEA_Float *x, IAEA_Float *y, IAEA_Float *z,
+IAEA_Float *u, IAEA_Float *v, IAEA_Float *w,
+IAEA_Float *extra_floats, IAEA_I32 *extra_ints)
+{ iaea_get_particles_batch(id, n_max, n_read, n_stat, type,
+                           E, wt, x, y, z, u, v, w, extra_floats, extra_ints); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_GET_PARTICLES_BATCH(const IAEA_I32 *id, const IAEA_I32 *n_max,
+IAEA_I32 *n_read, IAEA_I32 *n_stat, IAEA_I32 *type, IAEA_Float *E,
+IAEA_Float *wt, IAEA_Float *x, IAEA_Float *y, IAEA_Float *z,
+IAEA_Float *u, IAEA_Float *v, IAEA_Float *w,
+IAEA_Float *extra_floats, IAEA_I32 *extra_ints)
+{ iaea_get_particles_batch(id, n_max, n_read, n_stat, type,
+                           E, wt, x, y, z, u, v, w, extra_floats, extra_ints); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_GET_PARTICLES_BATCH_(const IAEA_I32 *id, const IAEA_I32 *n_max,
+IAEA_I32 *n_read, IAEA_I32 *n_stat, IAEA_I32 *type, IAEA_Float *E,
+IAEA_Float *wt, IAEA_Float *x, IAEA_Float *y, IAEA_Float *z,
+IAEA_Float *u, IAEA_Float *v, IAEA_Float *w,
+IAEA_Float *extra_floats, IAEA_I32 *extra_ints)
+{ iaea_get_particles_batch(id, n_max, n_read, n_stat, type,
+                           E, wt, x, y, z, u, v, w, extra_floats, extra_ints); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_GET_PARTICLES_BATCH__(const IAEA_I32 *id, const IAEA_I32 *n_max,
+IAEA_I32 *n_read, IAEA_I32 *n_stat, IAEA_I32 *type, IAEA_Float *E,
+IAEA_Float *wt, IAEA_Float *x, IAEA_Float *y, IAEA_Float *z,
+IAEA_Float *u, IAEA_Float *v, IAEA_Float *w,
+IAEA_Float *extra_floats, IAEA_I32 *extra_ints)
+{ iaea_get_particles_batch(id, n_max, n_read, n_stat, type,
+                           E, wt, x, y, z, u, v, w, extra_floats, extra_ints); }
+
+/**************************************************************************
+* Write a block of particles
+*
+* Write n particles given as structure of arrays to the source with Id
+* id. The meaning of the variables is the same as in iaea_write_particle,
+* extra floats and integers are stored column by column with leading
+* dimension n (see iaea_get_particles_batch).
+* n_written is set to the number of particles written, or to -1 if
+* ERROR (source with Id id does not exist or writing failed).
+**************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_write_particles_batch(const IAEA_I32 *id, const IAEA_I32 *n,
+IAEA_I32 *n_written,
+const IAEA_I32 *n_stat,
+const IAEA_I32 *type, /* particle types */
+const IAEA_Float *E,  /* kinetic energies in MeV */
+const IAEA_Float *wt, /* statistical weights */
+const IAEA_Float *x,
+const IAEA_Float *y,
+const IAEA_Float *z,  /* positions in cartesian coordinates*/
+const IAEA_Float *u,
+const IAEA_Float *v,
+const IAEA_Float *w,  /* directions in cartesian coordinates*/
+const IAEA_Float *extra_floats,
+const IAEA_I32 *extra_ints)
+{
+      // No header found
+      if(p_iaea_header[*id]->fheader == NULL) {*n_written = -1; return;}
+
+      iaea_record_type *p = p_iaea_record[*id];
+      iaea_particle_block block = { *n, (IAEA_I32 *)n_stat, (IAEA_I32 *)type,
+          (IAEA_Float *)E, (IAEA_Float *)wt, (IAEA_Float *)x, (IAEA_Float *)y,
+          (IAEA_Float *)z, (IAEA_Float *)u, (IAEA_Float *)v, (IAEA_Float *)w,
+          (IAEA_Float *)extra_floats, (IAEA_I32 *)extra_ints };
+
+      unsigned char *records = p->output_records(*n);
+      if(records == NULL) {*n_written = -1; return;}
+
+      // Encoding all records into one buffer
+      p->pack_particles(&block, *n, records);
+
+      // and writing it with a single call
+      if( p->commit_records(*n) != OK )
+      {
+          fprintf(stderr, "\n ERROR: iaea_write_particles_batch: Failed to write particles\n");
+          *n_written = -1;
+          return;
+      }
+
+      // Updating counters once for the whole block (see iaea_write_particle)
+      p_iaea_header[*id]->update_counters(&block, 0, *n);
+
+      *n_written = *n;
+      return;
+}
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_write_particles_batch_(const IAEA_I32 *id, const IAEA_I32 *n,
+IAEA_I32 *n_written, const IAEA_I32 *n_stat, const IAEA_I32 *type,
+const IAEA_Float *E, const IAEA_Float *wt,
+const IAEA_Float *x, const IAEA_Float *y, const IAEA_Float *z,
+const IAEA_Float *u, const IAEA_Float *v, const IAEA_Float *w,
+const IAEA_Float *extra_floats, const IAEA_I32 *extra_ints)
+{ iaea_write_particles_batch(id, n, n_written, n_stat, type,
+                             E, wt, x, y, z, u, v, w, extra_floats, extra_ints); }
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_write_particles_batch__(const IAEA_I32 *id, const IAEA_I32 *n,
+IAEA_I32 *n_written, const IAEA_I32 *n_stat, const IAEA_I32 *type,
+const IAEA_Float *E, const IAEA_Float *wt,
+const IAEA_Float *x, const IAEA_Float *y, const IAEA_Float *z,
+const IAEA_Float *u, const IAEA_Float *v, const IAEA_Float *w,
+const IAEA_Float *extra_floats, const IAEA_I32 *extra_ints)
+{ iaea_write_particles_batch(id, n, n_written, n_stat, type,
+                             E, wt, x, y, z, u, v, w, extra_floats, extra_ints); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_WRITE_PARTICLES_BATCH(const IAEA_I32 *id, const IAEA_I32 *n,
+IAEA_I32 *n_written, const IAEA_I32 *n_stat, const IAEA_I32 *type,
+const IAEA_Float *E, const IAEA_Float *wt,
+const IAEA_Float *x, const IAEA_Float *y, const IAEA_Float *z,
+const IAEA_Float *u, const IAEA_Float *v, const IAEA_Float *w,
+const IAEA_Float *extra_floats, const IAEA_I32 *extra_ints)
+{ iaea_write_particles_batch(id, n, n_written, n_stat, type,
+                             E, wt, x, y, z, u, v, w, extra_floats, extra_ints); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_WRITE_PARTICLES_BATCH_(const IAEA_I32 *id, const IAEA_I32 *n,
+IAEA_I32 *n_written, const IAEA_I32 *n_stat, const IAEA_I32 *type,
+const IAEA_Float *E, const IAEA_Float *wt,
+const IAEA_Float *x, const IAEA_Float *y, const IAEA_Float *z,
+const IAEA_Float *u, const IAEA_Float *v, const IAEA_Float *w,
+const IAEA_Float *extra_floats, const IAEA_I32 *extra_ints)
+{ iaea_write_particles_batch(id, n, n_written, n_stat, type,
+                             E, wt, x, y, z, u, v, w, extra_floats, extra_ints); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_WRITE_PARTICLES_BATCH__(const IAEA_I32 *id, const IAEA_I32 *n,
+IAEA_I32 *n_written, const IAEA_I32 *n_stat, const IAEA_I32 *type,
+const IAEA_Float *E, const IAEA_Float *wt,
+const IAEA_Float *x, const IAEA_Float *y, const IAEA_Float *z,
+const IAEA_Float *u, const IAEA_Float *v, const IAEA_Float *w,
+const IAEA_Float *extra_floats, const IAEA_I32 *extra_ints)
+{ iaea_write_particles_batch(id, n, n_written, n_stat, type,
+                             E, wt, x, y, z, u, v, w, extra_floats, extra_ints); }
+
+/**************************************************************************
+* Copy particles without decoding them
+*
+* Copy the raw records of the particles selected by mask from the last
+* block read with iaea_get_particles_batch from source with Id source_ID
+* to the source with Id destiny_ID. n is the number of particles of that
+* block, bit (i-1)%64 of mask((i-1)/64+1) selects the i-th particle.
+* The records of both sources have to be stored in the same way. n_stat,
+* type, E, wt, x, y and z are the values of the block as returned by
+* iaea_get_particles_batch, used to update the counters of destiny_ID.
+* The history marks of the records copied (sign of the energy and the
+* incremental number of histories, if stored) are set from n_stat, which
+* may thus differ from the values read, e.g. to carry the histories of
+* particles left out over to the next particle written.
+* n_written is set to the number of particles copied, or to
+*    -1 if ERROR (source does not exist or writing failed)
+*    -2 if records of both sources are stored differently
+*    -3 if no block of n particles was read before
+**************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_copy_particles_batch(const IAEA_I32 *source_ID,
+const IAEA_I32 *destiny_ID, const IAEA_I32 *n, const IAEA_U64 *mask,
+const IAEA_I32 *n_stat,
+const IAEA_I32 *type, /* particle types */
+const IAEA_Float *E,  /* kinetic energies in MeV */
+const IAEA_Float *wt, /* statistical weights */
+const IAEA_Float *x,
+const IAEA_Float *y,
+const IAEA_Float *z,  /* positions in cartesian coordinates*/
+IAEA_I32 *n_written)
+{
+      // No header found
+      if(p_iaea_header[*source_ID]->fheader == NULL ||
+         p_iaea_header[*destiny_ID]->fheader == NULL) {*n_written = -1; return;}
+
+      if(p_iaea_header[*source_ID]->same_record_layout(p_iaea_header[*destiny_ID]) != OK)
+      {
+          *n_written = -2;
+          return;
+      }
+
+      iaea_record_type *p_source = p_iaea_record[*source_ID];
+      iaea_record_type *p_destiny = p_iaea_record[*destiny_ID];
+      if(p_source->block_records == NULL || *n > p_source->block_count)
+      {
+          *n_written = -3;
+          return;
+      }
+
+      int stat_long = -1;
+      for(int j=0;j<p_destiny->iextralong;j++)
+          if(p_iaea_header[*destiny_ID]->extralong_contents[j] == 1) stat_long = j;
+
+      int reclength = p_source->record_size();
+      unsigned char *records = p_destiny->output_records(*n);
+      if(records == NULL) {*n_written = -1; return;}
+
+      // Selected records are copied byte by byte into the output buffer
+      int n_copy = 0;
+      for(int k=0;k<*n;k++)
+      {
+          if( !((mask[k >> 6] >> (k & 63)) & 1) ) continue;
+          unsigned char *record = records + (IAEA_I64)n_copy*reclength;
+          memcpy(record, p_source->block_records + (IAEA_I64)k*reclength, (size_t)reclength);
+          p_destiny->mark_history(record, n_stat[k], stat_long);
+          n_copy++;
+      }
+
+      if( p_destiny->commit_records(n_copy) != OK )
+      {
+          fprintf(stderr, "\n ERROR: iaea_copy_particles_batch: Failed to write particles\n");
+          *n_written = -1;
+          return;
+      }
+
+      // Counters are updated from the already decoded values
+      iaea_particle_block block = { *n, (IAEA_I32 *)n_stat, (IAEA_I32 *)type,
+          (IAEA_Float *)E, (IAEA_Float *)wt, (IAEA_Float *)x, (IAEA_Float *)y,
+          (IAEA_Float *)z, NULL, NULL, NULL, NULL, NULL };
+      p_iaea_header[*destiny_ID]->update_counters(&block, mask, *n);
+
+      *n_written = n_copy;
+      return;
+}
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_copy_particles_batch_(const IAEA_I32 *source_ID,
+const IAEA_I32 *destiny_ID, const IAEA_I32 *n, const IAEA_U64 *mask,
+const IAEA_I32 *n_stat, const IAEA_I32 *type, const IAEA_Float *E,
+const IAEA_Float *wt, const IAEA_Float *x, const IAEA_Float *y,
+const IAEA_Float *z, IAEA_I32 *n_written)
+{ iaea_copy_particles_batch(source_ID, destiny_ID, n, mask, n_stat, type,
+                            E, wt, x, y, z, n_written); }
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_copy_particles_batch__(const IAEA_I32 *source_ID,
+const IAEA_I32 *destiny_ID, const IAEA_I32 *n, const IAEA_U64 *mask,
+const IAEA_I32 *n_stat, const IAEA_I32 *type, const IAEA_Float *E,
+const IAEA_Float *wt, const IAEA_Float *x, const IAEA_Float *y,
+const IAEA_Float *z, IAEA_I32 *n_written)
+{ iaea_copy_particles_batch(source_ID, destiny_ID, n, mask, n_stat, type,
+                            E, wt, x, y, z, n_written); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_COPY_PARTICLES_BATCH(const IAEA_I32 *source_ID,
+const IAEA_I32 *destiny_ID, const IAEA_I32 *n, const IAEA_U64 *mask,
+const IAEA_I32 *n_stat, const IAEA_I32 *type, const IAEA_Float *E,
+const IAEA_Float *wt, const IAEA_Float *x, const IAEA_Float *y,
+const IAEA_Float *z, IAEA_I32 *n_written)
+{ iaea_copy_particles_batch(source_ID, destiny_ID, n, mask, n_stat, type,
+                            E, wt, x, y, z, n_written); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_COPY_PARTICLES_BATCH_(const IAEA_I32 *source_ID,
+const IAEA_I32 *destiny_ID, const IAEA_I32 *n, const IAEA_U64 *mask,
+const IAEA_I32 *n_stat, const IAEA_I32 *type, const IAEA_Float *E,
+const IAEA_Float *wt, const IAEA_Float *x, const IAEA_Float *y,
+const IAEA_Float *z, IAEA_I32 *n_written)
+{ iaea_copy_particles_batch(source_ID, destiny_ID, n, mask, n_stat, type,
+                            E, wt, x, y, z, n_written); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_COPY_PARTICLES_BATCH__(const IAEA_I32 *source_ID,
+const IAEA_I32 *destiny_ID, const IAEA_I32 *n, const IAEA_U64 *mask,
+const IAEA_I32 *n_stat, const IAEA_I32 *type, const IAEA_Float *E,
+const IAEA_Float *wt, const IAEA_Float *x, const IAEA_Float *y,
+const IAEA_Float *z, IAEA_I32 *n_written)
+{ iaea_copy_particles_batch(source_ID, destiny_ID, n, mask, n_stat, type,
+                            E, wt, x, y, z, n_written); }
+
+/**************************************************************************
+* Read the variables left out (see iaea_set_read_columns) of the particles
+* selected by mask of the last block read with iaea_get_particles_batch
+* from source with Id id. n is the number of particles of that block, bit
+* (i-1)%64 of mask((i-1)/64+1) selects the i-th particle. The particles
+* selected are decoded again into the arrays of the block (n_max and the
+* arrays as given to iaea_get_particles_batch), the others are left as
+* they are, and their records are complete for iaea_copy_particles_batch.
+* Only the values of the particles selected are read from the file, a
+* run of them at a time. Nothing is read if no variable is left out.
+* Set result to negative if such source does not exist (-1), if no block
+* of n particles was read before (-2) or the file can not be read (-3).
+**************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_gather_particles_batch(const IAEA_I32 *id, const IAEA_I32 *n_max,
+const IAEA_I32 *n, const IAEA_U64 *mask,
+IAEA_I32 *n_stat,
+IAEA_I32 *type, /* particle types */
+IAEA_Float *E,  /* kinetic energies in MeV */
+IAEA_Float *wt, /* statistical weights */
+IAEA_Float *x,
+IAEA_Float *y,
+IAEA_Float *z,  /* positions in cartesian coordinates*/
+IAEA_Float *u,
+IAEA_Float *v,
+IAEA_Float *w,  /* directions in cartesian coordinates*/
+IAEA_Float *extra_floats,
+IAEA_I32 *extra_ints,
+IAEA_I32 *result)
+{
+      // No header found
+      if(p_iaea_header[*id]->fheader == NULL) {*result = -1; return;}
+
+      iaea_record_type *p = p_iaea_record[*id];
+      if(p->block_records == NULL || *n > p->block_count) {*result = -2; return;}
+      if(!p->projected()) {*result = 0; return;}
+      if(p->gather_records(mask, *n) != OK) {*result = -3; return;}
+
+      int stat_long = -1;
+      for(int j=0;j<p->iextralong ;j++)
+          if(p_iaea_header[*id]->extralong_contents[j] == 1) stat_long = j;
+
+      // Runs of particles selected are decoded again
+      iaea_particle_block block = { *n_max, n_stat, type, E, wt, x, y, z,
+                                    u, v, w, extra_floats, extra_ints };
+      int reclength = p->record_size();
+      for(int i=0;i<*n;)
+      {
+          if( !((mask[i >> 6] >> (i & 63)) & 1) ) { i++; continue; }
+          int end = i + 1;
+          while(end < *n && ((mask[end >> 6] >> (end & 63)) & 1)) end++;
+          p->unpack_particles(p->block_records + (IAEA_I64)i*reclength, end - i,
+                              &block, i, stat_long);
+          i = end;
+      }
+
+      *result = 0;
+      return;
+}
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_gather_particles_batch_(const IAEA_I32 *id, const IAEA_I32 *n_max,
+const IAEA_I32 *n, const IAEA_U64 *mask, IAEA_I32 *n_stat, IAEA_I32 *type,
+IAEA_Float *E, IAEA_Float *wt, IAEA_Float *x, IAEA_Float *y, IAEA_Float *z,
+IAEA_Float *u, IAEA_Float *v, IAEA_Float *w,
+IAEA_Float *extra_floats, IAEA_I32 *extra_ints, IAEA_I32 *result)
+{ iaea_gather_particles_batch(id, n_max, n, mask, n_stat, type, E, wt, x, y, z,
+                              u, v, w, extra_floats, extra_ints, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_gather_particles_batch__(const IAEA_I32 *id, const IAEA_I32 *n_max,
+const IAEA_I32 *n, const IAEA_U64 *mask, IAEA_I32 *n_stat, IAEA_I32 *type,
+IAEA_Float *E, IAEA_Float *wt, IAEA_Float *x, IAEA_Float *y, IAEA_Float *z,
+IAEA_Float *u, IAEA_Float *v, IAEA_Float *w,
+IAEA_Float *extra_floats, IAEA_I32 *extra_ints, IAEA_I32 *result)
+{ iaea_gather_particles_batch(id, n_max, n, mask, n_stat, type, E, wt, x, y, z,
+                              u, v, w, extra_floats, extra_ints, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_GATHER_PARTICLES_BATCH(const IAEA_I32 *id, const IAEA_I32 *n_max,
+const IAEA_I32 *n, const IAEA_U64 *mask, IAEA_I32 *n_stat, IAEA_I32 *type,
+IAEA_Float *E, IAEA_Float *wt, IAEA_Float *x, IAEA_Float *y, IAEA_Float *z,
+IAEA_Float *u, IAEA_Float *v, IAEA_Float *w,
+IAEA_Float *extra_floats, IAEA_I32 *extra_ints, IAEA_I32 *result)
+{ iaea_gather_particles_batch(id, n_max, n, mask, n_stat, type, E, wt, x, y, z,
+                              u, v, w, extra_floats, extra_ints, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_GATHER_PARTICLES_BATCH_(const IAEA_I32 *id, const IAEA_I32 *n_max,
+const IAEA_I32 *n, const IAEA_U64 *mask, IAEA_I32 *n_stat, IAEA_I32 *type,
+IAEA_Float *E, IAEA_Float *wt, IAEA_Float *x, IAEA_Float *y, IAEA_Float *z,
+IAEA_Float *u, IAEA_Float *v, IAEA_Float *w,
+IAEA_Float *extra_floats, IAEA_I32 *extra_ints, IAEA_I32 *result)
+{ iaea_gather_particles_batch(id, n_max, n, mask, n_stat, type, E, wt, x, y, z,
+                              u, v, w, extra_floats, extra_ints, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_GATHER_PARTICLES_BATCH__(const IAEA_I32 *id, const IAEA_I32 *n_max,
+const IAEA_I32 *n, const IAEA_U64 *mask, IAEA_I32 *n_stat, IAEA_I32 *type,
+IAEA_Float *E, IAEA_Float *wt, IAEA_Float *x, IAEA_Float *y, IAEA_Float *z,
+IAEA_Float *u, IAEA_Float *v, IAEA_Float *w,
+IAEA_Float *extra_floats, IAEA_I32 *extra_ints, IAEA_I32 *result)
+{ iaea_gather_particles_batch(id, n_max, n, mask, n_stat, type, E, wt, x, y, z,
+                              u, v, w, extra_floats, extra_ints, result); }
+
+/**************************************************************************
+* Copy particles without decoding them, in a given order
+*
+* Same as iaea_copy_particles_batch, but the particles order(1), ...,
+* order(n) of the last block read from source with Id source_ID are
+* copied, in this order (order(k) = i selects the i-th particle of the
+* block). A particle can be selected once. Used to reorder the records
+* of a file, e.g. to sort them (see iaea_cluster in iaea_index.h).
+* n_written is set to the number of particles copied, or to
+*    -1 if ERROR (source does not exist or writing failed)
+*    -2 if records of both sources are stored differently
+*    -3 if no block holding the particles selected was read before
+*    -4 if a particle is selected twice
+**************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_copy_particles_ordered(const IAEA_I32 *source_ID,
+const IAEA_I32 *destiny_ID, const IAEA_I32 *n, const IAEA_I32 *order,
+const IAEA_I32 *n_stat,
+const IAEA_I32 *type, /* particle types */
+const IAEA_Float *E,  /* kinetic energies in MeV */
+const IAEA_Float *wt, /* statistical weights */
+const IAEA_Float *x,
+const IAEA_Float *y,
+const IAEA_Float *z,  /* positions in cartesian coordinates*/
+IAEA_I32 *n_written)
+{
+      // No header found
+      if(p_iaea_header[*source_ID]->fheader == NULL ||
+         p_iaea_header[*destiny_ID]->fheader == NULL) {*n_written = -1; return;}
+
+      if(p_iaea_header[*source_ID]->same_record_layout(p_iaea_header[*destiny_ID]) != OK)
+      {
+          *n_written = -2;
+          return;
+      }
+
+      iaea_record_type *p_source = p_iaea_record[*source_ID];
+      iaea_record_type *p_destiny = p_iaea_record[*destiny_ID];
+      if(*n <= 0) {*n_written = 0; return;}
+      if(p_source->block_records == NULL) {*n_written = -3; return;}
+
+      // The particles selected span first..last of the block, they are
+      // marked in a mask of that span for the counters
+      int first = p_source->block_count, last = -1;
+      for(int k=0;k<*n;k++)
+      {
+          int i = order[k] - 1;
+          if(i < 0 || i >= p_source->block_count) {*n_written = -3; return;}
+          if(i < first) first = i;
+          if(i > last)  last = i;
+      }
+      int span = last - first + 1;
+      IAEA_U64 *mask = (IAEA_U64 *) calloc((size_t)((span + 63) >> 6), sizeof(IAEA_U64));
+      if(mask == NULL) {*n_written = -1; return;}
+      for(int k=0;k<*n;k++)
+      {
+          int i = order[k] - 1 - first;
+          if( (mask[i >> 6] >> (i & 63)) & 1 )
+          {
+              free(mask);
+              *n_written = -4;
+              return;
+          }
+          mask[i >> 6] |= (IAEA_U64)1 << (i & 63);
+      }
+
+      int stat_long = -1;
+      for(int j=0;j<p_destiny->iextralong;j++)
+          if(p_iaea_header[*destiny_ID]->extralong_contents[j] == 1) stat_long = j;
+
+      int reclength = p_source->record_size();
+      unsigned char *records = p_destiny->output_records(*n);
+      if(records == NULL) {free(mask); *n_written = -1; return;}
+      for(int k=0;k<*n;k++)
+      {
+          unsigned char *record = records + (IAEA_I64)k*reclength;
+          memcpy(record, p_source->block_records + (IAEA_I64)(order[k] - 1)*reclength,
+                 (size_t)reclength);
+          p_destiny->mark_history(record, n_stat[order[k] - 1], stat_long);
+      }
+
+      if( p_destiny->commit_records(*n) != OK )
+      {
+          fprintf(stderr, "\n ERROR: iaea_copy_particles_ordered: Failed to write particles\n");
+          free(mask);
+          *n_written = -1;
+          return;
+      }
+
+      // Counters are updated from the already decoded values
+      iaea_particle_block block = { span, (IAEA_I32 *)n_stat + first, (IAEA_I32 *)type + first,
+          (IAEA_Float *)E + first, (IAEA_Float *)wt + first, (IAEA_Float *)x + first,
+          (IAEA_Float *)y + first, (IAEA_Float *)z + first, NULL, NULL, NULL, NULL, NULL };
+      p_iaea_header[*destiny_ID]->update_counters(&block, mask, span);
+      free(mask);
+
+      *n_written = *n;
+      return;
+}
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_copy_particles_ordered_(const IAEA_I32 *source_ID,
+const IAEA_I32 *destiny_ID, const IAEA_I32 *n, const IAEA_I32 *order,
+const IAEA_I32 *n_stat, const IAEA_I32 *type, const IAEA_Float *E,
+const IAEA_Float *wt, const IAEA_Float *x, const IAEA_Float *y,
+const IAEA_Float *z, IAEA_I32 *n_written)
+{ iaea_copy_particles_ordered(source_ID, destiny_ID, n, order, n_stat, type,
+                              E, wt, x, y, z, n_written); }
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_copy_particles_ordered__(const IAEA_I32 *source_ID,
+const IAEA_I32 *destiny_ID, const IAEA_I32 *n, const IAEA_I32 *order,
+const IAEA_I32 *n_stat, const IAEA_I32 *type, const IAEA_Float *E,
+const IAEA_Float *wt, const IAEA_Float *x, const IAEA_Float *y,
+const IAEA_Float *z, IAEA_I32 *n_written)
+{ iaea_copy_particles_ordered(source_ID, destiny_ID, n, order, n_stat, type,
+                              E, wt, x, y, z, n_written); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_COPY_PARTICLES_ORDERED(const IAEA_I32 *source_ID,
+const IAEA_I32 *destiny_ID, const IAEA_I32 *n, const IAEA_I32 *order,
+const IAEA_I32 *n_stat, const IAEA_I32 *type, const IAEA_Float *E,
+const IAEA_Float *wt, const IAEA_Float *x, const IAEA_Float *y,
+const IAEA_Float *z, IAEA_I32 *n_written)
+{ iaea_copy_particles_ordered(source_ID, destiny_ID, n, order, n_stat, type,
+                              E, wt, x, y, z, n_written); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_COPY_PARTICLES_ORDERED_(const IAEA_I32 *source_ID,
+const IAEA_I32 *destiny_ID, const IAEA_I32 *n, const IAEA_I32 *order,
+const IAEA_I32 *n_stat, const IAEA_I32 *type, const IAEA_Float *E,
+const IAEA_Float *wt, const IAEA_Float *x, const IAEA_Float *y,
+const IAEA_Float *z, IAEA_I32 *n_written)
+{ iaea_copy_particles_ordered(source_ID, destiny_ID, n, order, n_stat, type,
+                              E, wt, x, y, z, n_written); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_COPY_PARTICLES_ORDERED__(const IAEA_I32 *source_ID,
+const IAEA_I32 *destiny_ID, const IAEA_I32 *n, const IAEA_I32 *order,
+const IAEA_I32 *n_stat, const IAEA_I32 *type, const IAEA_Float *E,
+const IAEA_Float *wt, const IAEA_Float *x, const IAEA_Float *y,
+const IAEA_Float *z, IAEA_I32 *n_written)
+{ iaea_copy_particles_ordered(source_ID, destiny_ID, n, order, n_stat, type,
+                              E, wt, x, y, z, n_written); }
+
+/**************************************************************************
+* Append a source
+*
+* Append all particles of the source with Id source_ID (open for reading)
+* to the source with Id destiny_ID. The records are copied without
+* decoding them and the counters of destiny_ID are updated, so the result
+* is the same as writing the particles to destiny_ID one by one. Used to
+* merge phase space files written in parallel into one file.
+* The records of both sources have to be stored in the same way.
+* result is set to the number of particles appended, or to
+*    -1 if ERROR (source does not exist, reading or writing failed)
+*    -2 if records of both sources are stored differently
+**************************************************************************/
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_append_source(const IAEA_I32 *destiny_ID, const IAEA_I32 *source_ID,
+                        IAEA_I64 *result)
+{
+      // No header found
+      if(p_iaea_header[*source_ID]->fheader == NULL ||
+         p_iaea_header[*destiny_ID]->fheader == NULL) {*result = -1; return;}
+
+      if(p_iaea_header[*source_ID]->same_record_layout(p_iaea_header[*destiny_ID]) != OK)
+      {
+          *result = -2;
+          return;
+      }
+
+      // One block of decoded particles and a mask selecting all of them
+      const IAEA_I32 n_max = APPEND_BLOCK_SIZE;
+      IAEA_I32 *ints = (IAEA_I32 *) malloc((size_t)n_max*(2 + NUM_EXTRA_LONG)*sizeof(IAEA_I32));
+      IAEA_Float *floats = (IAEA_Float *) malloc((size_t)n_max*(8 + NUM_EXTRA_FLOAT)*sizeof(IAEA_Float));
+      IAEA_U64 mask[APPEND_MASK_WORDS];
+      if(ints == NULL || floats == NULL)
+      {
+          fprintf(stderr, "\n ERROR: iaea_append_source: Failed to allocate particle block\n");
+          free(ints); free(floats);
+          *result = -1;
+          return;
+      }
+      memset(mask, 0xFF, sizeof(mask));
+
+      IAEA_I32 *n_stat = ints, *type = ints + n_max, *extra_ints = ints + 2*n_max;
+      IAEA_Float *E = floats, *wt = floats + n_max;
+      IAEA_Float *x = floats + 2*n_max, *y = floats + 3*n_max, *z = floats + 4*n_max;
+      IAEA_Float *u = floats + 5*n_max, *v = floats + 6*n_max, *w = floats + 7*n_max;
+      IAEA_Float *extra_floats = floats + 8*n_max;
+
+      p_iaea_record[*source_ID]->rewind_file();
+
+      IAEA_I64 n_total = 0;
+      for(;;)
+      {
+          IAEA_I32 n_read, n_written;
+          iaea_get_particles_batch(source_ID, &n_max, &n_read, n_stat, type, E, wt,
+                                   x, y, z, u, v, w, extra_floats, extra_ints);
+          if(n_read <= 0) break;
+
+          iaea_copy_particles_batch(source_ID, destiny_ID, &n_read, mask,
+                                    n_stat, type, E, wt, x, y, z, &n_written);
+          if(n_written != n_read)
+          {
+              n_total = -1;
+              break;
+          }
+          n_total += n_read;
+          if(n_read < n_max) break;
+      }
+
+      free(ints);
+      free(floats);
+
+      *result = n_total;
+      return;
+}
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_append_source_(const IAEA_I32 *destiny_ID, const IAEA_I32 *source_ID,
+                        IAEA_I64 *result)
+{ iaea_append_source(destiny_ID, source_ID, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void iaea_append_source__(const IAEA_I32 *destiny_ID, const IAEA_I32 *source_ID,
+                        IAEA_I64 *result)
+{ iaea_append_source(destiny_ID, source_ID, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_APPEND_SOURCE(const IAEA_I32 *destiny_ID, const IAEA_I32 *source_ID,
+                        IAEA_I64 *result)
+{ iaea_append_source(destiny_ID, source_ID, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_APPEND_SOURCE_(const IAEA_I32 *destiny_ID, const IAEA_I32 *source_ID,
+                        IAEA_I64 *result)
+{ iaea_append_source(destiny_ID, source_ID, result); }
+IAEA_EXTERN_C IAEA_EXPORT
+void IAEA_APPEND_SOURCE__(const IAEA_I32 *destiny_ID, const IAEA_I32 *source_ID,
+                        IAEA_I64 *result)
+{ iaea_append_source(destiny_ID, source_ID, result); }
+
 /***************************************************************************
 * Destroy a source
 *
@@ -1476,10 +2858,20 @@ const IAEA_I32 *extra_ints)
 IAEA_EXTERN_C IAEA_EXPORT
 void iaea_destroy_source(const IAEA_I32 *source_ID, IAEA_I32 *result)
 {
-   if(*source_ID > MAX_NUM_SOURCES) { *result = -98 ; return;} // Too big phsp ID
-   if(*source_ID < 0)               { *result = -97 ; return;} // wrong ID number
+   if(*source_ID >= MAX_NUM_SOURCES) { *result = -98 ; return;} // Too big phsp ID
+   if(*source_ID < 0)                { *result = -97 ; return;} // wrong ID number
 
-   if(p_iaea_header[*source_ID]->fheader == NULL) {*result = -1; return;}
+   if(p_iaea_header[*source_ID] == NULL ||
+      p_iaea_header[*source_ID]->fheader == NULL) {*result = -1; return;}
+
+   // The size of a file of compressed records is known once its last
+   // block is written
+   if(p_iaea_record[*source_ID]->use_packed)
+   {
+      IAEA_I64 size = p_iaea_record[*source_ID]->packed_size();
+      if(size >= 0) p_iaea_header[*source_ID]->checksum = size;
+   }
+   stored_quantization(*source_ID);
 
   /* Write an IAEA header */
    // For read-only files nothing happens
@@ -1488,14 +2880,19 @@ void iaea_destroy_source(const IAEA_I32 *source_ID, IAEA_I32 *result)
    // Closing header file
    fclose(p_iaea_header[*source_ID]->fheader);
    // Deallocating IAEA phsp header
+   p_iaea_header[*source_ID]->release();
    free(p_iaea_header[*source_ID]);
+   p_iaea_header[*source_ID] = NULL;
 
    // Closing phsp file
+   p_iaea_record[*source_ID]->release();
    fclose(p_iaea_record[*source_ID]->p_file);
    // Deallocating IAEA record
    free(p_iaea_record[*source_ID]);
+   p_iaea_record[*source_ID] = NULL;
 
-   __iaea_source_used[*source_ID] = false;
+   // The Id can be reused from now on
+   source_slot(*source_ID)->used.store(false);
 
    *result = 1; // Return OK
 
@@ -1569,20 +2966,19 @@ void iaea_copy_header(const IAEA_I32 *source_ID,
             p_iaea_header[*source_ID]->checksum ;
       p_iaea_header[*destiny_ID]->record_length =
             p_iaea_header[*source_ID]->record_length ;
-      p_iaea_header[*destiny_ID]->byte_order =
-            p_iaea_header[*source_ID]->byte_order ;
+      // The destination keeps the byte order it is written in
 
 // ******************************************************************************
 // 2. Mandatory description of the phsp
 
-      strcpy(p_iaea_header[*destiny_ID]->coordinate_system_description,
+      p_iaea_header[*destiny_ID]->set_text(&p_iaea_header[*destiny_ID]->coordinate_system_description,
             p_iaea_header[*source_ID]->coordinate_system_description) ;
 
       int file_type = p_iaea_header[*source_ID]->file_type;
       if(file_type == 1)
       {
             // For event generators
-            strcpy(p_iaea_header[*destiny_ID]->input_file_for_event_generator,
+            p_iaea_header[*destiny_ID]->set_text(&p_iaea_header[*destiny_ID]->input_file_for_event_generator,
                   p_iaea_header[*source_ID]->input_file_for_event_generator) ;
             *result = 1; // Return OK
             return;
@@ -1594,10 +2990,10 @@ void iaea_copy_header(const IAEA_I32 *source_ID,
 // ******************************************************************************
 // 3. Mandatory additional information
       /*********************************************/
-      strcpy(p_iaea_header[*destiny_ID]->machine_type,
+      p_iaea_header[*destiny_ID]->set_text(&p_iaea_header[*destiny_ID]->machine_type,
             p_iaea_header[*source_ID]->machine_type);
 
-      strcpy(p_iaea_header[*destiny_ID]->MC_code_and_version,
+      p_iaea_header[*destiny_ID]->set_text(&p_iaea_header[*destiny_ID]->MC_code_and_version,
             p_iaea_header[*source_ID]->MC_code_and_version);
 
       p_iaea_header[*destiny_ID]->global_photon_energy_cutoff =
@@ -1606,35 +3002,35 @@ void iaea_copy_header(const IAEA_I32 *source_ID,
       p_iaea_header[*destiny_ID]->global_particle_energy_cutoff =
             p_iaea_header[*source_ID]->global_particle_energy_cutoff;
 
-      strcpy(p_iaea_header[*destiny_ID]->transport_parameters,
+      p_iaea_header[*destiny_ID]->set_text(&p_iaea_header[*destiny_ID]->transport_parameters,
             p_iaea_header[*source_ID]->transport_parameters);
 
 // ******************************************************************************
 // 4. Optional description
-      strcpy(p_iaea_header[*destiny_ID]->beam_name,
+      p_iaea_header[*destiny_ID]->set_text(&p_iaea_header[*destiny_ID]->beam_name,
             p_iaea_header[*source_ID]->beam_name);
-      strcpy(p_iaea_header[*destiny_ID]->field_size,
+      p_iaea_header[*destiny_ID]->set_text(&p_iaea_header[*destiny_ID]->field_size,
             p_iaea_header[*source_ID]->field_size);
-      strcpy(p_iaea_header[*destiny_ID]->nominal_SSD,
+      p_iaea_header[*destiny_ID]->set_text(&p_iaea_header[*destiny_ID]->nominal_SSD,
             p_iaea_header[*source_ID]->nominal_SSD);
-      strcpy(p_iaea_header[*destiny_ID]->variance_reduction_techniques,
+      p_iaea_header[*destiny_ID]->set_text(&p_iaea_header[*destiny_ID]->variance_reduction_techniques,
             p_iaea_header[*source_ID]->variance_reduction_techniques);
-      strcpy(p_iaea_header[*destiny_ID]->initial_source_description,
+      p_iaea_header[*destiny_ID]->set_text(&p_iaea_header[*destiny_ID]->initial_source_description,
             p_iaea_header[*source_ID]->initial_source_description);
 
       // Documentation sub-section
       /*********************************************/
-      strcpy(p_iaea_header[*destiny_ID]->MC_input_filename,
+      p_iaea_header[*destiny_ID]->set_text(&p_iaea_header[*destiny_ID]->MC_input_filename,
             p_iaea_header[*source_ID]->MC_input_filename);
-      strcpy(p_iaea_header[*destiny_ID]->published_reference,
+      p_iaea_header[*destiny_ID]->set_text(&p_iaea_header[*destiny_ID]->published_reference,
             p_iaea_header[*source_ID]->published_reference);
-      strcpy(p_iaea_header[*destiny_ID]->authors,
+      p_iaea_header[*destiny_ID]->set_text(&p_iaea_header[*destiny_ID]->authors,
             p_iaea_header[*source_ID]->authors);
-      strcpy(p_iaea_header[*destiny_ID]->institution,
+      p_iaea_header[*destiny_ID]->set_text(&p_iaea_header[*destiny_ID]->institution,
             p_iaea_header[*source_ID]->institution);
-      strcpy(p_iaea_header[*destiny_ID]->link_validation,
+      p_iaea_header[*destiny_ID]->set_text(&p_iaea_header[*destiny_ID]->link_validation,
             p_iaea_header[*source_ID]->link_validation);
-      strcpy(p_iaea_header[*destiny_ID]->additional_notes,
+      p_iaea_header[*destiny_ID]->set_text(&p_iaea_header[*destiny_ID]->additional_notes,
             p_iaea_header[*source_ID]->additional_notes);
 
     *result = 1; // Return OK
@@ -1672,13 +3068,27 @@ void IAEA_COPY_HEADER__(const IAEA_I32 *source_ID,
 /***************************************************************************
 * Update header of the source_id
 *
-* result is set to negative if phsp source does not exist.
+* The particles not written yet are written first.
+* result is set to negative if phsp source does not exist (-1) or the
+* particles could not be written (-2).
 ****************************************************************************/
 IAEA_EXTERN_C IAEA_EXPORT
 void iaea_update_header(const IAEA_I32 *source_ID, IAEA_I32 *result)
 {
    if(p_iaea_header[*source_ID]->fheader == NULL) {*result = -1; return;}
 
+   if(p_iaea_record[*source_ID]->p_behind != NULL &&
+      p_iaea_record[*source_ID]->flush_records() != OK) {*result = -2; return;}
+
+   // Size of a file of compressed records, its last block written
+   if(p_iaea_record[*source_ID]->use_packed)
+   {
+      IAEA_I64 size = p_iaea_record[*source_ID]->packed_size();
+      if(size < 0) {*result = -2; return;}
+      p_iaea_header[*source_ID]->checksum = size;
+   }
+   stored_quantization(*source_ID);
+
   /* Write an IAEA header */
    // For read-only files nothing happens
    p_iaea_header[*source_ID]->write_header();
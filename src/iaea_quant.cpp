@@ -0,0 +1,358 @@
+/*
+ * Quantized records of the phase space files of FILE_TYPE 3 (see
+ * iaea_quant.h).
+ *
+ * The direction (u, v, w) is projected onto the octahedron
+ * |u|+|v|+|w| = 1 and the lower half (w < 0) folded over the edges of the
+ * upper one, which unfolds the whole sphere onto the square
+ * [-1,1] x [-1,1]. Its two coordinates are stored in 8 bits each
+ * (0 to 255 for -1 to 1), the code of a direction being the cell closest
+ * to it on the sphere among the 4 around its projection.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <cfloat>
+#include <mutex>
+
+#include "iaea_quant.h"
+#include "iaea_pack.h"
+#include "iaea_simd.h"
+
+#define QUANT_PI 3.14159265358979323846
+
+// Direction of every code, shared by all the quantizations
+struct quant_direction
+{
+  float u, v, w;
+};
+
+static quant_direction quant_directions[IAEA_QUANT_CODES];
+static std::once_flag quant_directions_once;
+
+static void make_directions()
+{
+  for(int code=0;code<IAEA_QUANT_CODES;code++)
+  {
+     double px = (code & 255)/127.5 - 1.;
+     double py = (code >> 8)/127.5 - 1.;
+     double pw = 1. - fabs(px) - fabs(py);
+     if(pw < 0.)
+     {
+        // Folded lower half
+        double tx = (1. - fabs(py))*(px >= 0. ? 1. : -1.);
+        double ty = (1. - fabs(px))*(py >= 0. ? 1. : -1.);
+        px = tx;
+        py = ty;
+     }
+     double norm = sqrt(px*px + py*py + pw*pw);
+     quant_directions[code].u = (float)(px/norm);
+     quant_directions[code].v = (float)(py/norm);
+     quant_directions[code].w = (float)(pw/norm);
+  }
+}
+
+// Size of a record of floats of the layout of p (see record_size)
+static inline int float_length(const iaea_record_type *p)
+{
+  return 1 + (1 + p->ix + p->iy + p->iz + p->iu + p->iv + p->iweight + p->iextrafloat)*4 +
+         p->iextralong*4;
+}
+
+static inline void put16(unsigned char *p, unsigned int value)
+{
+  p[0] = (unsigned char)value;
+  p[1] = (unsigned char)(value >> 8);
+}
+
+static inline unsigned int get16(const unsigned char *p)
+{
+  return (unsigned int)p[0] | ((unsigned int)p[1] << 8);
+}
+
+iaea_quantization *iaea_quant_new(float resolution, float energy_min, float energy_max)
+{
+  if(!(resolution > 0.f) || !(energy_min > 0.f) || !(energy_max > energy_min))
+     return (NULL);
+
+  iaea_quantization *q = (iaea_quantization *) calloc(1, sizeof(iaea_quantization));
+  if(q == NULL) return (NULL);
+  q->energy = (float *) malloc(IAEA_QUANT_CODES*sizeof(float));
+  if(q->energy == NULL)
+  {
+     free(q);
+     return (NULL);
+  }
+
+  q->resolution = resolution;
+  q->energy_min = energy_min;
+  q->energy_max = energy_max;
+  q->log_step = iaea_quant_log_step(energy_min, energy_max);
+  q->energy[0] = 0.f;
+  for(int code=1;code<IAEA_QUANT_CODES;code++)
+     q->energy[code] = (float)(energy_min*exp(q->log_step*(code - 1)));
+
+  std::call_once(quant_directions_once, make_directions);
+  return (q);
+}
+
+void iaea_quant_free(iaea_quantization *q)
+{
+  if(q == NULL) return;
+  free(q->energy);
+  free(q);
+}
+
+int iaea_quant_layout(const iaea_record_type *p)
+{
+  return (p->iu > 0 && p->iv > 0 && p->iw > 0) ? OK : FAIL;
+}
+
+int iaea_quant_length(const iaea_record_type *p)
+{
+  // particle type, energy, positions, direction, weight and extra numbers
+  return 1 + 2 + 2*((p->ix > 0) + (p->iy > 0) + (p->iz > 0)) + 2 +
+         4*((p->iweight > 0) + p->iextrafloat + p->iextralong);
+}
+
+double iaea_quant_log_step(float energy_min, float energy_max)
+{
+  return (log((double)energy_max/energy_min)/(IAEA_QUANT_CODES - 2));
+}
+
+int iaea_quant_position_range(float resolution, float x)
+{
+  return (fabs(x/(double)resolution) < IAEA_QUANT_POSITION + 0.5) ? OK : FAIL;
+}
+
+int iaea_quant_energy_range(float energy_min, double log_step, float energy)
+{
+  energy = fabsf(energy);
+  if(energy == 0.f) return (OK);
+  double s = log(energy/(double)energy_min)/log_step;
+  return (s > -0.5 && s < IAEA_QUANT_CODES - 1.5) ? OK : FAIL;
+}
+
+int iaea_quant_direction_range(double u, double v, double w)
+{
+  return (fabs(u) + fabs(v) + fabs(w) > 0.) ? OK : FAIL;
+}
+
+// Code of a position, -1 if it is out of range
+static int quantize_position(iaea_quantization *q, float x)
+{
+  if(iaea_quant_position_range(q->resolution, x) != OK)
+  {
+     fprintf(stderr, "\n ERROR: iaea_quantize_records: position %g cm out of the range"
+                     " of the resolution %g cm\n", x, q->resolution);
+     return (-1);
+  }
+
+  int code = (int)floor(x/(double)q->resolution + 0.5);
+  double error = fabs((float)(code*(double)q->resolution) - (double)x);
+  if(error > q->error[0]) q->error[0] = error;
+  return (code & 0xffff);
+}
+
+// Code of an energy, -1 if it is out of range
+static int quantize_energy(iaea_quantization *q, float energy)
+{
+  if(energy == 0.f) return (0);
+
+  if(iaea_quant_energy_range(q->energy_min, q->log_step, energy) != OK)
+  {
+     fprintf(stderr, "\n ERROR: iaea_quantize_records: energy %g MeV out of the range"
+                     " %g to %g MeV\n", energy, q->energy_min, q->energy_max);
+     return (-1);
+  }
+
+  // Code of the closest energy, the logarithm rounded or a neighbour
+  double s = log(energy/(double)q->energy_min)/q->log_step;
+  int code = 1 + (int)floor(s + 0.5);
+  if(code > IAEA_QUANT_CODES - 1) code = IAEA_QUANT_CODES - 1;
+  if(code > 1 && fabs(q->energy[code - 1] - energy) < fabs(q->energy[code] - energy))
+     code--;
+  else if(code < IAEA_QUANT_CODES - 1 &&
+          fabs(q->energy[code + 1] - energy) < fabs(q->energy[code] - energy))
+     code++;
+
+  double error = fabs(q->energy[code] - energy)/energy;
+  if(error > q->error[1]) q->error[1] = error;
+  return (code);
+}
+
+// Angle in degrees between two directions, not necessarily normalized
+static double angle(double u1, double v1, double w1, double u2, double v2, double w2)
+{
+  double cu = v1*w2 - w1*v2, cv = w1*u2 - u1*w2, cw = u1*v2 - v1*u2;
+  return (atan2(sqrt(cu*cu + cv*cv + cw*cw), u1*u2 + v1*v2 + w1*w2)*180./QUANT_PI);
+}
+
+// Code of a direction, -1 if it is not a direction. The error is measured
+// on the directions as they are decoded, w computed in single precision,
+// plus one float epsilon for the rounding of the original w.
+static int quantize_direction(iaea_quantization *q, float fu, float fv, float fw)
+{
+  double u = fu, v = fv, w = fw;
+  if(iaea_quant_direction_range(u, v, w) != OK)
+  {
+     fprintf(stderr, "\n ERROR: iaea_quantize_records: direction (%g,%g,%g) can not"
+                     " be quantized\n", u, v, w);
+     return (-1);
+  }
+
+  double sum = fabs(u) + fabs(v) + fabs(w);
+  double px = u/sum, py = v/sum;
+  if(w < 0.)
+  {
+     double tx = (1. - fabs(py))*(px >= 0. ? 1. : -1.);
+     double ty = (1. - fabs(px))*(py >= 0. ? 1. : -1.);
+     px = tx;
+     py = ty;
+  }
+
+  int ix = (int)floor((px + 1.)*127.5);
+  int iy = (int)floor((py + 1.)*127.5);
+  if(ix < 0) ix = 0;
+  if(ix > 254) ix = 254;
+  if(iy < 0) iy = 0;
+  if(iy > 254) iy = 254;
+
+  // Closest of the 4 cells around the projection
+  int code = 0;
+  double best = -2.;
+  for(int k=0;k<4;k++)
+  {
+     int c = ((iy + (k >> 1)) << 8) | (ix + (k & 1));
+     const quant_direction *d = &quant_directions[c];
+     double dot = d->u*u + d->v*v + d->w*w;
+     if(dot > best) {best = dot; code = c;}
+  }
+
+  const quant_direction *d = &quant_directions[code];
+  IAEA_Float du = d->u, dv = d->v, dw = (d->w < 0.f) ? -1.f : 1.f;
+  iaea_direction_w(1, &du, &dv, &dw);
+  double error = angle(fu, fv, fw, du, dv, dw) + FLT_EPSILON*180./QUANT_PI;
+  if(error > q->error[2]) q->error[2] = error;
+  return (code);
+}
+
+int iaea_quantize_records(iaea_quantization *q, const iaea_record_type *p,
+                          unsigned char *records, int n)
+{
+  if(iaea_quant_layout(p) != OK)
+  {
+     fprintf(stderr, "\n ERROR: iaea_quantize_records: u, v and w must be stored"
+                     " to quantize the records\n");
+     return (FAIL);
+  }
+
+  int reclength = float_length(p);
+  int length = iaea_quant_length(p);
+  int n_words = p->iextrafloat + p->iextralong;
+  unsigned char stored[1 + 2 + 3*2 + 2 + (1 + NUM_EXTRA_FLOAT + NUM_EXTRA_LONG)*4];
+
+  for(int i=0;i<n;i++)
+  {
+     const unsigned char *record = records + (IAEA_I64)i*reclength;
+     float f[6];
+     int n_floats = 1 + p->ix + p->iy + p->iz + 2;
+     memcpy(f, record + 1, n_floats*sizeof(float));
+
+     int type = (signed char)record[0];
+     IAEA_Float sign_w = 1.f;
+     if(type < 0) {type = -type; sign_w = -1.f;}
+     if(type > 127)
+     {
+        fprintf(stderr, "\n ERROR: iaea_quantize_records: particle type %d can not"
+                        " be quantized\n", type);
+        return (FAIL);
+     }
+     unsigned int e;
+     memcpy(&e, &f[0], sizeof(e));
+     stored[0] = (unsigned char)(type | ((e & 0x80000000u) ? 0x80 : 0));
+
+     int code = quantize_energy(q, fabsf(f[0]));
+     if(code < 0) return (FAIL);
+     put16(stored + 1, code);
+
+     int k = 1, out = 3;
+     const int stored_position[3] = {p->ix, p->iy, p->iz};
+     for(int j=0;j<3;j++)
+     {
+        if(stored_position[j] <= 0) continue;
+        if( (code = quantize_position(q, f[k++])) < 0 ) return (FAIL);
+        put16(stored + out, code);
+        out += 2;
+     }
+
+     // w from u and v as the records of floats are read
+     IAEA_Float u = f[k], v = f[k + 1], w = sign_w;
+     iaea_direction_w(1, &u, &v, &w);
+     if( (code = quantize_direction(q, u, v, w)) < 0 ) return (FAIL);
+     put16(stored + out, code);
+     out += 2;
+
+     // Weight and extra numbers kept as they are
+     const unsigned char *word = record + 1 + n_floats*sizeof(float);
+     for(int j=0;j<(p->iweight > 0) + n_words;j++, word += 4, out += 4)
+     {
+        unsigned int bits;
+        memcpy(&bits, word, sizeof(bits));
+        iaea_pack_put32(stored + out, bits);
+     }
+
+     memcpy(records + (IAEA_I64)i*length, stored, (size_t)length);
+  }
+  return (OK);
+}
+
+void iaea_expand_records(const iaea_quantization *q, const iaea_record_type *p,
+                         const unsigned char *stored, unsigned char *records, int n)
+{
+  int reclength = float_length(p);
+  int length = iaea_quant_length(p);
+  int n_words = (p->iweight > 0) + p->iextrafloat + p->iextralong;
+  const int stored_position[3] = {p->ix, p->iy, p->iz};
+  unsigned char record[1 + (NUM_EXTRA_FLOAT + 7)*sizeof(float) +
+                           NUM_EXTRA_LONG*sizeof(IAEA_I32)];
+
+  // From the last record on, as the records grow in place
+  for(int i=n-1;i>=0;i--)
+  {
+     const unsigned char *s = stored + (IAEA_I64)i*length;
+     float f[6];
+     int k = 0, in = 3;
+
+     int type = s[0] & 0x7f;
+     f[k++] = q->energy[get16(s + 1)];
+     if(s[0] & 0x80) f[0] = -f[0]; // sign of the energy set for a new history
+
+     for(int j=0;j<3;j++)
+     {
+        if(stored_position[j] <= 0) continue;
+        int code = (int)get16(s + in);
+        if(code > IAEA_QUANT_POSITION) code -= 65536;
+        f[k++] = (float)(code*(double)q->resolution);
+        in += 2;
+     }
+
+     const quant_direction *d = &quant_directions[get16(s + in)];
+     f[k++] = d->u;
+     f[k++] = d->v;
+     if(d->w < 0.f) type = -type;
+     in += 2;
+
+     record[0] = (unsigned char)(signed char)type;
+     memcpy(record + 1, f, k*sizeof(float));
+     unsigned char *word = record + 1 + k*sizeof(float);
+     for(int j=0;j<n_words;j++, word += 4, in += 4)
+     {
+        unsigned int bits = (unsigned int)iaea_pack_get32(s + in);
+        memcpy(word, &bits, sizeof(bits));
+     }
+
+     memcpy(records + (IAEA_I64)i*reclength, record, (size_t)reclength);
+  }
+}
@@ -46,15 +46,34 @@
 
 #if (defined WIN32) || (defined WIN64)
 #include <iostream>  // so that namespace std becomes defined
+#include <io.h>
 #endif
 #include <math.h>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#if !(defined WIN32) && !(defined WIN64)
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #if !(defined WIN32) && !(defined WIN64)
 using namespace std;
 #endif
 
 #include "iaea_record.h"
+#include "iaea_simd.h"
+#include "iaea_pack.h"
+#include "iaea_quant.h"
+#include "iaea_column.h"
 
 short iaea_record_type::initialize()
 {
@@ -92,24 +111,69 @@ short iaea_record_type::initialize()
 }
 
 short iaea_record_type::write_particle()
+{
+  unsigned char buffer[1 + (NUM_EXTRA_FLOAT+7)*sizeof(float) +
+                           NUM_EXTRA_LONG*sizeof(IAEA_I32)];
+  unsigned char *record = buffer;
+
+  // The whole record is written at once (particle type, floats and longs),
+  // it is encoded straight into the write-behind buffer if there is one
+  // (or collected with the records of a compressed block, or quantized)
+  int buffered = (use_behind || use_packed || p_quant != NULL);
+  if(buffered && (record = output_records(1)) == NULL) return (FAIL);
+
+  int reclength = pack_particle(record);
+
+  if(swap_bytes && !buffered) iaea_swap_records(buffer, buffer, 1, reclength);
+
+  if(buffered)
+  {
+    if(commit_records(1) != OK)
+    {
+      fprintf(stderr, "\n ERROR: write_particle: Failed to write particle record\n");
+      return (FAIL);
+    }
+  }
+  else if( fwrite(buffer, sizeof(char), (size_t)reclength, p_file) != (size_t)reclength)
+  {
+    fprintf(stderr, "\n ERROR: write_particle: Failed to write particle record\n");
+    return (FAIL);
+  }
+
+  if(reclength == 0) return(FAIL);
+
+  #ifdef DEBUG
+  // charge defined
+  int iaea_charge[MAX_NUM_PARTICLES]={0,-1,+1,0,+1};
+  int charge = iaea_charge[particle - 1];
+  int j;
+
+  printf("\n Wrote a particle with a record lenght %d",reclength);
+  printf("\n Q %d E %f X %f Y %f Z %f \n\t u %f v %f w %f W %f Part %d \n",
+  charge, energy, x, y, z, u, v, w, weight, particle);
+  if( iextrafloat > 0) printf(" EXTRA FLOATs:");
+  for(j=0;j<iextrafloat;j++) printf(" F%i %f",j+1,extrafloat[j]);
+  if( iextralong > 0)  printf(" EXTRA LONGs:");
+  for(j=0;j<iextralong;j++) printf(" L%i %d", j+1,extralong[j]);
+  printf("\n");
+  #endif
+
+  return(OK);
+}
+
+int iaea_record_type::pack_particle(unsigned char *record)
 {
   float floatArray[NUM_EXTRA_FLOAT+7];
-  IAEA_I32 longArray[NUM_EXTRA_LONG];
 
   char ishort = (char) particle;
   if(w < 0) ishort = -ishort; // Sign of w is stored in particle type
 
-  if( fwrite(&ishort, sizeof(char),   1, p_file) != 1)
-  {
-    fprintf(stderr, "\n ERROR: write_particle: Failed to write particle type\n");
-    return (FAIL);;
-  }
+  record[0] = (unsigned char) ishort;
 
   int reclength = sizeof(char);
 
-  if(IsNewHistory > 0) energy *= (-1); // New history is signaled by negative energy
-
   floatArray[0] = energy;
+  if(IsNewHistory > 0) floatArray[0] = -energy; // New history is signaled by negative energy
 
   int i = 0;
 
@@ -123,66 +187,130 @@ short iaea_record_type::write_particle()
   int j;
   for(j=0;j<iextrafloat;j++) floatArray[++i] = extrafloat[j];
 
+  memcpy(record + reclength, floatArray, (i+1)*sizeof(float));
   reclength += (i+1)*sizeof(float);
 
-  if( fwrite(floatArray, sizeof(float), (size_t)(i+1), p_file) != (size_t) (i+1))
-  {
-     fprintf(stderr, "\n ERROR: write_particle: Failed to write FLOAT phsp data\n");
-     return (FAIL);
-  }
-
   if(iextralong > 0)
   {
-     for(j=0;j<iextralong;j++) longArray[j] = extralong[j];
+     memcpy(record + reclength, extralong, iextralong*sizeof(IAEA_I32));
      reclength += iextralong*sizeof(IAEA_I32);
-     if( fwrite(longArray, sizeof(IAEA_I32), (size_t)iextralong, p_file) != (size_t)iextralong)
-     {
-        fprintf(stderr, "\n ERROR: write_particle: Failed to write LONG phsp data\n");
-        return (FAIL);
-     }
   }
 
-  if(reclength == 0) return(FAIL);
+  return(reclength);
+}
 
-  #ifdef DEBUG
-  // charge defined
-  int iaea_charge[MAX_NUM_PARTICLES]={0,-1,+1,0,+1};
-  int charge = iaea_charge[particle - 1];
+int iaea_record_type::record_size()
+{
+  // particle type, energy and the stored floats and longs (w is never stored)
+  return sizeof(char) +
+         (1 + ix + iy + iz + iu + iv + iweight + iextrafloat)*sizeof(float) +
+         iextralong*sizeof(IAEA_I32);
+}
 
-  printf("\n Wrote a particle with a record lenght %d",reclength);
-  printf("\n Q %d E %f X %f Y %f Z %f \n\t u %f v %f w %f W %f Part %d \n",
-  charge, energy, x, y, z, u, v, w, weight, particle);
-  if( iextrafloat > 0) printf(" EXTRA FLOATs:");
-  for(j=0;j<iextrafloat;j++) printf(" F%i %f",j+1,extrafloat[j]);
-  if( iextralong > 0)  printf(" EXTRA LONGs:");
-  for(j=0;j<iextralong;j++) printf(" L%i %d", j+1,extralong[j]);
-  printf("\n");
-  #endif
+// Size of a record in the phsp file, smaller than record_size() if the
+// records are quantized
+int iaea_record_type::stored_size()
+{
+  if(p_quant != NULL) return (iaea_quant_length(this));
+  return (record_size());
+}
 
-  return(OK);
+// Stores the records quantized to the given position resolution (cm) and
+// energy range (MeV) from now on, resolution = 0 switches back to records
+// of floats. Set before the first record is written.
+short iaea_record_type::set_quantization(float resolution, float energy_min,
+                                         float energy_max)
+{
+  iaea_quant_free(p_quant);
+  p_quant = NULL;
+  if(resolution == 0.f) return (OK);
+
+  if( (p_quant = iaea_quant_new(resolution, energy_min, energy_max)) == NULL )
+  {
+     fprintf(stderr, "\n ERROR: set_quantization: Wrong quantization parameters\n");
+     return (FAIL);
+  }
+  return (OK);
 }
 
 short iaea_record_type::read_particle()
 {
-  float floatArray[NUM_EXTRA_FLOAT+7];
-  IAEA_I32 longArray[NUM_EXTRA_LONG+7];
-  int i,j,is,reclength;
-  char ctmp;
+  unsigned char buffer[1 + (NUM_EXTRA_FLOAT+7)*sizeof(float) +
+                           NUM_EXTRA_LONG*sizeof(IAEA_I32)];
+  const unsigned char *record;
+  int reclength = stored_size();
 
   // IAEA_I32 pos = ftell(p_file); // To check file position
 
-  if( fread(&ctmp, sizeof(char),   1, p_file) != 1) // particle type is always read
+  block_count = 0;
+  if(range_first != NULL)
+  {
+    int n_got;
+    if( (record = next_records(1, &n_got)) == NULL)
+    {
+      fprintf(stderr, "\n ERROR: read_particle: Failed to read particle record\n");
+      return (FAIL);
+    }
+  }
+  else if(use_map)
+  {
+    int n_got;
+    if( (record = map_records(reclength, 1, &n_got)) == NULL)
+    {
+      fprintf(stderr, "\n ERROR: read_particle: Failed to read mapped record\n");
+      return (FAIL);
+    }
+  }
+  else if(use_ahead)
+  {
+    int n_got;
+    if( (record = ahead_records(reclength, 1, &n_got)) == NULL)
+    {
+      fprintf(stderr, "\n ERROR: read_particle: Failed to read particle record\n");
+      return (FAIL);
+    }
+  }
+  else
+  {
+    // The whole record is read at once (particle type, floats and longs)
+    if( read_raw(buffer, reclength, 1) != 1 )
+    {
+      fprintf(stderr, "\n ERROR: read_particle: Failed to read particle record\n");
+      return (FAIL);
+    }
+    record = buffer;
+  }
+
+  if(p_quant != NULL)
+  {
+    iaea_expand_records(p_quant, this, record, buffer, 1);
+    record = buffer;
+  }
+  else if(swap_bytes)
   {
-    fprintf(stderr, "\n ERROR: read_particle: Failed to read particle type\n");
-    return (FAIL);;
+    iaea_swap_records(record, buffer, 1, reclength);
+    record = buffer;
   }
 
+  if( unpack_particle(record) == FAIL ) return (FAIL);
+
+  return(reclength);
+}
+
+short iaea_record_type::unpack_particle(const unsigned char *record)
+{
+  float floatArray[NUM_EXTRA_FLOAT+7];
+  IAEA_I32 longArray[NUM_EXTRA_LONG+7];
+  int i,j,is;
+  char ctmp;
+
+  ctmp = (char) record[0]; // particle type is always read
+
   particle = (short) ctmp;
 
   is = 1; // getting sign of Z director cosine w
   if(particle < 0) {is = -1; particle = -particle;}
 
-  reclength = sizeof(char);      // particle type is always read
   unsigned int rec_to_read = 1;    // energy is always read
 
   if(ix > 0) rec_to_read++;
@@ -193,14 +321,7 @@ short iaea_record_type::read_particle()
   if(iweight > 0) rec_to_read++;
   if(iextrafloat>0) rec_to_read += iextrafloat;
 
-  if( fread(floatArray, sizeof(float), rec_to_read, p_file) != rec_to_read)
-  {
-    fprintf(stderr, "\n ERROR: read_particle: Failed to read FLOATs \n");
-    return (FAIL);;
-  }
-
-  reclength += rec_to_read*sizeof(float);
-
+  memcpy(floatArray, record + sizeof(char), rec_to_read*sizeof(float));
 
   IsNewHistory = 0;
   if(floatArray[0]<0) IsNewHistory = 1; // like egsnrc
@@ -230,13 +351,9 @@ short iaea_record_type::read_particle()
 
   if(iextralong > 0)
   {
-     if( fread(longArray, sizeof(IAEA_I32), (size_t)iextralong, p_file) != (size_t)iextralong)
-     {
-       fprintf(stderr, "\n ERROR: read_particle: Failed to read LONGS\n");
-       return (FAIL);
-     }
+     memcpy(longArray, record + sizeof(char) + rec_to_read*sizeof(float),
+            iextralong*sizeof(IAEA_I32));
      for(int l=0,j=0;j<iextralong;j++) extralong[j] = longArray[l++];
-     reclength += (iextralong)*sizeof(IAEA_I32);
   }
 
   #ifdef DEBUG
@@ -245,7 +362,7 @@ short iaea_record_type::read_particle()
   int charge = iaea_charge[particle - 1];
 
   printf("\n Read a particle with a record lenght %d (New History: %d)",
-               reclength,IsNewHistory);
+               record_size(),IsNewHistory);
   printf("\n Q %d E %f X %f Y %f Z %f \n\t u %f v %f w %f W %f Part %d \n",
   charge, energy, x, y, z, u, v, w, weight, particle);
   if( iextrafloat > 0) printf(" EXTRA FLOATs:");
@@ -254,5 +371,1719 @@ short iaea_record_type::read_particle()
   for(j=0;j<iextralong;j++)  printf(" L%i %d",j+1,extralong[j]);
   printf("\n");
   #endif
-  return(reclength);
+  return(OK);
+}
+
+/* *********************************************************************** */
+// Memory mapped reading
+//
+// The phsp file is mapped in windows of IAEA_MAP_WINDOW bytes which are
+// moved along the file as records are consumed, so files larger than the
+// available address space can be read. The kernel is told that the access
+// is sequential and the next IAEA_MAP_READAHEAD bytes are requested in
+// advance while the current ones are decoded.
+
+short iaea_record_type::map_file()
+{
+#if (defined WIN32) || (defined WIN64)
+  fprintf(stderr, "\n ERROR: map_file: memory mapped reading is not available\n");
+  return (FAIL);
+#else
+  struct stat fileStatus;
+
+  if(p_file == NULL || use_packed) return (FAIL);
+
+  if( fstat(fileno(p_file),&fileStatus) != 0 )
+  {
+     fprintf(stderr, "\n ERROR: map_file: Failed to get phsp file size\n");
+     return (FAIL);
+  }
+
+  file_size = fileStatus.st_size;
+  map_position = (IAEA_I64)ftell(p_file);
+  map_offset = map_length = map_advised = 0;
+  p_map = NULL;
+  use_map = 1;
+
+  return (OK);
+#endif
+}
+
+short iaea_record_type::unmap_file()
+{
+#if !(defined WIN32) && !(defined WIN64)
+  if(p_map != NULL) munmap(p_map, (size_t)map_length);
+#endif
+  p_map = NULL;
+  map_offset = map_length = 0;
+  use_map = 0;
+  return (OK);
+}
+
+const unsigned char *iaea_record_type::map_records(int reclength, int n, int *n_got)
+{
+  *n_got = 0;
+#if (defined WIN32) || (defined WIN64)
+  return (NULL);
+#else
+  if(map_position + reclength > file_size) return (NULL); // end of file
+
+  if( p_map == NULL || map_position < map_offset ||
+      map_position + reclength > map_offset + map_length )
+  {
+     // Moving the window, which has to start at a page boundary
+     if(p_map != NULL) munmap(p_map, (size_t)map_length);
+     p_map = NULL;
+
+     IAEA_I64 page = (IAEA_I64)sysconf(_SC_PAGESIZE);
+     map_offset = map_position - map_position % page;
+     map_length = file_size - map_offset;
+     if(map_length > IAEA_MAP_WINDOW) map_length = IAEA_MAP_WINDOW;
+
+     void *p = mmap(NULL, (size_t)map_length, PROT_READ, MAP_SHARED,
+                    fileno(p_file), (off_t)map_offset);
+     if(p == MAP_FAILED)
+     {
+        fprintf(stderr, "\n ERROR: map_records: Failed to map phsp file\n");
+        map_length = 0;
+        return (NULL);
+     }
+     p_map = (unsigned char *) p;
+     madvise(p_map, (size_t)map_length, (range_first != NULL) ? MADV_RANDOM : MADV_SEQUENTIAL);
+     map_advised = map_offset;
+  }
+
+  // Whole records left in the window
+  IAEA_I64 available = (map_offset + map_length - map_position)/reclength;
+  if(available > n) available = n;
+
+  const unsigned char *records = p_map + (map_position - map_offset);
+  map_position += available*reclength;
+  *n_got = (int)available;
+
+  if(range_first != NULL) advise_ranges(reclength);
+  else if(map_position + IAEA_MAP_READAHEAD/2 > map_advised &&
+     map_advised < map_offset + map_length)
+  {
+     // Asking for the next part of the window to be read in advance
+     if(map_advised < map_position) map_advised = map_position;
+     IAEA_I64 start = map_advised - map_offset;
+     start -= start % (IAEA_I64)sysconf(_SC_PAGESIZE);
+     IAEA_I64 length = map_offset + map_length - map_advised;
+     if(length > IAEA_MAP_READAHEAD) length = IAEA_MAP_READAHEAD;
+     madvise(p_map + start, (size_t)length, MADV_WILLNEED);
+     map_advised += length;
+  }
+
+  return (records);
+#endif
+}
+
+/* *********************************************************************** */
+// Compressed records
+//
+// The records of a phsp file of FILE_TYPE 2 are stored in blocks
+// compressed with iaea_pack_records (see iaea_pack.h). The file is read as
+// if it held the raw records: the position of the next record is kept as
+// the offset it would have among the raw records, and the block holding
+// it is decoded into records as a whole. Read ahead, the reader thread
+// decodes block after block into its buffers instead. Records written are
+// collected until a block is full, which is then compressed and written
+// (by the writer thread if there is one). finish_packed writes the block
+// not yet full, the block table and the trailer; the next record written
+// cuts them off the file again.
+//
+// The blocks of a phsp file of FILE_TYPE 4 hold the columns of the records
+// instead (see iaea_column.h) and are read the same way. Only the columns
+// selected by set_columns are read from a block then, and gather_records
+// reads the values of the other ones for the records kept.
+
+struct iaea_packed
+{
+  int block;               // records per block
+  int reclength;
+  int columnar;            // 1 if the blocks hold columns (FILE_TYPE 4, see iaea_column.h)
+  unsigned int columns;    // columns loaded from a block (bit j for column j)
+  int writing;             // 1 if the file is written
+  IAEA_I64 n_records;      // records in the file (reading)
+  IAEA_I64 n_blocks;       // blocks in the file, full blocks written
+  IAEA_I64 *offset;        // file offset of every block
+  IAEA_I64 offset_capacity;
+  unsigned char *data;     // compressed block
+  IAEA_I64 data_capacity;
+  unsigned char *records;  // block decoded, or records of the block being filled
+  IAEA_I64 records_capacity;
+  IAEA_I64 end;            // size of the file (reading, and writing once finished)
+
+  // Reading
+  IAEA_I64 position;       // offset of the next record among the raw records
+  IAEA_I64 loaded;         // block decoded into records, -1 if none
+  IAEA_I64 n_loaded;       // records of that block
+
+  // Writing
+  IAEA_I64 staged;         // records of the block being filled
+  IAEA_I64 tail;           // file offset after the last full block
+  int finished;            // the block being filled, table and trailer are written
+};
+
+static const char packed_magic[8] = { 'I','A','E','A','P','A','C','K' };
+static const char column_magic[8] = { 'I','A','E','A','C','O','L','S' };
+
+// Columns of a record of reclength bytes and the mask of all of them
+static inline int columns_of(int reclength)
+{
+  return 1 + (reclength - 1)/4;
+}
+
+static inline unsigned int all_columns(int reclength)
+{
+  return (columns_of(reclength) >= 32) ? ~0u : (1u << columns_of(reclength)) - 1;
+}
+
+static short grow_buffer(unsigned char **buffer, IAEA_I64 *capacity, IAEA_I64 size)
+{
+  if(size <= *capacity && *buffer != NULL) return (OK);
+  unsigned char *p = (unsigned char *) realloc(*buffer, (size_t)(size > 0 ? size : 1));
+  if(p == NULL) return (FAIL);
+  *buffer = p;
+  *capacity = size;
+  return (OK);
+}
+
+static short add_block(iaea_packed *k, IAEA_I64 offset)
+{
+  if(k->n_blocks >= k->offset_capacity)
+  {
+     IAEA_I64 capacity = (k->offset_capacity > 0) ? 2*k->offset_capacity : 1024;
+     IAEA_I64 *p = (IAEA_I64 *) realloc(k->offset, (size_t)capacity*sizeof(IAEA_I64));
+     if(p == NULL) return (FAIL);
+     k->offset = p;
+     k->offset_capacity = capacity;
+  }
+  k->offset[k->n_blocks++] = offset;
+  return (OK);
+}
+
+// Records of block i of the file
+static IAEA_I64 block_records_of(const iaea_packed *k, IAEA_I64 i)
+{
+  IAEA_I64 left = k->n_records - i*k->block;
+  return (left < k->block) ? left : k->block;
+}
+
+// Reads the columns of k->columns of a block of n records, the file
+// positioned after its header, into records. Runs of consecutive columns
+// are read at once into *data, the other columns of the records are 0.
+static short load_columns(const iaea_packed *k, FILE *p_file, IAEA_I64 n,
+                          unsigned char *records, unsigned char **data, IAEA_I64 *capacity)
+{
+  int n_columns = columns_of(k->reclength);
+  IAEA_I64 position = 0; // offset in the block data the file is at
+  if(k->columns != all_columns(k->reclength))
+     memset(records, 0, (size_t)(n*k->reclength));
+
+  for(int j=0;j<n_columns;)
+  {
+     if( !((k->columns >> j) & 1) ) { j++; continue; }
+     int last = j;
+     while(last + 1 < n_columns && ((k->columns >> (last + 1)) & 1)) last++;
+
+     IAEA_I64 start = iaea_column_offset((int)n, k->reclength, j);
+     IAEA_I64 size = iaea_column_offset((int)n, k->reclength, last + 1) - start;
+     if( grow_buffer(data, capacity, size) != OK ||
+         (start != position && fseek(p_file, start - position, SEEK_CUR) != 0) ||
+         fread(*data, 1, (size_t)size, p_file) != (size_t)size ) return (FAIL);
+     position = start + size;
+
+     for(;j<=last;j++)
+        iaea_column_scatter(*data + iaea_column_offset((int)n, k->reclength, j) - start,
+                            (int)n, k->reclength, j, records);
+  }
+  return (OK);
+}
+
+// Reads block i of the file and decodes it into records, the compressed
+// data are read into *data. Returns the records decoded, -1 if the block
+// cannot be read.
+static IAEA_I64 load_block(const iaea_packed *k, FILE *p_file, IAEA_I64 i,
+                           unsigned char *records, unsigned char **data, IAEA_I64 *capacity)
+{
+  unsigned char head[IAEA_PACK_BLOCK_HEADER];
+  IAEA_I64 n = block_records_of(k, i);
+
+  if( fseek(p_file, k->offset[i], SEEK_SET) != 0 ||
+      fread(head, 1, sizeof(head), p_file) != sizeof(head) ) return (-1);
+
+  IAEA_I64 size = iaea_pack_get32(head + 4);
+  int damaged = (iaea_pack_get32(head) != n);
+  if(k->columnar)
+     damaged = damaged || size != iaea_column_size((int)n, k->reclength) ||
+               load_columns(k, p_file, n, records, data, capacity) != OK;
+  else
+     damaged = damaged || size > iaea_pack_bound((int)n, k->reclength) ||
+               grow_buffer(data, capacity, size) != OK ||
+               fread(*data, 1, (size_t)size, p_file) != (size_t)size ||
+               iaea_unpack_records(*data, size, (int)n, k->reclength, records) != OK;
+  if(damaged)
+  {
+     fprintf(stderr, "\n ERROR: load_block: Block %lld of the phsp file is damaged\n",
+             (long long)(i + 1));
+     return (-1);
+  }
+  return (n);
+}
+
+// Compresses n records (or splits them into columns) and writes them as
+// a block at the current file position. Returns the bytes written, -1 if
+// the write failed.
+static IAEA_I64 write_block(iaea_packed *k, FILE *p_file, const unsigned char *records, int n)
+{
+  IAEA_I64 bound = IAEA_PACK_BLOCK_HEADER + (k->columnar ? iaea_column_size(n, k->reclength)
+                                                         : iaea_pack_bound(n, k->reclength));
+  if(grow_buffer(&k->data, &k->data_capacity, bound) != OK) return (-1);
+
+  IAEA_I64 size = bound - IAEA_PACK_BLOCK_HEADER;
+  if(k->columnar) iaea_column_records(records, n, k->reclength, k->data + IAEA_PACK_BLOCK_HEADER);
+  else size = iaea_pack_records(records, n, k->reclength, k->data + IAEA_PACK_BLOCK_HEADER);
+  iaea_pack_put32(k->data, n);
+  iaea_pack_put32(k->data + 4, size);
+  size += IAEA_PACK_BLOCK_HEADER;
+
+  if( fwrite(k->data, 1, (size_t)size, p_file) != (size_t)size ) return (-1);
+  return (size);
+}
+
+static short write_full_block(iaea_packed *k, FILE *p_file, const unsigned char *records)
+{
+  IAEA_I64 size = write_block(k, p_file, records, k->block);
+  if(size < 0 || add_block(k, k->tail) != OK) return (FAIL);
+  k->tail += size;
+  return (OK);
+}
+
+// Cuts the block not yet full, the table and the trailer off the file
+static short resume_packed(iaea_packed *k, FILE *p_file)
+{
+  if(fflush(p_file) != 0) return (FAIL);
+#if (defined WIN32) || (defined WIN64)
+  if(_chsize_s(_fileno(p_file), k->tail) != 0) return (FAIL);
+#else
+  if(ftruncate(fileno(p_file), (off_t)k->tail) != 0) return (FAIL);
+#endif
+  if( fseek(p_file, k->tail, SEEK_SET) != 0 ) return (FAIL);
+  k->finished = 0;
+  return (OK);
+}
+
+// Adds size bytes of raw records to the file
+static short write_packed(iaea_packed *k, FILE *p_file, const unsigned char *records,
+                          IAEA_I64 size)
+{
+  if(k->finished && resume_packed(k, p_file) != OK) return (FAIL);
+
+  IAEA_I64 block_size = (IAEA_I64)k->block*k->reclength;
+  if(grow_buffer(&k->records, &k->records_capacity, block_size) != OK) return (FAIL);
+
+  IAEA_I64 n = size/k->reclength;
+  while(n > 0)
+  {
+     if(k->staged == 0 && n >= k->block)
+     {
+        // A whole block is compressed where it is
+        if(write_full_block(k, p_file, records) != OK) return (FAIL);
+        records += block_size;
+        n -= k->block;
+        continue;
+     }
+
+     IAEA_I64 m = k->block - k->staged;
+     if(m > n) m = n;
+     memcpy(k->records + k->staged*k->reclength, records, (size_t)(m*k->reclength));
+     k->staged += m;
+     records += m*k->reclength;
+     n -= m;
+     if(k->staged == k->block)
+     {
+        if(write_full_block(k, p_file, k->records) != OK) return (FAIL);
+        k->staged = 0;
+     }
+  }
+  return (OK);
+}
+
+// Writes the block being filled, the block table and the trailer
+static short finish_packed(iaea_packed *k, FILE *p_file)
+{
+  if(!k->writing || k->finished) return (OK);
+
+  IAEA_I64 end = k->tail;
+  if(k->staged > 0)
+  {
+     IAEA_I64 size = write_block(k, p_file, k->records, (int)k->staged);
+     if(size < 0 || add_block(k, end) != OK) return (FAIL);
+     end += size;
+  }
+
+  IAEA_I64 size = k->n_blocks*8 + IAEA_PACK_TRAILER;
+  if(grow_buffer(&k->data, &k->data_capacity, size) != OK) return (FAIL);
+  unsigned char *p = k->data;
+  for(IAEA_I64 i=0;i<k->n_blocks;i++, p+=8) iaea_pack_put64(p, k->offset[i]);
+  memcpy(p, k->columnar ? column_magic : packed_magic, sizeof(packed_magic));
+  iaea_pack_put32(p + 8, k->columnar ? IAEA_COLUMN_VERSION : IAEA_PACK_VERSION);
+  iaea_pack_put32(p + 12, k->block);
+  iaea_pack_put64(p + 16, (k->n_blocks - (k->staged > 0))*k->block + k->staged);
+  iaea_pack_put64(p + 24, k->n_blocks);
+
+  // The block being filled is written again with the next records
+  if(k->staged > 0) k->n_blocks--;
+
+  if( fwrite(k->data, 1, (size_t)size, p_file) != (size_t)size ) return (FAIL);
+  k->end = end + size;
+  k->finished = 1;
+  return (OK);
+}
+
+// Writes the records in blocks of block records from now on, compressed
+// or split into columns (columnar = 1), block = 0 switches back to raw
+// records. Set before the first record is written.
+short iaea_record_type::set_packed(int block, int columnar)
+{
+  if(block <= 0)
+  {
+     if(p_packed != NULL)
+     {
+        free(p_packed->offset);
+        free(p_packed->data);
+        free(p_packed->records);
+        delete p_packed;
+        p_packed = NULL;
+     }
+     use_packed = 0;
+     return (OK);
+  }
+
+  if(p_packed == NULL)
+  {
+     p_packed = new (std::nothrow) iaea_packed();
+     if(p_packed == NULL) return (FAIL);
+  }
+  p_packed->block = block;
+  p_packed->reclength = stored_size();
+  p_packed->columnar = columnar;
+  p_packed->columns = all_columns(p_packed->reclength);
+  p_packed->writing = 1;
+  p_packed->loaded = -1;
+  use_packed = 1;
+  return (OK);
+}
+
+// Reads the block table of the file (of columns if columnar = 1). A file
+// appended to (append = 1) is written on from the last block, which is
+// decoded again if it is not full.
+short iaea_record_type::open_packed(int append, int columnar)
+{
+  if(set_packed(IAEA_PACK_BLOCK_RECORDS, columnar) != OK)
+  {
+     fprintf(stderr, "\n ERROR: open_packed: Failed to allocate block table\n");
+     return (FAIL);
+  }
+  iaea_packed *k = p_packed;
+  k->writing = 0;
+
+  unsigned char trailer[IAEA_PACK_TRAILER];
+  IAEA_I64 size = -1;
+  if( fseek(p_file, 0, SEEK_END) == 0 ) size = (IAEA_I64)ftell(p_file);
+  if( size < IAEA_PACK_TRAILER ||
+      fseek(p_file, size - IAEA_PACK_TRAILER, SEEK_SET) != 0 ||
+      fread(trailer, 1, sizeof(trailer), p_file) != sizeof(trailer) ||
+      memcmp(trailer, columnar ? column_magic : packed_magic, sizeof(packed_magic)) != 0 )
+  {
+     fprintf(stderr, "\n ERROR: open_packed: The phsp file has no block table\n");
+     return (FAIL);
+  }
+  if(iaea_pack_get32(trailer + 8) != (columnar ? IAEA_COLUMN_VERSION : IAEA_PACK_VERSION))
+  {
+     fprintf(stderr, "\n ERROR: open_packed: Unknown version %lld of %s\n",
+             (long long)iaea_pack_get32(trailer + 8),
+             columnar ? "columns" : "compressed records");
+     return (FAIL);
+  }
+  k->block = (int)iaea_pack_get32(trailer + 12);
+  k->n_records = iaea_pack_get64(trailer + 16);
+  IAEA_I64 n_blocks = iaea_pack_get64(trailer + 24);
+  IAEA_I64 table = size - IAEA_PACK_TRAILER - 8*n_blocks;
+  if( k->block <= 0 || k->n_records < 0 || n_blocks < 0 || table < 0 ||
+      n_blocks != (k->n_records + k->block - 1)/k->block )
+  {
+     fprintf(stderr, "\n ERROR: open_packed: The block table of the phsp file is damaged\n");
+     return (FAIL);
+  }
+
+  k->n_blocks = 0;
+  if(grow_buffer(&k->data, &k->data_capacity, 8*n_blocks) != OK ||
+     fseek(p_file, table, SEEK_SET) != 0 ||
+     fread(k->data, 1, (size_t)(8*n_blocks), p_file) != (size_t)(8*n_blocks))
+  {
+     fprintf(stderr, "\n ERROR: open_packed: Failed to read the block table\n");
+     return (FAIL);
+  }
+  for(IAEA_I64 i=0;i<n_blocks;i++)
+  {
+     IAEA_I64 offset = iaea_pack_get64(k->data + 8*i);
+     if( (i > 0 && offset <= k->offset[i-1]) || offset < 0 || offset >= table ||
+         add_block(k, offset) != OK )
+     {
+        fprintf(stderr, "\n ERROR: open_packed: The block table of the phsp file is damaged\n");
+        return (FAIL);
+     }
+  }
+  k->end = size;
+  k->loaded = -1;
+  k->position = 0;
+  if(grow_buffer(&k->records, &k->records_capacity,
+                 (IAEA_I64)k->block*k->reclength) != OK) return (FAIL);
+
+  if(append)
+  {
+     // New records are added to the last block if it is not full
+     k->writing = 1;
+     k->finished = 1;
+     k->tail = table;
+     k->staged = 0;
+     if(k->n_records % k->block != 0)
+     {
+        IAEA_I64 last = n_blocks - 1;
+        if( (k->staged = load_block(k, p_file, last, k->records,
+                                    &k->data, &k->data_capacity)) < 0 ) return (FAIL);
+        k->tail = k->offset[last];
+        k->n_blocks--;
+     }
+  }
+  if( fseek(p_file, 0, SEEK_SET) != 0 ) return (FAIL);
+  return (OK);
+}
+
+// Size of the file, once the records written are flushed
+IAEA_I64 iaea_record_type::packed_size()
+{
+  if(!use_packed) return (-1);
+  if(p_packed->writing && flush_records() != OK) return (-1);
+  return (p_packed->end);
+}
+
+// Up to n raw records from the current position, decoding the blocks
+// they are stored in
+static size_t read_packed(iaea_packed *k, FILE *p_file, unsigned char *records, size_t n)
+{
+  size_t n_got = 0;
+  IAEA_I64 block_size = (IAEA_I64)k->block*k->reclength;
+  while(n_got < n)
+  {
+     IAEA_I64 i = k->position/block_size;
+     if(i >= k->n_blocks) break;
+     if(i != k->loaded)
+     {
+        k->loaded = -1;
+        if( (k->n_loaded = load_block(k, p_file, i, k->records,
+                                      &k->data, &k->data_capacity)) < 0 ) break;
+        k->loaded = i;
+     }
+     IAEA_I64 first = (k->position - i*block_size)/k->reclength;
+     IAEA_I64 m = k->n_loaded - first;
+     if(m <= 0) break;
+     if(m > (IAEA_I64)(n - n_got)) m = (IAEA_I64)(n - n_got);
+     memcpy(records + n_got*k->reclength, k->records + first*k->reclength,
+            (size_t)(m*k->reclength));
+     n_got += (size_t)m;
+     k->position += m*k->reclength;
+  }
+  return (n_got);
+}
+
+// Positioning and reading raw records, whether they are stored raw or in
+// compressed blocks
+
+short iaea_record_type::set_position(IAEA_I64 offset)
+{
+  if(use_packed)
+  {
+     p_packed->position = offset;
+     return (OK);
+  }
+  if( fseek(p_file, offset, SEEK_SET) != 0 ) return (FAIL);
+  return (OK);
+}
+
+IAEA_I64 iaea_record_type::get_position()
+{
+  if(use_packed) return (p_packed->position);
+  return ((IAEA_I64)ftell(p_file));
+}
+
+size_t iaea_record_type::read_raw(unsigned char *records, int reclength, size_t n)
+{
+  if(use_packed) return (read_packed(p_packed, p_file, records, n));
+  return (fread(records, (size_t)reclength, n, p_file));
+}
+
+// Reads only the columns holding the variables of the mask variables
+// (IAEA_COLUMN_*) from the blocks of a file of columns, from the next
+// block loaded on; the other values of the records read are 0 until
+// gather_records reads them. The energy and the type byte if w is asked
+// for are always read, IAEA_COLUMN_ALL reads whole records again. Leaving
+// columns out stops the read-ahead, the columns are read as they are
+// needed.
+short iaea_record_type::set_columns(int variables)
+{
+  if(!use_packed || !p_packed->columnar) return (FAIL);
+
+  if(variables & IAEA_COLUMN_W) variables |= IAEA_COLUMN_TYPE | IAEA_COLUMN_U | IAEA_COLUMN_V;
+  variables |= IAEA_COLUMN_E;
+
+  // Type byte and energy, then the stored floats and longs in record order
+  unsigned int columns = (variables & IAEA_COLUMN_TYPE) ? 0x3u : 0x2u;
+  int j = 2, k;
+  const int stored[6] = { ix, iy, iz, iu, iv, iweight };
+  const int variable[6] = { IAEA_COLUMN_X, IAEA_COLUMN_Y, IAEA_COLUMN_Z,
+                            IAEA_COLUMN_U, IAEA_COLUMN_V, IAEA_COLUMN_WEIGHT };
+  for(k=0;k<6;k++)
+  {
+     if(stored[k] <= 0) continue;
+     if(variables & variable[k]) columns |= 1u << j;
+     j++;
+  }
+  for(k=0;k<iextrafloat;k++, j++)
+     if(variables & IAEA_COLUMN_EXTRA_FLOAT(k)) columns |= 1u << j;
+  for(k=0;k<iextralong;k++, j++)
+     if(variables & IAEA_COLUMN_EXTRA_LONG(k)) columns |= 1u << j;
+  columns &= all_columns(record_size());
+
+  if(columns == p_packed->columns) return (OK);
+  if(use_ahead && columns != all_columns(record_size()) &&
+     set_read_ahead(0, IAEA_READ_AHEAD_BUFFERS) != OK) return (FAIL);
+
+  // The block loaded is read again with the new columns
+  p_packed->columns = columns;
+  p_packed->loaded = -1;
+  block_count = 0;
+  return (OK);
+}
+
+// 1 if columns are left out of the records read (see set_columns)
+int iaea_record_type::projected()
+{
+  return (use_packed && p_packed->columnar &&
+          p_packed->columns != all_columns(record_size()));
+}
+
+// Reads size bytes at offset of the file without the stdio buffer, which
+// would be filled around every value of a sparse read
+static short read_at(FILE *p_file, IAEA_I64 offset, unsigned char *data, IAEA_I64 size)
+{
+#if (defined WIN32) || (defined WIN64)
+  if( fseek(p_file, offset, SEEK_SET) != 0 ||
+      fread(data, 1, (size_t)size, p_file) != (size_t)size ) return (FAIL);
+#else
+  if( pread(fileno(p_file), data, (size_t)size, (off_t)offset) != (ssize_t)size ) return (FAIL);
+#endif
+  return (OK);
+}
+
+// Notes the records of the file the n records of the block from record
+// first on were read from, the position being after the last of them
+short iaea_record_type::index_records(int first, int n)
+{
+  if(first + n > index_capacity)
+  {
+     IAEA_I64 *p = (IAEA_I64 *) realloc(block_index, (size_t)(first + n)*sizeof(IAEA_I64));
+     if(p == NULL)
+     {
+        fprintf(stderr, "\n ERROR: index_records: Failed to allocate record index\n");
+        return (FAIL);
+     }
+     block_index = p;
+     index_capacity = first + n;
+  }
+
+  IAEA_I64 next = get_position()/record_size();
+  for(int i=0;i<n;i++) block_index[first + i] = next - n + i;
+  return (OK);
+}
+
+// Reads the columns left out (see set_columns) of the records of the last
+// block returned by read_records selected by mask (n records, bit (i & 63)
+// of mask[i >> 6] for the i-th one). The values of a column are read in
+// runs of the records selected, a run spanning the values closer than
+// IAEA_COLUMN_GAP bytes.
+short iaea_record_type::gather_records(const IAEA_U64 *mask, int n)
+{
+  if(!projected()) return (OK);
+  if(block_records == NULL || n > block_count)
+  {
+     fprintf(stderr, "\n ERROR: gather_records: No block of %d records was read\n", n);
+     return (FAIL);
+  }
+
+  iaea_packed *k = p_packed;
+  int reclength = record_size();
+  int n_columns = columns_of(reclength);
+  unsigned char *records = (unsigned char *)block_records; // raw_buffer or range_buffer
+
+  for(int j=0;j<n_columns;j++)
+  {
+     if((k->columns >> j) & 1) continue;
+     int width = iaea_column_width(j);
+     int field = (j == 0) ? 0 : 1 + 4*(j - 1);
+
+     int i = 0;
+     while(i < n)
+     {
+        if( !((mask[i >> 6] >> (i & 63)) & 1) ) { i++; continue; }
+
+        // Run of the selected records of the block of record i
+        IAEA_I64 b = block_index[i]/k->block;
+        IAEA_I64 n_block = block_records_of(k, b);
+        IAEA_I64 first = block_index[i] - b*k->block, last = first;
+        int end = i + 1;
+        for(int m=i+1;m<n;m++)
+        {
+           if( !((mask[m >> 6] >> (m & 63)) & 1) ) continue;
+           IAEA_I64 r = block_index[m] - b*k->block;
+           if(r < last || r >= n_block || (r - last)*width > IAEA_COLUMN_GAP) break;
+           last = r;
+           end = m + 1;
+        }
+
+        IAEA_I64 size = (last - first + 1)*width;
+        IAEA_I64 start = k->offset[b] + IAEA_PACK_BLOCK_HEADER +
+                         iaea_column_offset((int)n_block, reclength, j) + first*width;
+        if( grow_buffer(&k->data, &k->data_capacity, size) != OK ||
+            read_at(p_file, start, k->data, size) != OK )
+        {
+           fprintf(stderr, "\n ERROR: gather_records: Failed to read block %lld"
+                           " of the phsp file\n", (long long)(b + 1));
+           return (FAIL);
+        }
+
+        for(int m=i;m<end;m++)
+        {
+           if( !((mask[m >> 6] >> (m & 63)) & 1) ) continue;
+           unsigned char *value = records + (IAEA_I64)m*reclength + field;
+           memcpy(value, k->data + (block_index[m] - b*k->block - first)*width, (size_t)width);
+           if(swap_bytes && width == 4)
+           {
+              unsigned char c = value[0]; value[0] = value[3]; value[3] = c;
+              c = value[1]; value[1] = value[2]; value[2] = c;
+           }
+        }
+        i = end;
+     }
+  }
+  return (OK);
+}
+
+/* *********************************************************************** */
+// Read-ahead reading
+//
+// A reader thread reads the phsp file into a ring of large buffers while
+// the records of the previous buffer are decoded. A buffer holds whole
+// records only and is handed back to the reader when all its records have
+// been returned. The reader is started at the first read and stopped when
+// the file is repositioned.
+
+struct iaea_read_ahead
+{
+  std::thread reader;
+  std::mutex lock;
+  std::condition_variable changed;
+
+  IAEA_I64 size;       // bytes per buffer requested
+  int n_buffers;
+  unsigned char *buffer[IAEA_READ_AHEAD_MAX_BUFFERS];
+  IAEA_I64 capacity[IAEA_READ_AHEAD_MAX_BUFFERS];
+  IAEA_I64 chunk;      // bytes read into a buffer at once (whole records)
+  int running;
+
+  // Shared with the reader, guarded by lock
+  IAEA_I64 length[IAEA_READ_AHEAD_MAX_BUFFERS]; // bytes read into a buffer, -1 if free
+  int next_fill;       // buffer filled next by the reader
+  int at_end;          // the reader reached the end of the file
+  int stop;            // the reader has to stop
+
+  // Used by the decoding thread only
+  int current;         // buffer the records are returned from
+  IAEA_I64 used;       // bytes of the current buffer returned
+  IAEA_I64 position;   // file offset of the next record returned
+  IAEA_I64 next_block; // block decoded next by the reader (compressed records)
+};
+
+static void read_ahead_loop(iaea_read_ahead *a, FILE *p_file, iaea_packed *packed)
+{
+  unsigned char *data = NULL; // compressed block
+  IAEA_I64 capacity = 0;
+
+  std::unique_lock<std::mutex> guard(a->lock);
+  while(!a->stop && !a->at_end)
+  {
+     int k = a->next_fill;
+     if(a->length[k] >= 0) { a->changed.wait(guard); continue; } // all buffers full
+
+     guard.unlock();
+     size_t n = 0;
+     if(packed == NULL) n = fread(a->buffer[k], 1, (size_t)a->chunk, p_file);
+     else if(a->next_block < packed->n_blocks)
+     {
+        // A buffer holds one decoded block
+        IAEA_I64 m = load_block(packed, p_file, a->next_block++, a->buffer[k],
+                                &data, &capacity);
+        if(m > 0) n = (size_t)(m*packed->reclength);
+     }
+     guard.lock();
+
+     a->length[k] = (IAEA_I64)n;
+     if(n < (size_t)a->chunk) a->at_end = 1; // end of file (or read error)
+     a->next_fill = (k + 1) % a->n_buffers;
+     a->changed.notify_all();
+  }
+  guard.unlock();
+  free(data);
+}
+
+// Reads the file through n_buffers buffers of size bytes from the next
+// record on, size = 0 switches back to plain stdio reading. Not while
+// columns are left out of the records read (see set_columns).
+short iaea_record_type::set_read_ahead(IAEA_I64 size, int n_buffers)
+{
+  if(p_file == NULL || use_map || (size > 0 && projected())) return (FAIL);
+
+  if(p_ahead == NULL)
+  {
+     p_ahead = new (std::nothrow) iaea_read_ahead();
+     if(p_ahead == NULL) return (FAIL);
+  }
+
+  if(p_ahead->running)
+  {
+     // The reader is ahead of the records returned
+     stop_reader();
+     if( set_position(p_ahead->position) != OK ) return (FAIL);
+  }
+  else p_ahead->position = get_position();
+
+  if(n_buffers < 2) n_buffers = 2;
+  if(n_buffers > IAEA_READ_AHEAD_MAX_BUFFERS) n_buffers = IAEA_READ_AHEAD_MAX_BUFFERS;
+  p_ahead->size = size;
+  p_ahead->n_buffers = n_buffers;
+  use_ahead = (size > 0);
+
+  return (OK);
+}
+
+short iaea_record_type::start_reader(int reclength)
+{
+  iaea_read_ahead *a = p_ahead;
+
+  a->chunk = a->size - a->size % reclength;
+  if(a->chunk < reclength) a->chunk = reclength;
+  a->used = 0;
+  if(use_packed)
+  {
+     // Block by block, from the one holding the next record
+     a->chunk = (IAEA_I64)p_packed->block*reclength;
+     a->next_block = a->position/a->chunk;
+     a->used = a->position % a->chunk;
+  }
+
+  for(int k=0;k<a->n_buffers;k++)
+  {
+     if(a->capacity[k] < a->chunk)
+     {
+        unsigned char *p = (unsigned char *) realloc(a->buffer[k], (size_t)a->chunk);
+        if(p == NULL)
+        {
+           fprintf(stderr, "\n ERROR: start_reader: Failed to allocate read-ahead buffer\n");
+           return (FAIL);
+        }
+        a->buffer[k] = p;
+        a->capacity[k] = a->chunk;
+     }
+     a->length[k] = -1;
+  }
+  a->next_fill = a->current = 0;
+  a->at_end = a->stop = 0;
+
+  try
+  {
+     a->reader = std::thread(read_ahead_loop, a, p_file, use_packed ? p_packed : NULL);
+  }
+  catch(...)
+  {
+     fprintf(stderr, "\n ERROR: start_reader: Failed to start read-ahead thread\n");
+     return (FAIL);
+  }
+  a->running = 1;
+  return (OK);
+}
+
+void iaea_record_type::stop_reader()
+{
+  iaea_read_ahead *a = p_ahead;
+  if(a == NULL || !a->running) return;
+
+  {
+     std::lock_guard<std::mutex> guard(a->lock);
+     a->stop = 1;
+  }
+  a->changed.notify_all();
+  a->reader.join();
+  a->running = 0;
+}
+
+// Number of whole records left in the current buffer, waiting for the
+// reader if needed; 0 at the end of the file.
+IAEA_I64 iaea_record_type::ahead_wait(int reclength)
+{
+  iaea_read_ahead *a = p_ahead;
+  if(!a->running && start_reader(reclength) != OK) return (0);
+
+  std::unique_lock<std::mutex> guard(a->lock);
+  for(;;)
+  {
+     int c = a->current;
+     while(a->length[c] < 0 && !a->at_end) a->changed.wait(guard);
+     if(a->length[c] < 0) return (0); // nothing more will be read
+
+     IAEA_I64 available = (a->length[c] - a->used)/reclength;
+     if(available > 0) return (available);
+
+     // Buffer used up, handed back to the reader
+     a->length[c] = -1;
+     a->current = (c + 1) % a->n_buffers;
+     a->used = 0;
+     a->changed.notify_all();
+  }
+}
+
+const unsigned char *iaea_record_type::ahead_records(int reclength, int n, int *n_got)
+{
+  *n_got = 0;
+  IAEA_I64 available = ahead_wait(reclength);
+  if(available == 0) return (NULL);
+  if(available > n) available = n;
+
+  iaea_read_ahead *a = p_ahead;
+  const unsigned char *records = a->buffer[a->current] + a->used;
+  a->used += available*reclength;
+  a->position += available*reclength;
+  *n_got = (int)available;
+
+  return (records);
+}
+
+/* *********************************************************************** */
+// Write-behind writing
+//
+// Records are encoded straight into the current one of a ring of large
+// buffers (output_records, commit_records). A filled buffer is handed to a
+// writer thread, which writes it with a single fwrite while the next one
+// is filled. flush_records() waits until all records handed over are
+// written; a failed write is reported by the next commit or flush.
+
+struct iaea_write_behind
+{
+  std::thread writer;
+  std::mutex lock;
+  std::condition_variable changed;
+
+  IAEA_I64 size;       // bytes per buffer requested
+  int n_buffers;
+  unsigned char *buffer[IAEA_WRITE_BEHIND_MAX_BUFFERS];
+  IAEA_I64 capacity[IAEA_WRITE_BEHIND_MAX_BUFFERS];
+  int running;
+  std::atomic<int> failed; // a write failed
+
+  // Shared with the writer, guarded by lock
+  IAEA_I64 length[IAEA_WRITE_BEHIND_MAX_BUFFERS]; // bytes to be written, -1 if free
+  int next_write;      // buffer written next by the writer
+  int stop;            // the writer has to stop once all buffers are written
+
+  // Used by the encoding thread only
+  int current;         // buffer the records are encoded into
+  IAEA_I64 used;       // bytes of the current buffer filled
+};
+
+static void write_behind_loop(iaea_write_behind *b, FILE *p_file, iaea_packed *packed)
+{
+  std::unique_lock<std::mutex> guard(b->lock);
+  for(;;)
+  {
+     int k = b->next_write;
+     if(b->length[k] < 0)
+     {
+        if(b->stop) break;
+        b->changed.wait(guard);
+        continue;
+     }
+
+     guard.unlock();
+     size_t n = (size_t)b->length[k];
+     int written = (packed != NULL) ? (write_packed(packed, p_file, b->buffer[k], (IAEA_I64)n) == OK)
+                                    : (fwrite(b->buffer[k], 1, n, p_file) == n);
+     guard.lock();
+
+     if(!written) b->failed = 1;
+     b->length[k] = -1;
+     b->next_write = (k + 1) % b->n_buffers;
+     b->changed.notify_all();
+  }
+}
+
+// Hands the current buffer (if anything was encoded into it) to the writer
+// and waits until the next one is free.
+static void hand_off(iaea_write_behind *b, std::unique_lock<std::mutex> &guard)
+{
+  if(b->used > 0)
+  {
+     b->length[b->current] = b->used;
+     b->current = (b->current + 1) % b->n_buffers;
+     b->used = 0;
+     b->changed.notify_all();
+  }
+  while(b->length[b->current] >= 0) b->changed.wait(guard);
+}
+
+// Writes the file through n_buffers buffers of size bytes from now on,
+// size = 0 switches back to plain stdio writing.
+short iaea_record_type::set_write_behind(IAEA_I64 size, int n_buffers)
+{
+  if(p_file == NULL) return (FAIL);
+
+  if(p_behind == NULL)
+  {
+     p_behind = new (std::nothrow) iaea_write_behind();
+     if(p_behind == NULL) return (FAIL);
+  }
+  else if(flush_records() != OK || stop_writer() != OK) return (FAIL);
+
+  if(n_buffers < 2) n_buffers = 2;
+  if(n_buffers > IAEA_WRITE_BEHIND_MAX_BUFFERS) n_buffers = IAEA_WRITE_BEHIND_MAX_BUFFERS;
+  p_behind->size = size;
+  p_behind->n_buffers = n_buffers;
+  use_behind = (size > 0);
+
+  return (OK);
+}
+
+short iaea_record_type::start_writer()
+{
+  iaea_write_behind *b = p_behind;
+
+  for(int k=0;k<b->n_buffers;k++) b->length[k] = -1;
+  b->next_write = b->current = 0;
+  b->used = 0;
+  b->stop = 0;
+  b->failed = 0;
+  if(use_packed) p_packed->reclength = stored_size();
+
+  try
+  {
+     b->writer = std::thread(write_behind_loop, b, p_file, use_packed ? p_packed : NULL);
+  }
+  catch(...)
+  {
+     fprintf(stderr, "\n ERROR: start_writer: Failed to start write-behind thread\n");
+     return (FAIL);
+  }
+  b->running = 1;
+  return (OK);
+}
+
+// Stops the writer once the records handed over are written
+short iaea_record_type::stop_writer()
+{
+  iaea_write_behind *b = p_behind;
+  if(b == NULL || !b->running) return (OK);
+
+  {
+     std::lock_guard<std::mutex> guard(b->lock);
+     b->stop = 1;
+  }
+  b->changed.notify_all();
+  b->writer.join();
+  b->running = 0;
+
+  return (b->failed ? FAIL : OK);
+}
+
+short iaea_record_type::flush_records()
+{
+  iaea_write_behind *b = p_behind;
+  if(b != NULL && b->running)
+  {
+     std::unique_lock<std::mutex> guard(b->lock);
+     hand_off(b, guard);
+     for(int k=0;k<b->n_buffers;k++)
+        while(b->length[k] >= 0) b->changed.wait(guard);
+     guard.unlock();
+
+     if(b->failed)
+     {
+        fprintf(stderr, "\n ERROR: flush_records: Failed to write particles\n");
+        return (FAIL);
+     }
+  }
+  if(use_packed && finish_packed(p_packed, p_file) != OK)
+  {
+     fprintf(stderr, "\n ERROR: flush_records: Failed to write compressed records\n");
+     return (FAIL);
+  }
+  if(fflush(p_file) != 0) return (FAIL);
+  return (OK);
+}
+
+/* *********************************************************************** */
+// Reading ranges of records
+//
+// Only the records of a list of ranges (sorted, not overlapping) are read,
+// e.g. the candidates of a cut selected with a spatial index. A mapped
+// file is then advised as randomly accessed, and the pages of the ranges
+// within the next IAEA_MAP_READAHEAD bytes are requested in advance, so
+// only the pages holding records of the ranges are read from disk. Read
+// through stdio, every range is read with fseek and fread (the read-ahead
+// buffers are not used).
+
+short iaea_record_type::set_ranges(const IAEA_I64 *first, const IAEA_I64 *count, IAEA_I64 n)
+{
+  int had_ranges = (range_first != NULL);
+  free(range_first);
+  range_first = range_count = NULL;
+  n_ranges = next_range = range_left = range_advised = 0;
+  block_count = 0;
+
+  if(n <= 0)
+  {
+     if(!had_ranges) return (OK);
+     // Back to reading the whole file from the current position
+     if(p_ahead != NULL) p_ahead->position = get_position();
+#if !(defined WIN32) && !(defined WIN64)
+     if(p_map != NULL) madvise(p_map, (size_t)map_length, MADV_SEQUENTIAL);
+#endif
+     return (OK);
+  }
+
+  range_first = (IAEA_I64 *) malloc((size_t)n*2*sizeof(IAEA_I64));
+  if(range_first == NULL)
+  {
+     fprintf(stderr, "\n ERROR: set_ranges: Failed to allocate record ranges\n");
+     return (FAIL);
+  }
+  range_count = range_first + n;
+  memcpy(range_first, first, (size_t)n*sizeof(IAEA_I64));
+  memcpy(range_count, count, (size_t)n*sizeof(IAEA_I64));
+  n_ranges = n;
+
+  if(use_ahead) stop_reader();
+#if !(defined WIN32) && !(defined WIN64)
+  if(p_map != NULL) madvise(p_map, (size_t)map_length, MADV_RANDOM);
+#endif
+  return (OK);
+}
+
+// Moves to the first record of the next range
+short iaea_record_type::start_range()
+{
+  IAEA_I64 offset = (range_first[next_range] - 1)*stored_size();
+  range_left = range_count[next_range++];
+
+  if(use_map)
+  {
+     map_position = offset;
+     return (OK);
+  }
+  return (set_position(offset));
+}
+
+// Up to n records of the current range read through stdio
+const unsigned char *iaea_record_type::range_records(int reclength, int n, int *n_got)
+{
+  IAEA_I64 size = (IAEA_I64)n*reclength;
+  if(size > range_capacity)
+  {
+     unsigned char *p = (unsigned char *) realloc(range_buffer, (size_t)size);
+     if(p == NULL)
+     {
+        fprintf(stderr, "\n ERROR: range_records: Failed to allocate record buffer\n");
+        return (NULL);
+     }
+     range_buffer = p;
+     range_capacity = size;
+  }
+  *n_got = (int)read_raw(range_buffer, reclength, (size_t)n);
+  if(*n_got == 0) return (NULL);
+  return (range_buffer);
+}
+
+// Requests the pages of the ranges in the next IAEA_MAP_READAHEAD bytes
+// of the mapped window
+void iaea_record_type::advise_ranges(int reclength)
+{
+#if !(defined WIN32) && !(defined WIN64)
+  IAEA_I64 page = (IAEA_I64)sysconf(_SC_PAGESIZE);
+  if(range_advised < next_range - 1) range_advised = next_range - 1;
+  for(;range_advised<n_ranges;range_advised++)
+  {
+     IAEA_I64 start = (range_first[range_advised] - 1)*reclength;
+     IAEA_I64 end = start + range_count[range_advised]*reclength;
+     if(start > map_position + IAEA_MAP_READAHEAD || end > map_offset + map_length) break;
+     if(start < map_offset || end <= map_advised) continue;
+
+     if(start < map_advised) start = map_advised;
+     start -= start % page;
+     madvise(p_map + (start - map_offset), (size_t)(end - start), MADV_WILLNEED);
+     map_advised = end;
+  }
+#else
+  (void)reclength;
+#endif
+}
+
+void iaea_record_type::release()
+{
+  free(range_first);
+  range_first = range_count = NULL;
+  n_ranges = next_range = range_left = range_advised = 0;
+  free(range_buffer);
+  range_buffer = NULL;
+  range_capacity = 0;
+  unmap_file();
+  if(p_behind != NULL)
+  {
+     flush_records();
+     stop_writer();
+     for(int k=0;k<IAEA_WRITE_BEHIND_MAX_BUFFERS;k++) free(p_behind->buffer[k]);
+     delete p_behind;
+     p_behind = NULL;
+  }
+  use_behind = 0;
+  if(p_ahead != NULL)
+  {
+     stop_reader();
+     for(int k=0;k<IAEA_READ_AHEAD_MAX_BUFFERS;k++) free(p_ahead->buffer[k]);
+     delete p_ahead;
+     p_ahead = NULL;
+  }
+  use_ahead = 0;
+  set_packed(0);
+  set_quantization(0.f, 0.f, 0.f);
+  free(raw_buffer);
+  raw_buffer = NULL;
+  raw_capacity = 0;
+  free(block_index);
+  block_index = NULL;
+  index_capacity = 0;
+}
+
+/* *********************************************************************** */
+// Batched access
+//
+// next_records() returns up to n consecutive raw records, either straight
+// from the mapped window or the read-ahead buffers, or read with a single
+// fread into raw_buffer.
+// The returned block stays valid until the next call.
+//
+// output_records() returns room for n records to be encoded into, at the
+// end of the current write-behind buffer or in raw_buffer, and
+// commit_records() writes the n records encoded there.
+//
+// Records of the other byte order are converted to the machine's in
+// raw_buffer by read_records, and converted back in place by
+// commit_records, so the codecs and pass-through copies only ever see
+// records in the byte order of the machine. Quantized records are
+// expanded and quantized the same way (next_records returns them as they
+// are stored).
+
+unsigned char *iaea_record_type::buffer_records(int n)
+{
+  IAEA_I64 size = (IAEA_I64)n*record_size();
+
+  if(size > raw_capacity)
+  {
+     unsigned char *p = (unsigned char *) realloc(raw_buffer, (size_t)size);
+     if(p == NULL)
+     {
+        fprintf(stderr, "\n ERROR: buffer_records: Failed to allocate record buffer\n");
+        return (NULL);
+     }
+     raw_buffer = p;
+     raw_capacity = size;
+  }
+  return (raw_buffer);
+}
+
+unsigned char *iaea_record_type::output_records(int n)
+{
+  if(!use_behind) return (buffer_records(n));
+
+  iaea_write_behind *b = p_behind;
+  IAEA_I64 size = (IAEA_I64)n*record_size();
+
+  if(!b->running && start_writer() != OK) return (NULL);
+  if(b->used + size > b->capacity[b->current] || b->buffer[b->current] == NULL)
+  {
+     std::unique_lock<std::mutex> guard(b->lock);
+     hand_off(b, guard);
+  }
+
+  int c = b->current;
+  if(b->capacity[c] < size || b->buffer[c] == NULL)
+  {
+     // The buffer is free, it can be resized
+     IAEA_I64 capacity = (b->size > size) ? b->size : size;
+     unsigned char *p = (unsigned char *) realloc(b->buffer[c], (size_t)capacity);
+     if(p == NULL)
+     {
+        fprintf(stderr, "\n ERROR: output_records: Failed to allocate write-behind buffer\n");
+        return (NULL);
+     }
+     b->buffer[c] = p;
+     b->capacity[c] = capacity;
+  }
+  return (b->buffer[c] + b->used);
+}
+
+short iaea_record_type::commit_records(int n)
+{
+  int reclength = stored_size();
+  unsigned char *records = use_behind ? p_behind->buffer[p_behind->current] + p_behind->used
+                                      : raw_buffer;
+
+  if(p_quant != NULL)
+  {
+     if(iaea_quantize_records(p_quant, this, records, n) != OK) return (FAIL);
+  }
+  else if(swap_bytes) iaea_swap_records(records, records, n, reclength);
+
+  if(use_behind)
+  {
+     p_behind->used += (IAEA_I64)n*reclength;
+     return (p_behind->failed ? FAIL : OK);
+  }
+
+  if(use_packed)
+  {
+     p_packed->reclength = reclength;
+     return (write_packed(p_packed, p_file, raw_buffer, (IAEA_I64)n*reclength));
+  }
+  if( fwrite(raw_buffer, (size_t)reclength, (size_t)n, p_file) != (size_t)n ) return (FAIL);
+  return (OK);
+}
+
+const unsigned char *iaea_record_type::next_records(int n, int *n_got)
+{
+  int reclength = stored_size();
+
+  *n_got = 0;
+  if(n <= 0) return (NULL);
+
+  if(range_first != NULL)
+  {
+     // The records of a range are returned, up to its end
+     while(range_left == 0)
+     {
+        if(next_range >= n_ranges || start_range() != OK) return (NULL);
+     }
+     if(n > range_left) n = (int)range_left;
+
+     const unsigned char *records = use_map ? map_records(reclength, n, n_got)
+                                            : range_records(reclength, n, n_got);
+     range_left -= *n_got;
+     if(records == NULL) range_left = 0; // the range reaches beyond the end of the file
+     return (records);
+  }
+
+  if(use_map) return (map_records(reclength, n, n_got));
+  if(use_ahead) return (ahead_records(reclength, n, n_got));
+
+  unsigned char *records = buffer_records(n);
+  if(records == NULL) return (NULL);
+
+  *n_got = (int)read_raw(records, reclength, (size_t)n);
+  if(*n_got == 0) return (NULL);
+
+  return (records);
+}
+
+// Same as next_records, but the records are always returned in one piece.
+// A block crossing the end of the mapped window, of a read-ahead buffer
+// or of a range of records is assembled in raw_buffer.
+// The block is kept (block_records, block_count) for pass-through copies
+// until the next read or repositioning of the file. While columns are left
+// out, the records of the file they come from are noted (block_index) for
+// gather_records.
+const unsigned char *iaea_record_type::read_records(int n, int *n_got)
+{
+  block_records = NULL;
+  block_count = 0;
+
+  int indexed = projected();
+  const unsigned char *records = next_records(n, n_got);
+  if(records != NULL && indexed && index_records(0, *n_got) != OK) return (NULL);
+  if(records != NULL && *n_got < n && (use_map || use_ahead || range_first != NULL))
+  {
+     int reclength = stored_size();
+     unsigned char *buffer = buffer_records(n);
+     if(buffer == NULL) return (NULL);
+
+     int n_total = *n_got;
+     memcpy(buffer, records, (size_t)n_total*reclength);
+     while(n_total < n)
+     {
+        int n_more;
+        records = next_records(n - n_total, &n_more);
+        if(records == NULL) break;
+        if(indexed && index_records(n_total, n_more) != OK) return (NULL);
+        memcpy(buffer + (IAEA_I64)n_total*reclength, records, (size_t)n_more*reclength);
+        n_total += n_more;
+     }
+     *n_got = n_total;
+     records = buffer;
+  }
+
+  if(records != NULL && (swap_bytes || p_quant != NULL))
+  {
+     // Mapped and read-ahead records are converted into raw_buffer
+     unsigned char *buffer = (records == raw_buffer) ? raw_buffer : buffer_records(*n_got);
+     if(buffer == NULL) return (NULL);
+     if(p_quant != NULL) iaea_expand_records(p_quant, this, records, buffer, *n_got);
+     else iaea_swap_records(records, buffer, *n_got, record_size());
+     records = buffer;
+  }
+
+  if(records != NULL)
+  {
+     block_records = records;
+     block_count = *n_got;
+  }
+  return (records);
+}
+
+/* *********************************************************************** */
+// Layout-specialized codecs
+//
+// The layout of the records is the same for the whole file, so the common
+// layouts (x, y, u, v and w variable, z and the weight variable or
+// constant, up to one extra float and two extra longs) are decoded and
+// encoded by functions generated for that layout, without any test on the
+// layout inside the loop. Other layouts go record by record through
+// unpack_particle/pack_particle. Both give exactly the same values.
+// Where AVX2 is available the records of a block are transposed into its
+// columns with SIMD gathers (iaea_transpose_records).
+
+// Transposition of n records of a specialized layout into the block
+static void decode_transposed(const iaea_record_type *p, const unsigned char *records,
+                              int n, const iaea_particle_block *block, int first,
+                              int stat_long, int has_z, int has_wt, int nef, int nel)
+{
+  void *column[5 + 1 + 1 + NUM_EXTRA_FLOAT + NUM_EXTRA_LONG];
+  int n_words = 0, j;
+  column[n_words++] = block->E + first;
+  column[n_words++] = block->x + first;
+  column[n_words++] = block->y + first;
+  if(has_z) column[n_words++] = block->z + first;
+  column[n_words++] = block->u + first;
+  column[n_words++] = block->v + first;
+  if(has_wt) column[n_words++] = block->wt + first;
+  for(j=0;j<nef;j++)
+    column[n_words++] = (block->extra_floats != NULL) ?
+                        block->extra_floats + j*block->n_max + first : NULL;
+  int i_long = n_words;
+  for(j=0;j<nel;j++)
+    column[n_words++] = (block->extra_ints != NULL) ?
+                        block->extra_ints + j*block->n_max + first : NULL;
+  // The history counter goes straight to n_stat if the extra longs are not kept
+  if(stat_long >= 0 && block->extra_ints == NULL)
+    column[i_long + stat_long] = block->n_stat + first;
+
+  iaea_transpose_records(records, n, 1 + n_words*4, n_words, column,
+                         block->type + first, block->w + first,
+                         (stat_long >= 0) ? NULL : block->n_stat + first);
+
+  if(stat_long >= 0 && block->extra_ints != NULL)
+    memcpy(block->n_stat + first, block->extra_ints + stat_long*block->n_max + first,
+           n*sizeof(IAEA_I32));
+  int k;
+  if(!has_z)  for(k=first;k<first+n;k++) block->z[k] = p->z;
+  if(!has_wt) for(k=first;k<first+n;k++) block->wt[k] = p->weight;
+}
+
+template<int HAS_Z, int HAS_WT, int NEF, int NEL>
+static void decode_layout(const iaea_record_type *p, const unsigned char *records,
+                          int n, const iaea_particle_block *block, int first,
+                          int stat_long)
+{
+  const int n_floats = 5 + HAS_Z + HAS_WT + NEF; // E x y [z] u v [weight] [extra floats]
+  const int reclength = 1 + (n_floats + NEL)*4;
+  const int iu = 3 + HAS_Z;
+
+  if(sizeof(IAEA_Float) == sizeof(float) && iaea_simd_isa() >= IAEA_ISA_AVX2)
+  {
+      decode_transposed(p, records, n, block, first, stat_long, HAS_Z, HAS_WT, NEF, NEL);
+      iaea_direction_w(n, block->u + first, block->v + first, block->w + first);
+      return;
+  }
+
+  for(int i=0;i<n;i++)
+  {
+      const unsigned char *record = records + (IAEA_I64)i*reclength;
+      float f[n_floats];
+      IAEA_I32 l[NEL > 0 ? NEL : 1];
+      memcpy(f, record + 1, sizeof(f));
+      if(NEL > 0) memcpy(l, record + 1 + sizeof(f), NEL*sizeof(IAEA_I32));
+
+      char ctmp = (char) record[0];
+      short particle = (short) ctmp;
+      float is = 1.f; // sign of w
+      if(particle < 0) {is = -1.f; particle = -particle;}
+
+      IAEA_I32 n_stat = (f[0] < 0) ? 1 : 0;
+      if(NEL > 0 && stat_long >= 0) n_stat = l[stat_long];
+
+      int k = first + i;
+      block->n_stat[k] = n_stat;
+      block->type[k] = particle;
+      block->E[k]  = fabs(f[0]);
+      block->wt[k] = HAS_WT ? f[iu+2] : p->weight;
+      block->x[k] = f[1];
+      block->y[k] = f[2];
+      block->z[k] = HAS_Z ? f[3] : p->z;
+      block->u[k] = f[iu];
+      block->v[k] = f[iu+1];
+      block->w[k] = is;
+      int j;
+      if(NEF > 0 && block->extra_floats != NULL)
+        for(j=0;j<NEF;j++)
+          block->extra_floats[j*block->n_max + k] = f[iu + 2 + HAS_WT + j];
+      if(NEL > 0 && block->extra_ints != NULL)
+        for(j=0;j<NEL;j++)
+          block->extra_ints[j*block->n_max + k] = l[j];
+  }
+
+  // w from u, v and its sign, for the whole block at once
+  iaea_direction_w(n, block->u + first, block->v + first, block->w + first);
+}
+
+template<int HAS_Z, int HAS_WT, int NEF, int NEL>
+static void encode_layout(const iaea_record_type *p, const iaea_particle_block *block,
+                          int n, unsigned char *records)
+{
+  const int n_floats = 5 + HAS_Z + HAS_WT + NEF;
+  const int reclength = 1 + (n_floats + NEL)*4;
+  const int iu = 3 + HAS_Z;
+  (void)p;
+
+  for(int i=0;i<n;i++)
+  {
+      unsigned char *record = records + (IAEA_I64)i*reclength;
+      float f[n_floats];
+      IAEA_I32 l[NEL > 0 ? NEL : 1];
+
+      char ishort = (char) block->type[i];
+      if(block->w[i] < 0) ishort = -ishort; // Sign of w is stored in particle type
+      record[0] = (unsigned char) ishort;
+
+      // New history is signaled by negative energy
+      f[0] = (block->n_stat[i] > 0) ? -block->E[i] : block->E[i];
+      f[1] = block->x[i];
+      f[2] = block->y[i];
+      if(HAS_Z) f[3] = block->z[i];
+      f[iu] = block->u[i];
+      f[iu+1] = block->v[i];
+      if(HAS_WT) f[iu+2] = block->wt[i];
+      int j;
+      for(j=0;j<NEF;j++) f[iu + 2 + HAS_WT + j] = block->extra_floats[j*block->n_max + i];
+      for(j=0;j<NEL;j++) l[j] = block->extra_ints[j*block->n_max + i];
+
+      memcpy(record + 1, f, sizeof(f));
+      if(NEL > 0) memcpy(record + 1 + sizeof(f), l, NEL*sizeof(IAEA_I32));
+  }
+}
+
+#define IAEA_CODECS(CODEC, HAS_Z, HAS_WT) \
+  { { CODEC<HAS_Z,HAS_WT,0,0>, CODEC<HAS_Z,HAS_WT,0,1>, CODEC<HAS_Z,HAS_WT,0,2> }, \
+    { CODEC<HAS_Z,HAS_WT,1,0>, CODEC<HAS_Z,HAS_WT,1,1>, CODEC<HAS_Z,HAS_WT,1,2> } }
+
+// Indexed by [z variable][weight variable][extra floats][extra longs]
+static const iaea_decode_fn layout_decoders[2][2][2][3] = {
+  { IAEA_CODECS(decode_layout, 0, 0), IAEA_CODECS(decode_layout, 0, 1) },
+  { IAEA_CODECS(decode_layout, 1, 0), IAEA_CODECS(decode_layout, 1, 1) } };
+static const iaea_encode_fn layout_encoders[2][2][2][3] = {
+  { IAEA_CODECS(encode_layout, 0, 0), IAEA_CODECS(encode_layout, 0, 1) },
+  { IAEA_CODECS(encode_layout, 1, 0), IAEA_CODECS(encode_layout, 1, 1) } };
+
+// Stored variables and extra numbers of the records (never 0)
+static int layout_of(const iaea_record_type *p)
+{
+  return 1 | (p->ix > 0) << 1 | (p->iy > 0) << 2 | (p->iz > 0) << 3 | (p->iu > 0) << 4 |
+         (p->iv > 0) << 5 | (p->iw > 0) << 6 | (p->iweight > 0) << 7 |
+         p->iextrafloat << 8 | p->iextralong << 16;
+}
+
+// Chooses the codecs for the current layout. The layout is fixed once the
+// header is read or written, but may still change before the first record
+// (e.g. iaea_set_extra_numbers), so it is checked for every block.
+void iaea_record_type::select_codecs()
+{
+  codec_layout = layout_of(this);
+  decode = NULL;
+  encode = NULL;
+
+  if(ix > 0 && iy > 0 && iu > 0 && iv > 0 && iw > 0 &&
+     iextrafloat <= 1 && iextralong <= 2)
+  {
+     decode = layout_decoders[iz > 0][iweight > 0][iextrafloat][iextralong];
+     encode = layout_encoders[iz > 0][iweight > 0][iextrafloat][iextralong];
+  }
+}
+
+void iaea_record_type::unpack_particles(const unsigned char *records, int n,
+                                        const iaea_particle_block *block, int first,
+                                        int stat_long)
+{
+  int reclength = record_size();
+
+  if(layout_of(this) != codec_layout) select_codecs();
+  if(decode != NULL)
+  {
+      decode(this, records, n, block, first, stat_long);
+      return;
+  }
+
+  for(int i=0;i<n;i++)
+  {
+      unpack_particle(records + (IAEA_I64)i*reclength);
+
+      // Incremental number of histories kept as extralong number stat_long
+      if(stat_long >= 0) IsNewHistory = extralong[stat_long];
+
+      int k = first + i;
+      block->n_stat[k] = IsNewHistory;
+      block->type[k] = particle;
+      block->E[k]  = energy;
+      block->wt[k] = weight;
+      block->x[k] = x;
+      block->y[k] = y;
+      block->z[k] = z;
+      block->u[k] = u;
+      block->v[k] = v;
+      block->w[k] = w;
+      int j;
+      if(block->extra_floats != NULL)
+        for(j=0;j<iextrafloat;j++)
+          block->extra_floats[j*block->n_max + k] = extrafloat[j];
+      if(block->extra_ints != NULL)
+        for(j=0;j<iextralong;j++)
+          block->extra_ints[j*block->n_max + k] = extralong[j];
+  }
+}
+
+// Encodes n particles of block into consecutive records. The extra
+// numbers of the i-th particle are extra_floats[k*n_max + i] and
+// extra_ints[k*n_max + i].
+void iaea_record_type::pack_particles(const iaea_particle_block *block, int n,
+                                      unsigned char *records)
+{
+  if(layout_of(this) != codec_layout) select_codecs();
+  if(encode != NULL)
+  {
+      encode(this, block, n, records);
+      return;
+  }
+
+  int reclength = record_size();
+
+  for(int i=0;i<n;i++)
+  {
+      if( block->n_stat[i] > 0 ) IsNewHistory = block->n_stat[i];
+      else                       IsNewHistory = 0;
+
+      particle = (short)block->type[i]; /* particle type */
+      energy   = block->E[i];    /* kinetic energy in MeV */
+      if(iweight > 0) weight = block->wt[i];   /* statistical weight */
+      if(ix > 0) x = block->x[i]; /* position in cartesian coordinates*/
+      if(iy > 0) y = block->y[i];
+      if(iz > 0) z = block->z[i];
+      if(iu > 0) u = block->u[i]; /* direction in cartesian coordinates*/
+      if(iv > 0) v = block->v[i];
+      if(iw > 0) w = block->w[i];
+
+      for(int k=0;k<iextrafloat;k++) extrafloat[k] = block->extra_floats[k*block->n_max + i];
+      for(int j=0;j<iextralong ;j++)  extralong[j] = block->extra_ints[j*block->n_max + i];
+
+      pack_particle(records + (IAEA_I64)i*reclength);
+  }
+}
+
+// Sets the history mark of an encoded record (in the byte order of the
+// machine) to n_stat: the sign of the energy and, if it is stored as
+// extralong number stat_long, the incremental number of histories.
+void iaea_record_type::mark_history(unsigned char *record, IAEA_I32 n_stat, int stat_long)
+{
+  unsigned int e;
+  memcpy(&e, record + 1, sizeof(e));
+  e = (n_stat > 0) ? (e | 0x80000000u) : (e & 0x7fffffffu);
+  memcpy(record + 1, &e, sizeof(e));
+
+  if(stat_long >= 0)
+  {
+     IAEA_I32 n = (n_stat > 0) ? n_stat : 0;
+     int offset = 1 + (1 + ix + iy + iz + iu + iv + iweight + iextrafloat)*(int)sizeof(float) +
+                  stat_long*(int)sizeof(IAEA_I32);
+     memcpy(record + offset, &n, sizeof(n));
+  }
+}
+
+short iaea_record_type::seek_position(IAEA_I64 offset)
+{
+  block_count = 0;
+  if(p_behind != NULL && flush_records() != OK) return (FAIL);
+  if(use_map)
+  {
+     if(offset < 0 || offset > file_size) return (FAIL);
+     map_position = offset;
+     return (OK);
+  }
+  if(use_ahead)
+  {
+     stop_reader();
+     p_ahead->position = offset;
+  }
+  return (set_position(offset));
+}
+
+void iaea_record_type::rewind_file()
+{
+  block_count = 0;
+  if(p_behind != NULL) flush_records();
+  // Ranges are read again from the first one
+  next_range = range_left = range_advised = 0;
+  if(use_map) map_position = 0;
+  else
+  {
+     if(use_ahead)
+     {
+        stop_reader();
+        p_ahead->position = 0;
+     }
+     if(use_packed) p_packed->position = 0;
+     else rewind(p_file);
+  }
+}
+
+int iaea_record_type::end_of_file()
+{
+  if(range_first != NULL) return (range_left == 0 && next_range >= n_ranges);
+  if(use_map) return (map_position >= file_size);
+  if(use_ahead) return (ahead_wait(stored_size()) == 0);
+  if(use_packed) return (p_packed->position >= p_packed->n_records*stored_size());
+  return (feof(p_file));
 }
@@ -0,0 +1,803 @@
+/*
+ * Vectorized kernels of the record layer: the reduction computing the
+ * header statistics of a block of particles, the reconstruction of the
+ * direction cosine w of decoded particles, the transposition of raw
+ * records into columns and the byte order conversion of raw records, and
+ * the selection of the instruction set all the kernels (the filters of
+ * iaea_filter.cpp too) are dispatched to.
+ *
+ * The SIMD versions are compiled with function level target attributes,
+ * so the file builds without special compiler flags; the best version for
+ * the running CPU is picked at the first call. They give the same results
+ * as the scalar versions (see the functions in iaea_simd.h).
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+#include "iaea_simd.h"
+
+#ifdef IAEA_SIMD_X86
+#include <immintrin.h>
+#endif
+
+// w = sqrt(1 - u*u - v*v) must not use fused multiply-adds, otherwise it
+// could differ from the w of the records decoded one by one
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize ("fp-contract=off")
+#endif
+
+// GCC 12 warns that the vectors its AVX-512 intrinsics start from
+// (_mm512_undefined_*) "may be used uninitialized" wherever they are
+// inlined (GCC bug 105593). The warnings are false, they are silenced
+// around the AVX-512 kernels only.
+#if defined(__GNUC__) && !defined(__clang__)
+  #define IAEA_AVX512_BEGIN _Pragma("GCC diagnostic push") \
+                            _Pragma("GCC diagnostic ignored \"-Wmaybe-uninitialized\"")
+  #define IAEA_AVX512_END   _Pragma("GCC diagnostic pop")
+#else
+  #define IAEA_AVX512_BEGIN
+  #define IAEA_AVX512_END
+#endif
+
+static const char *isa_names[] = { "scalar", "sse2", "avx2", "avx512" };
+
+/* *********************************************************************** */
+// Block statistics (header counters)
+
+static void stats_reset(iaea_block_stats *s)
+{
+  s->n_particles = s->n_histories = 0;
+  s->min_x = s->min_y = s->min_z = INFINITY;
+  s->max_x = s->max_y = s->max_z = -INFINITY;
+  for(int t=0;t<MAX_NUM_PARTICLES;t++)
+  {
+      s->count[t] = 0;
+      s->sum_weight[t] = s->sum_energy[t] = 0.;
+      s->min_weight[t] = s->min_energy[t] = INFINITY;
+      s->max_weight[t] = s->max_energy[t] = -INFINITY;
+  }
+}
+
+// Folds the lanes of a vector accumulator into a single value, with the
+// same comparisons as the scalar code
+static void fold_min(const float *lanes, int n, float *value)
+{
+  for(int k=0;k<n;k++) if(lanes[k] < *value) *value = lanes[k];
+}
+
+static void fold_max(const float *lanes, int n, float *value)
+{
+  for(int k=0;k<n;k++) if(lanes[k] > *value) *value = lanes[k];
+}
+
+static void fold_sum(const double *lanes, int n, double *value)
+{
+  for(int k=0;k<n;k++) *value += lanes[k];
+}
+
+static void stats_scalar(int first, int n, const IAEA_U64 *mask,
+                         const IAEA_I32 *n_stat, const IAEA_I32 *type,
+                         const IAEA_Float *E, const IAEA_Float *wt, float wt_const,
+                         const IAEA_Float *x, const IAEA_Float *y, const IAEA_Float *z,
+                         iaea_block_stats *s)
+{
+  for(int i=first;i<n;i++)
+  {
+      if( mask != NULL && !((mask[i >> 6] >> (i & 63)) & 1) ) continue;
+
+      s->n_particles++;
+      if( n_stat[i] > 0 ) s->n_histories += n_stat[i];
+
+      if(x != NULL)
+      {
+          float value = (float)x[i];
+          if(value < s->min_x) s->min_x = value;
+          if(value > s->max_x) s->max_x = value;
+      }
+      if(y != NULL)
+      {
+          float value = (float)y[i];
+          if(value < s->min_y) s->min_y = value;
+          if(value > s->max_y) s->max_y = value;
+      }
+      if(z != NULL)
+      {
+          float value = (float)z[i];
+          if(value < s->min_z) s->min_z = value;
+          if(value > s->max_z) s->max_z = value;
+      }
+
+      int t = type[i] - 1;
+      if( t < 0 || t >= MAX_NUM_PARTICLES ) continue;
+
+      float weight = (wt != NULL) ? (float)wt[i] : wt_const;
+      float energy = fabsf((float)E[i]);
+      s->count[t]++;
+      s->sum_weight[t] += weight;
+      s->sum_energy[t] += weight*energy;
+      if(weight < s->min_weight[t]) s->min_weight[t] = weight;
+      if(weight > s->max_weight[t]) s->max_weight[t] = weight;
+      if(energy < s->min_energy[t]) s->min_energy[t] = energy;
+      if(energy > s->max_energy[t]) s->max_energy[t] = energy;
+  }
+}
+
+#ifdef IAEA_SIMD_X86
+
+// Vector lanes selected by the 8 lowest bits
+__attribute__((target("avx2")))
+static inline __m256 lanes_avx2(unsigned int bits)
+{
+  const __m256i bit = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  __m256i b = _mm256_and_si256(_mm256_set1_epi32((int)bits), bit);
+  return _mm256_castsi256_ps(_mm256_cmpeq_epi32(b, bit));
+}
+
+// Unselected lanes are set to +/-infinity before the min/max and to zero
+// before the sums, so they never change the result. min/max(value, acc)
+// keeps acc if value is NaN, as the scalar comparisons do.
+__attribute__((target("avx2")))
+static void stats_avx2(int n, const IAEA_U64 *mask,
+                       const IAEA_I32 *n_stat, const IAEA_I32 *type,
+                       const IAEA_Float *E, const IAEA_Float *wt, float wt_const,
+                       const IAEA_Float *x, const IAEA_Float *y, const IAEA_Float *z,
+                       iaea_block_stats *s)
+{
+  const __m256 inf  = _mm256_set1_ps(INFINITY);
+  const __m256 ninf = _mm256_set1_ps(-INFINITY);
+  const __m256 sign = _mm256_set1_ps(-0.0f);
+  const __m256i zero = _mm256_setzero_si256();
+
+  __m256 min_x = inf, max_x = ninf, min_y = inf, max_y = ninf, min_z = inf, max_z = ninf;
+  __m256i histories = zero;
+  __m256 min_w[MAX_NUM_PARTICLES], max_w[MAX_NUM_PARTICLES];
+  __m256 min_e[MAX_NUM_PARTICLES], max_e[MAX_NUM_PARTICLES];
+  __m256d sum_w[MAX_NUM_PARTICLES][2], sum_e[MAX_NUM_PARTICLES][2];
+  for(int t=0;t<MAX_NUM_PARTICLES;t++)
+  {
+      min_w[t] = min_e[t] = inf;
+      max_w[t] = max_e[t] = ninf;
+      sum_w[t][0] = sum_w[t][1] = sum_e[t][0] = sum_e[t][1] = _mm256_setzero_pd();
+  }
+
+  int i = 0;
+  for(;i+8<=n;i+=8)
+  {
+      unsigned int bits = (mask != NULL) ? (unsigned int)(mask[i >> 6] >> (i & 63)) & 0xFF
+                                         : 0xFF;
+      if(bits == 0) continue;
+      __m256 sel = lanes_avx2(bits);
+      s->n_particles += __builtin_popcount(bits);
+
+      __m256i ns = _mm256_loadu_si256((const __m256i *)(n_stat + i));
+      ns = _mm256_and_si256(ns, _mm256_and_si256(_mm256_cmpgt_epi32(ns, zero),
+                                                 _mm256_castps_si256(sel)));
+      histories = _mm256_add_epi64(histories, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(ns)));
+      histories = _mm256_add_epi64(histories, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(ns, 1)));
+
+      if(x != NULL)
+      {
+          __m256 X = _mm256_loadu_ps(x + i);
+          min_x = _mm256_min_ps(_mm256_blendv_ps(inf, X, sel), min_x);
+          max_x = _mm256_max_ps(_mm256_blendv_ps(ninf, X, sel), max_x);
+      }
+      if(y != NULL)
+      {
+          __m256 Y = _mm256_loadu_ps(y + i);
+          min_y = _mm256_min_ps(_mm256_blendv_ps(inf, Y, sel), min_y);
+          max_y = _mm256_max_ps(_mm256_blendv_ps(ninf, Y, sel), max_y);
+      }
+      if(z != NULL)
+      {
+          __m256 Z = _mm256_loadu_ps(z + i);
+          min_z = _mm256_min_ps(_mm256_blendv_ps(inf, Z, sel), min_z);
+          max_z = _mm256_max_ps(_mm256_blendv_ps(ninf, Z, sel), max_z);
+      }
+
+      __m256i T = _mm256_loadu_si256((const __m256i *)(type + i));
+      __m256 W = (wt != NULL) ? _mm256_loadu_ps(wt + i) : _mm256_set1_ps(wt_const);
+      __m256 A = _mm256_andnot_ps(sign, _mm256_loadu_ps(E + i));
+      __m256 P = _mm256_mul_ps(W, A);
+      for(int t=0;t<MAX_NUM_PARTICLES;t++)
+      {
+          __m256 tsel = _mm256_and_ps(sel,
+              _mm256_castsi256_ps(_mm256_cmpeq_epi32(T, _mm256_set1_epi32(t + 1))));
+          unsigned int tbits = (unsigned int)_mm256_movemask_ps(tsel);
+          if(tbits == 0) continue;
+          s->count[t] += __builtin_popcount(tbits);
+
+          __m256 Ws = _mm256_and_ps(W, tsel), Ps = _mm256_and_ps(P, tsel);
+          sum_w[t][0] = _mm256_add_pd(sum_w[t][0], _mm256_cvtps_pd(_mm256_castps256_ps128(Ws)));
+          sum_w[t][1] = _mm256_add_pd(sum_w[t][1], _mm256_cvtps_pd(_mm256_extractf128_ps(Ws, 1)));
+          sum_e[t][0] = _mm256_add_pd(sum_e[t][0], _mm256_cvtps_pd(_mm256_castps256_ps128(Ps)));
+          sum_e[t][1] = _mm256_add_pd(sum_e[t][1], _mm256_cvtps_pd(_mm256_extractf128_ps(Ps, 1)));
+
+          min_w[t] = _mm256_min_ps(_mm256_blendv_ps(inf, W, tsel), min_w[t]);
+          max_w[t] = _mm256_max_ps(_mm256_blendv_ps(ninf, W, tsel), max_w[t]);
+          min_e[t] = _mm256_min_ps(_mm256_blendv_ps(inf, A, tsel), min_e[t]);
+          max_e[t] = _mm256_max_ps(_mm256_blendv_ps(ninf, A, tsel), max_e[t]);
+      }
+  }
+
+  float f[8];
+  double d[4];
+  IAEA_I64 h[4];
+  _mm256_storeu_si256((__m256i *)h, histories);
+  s->n_histories += h[0] + h[1] + h[2] + h[3];
+  _mm256_storeu_ps(f, min_x); fold_min(f, 8, &s->min_x);
+  _mm256_storeu_ps(f, max_x); fold_max(f, 8, &s->max_x);
+  _mm256_storeu_ps(f, min_y); fold_min(f, 8, &s->min_y);
+  _mm256_storeu_ps(f, max_y); fold_max(f, 8, &s->max_y);
+  _mm256_storeu_ps(f, min_z); fold_min(f, 8, &s->min_z);
+  _mm256_storeu_ps(f, max_z); fold_max(f, 8, &s->max_z);
+  for(int t=0;t<MAX_NUM_PARTICLES;t++)
+  {
+      _mm256_storeu_ps(f, min_w[t]); fold_min(f, 8, &s->min_weight[t]);
+      _mm256_storeu_ps(f, max_w[t]); fold_max(f, 8, &s->max_weight[t]);
+      _mm256_storeu_ps(f, min_e[t]); fold_min(f, 8, &s->min_energy[t]);
+      _mm256_storeu_ps(f, max_e[t]); fold_max(f, 8, &s->max_energy[t]);
+      for(int k=0;k<2;k++)
+      {
+          _mm256_storeu_pd(d, sum_w[t][k]); fold_sum(d, 4, &s->sum_weight[t]);
+          _mm256_storeu_pd(d, sum_e[t][k]); fold_sum(d, 4, &s->sum_energy[t]);
+      }
+  }
+
+  stats_scalar(i, n, mask, n_stat, type, E, wt, wt_const, x, y, z, s);
+}
+
+IAEA_AVX512_BEGIN
+__attribute__((target("avx512f")))
+static void stats_avx512(int n, const IAEA_U64 *mask,
+                         const IAEA_I32 *n_stat, const IAEA_I32 *type,
+                         const IAEA_Float *E, const IAEA_Float *wt, float wt_const,
+                         const IAEA_Float *x, const IAEA_Float *y, const IAEA_Float *z,
+                         iaea_block_stats *s)
+{
+  const __m512 inf  = _mm512_set1_ps(INFINITY);
+  const __m512 ninf = _mm512_set1_ps(-INFINITY);
+  const __m512i zero = _mm512_setzero_si512();
+
+  __m512 min_x = inf, max_x = ninf, min_y = inf, max_y = ninf, min_z = inf, max_z = ninf;
+  __m512i histories = zero;
+  __m512 min_w[MAX_NUM_PARTICLES], max_w[MAX_NUM_PARTICLES];
+  __m512 min_e[MAX_NUM_PARTICLES], max_e[MAX_NUM_PARTICLES];
+  __m512d sum_w[MAX_NUM_PARTICLES][2], sum_e[MAX_NUM_PARTICLES][2];
+  for(int t=0;t<MAX_NUM_PARTICLES;t++)
+  {
+      min_w[t] = min_e[t] = inf;
+      max_w[t] = max_e[t] = ninf;
+      sum_w[t][0] = sum_w[t][1] = sum_e[t][0] = sum_e[t][1] = _mm512_setzero_pd();
+  }
+
+  for(int i=0;i<n;i+=16)
+  {
+      // The last (partial) vector is loaded with a lane mask
+      __mmask16 lanes = (n - i >= 16) ? (__mmask16)0xFFFF
+                                      : (__mmask16)((1u << (n - i)) - 1);
+      __mmask16 sel = lanes;
+      if(mask != NULL) sel &= (__mmask16)(mask[i >> 6] >> (i & 63));
+      if(sel == 0) continue;
+      s->n_particles += __builtin_popcount((unsigned int)sel);
+
+      __m512i ns = _mm512_maskz_loadu_epi32(sel, n_stat + i);
+      ns = _mm512_maskz_mov_epi32(_mm512_mask_cmpgt_epi32_mask(sel, ns, zero), ns);
+      histories = _mm512_add_epi64(histories, _mm512_cvtepi32_epi64(_mm512_castsi512_si256(ns)));
+      histories = _mm512_add_epi64(histories, _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(ns, 1)));
+
+      if(x != NULL)
+      {
+          __m512 X = _mm512_maskz_loadu_ps(sel, x + i);
+          min_x = _mm512_mask_min_ps(min_x, sel, X, min_x);
+          max_x = _mm512_mask_max_ps(max_x, sel, X, max_x);
+      }
+      if(y != NULL)
+      {
+          __m512 Y = _mm512_maskz_loadu_ps(sel, y + i);
+          min_y = _mm512_mask_min_ps(min_y, sel, Y, min_y);
+          max_y = _mm512_mask_max_ps(max_y, sel, Y, max_y);
+      }
+      if(z != NULL)
+      {
+          __m512 Z = _mm512_maskz_loadu_ps(sel, z + i);
+          min_z = _mm512_mask_min_ps(min_z, sel, Z, min_z);
+          max_z = _mm512_mask_max_ps(max_z, sel, Z, max_z);
+      }
+
+      __m512i T = _mm512_maskz_loadu_epi32(sel, type + i);
+      __m512 W = (wt != NULL) ? _mm512_maskz_loadu_ps(sel, wt + i) : _mm512_set1_ps(wt_const);
+      __m512 A = _mm512_abs_ps(_mm512_maskz_loadu_ps(sel, E + i));
+      __m512 P = _mm512_mul_ps(W, A);
+      for(int t=0;t<MAX_NUM_PARTICLES;t++)
+      {
+          __mmask16 tsel = _mm512_mask_cmpeq_epi32_mask(sel, T, _mm512_set1_epi32(t + 1));
+          if(tsel == 0) continue;
+          s->count[t] += __builtin_popcount((unsigned int)tsel);
+
+          __mmask8 lo = (__mmask8)tsel, hi = (__mmask8)(tsel >> 8);
+          sum_w[t][0] = _mm512_mask_add_pd(sum_w[t][0], lo, sum_w[t][0],
+                                           _mm512_cvtps_pd(_mm512_castps512_ps256(W)));
+          sum_w[t][1] = _mm512_mask_add_pd(sum_w[t][1], hi, sum_w[t][1],
+                  _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(W), 1))));
+          sum_e[t][0] = _mm512_mask_add_pd(sum_e[t][0], lo, sum_e[t][0],
+                                           _mm512_cvtps_pd(_mm512_castps512_ps256(P)));
+          sum_e[t][1] = _mm512_mask_add_pd(sum_e[t][1], hi, sum_e[t][1],
+                  _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(P), 1))));
+
+          min_w[t] = _mm512_mask_min_ps(min_w[t], tsel, W, min_w[t]);
+          max_w[t] = _mm512_mask_max_ps(max_w[t], tsel, W, max_w[t]);
+          min_e[t] = _mm512_mask_min_ps(min_e[t], tsel, A, min_e[t]);
+          max_e[t] = _mm512_mask_max_ps(max_e[t], tsel, A, max_e[t]);
+      }
+  }
+
+  float f[16];
+  double d[8];
+  IAEA_I64 h[8];
+  _mm512_storeu_si512((void *)h, histories);
+  for(int k=0;k<8;k++) s->n_histories += h[k];
+  _mm512_storeu_ps(f, min_x); fold_min(f, 16, &s->min_x);
+  _mm512_storeu_ps(f, max_x); fold_max(f, 16, &s->max_x);
+  _mm512_storeu_ps(f, min_y); fold_min(f, 16, &s->min_y);
+  _mm512_storeu_ps(f, max_y); fold_max(f, 16, &s->max_y);
+  _mm512_storeu_ps(f, min_z); fold_min(f, 16, &s->min_z);
+  _mm512_storeu_ps(f, max_z); fold_max(f, 16, &s->max_z);
+  for(int t=0;t<MAX_NUM_PARTICLES;t++)
+  {
+      _mm512_storeu_ps(f, min_w[t]); fold_min(f, 16, &s->min_weight[t]);
+      _mm512_storeu_ps(f, max_w[t]); fold_max(f, 16, &s->max_weight[t]);
+      _mm512_storeu_ps(f, min_e[t]); fold_min(f, 16, &s->min_energy[t]);
+      _mm512_storeu_ps(f, max_e[t]); fold_max(f, 16, &s->max_energy[t]);
+      for(int k=0;k<2;k++)
+      {
+          _mm512_storeu_pd(d, sum_w[t][k]); fold_sum(d, 8, &s->sum_weight[t]);
+          _mm512_storeu_pd(d, sum_e[t][k]); fold_sum(d, 8, &s->sum_energy[t]);
+      }
+  }
+}
+IAEA_AVX512_END
+
+#endif // IAEA_SIMD_X86
+
+void iaea_block_statistics(int n, const IAEA_U64 *mask,
+                           const IAEA_I32 *n_stat, const IAEA_I32 *type,
+                           const IAEA_Float *E, const IAEA_Float *wt, float wt_const,
+                           const IAEA_Float *x, const IAEA_Float *y, const IAEA_Float *z,
+                           iaea_block_stats *stats)
+{
+  stats_reset(stats);
+  if(n <= 0) return;
+
+  // There is no SSE2 version, the scalar loop is as fast there
+  switch(iaea_simd_isa())
+  {
+#ifdef IAEA_SIMD_X86
+  case IAEA_ISA_AVX512: stats_avx512(n, mask, n_stat, type, E, wt, wt_const, x, y, z, stats); return;
+  case IAEA_ISA_AVX2:   stats_avx2(n, mask, n_stat, type, E, wt, wt_const, x, y, z, stats); return;
+#endif
+  default:              stats_scalar(0, n, mask, n_stat, type, E, wt, wt_const, x, y, z, stats); return;
+  }
+}
+
+/* *********************************************************************** */
+// Direction cosine w
+//
+// w = sign*sqrt(1 - (u*u + v*v)) in single precision is what the record
+// decoder computes in double (1 - s is exact or rounds the same way for
+// any float s); the renormalization is blended in where u*u + v*v > 1.
+
+static void direction_scalar(int first, int n, IAEA_Float *u, IAEA_Float *v, IAEA_Float *w)
+{
+  for(int i=first;i<n;i++)
+  {
+      float U = u[i], V = v[i];
+      float s = U*U + V*V;
+      if(s <= 1.0f) w[i] = (float)w[i]*sqrtf(1.0f - s);
+      else
+      {
+          float r = sqrtf(s);
+          u[i] = U/r;
+          v[i] = V/r;
+          w[i] = 0.f;
+      }
+  }
+}
+
+#ifdef IAEA_SIMD_X86
+
+__attribute__((target("sse2")))
+static void direction_sse2(int n, IAEA_Float *u, IAEA_Float *v, IAEA_Float *w)
+{
+  const __m128 one = _mm_set1_ps(1.0f);
+  int i = 0;
+  for(;i+4<=n;i+=4)
+  {
+      __m128 U = _mm_loadu_ps(u + i), V = _mm_loadu_ps(v + i), W = _mm_loadu_ps(w + i);
+      __m128 s = _mm_add_ps(_mm_mul_ps(U, U), _mm_mul_ps(V, V));
+      __m128 in = _mm_cmple_ps(s, one);
+      if(_mm_movemask_ps(in) != 0xF)
+      {
+          __m128 r = _mm_sqrt_ps(s);
+          U = _mm_or_ps(_mm_and_ps(in, U), _mm_andnot_ps(in, _mm_div_ps(U, r)));
+          V = _mm_or_ps(_mm_and_ps(in, V), _mm_andnot_ps(in, _mm_div_ps(V, r)));
+          _mm_storeu_ps(u + i, U);
+          _mm_storeu_ps(v + i, V);
+      }
+      W = _mm_and_ps(in, _mm_mul_ps(W, _mm_sqrt_ps(_mm_sub_ps(one, s))));
+      _mm_storeu_ps(w + i, W);
+  }
+  direction_scalar(i, n, u, v, w);
+}
+
+__attribute__((target("avx2")))
+static void direction_avx2(int n, IAEA_Float *u, IAEA_Float *v, IAEA_Float *w)
+{
+  const __m256 one = _mm256_set1_ps(1.0f);
+  int i = 0;
+  for(;i+8<=n;i+=8)
+  {
+      __m256 U = _mm256_loadu_ps(u + i), V = _mm256_loadu_ps(v + i), W = _mm256_loadu_ps(w + i);
+      __m256 s = _mm256_add_ps(_mm256_mul_ps(U, U), _mm256_mul_ps(V, V));
+      __m256 in = _mm256_cmp_ps(s, one, _CMP_LE_OQ);
+      if(_mm256_movemask_ps(in) != 0xFF)
+      {
+          __m256 r = _mm256_sqrt_ps(s);
+          _mm256_storeu_ps(u + i, _mm256_blendv_ps(_mm256_div_ps(U, r), U, in));
+          _mm256_storeu_ps(v + i, _mm256_blendv_ps(_mm256_div_ps(V, r), V, in));
+      }
+      W = _mm256_and_ps(in, _mm256_mul_ps(W, _mm256_sqrt_ps(_mm256_sub_ps(one, s))));
+      _mm256_storeu_ps(w + i, W);
+  }
+  direction_scalar(i, n, u, v, w);
+}
+
+IAEA_AVX512_BEGIN
+__attribute__((target("avx512f")))
+static void direction_avx512(int n, IAEA_Float *u, IAEA_Float *v, IAEA_Float *w)
+{
+  const __m512 one = _mm512_set1_ps(1.0f);
+  const __m512 zero = _mm512_setzero_ps();
+  int i = 0;
+  for(;i+16<=n;i+=16)
+  {
+      __m512 U = _mm512_loadu_ps(u + i), V = _mm512_loadu_ps(v + i), W = _mm512_loadu_ps(w + i);
+      __m512 s = _mm512_add_ps(_mm512_mul_ps(U, U), _mm512_mul_ps(V, V));
+      __mmask16 out = _mm512_cmp_ps_mask(s, one, _CMP_NLE_UQ);
+      if(out != 0)
+      {
+          __m512 r = _mm512_sqrt_ps(s);
+          _mm512_storeu_ps(u + i, _mm512_mask_div_ps(U, out, U, r));
+          _mm512_storeu_ps(v + i, _mm512_mask_div_ps(V, out, V, r));
+      }
+      W = _mm512_mask_mov_ps(_mm512_mul_ps(W, _mm512_sqrt_ps(_mm512_sub_ps(one, s))), out, zero);
+      _mm512_storeu_ps(w + i, W);
+  }
+  direction_scalar(i, n, u, v, w);
+}
+IAEA_AVX512_END
+
+#endif // IAEA_SIMD_X86
+
+void iaea_direction_w(int n, IAEA_Float *u, IAEA_Float *v, IAEA_Float *w)
+{
+  switch(iaea_simd_isa())
+  {
+#ifdef IAEA_SIMD_X86
+  case IAEA_ISA_AVX512: direction_avx512(n, u, v, w); return;
+  case IAEA_ISA_AVX2:   direction_avx2(n, u, v, w); return;
+  case IAEA_ISA_SSE2:   direction_sse2(n, u, v, w); return;
+#endif
+  default:              direction_scalar(0, n, u, v, w); return;
+  }
+}
+
+/* *********************************************************************** */
+// Transposition of raw records
+//
+// Records are a type byte followed by 4-byte words, so the words are never
+// aligned and the stride is the record length. Word j of 8 (AVX2) or 16
+// (AVX-512) records is read at once with a gather of stride reclength.
+
+static void transpose_scalar(int first, const unsigned char *records, int n, int reclength,
+                             int n_words, void *const *column, IAEA_I32 *type,
+                             IAEA_Float *sign, IAEA_I32 *new_history)
+{
+  for(int i=first;i<n;i++)
+  {
+      const unsigned char *record = records + (IAEA_I64)i*reclength;
+      char ctmp = (char) record[0];
+      short particle = (short) ctmp;
+      sign[i] = 1.f;
+      if(particle < 0) {sign[i] = -1.f; particle = -particle;}
+      type[i] = particle;
+
+      float E;
+      memcpy(&E, record + 1, sizeof(float));
+      if(new_history != NULL) new_history[i] = (E < 0) ? 1 : 0;
+      if(column[0] != NULL) ((IAEA_Float *)column[0])[i] = fabsf(E);
+
+      for(int j=1;j<n_words;j++)
+        if(column[j] != NULL)
+          memcpy((unsigned char *)column[j] + 4*(IAEA_I64)i, record + 1 + 4*j, 4);
+  }
+}
+
+#ifdef IAEA_SIMD_X86
+
+__attribute__((target("avx2")))
+static void transpose_avx2(const unsigned char *records, int n, int reclength,
+                           int n_words, void *const *column, IAEA_I32 *type,
+                           IAEA_Float *sign, IAEA_I32 *new_history)
+{
+  const __m256i offset = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                            _mm256_set1_epi32(reclength));
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256 plus = _mm256_set1_ps(1.f);
+  const __m256 sign_bit = _mm256_set1_ps(-0.f);
+
+  int i = 0;
+  for(;i+8<=n;i+=8)
+  {
+      const unsigned char *base = records + (IAEA_I64)i*reclength;
+
+      // Type byte (with the first bytes of E above it), sign extended
+      __m256i t = _mm256_i32gather_epi32((const int *)base, offset, 1);
+      t = _mm256_srai_epi32(_mm256_slli_epi32(t, 24), 24);
+      __m256 negative = _mm256_castsi256_ps(_mm256_cmpgt_epi32(zero, t));
+      _mm256_storeu_si256((__m256i *)(type + i), _mm256_abs_epi32(t));
+      _mm256_storeu_ps(sign + i, _mm256_or_ps(plus, _mm256_and_ps(negative, sign_bit)));
+
+      __m256 E = _mm256_castsi256_ps(_mm256_i32gather_epi32((const int *)(base + 1), offset, 1));
+      if(new_history != NULL)
+      {
+          __m256i is_new = _mm256_castps_si256(_mm256_cmp_ps(E, _mm256_setzero_ps(), _CMP_LT_OQ));
+          _mm256_storeu_si256((__m256i *)(new_history + i), _mm256_and_si256(is_new, one));
+      }
+      if(column[0] != NULL)
+          _mm256_storeu_ps((float *)column[0] + i, _mm256_andnot_ps(sign_bit, E));
+
+      for(int j=1;j<n_words;j++)
+      {
+          if(column[j] == NULL) continue;
+          __m256i word = _mm256_i32gather_epi32((const int *)(base + 1 + 4*j), offset, 1);
+          _mm256_storeu_si256((__m256i *)((IAEA_I32 *)column[j] + i), word);
+      }
+  }
+  transpose_scalar(i, records, n, reclength, n_words, column, type, sign, new_history);
+}
+
+IAEA_AVX512_BEGIN
+__attribute__((target("avx512f")))
+static void transpose_avx512(const unsigned char *records, int n, int reclength,
+                             int n_words, void *const *column, IAEA_I32 *type,
+                             IAEA_Float *sign, IAEA_I32 *new_history)
+{
+  const __m512i offset = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
+                                                              10, 11, 12, 13, 14, 15),
+                                            _mm512_set1_epi32(reclength));
+  const __m512i one = _mm512_set1_epi32(1);
+  const __m512 plus = _mm512_set1_ps(1.f);
+  const __m512 minus = _mm512_set1_ps(-1.f);
+  const __m512i abs_bits = _mm512_set1_epi32(0x7FFFFFFF);
+
+  int i = 0;
+  for(;i+16<=n;i+=16)
+  {
+      const unsigned char *base = records + (IAEA_I64)i*reclength;
+
+      __m512i t = _mm512_i32gather_epi32(offset, base, 1);
+      t = _mm512_srai_epi32(_mm512_slli_epi32(t, 24), 24);
+      __mmask16 negative = _mm512_cmplt_epi32_mask(t, _mm512_setzero_si512());
+      _mm512_storeu_si512(type + i, _mm512_abs_epi32(t));
+      _mm512_storeu_ps(sign + i, _mm512_mask_mov_ps(plus, negative, minus));
+
+      __m512i E = _mm512_i32gather_epi32(offset, base + 1, 1);
+      if(new_history != NULL)
+      {
+          __mmask16 is_new = _mm512_cmp_ps_mask(_mm512_castsi512_ps(E),
+                                                _mm512_setzero_ps(), _CMP_LT_OQ);
+          _mm512_storeu_si512(new_history + i, _mm512_maskz_mov_epi32(is_new, one));
+      }
+      if(column[0] != NULL)
+          _mm512_storeu_si512((IAEA_I32 *)column[0] + i, _mm512_and_si512(E, abs_bits));
+
+      for(int j=1;j<n_words;j++)
+        if(column[j] != NULL)
+          _mm512_storeu_si512((IAEA_I32 *)column[j] + i,
+                              _mm512_i32gather_epi32(offset, base + 1 + 4*j, 1));
+  }
+  transpose_scalar(i, records, n, reclength, n_words, column, type, sign, new_history);
+}
+IAEA_AVX512_END
+
+#endif // IAEA_SIMD_X86
+
+void iaea_transpose_records(const unsigned char *records, int n, int reclength,
+                            int n_words, void *const *column, IAEA_I32 *type,
+                            IAEA_Float *sign, IAEA_I32 *new_history)
+{
+  switch(iaea_simd_isa())
+  {
+#ifdef IAEA_SIMD_X86
+  case IAEA_ISA_AVX512:
+      transpose_avx512(records, n, reclength, n_words, column, type, sign, new_history);
+      return;
+  case IAEA_ISA_AVX2:
+      transpose_avx2(records, n, reclength, n_words, column, type, sign, new_history);
+      return;
+#endif
+  default:
+      transpose_scalar(0, records, n, reclength, n_words, column, type, sign, new_history);
+      return;
+  }
+}
+
+/* *********************************************************************** */
+// Byte order conversion of raw records
+//
+// The words of a record start one byte after the record, so they are
+// swapped record by record: the words of a record are loaded at once
+// (masked loads where the ISA has them), their bytes reversed with
+// shuffles or rotations and stored back.
+
+static inline void swap_words(const unsigned char *in, unsigned char *out, int n_words)
+{
+  for(int j=0;j<n_words;j++,in+=4,out+=4)
+  {
+      unsigned char b0 = in[0], b1 = in[1], b2 = in[2], b3 = in[3];
+      out[0] = b3; out[1] = b2; out[2] = b1; out[3] = b0;
+  }
+}
+
+static void swap_scalar(const unsigned char *records, unsigned char *out, int n, int reclength)
+{
+  int n_words = (reclength - 1)/4;
+  for(int i=0;i<n;i++)
+  {
+      const unsigned char *record = records + (IAEA_I64)i*reclength;
+      unsigned char *swapped = out + (IAEA_I64)i*reclength;
+      swapped[0] = record[0];
+      swap_words(record + 1, swapped + 1, n_words);
+  }
+}
+
+#ifdef IAEA_SIMD_X86
+
+__attribute__((target("sse2")))
+static void swap_sse2(const unsigned char *records, unsigned char *out, int n, int reclength)
+{
+  const __m128i mid = _mm_set1_epi32(0x00FF0000);
+  int n_words = (reclength - 1)/4;
+  for(int i=0;i<n;i++)
+  {
+      const unsigned char *in = records + (IAEA_I64)i*reclength;
+      unsigned char *swapped = out + (IAEA_I64)i*reclength;
+      swapped[0] = in[0];
+      in++; swapped++;
+      int j = 0;
+      for(;j+4<=n_words;j+=4,in+=16,swapped+=16)
+      {
+          __m128i x = _mm_loadu_si128((const __m128i *)in);
+          __m128i hi = _mm_or_si128(_mm_slli_epi32(x, 24), _mm_and_si128(_mm_slli_epi32(x, 8), mid));
+          __m128i lo = _mm_or_si128(_mm_srli_epi32(x, 24),
+                                    _mm_srli_epi32(_mm_and_si128(x, mid), 8));
+          _mm_storeu_si128((__m128i *)swapped, _mm_or_si128(hi, lo));
+      }
+      swap_words(in, swapped, n_words - j);
+  }
+}
+
+__attribute__((target("avx2")))
+static void swap_avx2(const unsigned char *records, unsigned char *out, int n, int reclength)
+{
+  const __m256i reverse = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                           3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  int n_words = (reclength - 1)/4;
+  int n_last = n_words & 7;
+  const __m256i last = _mm256_cmpgt_epi32(_mm256_set1_epi32(n_last), lane);
+  for(int i=0;i<n;i++)
+  {
+      const unsigned char *in = records + (IAEA_I64)i*reclength;
+      unsigned char *swapped = out + (IAEA_I64)i*reclength;
+      swapped[0] = in[0];
+      in++; swapped++;
+      int j = 0;
+      for(;j+8<=n_words;j+=8,in+=32,swapped+=32)
+      {
+          __m256i x = _mm256_loadu_si256((const __m256i *)in);
+          _mm256_storeu_si256((__m256i *)swapped, _mm256_shuffle_epi8(x, reverse));
+      }
+      if(n_last > 0)
+      {
+          __m256i x = _mm256_maskload_epi32((const int *)in, last);
+          _mm256_maskstore_epi32((int *)swapped, last, _mm256_shuffle_epi8(x, reverse));
+      }
+  }
+}
+
+IAEA_AVX512_BEGIN
+__attribute__((target("avx512f")))
+static void swap_avx512(const unsigned char *records, unsigned char *out, int n, int reclength)
+{
+  const __m512i odd = _mm512_set1_epi32((int)0xFF00FF00);
+  int n_words = (reclength - 1)/4;
+  __mmask16 last = (__mmask16)((1u << (n_words & 15)) - 1);
+  for(int i=0;i<n;i++)
+  {
+      const unsigned char *in = records + (IAEA_I64)i*reclength;
+      unsigned char *swapped = out + (IAEA_I64)i*reclength;
+      swapped[0] = in[0];
+      in++; swapped++;
+      for(int j=0;j<n_words;j+=16,in+=64,swapped+=64)
+      {
+          // Bytes 1 and 3 of every word come from the word rotated right by
+          // 8 bits, bytes 0 and 2 from the word rotated left by 8 bits
+          __mmask16 k = (j + 16 <= n_words) ? (__mmask16)0xFFFF : last;
+          __m512i x = _mm512_maskz_loadu_epi32(k, in);
+          __m512i y = _mm512_or_si512(_mm512_and_si512(_mm512_ror_epi32(x, 8), odd),
+                                      _mm512_andnot_si512(odd, _mm512_rol_epi32(x, 8)));
+          _mm512_mask_storeu_epi32(swapped, k, y);
+      }
+  }
+}
+IAEA_AVX512_END
+
+#endif // IAEA_SIMD_X86
+
+void iaea_swap_records(const unsigned char *records, unsigned char *out, int n, int reclength)
+{
+  switch(iaea_simd_isa())
+  {
+#ifdef IAEA_SIMD_X86
+  case IAEA_ISA_AVX512:
+      swap_avx512(records, out, n, reclength);
+      return;
+  case IAEA_ISA_AVX2:
+      swap_avx2(records, out, n, reclength);
+      return;
+  case IAEA_ISA_SSE2:
+      swap_sse2(records, out, n, reclength);
+      return;
+#endif
+  default:
+      swap_scalar(records, out, n, reclength);
+      return;
+  }
+}
+
+/* *********************************************************************** */
+// Instruction set selection
+
+static int detect_isa()
+{
+  int isa = IAEA_ISA_SCALAR;
+#ifdef IAEA_SIMD_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("sse2"))    isa = IAEA_ISA_SSE2;
+  if(__builtin_cpu_supports("avx2"))    isa = IAEA_ISA_AVX2;
+  if(__builtin_cpu_supports("avx512f")) isa = IAEA_ISA_AVX512;
+#endif
+
+  const char *env = getenv("IAEA_SIMD");
+  if(env != NULL)
+  {
+     for(int k=IAEA_ISA_SCALAR;k<isa;k++)
+        if(strcmp(env, isa_names[k]) == 0) isa = k;
+  }
+  return isa;
+}
+
+int iaea_simd_isa()
+{
+  static const int isa = detect_isa();
+  return isa;
+}
+
+const char *iaea_simd_isa_name()
+{
+  return isa_names[iaea_simd_isa()];
+}
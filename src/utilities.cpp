@@ -645,9 +645,41 @@ int get_string(FILE *fspec, char *string)
   return(fget_c_string(string, MAX_STR_LEN, fspec));
 #endif
 }
-#define REWIND_STREAM 100
 /* ************************************************************************** */
-int fget_c_string(char *string, int Max_Str_Len, FILE *fspec)
+/* ************************************************************************** */
+/* Lines read by get_c_string come from a file or from a memory buffer,
+   next_line reads the next one as fgets does (NULL at the end) */
+typedef char *(*line_reader)(char *s, int n, void *source);
+
+static char *file_line(char *s, int n, void *source)
+{
+   return(fgets(s, n, (FILE *)source));
+}
+
+struct buffer_source
+{
+   const char *buffer; /* size characters */
+   long size;
+   long *position;     /* of the next line */
+};
+
+static char *buffer_line(char *s, int n, void *source)
+{  /* mimic fgets reading from buffer[*position..size-1] */
+   buffer_source *b = (buffer_source *)source;
+   long i = *b->position;
+   int k = 0;
+   if(i >= b->size) return(NULL);
+   while(k < n-1 && i < b->size)
+   {
+      s[k++] = b->buffer[i];
+      if(b->buffer[i++] == '\n') break;
+   }
+   s[k] = '\0';
+   *b->position = i;
+   return(s);
+}
+/* ************************************************************************** */
+static int get_c_string(char *string, int Max_Str_Len, line_reader next_line, void *source)
 {
    /* gets a string from the input and removes comments from it */
    /* allows comments in standard "c" syntax,
@@ -664,49 +696,31 @@ int fget_c_string(char *string, int Max_Str_Len, FILE *fspec)
    int olen; /* location on output string */
    int icnt; /* location on string */
 
-   //   int n_pass = 0; /* Number of passes through the file looking for a value */
-
    olen = 0;
    /* allocate memory for input string */
    istring = (char *)calloc(Max_Str_Len,sizeof(char));
    if(istring == NULL)
    {
-      printf("\n ERROR: Allocating memory for input string if fget_c_string");
+      printf("\n ERROR: Allocating memory for input string if get_c_string");
       return(FAIL);
    }
    strnset(string,'\0',Max_Str_Len); /* null entire output string */
    strnset(istring,'\0',Max_Str_Len); /* null entire input string */
 
 #ifdef DEBUG
-   printf ("\n --------------fget_c_string");
+   printf ("\n --------------get_c_string");
 #endif
    clen = strlen(comment_start);
    /* read in the line, verify that it exists */
    do{
-      /* read in a line from the file */
-      while(fgets(istring, Max_Str_Len, fspec) == NULL) /* output warning if not a valid read */
+      /* read in a line from the source */
+      if(next_line(istring, Max_Str_Len, source) == NULL) /* end of the input */
       {
 #ifdef DEBUG
         printf("\n istring: %s", istring);
 #endif
-#ifdef ALLOW_REWIND
-   if(n_pass) /* if already gone through file once looking for value, quit */
-#endif
-   {
-#ifdef DEBUG
-           //  printf ("\n***End of Input File in get_string, closing");
-#endif
-           //  printf ("\nERROR: Reading File : End of File On Read ");
-           // fclose(fspec);
-           free(istring);
-           return(FAIL);
-        }
-#ifdef ALLOW_REWIND
-        n_pass++;      /* increment the number of times through the file */
-        rewind(fspec); /* rewind to the beginning of the file */
         free(istring);
-        return(REWIND_STREAM);
-#endif
+        return(FAIL);
       }
 #ifdef DEBUG
         printf("\n istring: %s", istring);
@@ -741,7 +755,7 @@ int fget_c_string(char *string, int Max_Str_Len, FILE *fspec)
                   icnt++; /* increment location on string */
                   if(icnt>ilen) /* if advance past end of string, get a new one */
                   {
-                     if(fgets(istring, Max_Str_Len, fspec) == NULL) /* output warning if not a valid read */
+                     if(next_line(istring, Max_Str_Len, source) == NULL) /* output warning if not a valid read */
                      {
                         printf ("\nERROR: Reading File, looking for end of comment %s",comment_stop);
                         // fclose(fspec);
@@ -792,3 +806,16 @@ int fget_c_string(char *string, int Max_Str_Len, FILE *fspec)
    free(istring);
    return(OK);
 }
+/* ************************************************************************** */
+int fget_c_string(char *string, int Max_Str_Len, FILE *fspec)
+{
+   return(get_c_string(string, Max_Str_Len, file_line, fspec));
+}
+/* ************************************************************************** */
+int sget_c_string(char *string, int Max_Str_Len, const char *buffer, long size, long *position)
+{
+   /* same as fget_c_string, but reads the lines from buffer (size characters)
+      starting at *position, which is advanced past the lines read */
+   buffer_source source = { buffer, size, position };
+   return(get_c_string(string, Max_Str_Len, buffer_line, &source));
+}